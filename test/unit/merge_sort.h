@@ -186,6 +186,115 @@ static bool file_limit_test(int limit) {
 	return sort_test(15,15,15,40, 0, false, false, limit);
 }
 
+static bool parameters_test_base(memory_size_type runLength,
+								 memory_size_type fanout,
+								 memory_size_type runs,
+								 bool upperBound = false,
+								 bool evacuateBeforeReport = false,
+								 bool evacuateWhileReporting = false)
+{
+	const stream_size_type items = runLength * runs + runLength / 2;
+	item_generator gen(items * sizeof(test_t));
+	log_debug() << "parameters_test_base with " << items << " items\n";
+	sorter s;
+	s.set_parameters(runLength, fanout);
+	if (upperBound) s.set_items(items);
+	s.begin();
+	for (stream_size_type i = 0; i < items; ++i) {
+		s.push(gen());
+	}
+	s.end();
+	Traits::merge_runs(s);
+	if (evacuateBeforeReport) s.evacuate();
+
+	test_t prev = std::numeric_limits<test_t>::min();
+	stream_size_type itemsRead = 0;
+	while (s.can_pull()) {
+		test_t read = s.pull();
+		if (read < prev) {
+			log_error() << "Out of order" << std::endl;
+			return false;
+		}
+		prev = read;
+		++itemsRead;
+		// Evacuate early on, while the start of the output may still be
+		// merged as it is reported, and again halfway through.
+		if (evacuateWhileReporting && (itemsRead == items / 16 || itemsRead == items / 2))
+			s.evacuate();
+	}
+	if (itemsRead != items) {
+		log_error() << "Read the wrong number of items. Got " << itemsRead << ", expected " << items << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static bool parameters_test(memory_size_type runLength,
+							memory_size_type fanout,
+							memory_size_type runs)
+{
+	return parameters_test_base(runLength, fanout, runs);
+}
+
+static bool upper_bound_test(memory_size_type runLength,
+							 memory_size_type fanout,
+							 memory_size_type runs)
+{
+	return parameters_test_base(runLength, fanout, runs, true);
+}
+
+static bool evacuate_while_reporting_test(memory_size_type runLength,
+										  memory_size_type fanout,
+										  memory_size_type runs)
+{
+	return parameters_test_base(runLength, fanout, runs, false, false, true);
+}
+
+static bool evacuate_before_and_while_reporting_test(memory_size_type runLength,
+													 memory_size_type fanout,
+													 memory_size_type runs)
+{
+	return parameters_test_base(runLength, fanout, runs, false, true, true);
+}
+
+static bool limit_test(memory_size_type limit) {
+	const memory_size_type runLength = 1000;
+	const stream_size_type items = runLength * 50 + 17;
+	item_generator gen(items * sizeof(test_t));
+	sorter s;
+	s.set_parameters(runLength, 4);
+	s.set_limit(limit);
+	s.begin();
+	std::vector<test_t> expected(items);
+	for (stream_size_type i = 0; i < items; ++i) {
+		expected[i] = gen();
+		s.push(expected[i]);
+	}
+	s.end();
+	std::sort(expected.begin(), expected.end());
+	expected.resize(std::min<stream_size_type>(items, limit));
+	if (s.item_count() != expected.size()) {
+		log_error() << "Wrong item count. Got " << s.item_count() << ", expected " << expected.size() << std::endl;
+		return false;
+	}
+	Traits::merge_runs(s);
+
+	stream_size_type itemsRead = 0;
+	while (s.can_pull()) {
+		test_t read = s.pull();
+		if (itemsRead == expected.size() || read != expected[itemsRead]) {
+			log_error() << "Wrong item at position " << itemsRead << std::endl;
+			return false;
+		}
+		++itemsRead;
+	}
+	if (itemsRead != expected.size()) {
+		log_error() << "Read the wrong number of items. Got " << itemsRead << ", expected " << expected.size() << std::endl;
+		return false;
+	}
+	return true;
+}
+
 public:
 
 static tests & add_all(tests & t) {
@@ -201,10 +310,46 @@ static tests & add_all(tests & t) {
 		;
 }
 
+static tests & add_external_report_test(tests & t, const std::string & name) {
+	return t.test(external_report_test, name);
+}
+
 static tests & add_file_limit_test(tests & t, int limit) {
 	return t.test(file_limit_test, "file_limit", "limit", limit);
 }
 
+static tests & add_parameters_test(tests & t, const std::string & name,
+								   memory_size_type runLength,
+								   memory_size_type fanout,
+								   memory_size_type runs) {
+	return t.test(parameters_test, name, "run_length", runLength, "fanout", fanout, "runs", runs);
+}
+
+static tests & add_upper_bound_test(tests & t, const std::string & name,
+									memory_size_type runLength,
+									memory_size_type fanout,
+									memory_size_type runs) {
+	return t.test(upper_bound_test, name, "run_length", runLength, "fanout", fanout, "runs", runs);
+}
+
+static tests & add_evacuate_while_reporting_test(tests & t, const std::string & name,
+												 memory_size_type runLength,
+												 memory_size_type fanout,
+												 memory_size_type runs) {
+	return t.test(evacuate_while_reporting_test, name, "run_length", runLength, "fanout", fanout, "runs", runs);
+}
+
+static tests & add_evacuate_before_and_while_reporting_test(tests & t, const std::string & name,
+															memory_size_type runLength,
+															memory_size_type fanout,
+															memory_size_type runs) {
+	return t.test(evacuate_before_and_while_reporting_test, name, "run_length", runLength, "fanout", fanout, "runs", runs);
+}
+
+static tests & add_limit_test(tests & t, const std::string & name, memory_size_type limit) {
+	return t.test(limit_test, name, "limit", limit);
+}
+
 };
 
 #endif // TPIE_TEST_MERGE_SORT_H
@@ -20,6 +20,10 @@
 #include "common.h"
 #include <tpie/compressed/stream.h>
 #include <tpie/file_stream.h>
+#include <thread>
+#include <random>
+#include <fstream>
+#include <cstring>
 
 template <tpie::compression_flags flags>
 class tests {
@@ -998,6 +1002,314 @@ bool stack_test() {
 	return true;
 }
 
+bool check_seek(tpie::file_stream<size_t> & fs, size_t offset) {
+	fs.seek(offset);
+	if (fs.offset() != offset) {
+		tpie::log_error() << "Offset " << fs.offset() << " after seek to " << offset << std::endl;
+		return false;
+	}
+	for (size_t i = offset; i < offset + 3 && i < fs.size(); ++i) {
+		size_t r = fs.read();
+		if (r != i) {
+			tpie::log_error() << "Read " << r << " at " << i << " after seek to " << offset << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool check_random_seeks(tpie::file_stream<size_t> & fs) {
+	std::mt19937 rng(42);
+	std::uniform_int_distribution<size_t> pos(0, fs.size() - 1);
+	for (size_t i = 0; i < 200; ++i) {
+		if (!check_seek(fs, pos(rng))) return false;
+	}
+	// Relative seeks and reading backwards after a seek
+	fs.seek(-5, tpie::file_stream<size_t>::end);
+	fs.seek(2, tpie::file_stream<size_t>::current);
+	if (fs.read() != fs.size() - 3) {
+		tpie::log_error() << "Wrong item after relative seek" << std::endl;
+		return false;
+	}
+	const size_t blockStart = fs.block_items() * 2;
+	fs.seek(blockStart);
+	if (fs.read_back() != blockStart - 1) {
+		tpie::log_error() << "Wrong item reading back from block boundary" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool block_index_test() {
+	typedef tpie::file_stream<size_t> stream_t;
+	const double blockFactor = stream_t::calculate_block_factor(1024 * sizeof(size_t));
+	const tpie::open::type flags = tpie::open::compression_all | tpie::open::block_index;
+	tpie::temp_file tf;
+	size_t items = 0;
+	{
+		stream_t fs(blockFactor);
+		fs.open(tf, flags);
+		TEST_ENSURE(fs.has_block_index(), "No block index");
+		for (; items < 5 * fs.block_items() + 123; ++items) fs.write(items);
+		// Some blocks are still being written, and the last one is not.
+		if (!check_random_seeks(fs)) return false;
+	}
+	{
+		// The index is kept without open::block_index.
+		stream_t fs(blockFactor);
+		fs.open(tf, tpie::open::read_only);
+		TEST_ENSURE(fs.has_block_index(), "Block index was not stored");
+		if (!check_random_seeks(fs)) return false;
+	}
+	{
+		stream_t fs(blockFactor);
+		fs.open(tf, flags);
+		fs.seek(0, stream_t::end);
+		for (; items < 8 * fs.block_items() + 7; ++items) fs.write(items);
+		if (!check_random_seeks(fs)) return false;
+	}
+	{
+		stream_t fs(blockFactor);
+		fs.open(tf, tpie::open::read_only);
+		TEST_ENSURE_EQUALITY(items, fs.size(), "Wrong size after appending");
+		if (!check_random_seeks(fs)) return false;
+		fs.seek(0);
+		for (size_t i = 0; i < items; ++i)
+			TEST_ENSURE_EQUALITY(i, fs.read(), "Wrong item when scanning");
+	}
+
+	// A stream written without an index
+	tpie::temp_file tf2;
+	{
+		stream_t fs(blockFactor);
+		fs.open(tf2, tpie::open::compression_all);
+		for (size_t i = 0; i < 3 * fs.block_items() + 5; ++i) fs.write(i);
+		bool threw = false;
+		try {
+			fs.seek(1);
+		} catch (tpie::stream_exception &) {
+			threw = true;
+		}
+		TEST_ENSURE(threw, "Random seek without index did not throw");
+	}
+	{
+		stream_t fs(blockFactor);
+		fs.open(tf2, tpie::open::read_only | tpie::open::block_index);
+		TEST_ENSURE(fs.has_block_index(), "Block index was not built");
+		if (!check_random_seeks(fs)) return false;
+	}
+	return true;
+}
+
+bool compressor_threads_test() {
+	const size_t streams = 8;
+	const size_t items = 1 << 18;
+	tpie::set_compressor_threads(4);
+	if (tpie::get_compressor_threads() != 4) {
+		tpie::log_error() << "Wrong compressor thread count" << std::endl;
+		return false;
+	}
+	std::vector<tpie::temp_file> files(streams);
+	{
+		// Write several compressed streams at once from several threads.
+		std::vector<std::thread> writers;
+		for (size_t t = 0; t < streams; ++t) {
+			writers.push_back(std::thread([&files, t, items] {
+				tpie::file_stream<size_t> fs;
+				fs.open(files[t], tpie::access_read_write, 0, tpie::access_sequential, tpie::compression_all);
+				for (size_t i = 0; i < items; ++i) fs.write(i * streams + t);
+			}));
+		}
+		for (size_t t = 0; t < streams; ++t) writers[t].join();
+	}
+
+	// Restart the pool with a single worker and read all streams in lockstep.
+	tpie::set_compressor_threads(1);
+	std::vector<tpie::file_stream<size_t> > fs(streams);
+	for (size_t t = 0; t < streams; ++t) fs[t].open(files[t], tpie::access_read);
+	bool success = true;
+	for (size_t i = 0; i < items && success; ++i) {
+		for (size_t t = 0; t < streams; ++t) {
+			size_t r = fs[t].read();
+			if (r != i * streams + t) {
+				tpie::log_error() << "Read " << r << " at " << i << " in stream " << t << std::endl;
+				success = false;
+				break;
+			}
+		}
+	}
+	for (size_t t = 0; t < streams; ++t) fs[t].close();
+	tpie::set_compressor_threads(0);
+	return success;
+}
+
+bool adaptive_compression_test() {
+	const size_t items = 1 << 18;
+	tpie::temp_file tf;
+	std::mt19937_64 rng(42);
+	const tpie::stream_size_type compressed = tpie::get_user(7);
+	const tpie::stream_size_type raw = tpie::get_user(8);
+	size_t blocks;
+	{
+		// Random data does not compress, so every block is stored as it is.
+		tpie::file_stream<tpie::uint64_t> fs;
+		fs.open(tf, tpie::access_read_write, 0, tpie::access_sequential, tpie::compression_normal);
+		for (size_t i = 0; i < items; ++i) fs.write(rng());
+		blocks = (items + fs.block_items() - 1) / fs.block_items();
+	}
+	TEST_ENSURE_EQUALITY(compressed, tpie::get_user(7), "Random blocks were compressed");
+	TEST_ENSURE_EQUALITY(raw + blocks, tpie::get_user(8), "Wrong number of raw blocks");
+
+	rng.seed(42);
+	tpie::file_stream<tpie::uint64_t> fs;
+	fs.open(tf, tpie::access_read);
+	for (size_t i = 0; i < items; ++i) {
+		tpie::uint64_t expect = rng();
+		TEST_ENSURE_EQUALITY(expect, fs.read(), "Wrong item read");
+	}
+	return true;
+}
+
+// Compress and uncompress the given bytes with the given scheme.
+bool delta_round_trip(tpie::compression_scheme::type t, const std::vector<char> & input) {
+	const tpie::compression_scheme & scheme = tpie::get_compression_scheme(t);
+	std::vector<char> compressed(scheme.max_compressed_length(input.size()));
+	size_t compressedSize;
+	scheme.compress(compressed.data(), input.data(), input.size(), &compressedSize);
+	TEST_ENSURE(compressedSize <= compressed.size(), "Compressed block is too large");
+	TEST_ENSURE_EQUALITY(input.size(), scheme.uncompressed_length(compressed.data(), compressedSize),
+						 "Wrong uncompressed length");
+	std::vector<char> output(input.size());
+	scheme.uncompress(output.data(), compressed.data(), compressedSize);
+	TEST_ENSURE(input == output, "Wrong uncompressed data");
+	return true;
+}
+
+template <typename word_t>
+bool delta_round_trips(tpie::compression_scheme::type t) {
+	std::mt19937_64 rng(42);
+	// Sizes that end inside a frame and inside a word.
+	const size_t sizes[] = {0, 1, sizeof(word_t), 127 * sizeof(word_t) + 3, 1000 * sizeof(word_t) + 1};
+	for (size_t s : sizes) {
+		const size_t words = s / sizeof(word_t);
+		std::vector<word_t> sorted(words), reversed(words), random(words), constant(words, 7);
+		word_t x = 0;
+		for (size_t i = 0; i < words; ++i) {
+			x += static_cast<word_t>(rng() % 1000);
+			sorted[i] = x;
+			reversed[words - 1 - i] = x;
+			random[i] = static_cast<word_t>(rng());
+		}
+		const std::vector<word_t> * inputs[] = {&sorted, &reversed, &random, &constant};
+		for (const std::vector<word_t> * v : inputs) {
+			std::vector<char> input(s, 'x');
+			if (words) memcpy(input.data(), v->data(), words * sizeof(word_t));
+			if (!delta_round_trip(t, input)) return false;
+		}
+	}
+	return true;
+}
+
+bool delta_scheme_test() {
+	return delta_round_trips<tpie::uint32_t>(tpie::compression_scheme::delta32)
+		&& delta_round_trips<tpie::uint64_t>(tpie::compression_scheme::delta64);
+}
+
+bool delta_stream_test() {
+	const size_t items = 1 << 20;
+	tpie::temp_file tf;
+	const tpie::stream_size_type compressed = tpie::get_user(7);
+	size_t blocks;
+	{
+		tpie::file_stream<tpie::uint64_t> fs;
+		fs.open(tf, tpie::access_read_write, 0, tpie::access_sequential, tpie::compression_all);
+		fs.set_compression_scheme(tpie::compression_scheme::delta64);
+		for (size_t i = 0; i < items; ++i) fs.write(1000000 + 3 * i + i % 2);
+		blocks = (items + fs.block_items() - 1) / fs.block_items();
+	}
+	TEST_ENSURE_EQUALITY(compressed + blocks, tpie::get_user(7), "Wrong number of compressed blocks");
+	std::ifstream file(tf.path().c_str(), std::ios::binary | std::ios::ate);
+	const tpie::stream_size_type fileSize = file.tellg();
+	TEST_ENSURE(fileSize < items * sizeof(tpie::uint64_t) / 8, "Sorted stream did not shrink: " << fileSize);
+
+	tpie::file_stream<tpie::uint64_t> fs;
+	fs.open(tf, tpie::access_read);
+	for (size_t i = 0; i < items; ++i)
+		TEST_ENSURE_EQUALITY(1000000 + 3 * i + i % 2, fs.read(), "Wrong item read");
+	return true;
+}
+
+struct weighted_point {
+	double x, y;
+	float weight;
+};
+
+bool shuffle_test() {
+	const size_t items = 1 << 18;
+	tpie::temp_file tf;
+	{
+		tpie::file_stream<weighted_point> fs;
+		fs.open(tf, tpie::access_read_write, 0, tpie::access_sequential, tpie::compression_all);
+		fs.set_shuffle(true);
+		for (size_t i = 0; i < items; ++i) {
+			weighted_point p = {i * 0.5, i * -0.25, static_cast<float>(i % 10)};
+			fs.write(p);
+		}
+	}
+	tpie::file_stream<weighted_point> fs;
+	fs.open(tf, tpie::access_read);
+	for (size_t i = 0; i < items; ++i) {
+		const weighted_point p = fs.read();
+		TEST_ENSURE(p.x == i * 0.5 && p.y == i * -0.25 && p.weight == static_cast<float>(i % 10),
+					"Wrong item read at " << i);
+	}
+	// Read the blocks backwards as well.
+	for (size_t i = items; i--;) {
+		const weighted_point p = fs.read_back();
+		TEST_ENSURE_EQUALITY(i * 0.5, p.x, "Wrong item read back");
+	}
+	return true;
+}
+
+bool read_ahead_test() {
+	const size_t items = 1 << 22;
+	tpie::temp_file tf;
+	{
+		tpie::file_stream<size_t> fs;
+		fs.open(tf, tpie::access_read_write, 0, tpie::access_sequential, tpie::compression_all);
+		for (size_t i = 0; i < items; ++i) fs.write(i);
+	}
+	TEST_ENSURE(tpie::file_stream<size_t>::memory_usage(1.0, 4) > tpie::file_stream<size_t>::memory_usage(1.0),
+				"Read-ahead buffers are not accounted");
+
+	tpie::file_stream<size_t> fs;
+	fs.set_read_ahead(4);
+	fs.open(tf, tpie::access_read);
+	TEST_ENSURE_EQUALITY(4, fs.read_ahead(), "Wrong read-ahead depth");
+	for (size_t i = 0; i < items / 2; ++i) {
+		const size_t r = fs.read();
+		TEST_ENSURE_EQUALITY(i, r, "Wrong item read");
+	}
+	// Read backwards and seek while blocks are read ahead.
+	for (size_t i = items / 2; i-- > items / 4;) {
+		const size_t r = fs.read_back();
+		TEST_ENSURE_EQUALITY(i, r, "Wrong item read back");
+	}
+	tpie::stream_position pos = fs.get_position();
+	for (size_t i = items / 4; i < items; ++i) {
+		const size_t r = fs.read();
+		TEST_ENSURE_EQUALITY(i, r, "Wrong item read after read_back");
+	}
+	fs.set_position(pos);
+	TEST_ENSURE_EQUALITY(items / 4, fs.read(), "Wrong item read after set_position");
+	fs.seek(0);
+	for (size_t i = 0; i < items; ++i) {
+		const size_t r = fs.read();
+		TEST_ENSURE_EQUALITY(i, r, "Wrong item read after seek");
+	}
+	return true;
+}
+
 template <tpie::compression_flags flags>
 tpie::tests & add_tests(tpie::tests & t, std::string suffix) {
 	typedef tests<flags> T;
@@ -1040,5 +1352,12 @@ int main(int argc, char ** argv) {
 		.test(write_peek_test, "write_peek", "n", static_cast<size_t>(1 << 23))
 		/* .test(read_only_test, "read_only") */
 		.test(write_only_test, "write_only")
-		.test(stack_test, "lockstep_reverse");
+		.test(stack_test, "lockstep_reverse")
+		.test(compressor_threads_test, "compressor_threads")
+		.test(block_index_test, "block_index")
+		.test(adaptive_compression_test, "adaptive_compression")
+		.test(delta_scheme_test, "delta_scheme")
+		.test(delta_stream_test, "delta_stream")
+		.test(shuffle_test, "shuffle")
+		.test(read_ahead_test, "read_ahead");
 }
@@ -0,0 +1,106 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2013, The TPIE development team
+// 
+// This file is part of TPIE.
+// 
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+// 
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+#include "common.h"
+#include <tpie/loser_tree.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace tpie;
+
+// Merge runs of random length, including empty runs, and compare the output
+// with a sorted copy of the input.
+bool merge_test(size_t runs) {
+	std::mt19937 rng(runs);
+	std::vector<std::vector<int> > input(runs);
+	std::vector<int> expected;
+	for (size_t i = 0; i < runs; ++i) {
+		input[i].resize(rng() % 50);
+		for (size_t j = 0; j < input[i].size(); ++j) input[i][j] = rng() % 1000;
+		std::sort(input[i].begin(), input[i].end());
+		expected.insert(expected.end(), input[i].begin(), input[i].end());
+	}
+	std::sort(expected.begin(), expected.end());
+
+	loser_tree<int> tree(runs);
+	std::vector<size_t> next(runs, 0);
+	for (size_t i = 0; i < runs; ++i) {
+		if (!input[i].empty()) tree.unsafe_set(i, input[i][next[i]++]);
+	}
+	tree.make_safe();
+
+	std::vector<int> output;
+	while (!tree.empty()) {
+		size_t run = tree.top_run();
+		TEST_ENSURE_EQUALITY(input[run][next[run]-1], tree.top(), "Wrong top of run");
+		output.push_back(tree.top());
+		if (next[run] < input[run].size()) {
+			tree.pop_and_push(input[run][next[run]++]);
+		} else {
+			tree.pop();
+		}
+	}
+	TEST_ENSURE(output == expected, "Wrong merge output");
+	return true;
+}
+
+bool basic_test() {
+	return merge_test(0) && merge_test(1) && merge_test(2) && merge_test(7)
+		&& merge_test(64) && merge_test(251);
+}
+
+bool reuse_test() {
+	loser_tree<int, std::greater<int> > tree(3);
+	tree.unsafe_set(0, 1);
+	tree.unsafe_set(2, 3);
+	tree.make_safe();
+	TEST_ENSURE_EQUALITY(2, tree.size(), "Wrong size");
+	TEST_ENSURE_EQUALITY(3, tree.top(), "Wrong top");
+	TEST_ENSURE_EQUALITY(2, tree.top_run(), "Wrong top run");
+	tree.pop();
+	TEST_ENSURE_EQUALITY(1, tree.top(), "Wrong top");
+	tree.pop();
+	TEST_ENSURE(tree.empty(), "Expected empty");
+
+	tree.resize(5);
+	TEST_ENSURE(tree.empty(), "Expected empty after resize");
+	for (int i = 0; i < 5; ++i) tree.unsafe_set(i, i);
+	tree.make_safe();
+	for (int i = 5; i--;) {
+		TEST_ENSURE_EQUALITY(i, tree.top(), "Wrong top");
+		tree.pop();
+	}
+	TEST_ENSURE(tree.empty(), "Expected empty");
+	return true;
+}
+
+class my_memory_test: public memory_test {
+public:
+	loser_tree<int> * a;
+	virtual void alloc() {a = tpie_new<loser_tree<int> >(123456);}
+	virtual void free() {tpie_delete(a);}
+	virtual size_type claimed_size() {return static_cast<size_type>(loser_tree<int>::memory_usage(123456));}
+};
+
+int main(int argc, char **argv) {
+	return tpie::tests(argc, argv)
+		.test(basic_test, "basic")
+		.test(reuse_test, "reuse")
+		.test(my_memory_test(), "memory");
+}
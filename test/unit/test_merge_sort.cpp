@@ -21,7 +21,11 @@
 #include <tpie/pipelining/merge_sorter.h>
 #include <tpie/parallel_sort.h>
 #include <tpie/sysinfo.h>
+#include <tpie/tiny.h>
 #include <random>
+#include <vector>
+#include <map>
+#include <algorithm>
 
 using namespace tpie;
 
@@ -53,6 +57,140 @@ public:
 	}
 };
 
+class use_double_buffered_merge_sort : public use_merge_sort {
+public:
+	class sorter : public use_merge_sort::sorter {
+	public:
+		sorter() {
+			set_double_buffering(true);
+		}
+	};
+
+	static void merge_runs(sorter & s) {
+		dummy_progress_indicator pi;
+		s.calc(pi);
+	}
+};
+
+class use_concurrent_merge_sort : public use_merge_sort {
+public:
+	class sorter : public use_merge_sort::sorter {
+	public:
+		sorter() {
+			set_merge_threads(3);
+		}
+	};
+
+	static void merge_runs(sorter & s) {
+		dummy_progress_indicator pi;
+		s.calc(pi);
+	}
+};
+
+class use_parallel_final_merge_sort : public use_merge_sort {
+public:
+	class sorter : public use_merge_sort::sorter {
+	public:
+		sorter() {
+			set_final_merge_threads(4);
+		}
+	};
+
+	static void merge_runs(sorter & s) {
+		dummy_progress_indicator pi;
+		s.calc(pi);
+	}
+};
+
+class use_replacement_selection_merge_sort : public use_merge_sort {
+public:
+	class sorter : public use_merge_sort::sorter {
+	public:
+		sorter() {
+			set_replacement_selection(true);
+		}
+	};
+
+	static void merge_runs(sorter & s) {
+		dummy_progress_indicator pi;
+		s.calc(pi);
+	}
+};
+
+class use_distribution_merge_sort : public use_merge_sort {
+public:
+	class sorter : public use_merge_sort::sorter {
+	public:
+		sorter() {
+			set_distribution(true);
+		}
+	};
+
+	static void merge_runs(sorter & s) {
+		dummy_progress_indicator pi;
+		s.calc(pi);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Sort only a few distinct keys with the sorter of the given traits.
+///////////////////////////////////////////////////////////////////////////////
+template <typename Traits>
+class use_duplicate_keys : public Traits {
+public:
+	class item_generator : public Traits::item_generator {
+	public:
+		item_generator(stream_size_type bytes)
+			: Traits::item_generator(bytes)
+		{
+		}
+
+		typename Traits::test_t operator()() { return Traits::item_generator::operator()() % 3; }
+	};
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Sort ascending keys, each displaced by a small random amount.
+///////////////////////////////////////////////////////////////////////////////
+template <typename Traits>
+class use_nearly_sorted_keys : public Traits {
+public:
+	class item_generator : public Traits::item_generator {
+	public:
+		item_generator(stream_size_type bytes)
+			: Traits::item_generator(bytes)
+			, m_next(0)
+		{
+		}
+
+		typename Traits::test_t operator()() { return m_next++ + Traits::item_generator::operator()() % 100; }
+
+	private:
+		typename Traits::test_t m_next;
+	};
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// Sort descending keys.
+///////////////////////////////////////////////////////////////////////////////
+template <typename Traits>
+class use_reversed_keys : public Traits {
+public:
+	class item_generator : public Traits::item_generator {
+	public:
+		item_generator(stream_size_type bytes)
+			: Traits::item_generator(bytes)
+			, m_next(this->items())
+		{
+		}
+
+		typename Traits::test_t operator()() { return m_next--; }
+
+	private:
+		typename Traits::test_t m_next;
+	};
+};
+
 bool sort_upper_bound_test_base(memory_size_type dataUpperBound) {
 	typedef use_merge_sort Traits;
 	typedef Traits::sorter sorter;
@@ -158,13 +296,87 @@ bool tall_tree_test(size_t fanout, size_t height) {
 	return true;
 }
 
+struct sum_combine {
+	void operator()(std::pair<uint64_t, uint64_t> & a, const std::pair<uint64_t, uint64_t> & b) const {
+		a.second += b.second;
+	}
+};
+
+bool combine_test(size_t mode, size_t keys) {
+	// mode 0: plain, 1: replacement selection, 2: double buffering,
+	// 3: parallel final merge, 4: concurrent merges.
+	typedef std::pair<uint64_t, uint64_t> item_t;
+	typedef key_less<tiny::bits::PairExtract<uint64_t, uint64_t> > pred_t;
+	merge_sorter<item_t, false, pred_t, default_store, sum_combine> s;
+	const memory_size_type runLength = 1000;
+	const memory_size_type fanout = 4;
+	const memory_size_type items = runLength * 50 + 17;
+	s.set_parameters(runLength, fanout);
+	switch (mode) {
+		case 1: s.set_replacement_selection(true); break;
+		case 2: s.set_double_buffering(true); break;
+		case 3: s.set_final_merge_threads(4); break;
+		case 4: s.set_merge_threads(3); break;
+	}
+	s.begin();
+	std::mt19937 rng(42);
+	std::map<uint64_t, uint64_t> expected;
+	for (size_t i = 0; i < items; ++i) {
+		uint64_t key = rng() % keys;
+		uint64_t count = 1 + rng() % 3;
+		expected[key] += count;
+		s.push(item_t(key, count));
+	}
+	s.end();
+	dummy_progress_indicator pi;
+	s.calc(pi);
+	std::map<uint64_t, uint64_t>::iterator i = expected.begin();
+	while (s.can_pull()) {
+		item_t x = s.pull();
+		TEST_ENSURE(i != expected.end(), "Too many items");
+		TEST_ENSURE_EQUALITY(i->first, x.first, "Wrong key");
+		TEST_ENSURE_EQUALITY(i->second, x.second, "Wrong combined count");
+		++i;
+	}
+	TEST_ENSURE(i == expected.end(), "Too few items");
+	return true;
+}
+
 int main(int argc, char ** argv) {
 	tests t(argc, argv);
+	sort_tester<use_double_buffered_merge_sort>::add_external_report_test(t, "double_buffered_external_report");
+	sort_tester<use_double_buffered_merge_sort>::add_parameters_test(t, "double_buffering", 1000, 4, 37);
+	sort_tester<use_double_buffered_merge_sort>::add_parameters_test(t, "double_buffering_one_run", 1000, 4, 1);
+	sort_tester<use_concurrent_merge_sort>::add_parameters_test(t, "concurrent_merges", 1000, 5, 5*5*3 + 7);
+	sort_tester<use_parallel_final_merge_sort>::add_evacuate_while_reporting_test(t, "parallel_final_merge", 1000, 8, 8*3);
+	sort_tester<use_duplicate_keys<use_parallel_final_merge_sort> >::add_evacuate_while_reporting_test(t, "parallel_final_merge_duplicates", 1000, 8, 8*3);
+	sort_tester<use_replacement_selection_merge_sort>::add_parameters_test(t, "replacement_selection", 1000, 4, 4*4*2);
+	sort_tester<use_nearly_sorted_keys<use_replacement_selection_merge_sort> >::add_parameters_test(t, "replacement_selection_sorted", 1000, 4, 4*4*2);
+	sort_tester<use_reversed_keys<use_replacement_selection_merge_sort> >::add_parameters_test(t, "replacement_selection_reversed", 1000, 4, 4*4*2);
+	sort_tester<use_merge_sort>::add_limit_test(t, "limit", 100);
+	sort_tester<use_merge_sort>::add_limit_test(t, "limit_zero", 0);
+	sort_tester<use_merge_sort>::add_limit_test(t, "limit_external", 3000);
+	sort_tester<use_replacement_selection_merge_sort>::add_limit_test(t, "limit_replacement_selection", 3000);
+	sort_tester<use_double_buffered_merge_sort>::add_limit_test(t, "limit_double_buffering", 3000);
+	sort_tester<use_parallel_final_merge_sort>::add_limit_test(t, "limit_parallel_final_merge", 3000);
+	sort_tester<use_concurrent_merge_sort>::add_limit_test(t, "limit_concurrent_merges", 3000);
+	sort_tester<use_distribution_merge_sort>::add_upper_bound_test(t, "distribution", 1000, 4, 50);
+	sort_tester<use_distribution_merge_sort>::add_parameters_test(t, "distribution_unbounded", 1000, 4, 50);
+	sort_tester<use_duplicate_keys<use_distribution_merge_sort> >::add_upper_bound_test(t, "distribution_skewed", 1000, 4, 50);
+	sort_tester<use_distribution_merge_sort>::add_limit_test(t, "distribution_limit", 3000);
+	sort_tester<use_nearly_sorted_keys<use_distribution_merge_sort> >::add_upper_bound_test(t, "distribution_sorted", 1000, 4, 50);
+	sort_tester<use_distribution_merge_sort>::add_evacuate_before_and_while_reporting_test(t, "distribution_evacuate", 1000, 4, 0);
 	return
 		sort_tester<use_merge_sort>::add_all(t)
 		.test(sort_upper_bound_test, "sort_upper_bound")
 		.test(sort_faulty_upper_bound_test, "sort_faulty_upper_bound")
 		.test(temp_file_usage_test, "temp_file_usage")
 		.test(tall_tree_test, "tall_tree", "fanout", static_cast<size_t>(6), "height", static_cast<size_t>(1))
+		.test(combine_test, "combine", "mode", static_cast<size_t>(0), "keys", static_cast<size_t>(20000))
+		.test(combine_test, "combine_few_keys", "mode", static_cast<size_t>(0), "keys", static_cast<size_t>(3))
+		.test(combine_test, "combine_replacement_selection", "mode", static_cast<size_t>(1), "keys", static_cast<size_t>(20000))
+		.test(combine_test, "combine_double_buffering", "mode", static_cast<size_t>(2), "keys", static_cast<size_t>(20000))
+		.test(combine_test, "combine_parallel_final_merge", "mode", static_cast<size_t>(3), "keys", static_cast<size_t>(20000))
+		.test(combine_test, "combine_concurrent_merges", "mode", static_cast<size_t>(4), "keys", static_cast<size_t>(20000))
 		;
 }
@@ -19,7 +19,10 @@
 
 #include "common.h"
 #include <tpie/parallel_sort.h>
+#include <tpie/parallel_radix_sort.h>
+#include <tpie/tiny.h>
 #include <random>
+#include <array>
 #include <tpie/progress_indicator_arrow.h>
 #include <tpie/dummy_progress.h>
 #include <tpie/memory.h>
@@ -284,6 +287,103 @@ bool large_item_test_chooser(size_t mb, size_t itemSize) {
 	return large_item_test_helper<0, 8>::go(mb, itemSize);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// Radix sort n items made by the generator, ordered by pred, and check the
+/// keys against std::sort. The radix sort is not stable, so items with equal
+/// keys may be permuted.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename pred_t, typename generator_t>
+bool radix_test(size_t n, pred_t pred, generator_t gen) {
+	static_assert(bits::radix_key<T, pred_t>::value, "Expected a radix key");
+	std::vector<T> v1(n);
+	for (size_t i = 0; i < n; ++i) v1[i] = gen(i);
+	std::vector<T> v2(v1);
+	std::sort(v1.begin(), v1.end(), pred);
+	radix_or_parallel_sort(v2.data(), v2.data() + n, pred);
+	for (size_t i = 0; i < n; ++i) {
+		if (pred(v1[i], v2[i]) || pred(v2[i], v1[i])) {
+			tpie::log_error() << "std::sort and radix sort disagree at " << i << std::endl;
+			return false;
+		}
+	}
+	std::sort(v1.begin(), v1.end());
+	std::sort(v2.begin(), v2.end());
+	if (v1 != v2) {
+		tpie::log_error() << "Radix sort lost items" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool radix_unsigned(size_t n) {
+	std::mt19937_64 prng(42);
+	for (size_t m = 0; m < 300; ++m) {
+		if (!radix_test<uint64_t>(m, std::less<uint64_t>(), [&](size_t) { return prng(); })) return false;
+	}
+	return radix_test<uint64_t>(n, std::less<uint64_t>(), [&](size_t) { return prng(); })
+		&& radix_test<uint8_t>(n, std::less<uint8_t>(), [&](size_t) { return static_cast<uint8_t>(prng()); });
+}
+
+bool radix_signed(size_t n) {
+	std::mt19937 prng(42);
+	return radix_test<int>(n, std::less<int>(), [&](size_t) { return static_cast<int>(prng()); })
+		&& radix_test<int>(n, std::greater<int>(), [&](size_t) { return static_cast<int>(prng()); })
+		&& radix_test<int16_t>(n, std::less<int16_t>(), [&](size_t) { return static_cast<int16_t>(prng()); });
+}
+
+bool radix_duplicates(size_t n) {
+	std::mt19937 prng(42);
+	return radix_test<size_t>(n, std::less<size_t>(), [&](size_t) { return static_cast<size_t>(prng() % 5) << 40; })
+		&& radix_test<size_t>(n, std::less<size_t>(), [&](size_t) { return static_cast<size_t>(42); });
+}
+
+bool radix_key_extract(size_t n) {
+	typedef std::pair<uint32_t, int> item_t;
+	typedef key_less<tpie::tiny::bits::PairExtract<uint32_t, int> > pred_t;
+	std::mt19937 prng(42);
+	return radix_test<item_t>(n, pred_t(), [&](size_t i) {
+		return item_t(static_cast<uint32_t>(prng() % 1000), static_cast<int>(i));
+	});
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Sample sort n items made by the generator for a range of sizes, and
+/// compare with std::sort.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename generator_t>
+bool sample_sort_test(size_t n, generator_t gen) {
+	set_parallel_sort_algorithm(parallel_sample_sort);
+	bool result = true;
+	for (size_t m = 16; m <= n && result; m = m * 3 + 7) {
+		std::vector<T> v1(m);
+		for (size_t i = 0; i < m; ++i) v1[i] = gen(i);
+		std::vector<T> v2(v1);
+		std::sort(v1.begin(), v1.end());
+		parallel_sort_impl<typename std::vector<T>::iterator, std::less<T>, false, 16> s(0);
+		s(v2.begin(), v2.end());
+		if (v1 != v2) {
+			tpie::log_error() << "std::sort and sample sort disagree for " << m << " items" << std::endl;
+			result = false;
+		}
+	}
+	set_parallel_sort_algorithm(parallel_quick_sort);
+	return result;
+}
+
+bool sample_sort(size_t n) {
+	std::mt19937_64 prng(42);
+	typedef std::array<uint32_t, 32> big_t;
+	return sample_sort_test<uint64_t>(n, [&](size_t) { return prng(); })
+		&& sample_sort_test<big_t>(n / 16, [&](size_t) { big_t x; x.fill(0); x[0] = static_cast<uint32_t>(prng()); return x; });
+}
+
+bool sample_sort_duplicates(size_t n) {
+	std::mt19937 prng(42);
+	return sample_sort_test<int>(n, [&](size_t) { return static_cast<int>(prng() % 7); })
+		&& sample_sort_test<int>(n, [&](size_t) { return 42; })
+		&& sample_sort_test<int>(n, [&](size_t i) { return static_cast<int>(i % 1000 == 0 ? prng() : 3); });
+}
+
 template <size_t stdsort_limit>
 struct sort_tester {
 	bool operator()(size_t n) {
@@ -300,6 +400,12 @@ int main(int argc, char **argv) {
 		.test(sort_tester<1024*1024>(), "general", "n", 24*1024*1024)
 		.test(adversarial<make_equal_elements_data>(), "equal_elements", "n", 1234567, "seconds", 1.0)
 		.test(bad_case, "bad_case", "n", 1024*1024, "seconds", 1.0)
+		.test(radix_unsigned, "radix_unsigned", "n", static_cast<size_t>(1024*1024))
+		.test(radix_signed, "radix_signed", "n", static_cast<size_t>(1024*1024))
+		.test(radix_duplicates, "radix_duplicates", "n", static_cast<size_t>(300000))
+		.test(radix_key_extract, "radix_key_extract", "n", static_cast<size_t>(300000))
+		.test(sample_sort, "sample_sort", "n", static_cast<size_t>(2000000))
+		.test(sample_sort_duplicates, "sample_sort_duplicates", "n", static_cast<size_t>(500000))
 		.test(adversarial<make_random_data>(), "general2", "n", 1024*1024, "seconds", 1.0)
 		.test(stress_test, "stress_test")
 		.test(large_item_test_chooser, "large_item", "mb", static_cast<size_t>(2048), "item-size", static_cast<size_t>(32))
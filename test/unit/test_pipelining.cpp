@@ -438,6 +438,22 @@ bool sort_test_large() {
 	return sort_test(300*1024);
 }
 
+bool partial_sort_test(size_t elements, size_t k) {
+	bool result = false;
+	pipeline p = sequence_generator(elements, true)
+		| partial_sort(k)
+		| sequence_verifier(std::min(elements, k), &result);
+	p();
+	return result;
+}
+
+bool sort_test_partial() {
+	TEST_ENSURE(partial_sort_test(20, 10), "Cannot keep 10 of 20 elements");
+	TEST_ENSURE(partial_sort_test(20, 30), "Cannot keep 30 of 20 elements");
+	TEST_ENSURE(partial_sort_test(300*1024, 1000), "Cannot keep 1000 of 300*1024 elements");
+	return true;
+}
+
 // This tests that pipe_middle | pipe_middle -> pipe_middle,
 // and that pipe_middle | pipe_end -> pipe_end.
 // The other tests already test that pipe_begin | pipe_middle -> pipe_middle,
@@ -2295,6 +2311,7 @@ int main(int argc, char ** argv) {
 	.test(sort_test_trivial, "sorttrivial")
 	.test(sort_test_small, "sort")
 	.test(sort_test_large, "sortbig")
+	.test(sort_test_partial, "partial_sort")
 	.test(operator_test, "operators")
 	.test(uniq_test, "uniq")
 	.multi_test(memory_test_multi, "memory")
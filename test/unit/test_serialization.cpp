@@ -22,6 +22,7 @@
 #include <tpie/serialization2.h>
 #include <tpie/serialization_stream.h>
 #include <map>
+#include <fstream>
 
 using namespace tpie;
 using namespace std;
@@ -352,6 +353,61 @@ bool stream_temp_test() {
 		&& tmpUsage3 > tmpUsage2;
 }
 
+template <typename Writer, typename Reader, bool reverse>
+bool stream_compressed_test_case(compression_flags flags) {
+	const memory_size_type N = 400000;
+	temp_file f;
+	{
+		Writer wr;
+		wr.open(f.path(), flags);
+		for (memory_size_type i = 0; i < N; ++i) {
+			wr.serialize(i);
+			wr.serialize(std::string(i % 17, 'a' + i % 26));
+		}
+		wr.close();
+	}
+	{
+		// Uncompressed streams are still written as version 1, and
+		// compressed streams are written by the compressor thread with the
+		// header of a TPIE stream.
+		std::ifstream in(f.path().c_str(), std::ios::binary);
+		uint64_t header[2];
+		in.read(reinterpret_cast<char *>(header), sizeof(header));
+		if (flags == compression_none) {
+			TEST_ENSURE_EQUALITY(1, header[1], "Wrong stream version");
+		} else {
+			TEST_ENSURE_EQUALITY(stream_header_t::magicConst, header[0], "Wrong stream magic");
+		}
+	}
+	Reader rd;
+	rd.open(f.path());
+	std::string s;
+	memory_size_type x;
+	for (memory_size_type i = 0; i < N; ++i) {
+		TEST_ENSURE(rd.can_read(), "Expected can_read()");
+		memory_size_type j = reverse ? N - i - 1 : i;
+		if (reverse) {
+			rd.unserialize(s);
+			rd.unserialize(x);
+		} else {
+			rd.unserialize(x);
+			rd.unserialize(s);
+		}
+		TEST_ENSURE_EQUALITY(j, x, "Wrong number read");
+		TEST_ENSURE(s == std::string(j % 17, 'a' + j % 26), "Wrong string read");
+	}
+	TEST_ENSURE(!rd.can_read(), "Expected !can_read()");
+	rd.close();
+	return true;
+}
+
+bool stream_compressed_test() {
+	return stream_compressed_test_case<serialization_writer, serialization_reader, false>(compression_normal)
+		&& stream_compressed_test_case<serialization_writer, serialization_reader, false>(compression_all)
+		&& stream_compressed_test_case<serialization_reverse_writer, serialization_reverse_reader, true>(compression_all)
+		&& stream_compressed_test_case<serialization_writer, serialization_reader, false>(compression_none);
+}
+
 int main(int argc, char ** argv) {
 	return tpie::tests(argc, argv)
 		.test(safe_test, "safe")
@@ -362,5 +418,6 @@ int main(int argc, char ** argv) {
 		.test(stream_reopen_test, "stream_reopen")
 		.test(stream_reverse_test, "stream_reverse")
 		.test(stream_temp_test, "stream_temp")
+		.test(stream_compressed_test, "stream_compressed")
 		;
 }
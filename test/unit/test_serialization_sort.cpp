@@ -67,9 +67,68 @@ public:
 	};
 };
 
+class use_compressed_serialization_sorter : public use_serialization_sorter {
+public:
+	class sorter : public use_serialization_sorter::sorter {
+	public:
+		sorter() {
+			set_run_compression(compression_all);
+		}
+	};
+
+	static void merge_runs(sorter & s) {
+		s.merge_runs();
+	}
+};
+
+struct key_pred {
+	bool operator()(const std::vector<int> & a, const std::vector<int> & b) const {
+		return a[0] < b[0];
+	}
+};
+
+struct count_combine {
+	void operator()(std::vector<int> & a, const std::vector<int> & b) const {
+		a[1] += b[1];
+	}
+};
+
+bool combine_test() {
+	// Items are {key, count}.
+	const size_t items = 300000;
+	const int keys = 50000;
+	serialization_sorter<std::vector<int>, key_pred, count_combine> s(2*sizeof(int));
+	s.set_available_memory(3*1024*1024, 8*1024*1024, 8*1024*1024);
+	s.begin();
+	std::mt19937 rng(42);
+	std::vector<int> expected(keys);
+	for (size_t i = 0; i < items; ++i) {
+		int key = static_cast<int>(rng() % keys);
+		int count = static_cast<int>(1 + rng() % 3);
+		expected[key] += count;
+		s.push(std::vector<int>{key, count});
+	}
+	s.end();
+	s.merge_runs();
+	int key = 0;
+	while (s.can_pull()) {
+		std::vector<int> x = s.pull();
+		while (key < keys && expected[key] == 0) ++key;
+		TEST_ENSURE(key < keys, "Too many items");
+		TEST_ENSURE_EQUALITY(key, x[0], "Wrong key");
+		TEST_ENSURE_EQUALITY(expected[key], x[1], "Wrong combined count");
+		++key;
+	}
+	while (key < keys && expected[key] == 0) ++key;
+	TEST_ENSURE_EQUALITY(keys, key, "Too few items");
+	return true;
+}
+
 int main(int argc, char ** argv) {
 	tests t(argc, argv);
+	t.test(combine_test, "combine");
 	sort_tester<use_serialization_sorter>::add_all(t);
 	sort_tester<use_serialization_sorter>::add_file_limit_test(t, 3);
+	sort_tester<use_compressed_serialization_sorter>::add_external_report_test(t, "compressed_external_report");
 	return t;
 }
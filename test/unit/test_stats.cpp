@@ -28,6 +28,8 @@
 #include <tpie/file_stream.h>
 #include <tpie/util.h>
 #include <tpie/stats.h>
+#include <tpie/tempname.h>
+#include <boost/filesystem.hpp>
 
 using namespace tpie;
 
@@ -75,7 +77,77 @@ bool simple_test(size_type size) {
 	return true;
 }
 
+bool temp_dirs_test() {
+	const size_t dirs = 3;
+	const std::string oldPath = tempname::get_default_path();
+	std::string base = tempname::tpie_dir_name();
+	boost::filesystem::create_directory(base);
+	std::vector<std::string> paths;
+	for (size_t i = 0; i < dirs; ++i) {
+		std::stringstream ss;
+		ss << "dir" << i;
+		paths.push_back((boost::filesystem::path(base) / ss.str()).string());
+		boost::filesystem::create_directory(paths.back());
+	}
+
+	// Round robin: consecutive files go to consecutive directories.
+	tempname::set_default_paths(paths);
+	TEST_ENSURE(tempname::get_default_paths() == paths, "Wrong default paths");
+	for (size_t i = 0; i < 2*dirs; ++i) {
+		temp_file tf;
+		TEST_ENSURE_EQUALITY(i % dirs, tempname::get_temp_dir_index(tf.path()), "Wrong directory");
+	}
+
+	// Least used: a directory holding a large file is avoided.
+	tempname::set_default_paths(paths, temp_dir_least_used);
+	{
+		temp_file large;
+		file_stream<uint64_t> s;
+		s.open(large);
+		for (size_t i = 0; i < 1024*1024; ++i) s.write(i);
+		s.close();
+		size_t largeDir = tempname::get_temp_dir_index(large.path());
+		TEST_ENSURE(largeDir < dirs, "Temporary file not in a temporary directory");
+		TEST_ENSURE(test_about(get_temp_dir_usage(largeDir), 1024*1024*sizeof(uint64_t), "directory usage"), "Wrong directory usage");
+		for (size_t i = 0; i < 2*dirs; ++i) {
+			temp_file tf;
+			file_stream<uint64_t> t;
+			t.open(tf);
+			t.write(i);
+			t.close();
+			TEST_ENSURE(tempname::get_temp_dir_index(tf.path()) != largeDir, "Used the fullest directory");
+		}
+	}
+	for (size_t i = 0; i < dirs; ++i)
+		TEST_ENSURE_EQUALITY(0, get_temp_dir_usage(i), "Directory usage not reset");
+
+	// Setting the directories again starts the counters over, and files
+	// placed before no longer count.
+	{
+		temp_file old;
+		file_stream<uint64_t> s;
+		s.open(old);
+		for (size_t i = 0; i < 1024; ++i) s.write(i);
+		s.close();
+		tempname::set_default_paths(paths);
+		for (size_t i = 0; i < dirs; ++i)
+			TEST_ENSURE_EQUALITY(0, get_temp_dir_usage(i), "Directory usage not reset by set_default_paths");
+		s.open(old);
+		s.seek(0, file_stream<uint64_t>::end);
+		for (size_t i = 0; i < 1024*1024; ++i) s.write(i);
+		s.close();
+		for (size_t i = 0; i < dirs; ++i)
+			TEST_ENSURE_EQUALITY(0, get_temp_dir_usage(i), "Retired temporary file counted");
+	}
+
+	tempname::set_default_path(oldPath);
+	TEST_ENSURE(tempname::get_default_paths().empty(), "Default paths not reset");
+	boost::filesystem::remove_all(base);
+	return true;
+}
+
 int main(int argc, char ** argv) {
 	return tpie::tests(argc, argv)
-		.test(simple_test, "simple", "size", 1024*1024*10);
+		.test(simple_test, "simple", "size", 1024*1024*10)
+		.test(temp_dirs_test, "temp_dirs");
 }
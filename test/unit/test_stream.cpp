@@ -27,6 +27,7 @@
 #include <vector>
 #include <array>
 #include <random>
+#include <thread>
 #include <tpie/tpie_log.h>
 #include <tpie/progress_indicator_arrow.h>
 
@@ -35,6 +36,11 @@
 #include <tpie/array.h>
 #include <tpie/file_stream.h>
 #include <tpie/compressed/stream.h>
+#ifndef WIN32
+#include <sys/stat.h>
+#include <tpie/file_accessor/mmap.h>
+#include <tpie/file_accessor/uring.h>
+#endif
 #include <tpie/util.h>
 
 using tpie::uint64_t;
@@ -70,6 +76,11 @@ struct file_colon_colon_stream {
 	tpie::unique_ptr<typename tpie::file<T>::stream> m_stream;
 	typedef typename tpie::file<T>::stream stream_type;
 
+	file_colon_colon_stream(tpie::file_accessor::file_accessor * fileAccessor = 0)
+		: m_file(1.0, fileAccessor)
+	{
+	}
+
 	inline ~file_colon_colon_stream() {
 		m_stream.reset();
 	}
@@ -93,6 +104,16 @@ struct file_colon_colon_stream {
 	void open(tpie::temp_file & tf, tpie::access_type a, tpie::memory_size_type uds) { file().open(tf, a, uds); }
 };
 
+#ifndef WIN32
+template <typename T>
+struct uring_file_stream : public file_colon_colon_stream<T> {
+	uring_file_stream()
+		: file_colon_colon_stream<T>(new tpie::file_accessor::uring_stream_accessor())
+	{
+	}
+};
+#endif
+
 template <typename T>
 struct file_stream {
 	tpie::uncompressed_stream<T> m_fs;
@@ -116,6 +137,52 @@ struct file_stream {
 	void open(tpie::temp_file & tf, tpie::access_type a, tpie::memory_size_type uds) { file().open(tf, a, uds); }
 };
 
+template <typename T>
+struct direct_file_stream : public file_stream<T> {
+	void open(std::string fileName) {
+		this->file().open(fileName, tpie::access_read_write, 0, tpie::access_direct);
+	}
+	void open(tpie::temp_file & tf) {
+		this->file().open(tf, tpie::access_read_write, 0, tpie::access_direct);
+	}
+	void open(tpie::temp_file & tf, tpie::access_type a) {
+		this->file().open(tf, a, 0, tpie::access_direct);
+	}
+	void open(tpie::temp_file & tf, tpie::access_type a, tpie::memory_size_type uds) {
+		this->file().open(tf, a, uds, tpie::access_direct);
+	}
+};
+
+template <typename T>
+struct direct_file_colon_colon_stream : public file_colon_colon_stream<T> {
+	void open(std::string fileName) {
+		this->file().open(fileName, tpie::access_read_write, 0, tpie::access_direct);
+	}
+	void open(tpie::temp_file & tf) {
+		this->file().open(tf, tpie::access_read_write, 0, tpie::access_direct);
+	}
+	void open(tpie::temp_file & tf, tpie::access_type a) {
+		this->file().open(tf, a, 0, tpie::access_direct);
+	}
+	void open(tpie::temp_file & tf, tpie::access_type a, tpie::memory_size_type uds) {
+		this->file().open(tf, a, uds, tpie::access_direct);
+	}
+};
+
+template <typename T>
+struct write_behind_file_stream : public file_stream<T> {
+	write_behind_file_stream() {
+		this->file().set_write_behind(4);
+	}
+};
+
+template <typename T>
+struct write_behind_file_colon_colon_stream : public file_colon_colon_stream<T> {
+	write_behind_file_colon_colon_stream() {
+		this->file().set_write_behind(4);
+	}
+};
+
 template <typename T>
 struct compressed_stream {
 	tpie::file_stream<T> m_fs;
@@ -769,6 +836,333 @@ bool peek_skip_test_2() {
 	return true;
 }
 
+bool direct_padding_test() {
+	tpie::temp_file tmp;
+	tpie::uncompressed_stream<int> fs;
+	fs.open(tmp, tpie::access_read_write, 0, tpie::access_direct);
+	for (int i = 0; i < 10; ++i) fs.write(i + 1);
+	fs.seek(0);
+	// The tail block was written padded to the boundary;
+	// extending the stream must still yield zeroes.
+	fs.truncate(2000);
+	for (int i = 0; i < 10; ++i) TEST_ENSURE_EQUALITY(i + 1, fs.read(), "Wrong item before the old end");
+	for (int i = 10; i < 2000; ++i) TEST_ENSURE_EQUALITY(0, fs.read(), "Nonzero item after extending");
+	return true;
+}
+
+bool concurrent_read_test() {
+	tpie::temp_file tmp;
+	const tpie::memory_size_type blockSize = tpie::file<uint64_t>::block_size(1.0);
+	const tpie::memory_size_type blockItems = blockSize/sizeof(uint64_t);
+	const size_t threads = 4;
+	const tpie::stream_size_type blocks = 4*threads;
+	{
+		tpie::uncompressed_stream<uint64_t> fs;
+		fs.open(tmp, tpie::access_write);
+		for (size_t i = 0; i < blocks*blockItems; ++i) fs.write(ITEM(i));
+	}
+
+	tpie::default_file_accessor accessor;
+	accessor.open(tmp.path(), true, false, sizeof(uint64_t), blockSize, 0,
+				  tpie::access_random, tpie::compression_none);
+	// Every thread reads every threads'th block, so the positional
+	// reads of all threads are interleaved on the same descriptor.
+	std::vector<int> ok(threads, 1);
+	std::vector<std::thread> workers;
+	for (size_t t = 0; t < threads; ++t) {
+		workers.push_back(std::thread([&, t]() {
+			std::vector<uint64_t> buf(blockItems);
+			for (int pass = 0; pass < 4; ++pass) {
+				for (tpie::stream_size_type b = t; b < blocks; b += threads) {
+					if (accessor.read_block(&buf[0], b, blockItems) != blockItems) ok[t] = 0;
+					for (size_t i = 0; i < blockItems; ++i)
+						if (buf[i] != ITEM(b*blockItems + i)) ok[t] = 0;
+				}
+			}
+		}));
+	}
+	for (size_t t = 0; t < threads; ++t) workers[t].join();
+	for (size_t t = 0; t < threads; ++t)
+		TEST_ENSURE(ok[t], "Thread " << t << " read wrong data");
+	return true;
+}
+
+bool write_behind_test() {
+	tpie::temp_file tmp;
+	const tpie::memory_size_type writeBehind = 3;
+	const tpie::stream_size_type blockItems = tpie::file<uint64_t>::block_size(1.0)/sizeof(uint64_t);
+	const tpie::stream_size_type items = 20*blockItems + 5;
+	std::vector<uint64_t> expected(items);
+	std::mt19937 rng(42);
+
+	tpie::file<uint64_t> f;
+	f.set_write_behind(writeBehind);
+	f.open(tmp);
+	const tpie::memory_size_type bound =
+		tpie::file<uint64_t>::memory_usage(false, 1.0, writeBehind)
+		- tpie::file<uint64_t>::memory_usage(false)
+		+ 2*tpie::file<uint64_t>::stream::memory_usage();
+	const tpie::memory_size_type before = tpie::get_memory_manager().used();
+	{
+		// Two streams writing and reading the same blocks while other blocks
+		// are being written in the background.
+		tpie::file<uint64_t>::stream a(f);
+		tpie::file<uint64_t>::stream b(f);
+		for (size_t i = 0; i < items; ++i) a.write(expected[i] = ITEM(i));
+		std::uniform_int_distribution<tpie::stream_size_type> pos(0, items - 1);
+		for (size_t i = 0; i < 1000; ++i) {
+			tpie::file<uint64_t>::stream & s = (i % 2) ? a : b;
+			tpie::stream_size_type p = pos(rng);
+			s.seek(p);
+			if (i % 3 == 0) {
+				s.write(expected[p] = rng());
+			} else {
+				uint64_t got = s.read();
+				TEST_ENSURE_EQUALITY(expected[p], got, "Wrong item after random seek");
+			}
+			TEST_ENSURE(tpie::get_memory_manager().used() - before <= bound,
+						"Write-behind used more memory than reported");
+		}
+	}
+	f.close();
+
+	tpie::uncompressed_stream<uint64_t> fs;
+	fs.set_write_behind(writeBehind);
+	fs.open(tmp);
+	for (size_t i = 0; i < items; ++i) {
+		uint64_t got = fs.read();
+		TEST_ENSURE_EQUALITY(expected[i], got, "Wrong item after reopen");
+	}
+	TEST_ENSURE(!fs.can_read(), "can_read() at end of stream");
+	bool threw = false;
+	try {
+		fs.set_write_behind(0);
+	} catch (tpie::stream_exception &) {
+		threw = true;
+	}
+	TEST_ENSURE(threw, "set_write_behind() on an open stream did not throw");
+	return true;
+}
+
+template <typename Stream>
+bool check_items(Stream & fs, const std::vector<uint64_t> & expected, const char * what) {
+	TEST_ENSURE_EQUALITY(expected.size(), fs.size(), "Wrong size " << what);
+	fs.seek(0);
+	for (size_t i = 0; i < expected.size(); ++i)
+		TEST_ENSURE_EQUALITY(expected[i], fs.read(), "Wrong item " << i << " " << what);
+	return true;
+}
+
+bool concatenate_test() {
+	typedef tpie::uncompressed_stream<uint64_t> stream_t;
+	const size_t blockItems = tpie::file<uint64_t>::block_size(1.0)/sizeof(uint64_t);
+	tpie::temp_file tmpA;
+	tpie::temp_file tmpB;
+	tpie::temp_file tmpC;
+	std::vector<uint64_t> expected;
+	std::vector<uint64_t> other;
+
+	// Streams with different block sizes, both ending in a partial block.
+	stream_t a(1.0);
+	a.open(tmpA, tpie::access_read_write, sizeof(uint64_t));
+	a.write_user_data(static_cast<uint64_t>(1));
+	for (size_t i = 0; i < 3*blockItems + 7; ++i) {
+		expected.push_back(ITEM(i));
+		a.write(expected.back());
+	}
+	stream_t b(0.25);
+	b.open(tmpB, tpie::access_read_write, sizeof(uint64_t));
+	b.write_user_data(static_cast<uint64_t>(2));
+	for (size_t i = 0; i < 2*blockItems + 11; ++i) {
+		other.push_back(ITEM(i) + 1);
+		b.write(other.back());
+	}
+
+	// The last block of a is still dirty when concatenating.
+	a.concatenate(b);
+	expected.insert(expected.end(), other.begin(), other.end());
+	TEST_ENSURE_EQUALITY(3*blockItems + 7, a.offset(), "concatenate() moved the stream");
+	if (!check_items(a, expected, "after concatenate")) return false;
+
+	a.concatenate(a);
+	std::vector<uint64_t> twice(expected);
+	expected.insert(expected.end(), twice.begin(), twice.end());
+	if (!check_items(a, expected, "after concatenating a stream to itself")) return false;
+
+	a.close();
+	a.open(tmpA, tpie::access_read_write, sizeof(uint64_t));
+	if (!check_items(a, expected, "after reopen")) return false;
+	uint64_t userData = 0;
+	a.read_user_data(userData);
+	TEST_ENSURE_EQUALITY(1, userData, "concatenate() changed user data");
+
+	// Replace a longer stream written through write-behind.
+	stream_t c(0.5);
+	c.set_write_behind(2);
+	c.open(tmpC, tpie::access_read_write, sizeof(uint64_t));
+	for (size_t i = 0; i < 5*blockItems; ++i) c.write(0);
+	c.copy_from(b);
+	if (!check_items(c, other, "after copy")) return false;
+	c.close();
+	c.open(tmpC, tpie::access_read, sizeof(uint64_t));
+	if (!check_items(c, other, "after copy and reopen")) return false;
+	c.read_user_data(userData);
+	TEST_ENSURE_EQUALITY(2, userData, "copy_from() did not copy user data");
+	return true;
+}
+
+#ifndef WIN32
+bool mmap_test() {
+	typedef tpie::file_accessor::mmap_stream_accessor accessor_t;
+	tpie::temp_file tmp;
+	const size_t items = 3*tpie::file<uint64_t>::block_size(1.0)/sizeof(uint64_t) + 42;
+	{
+		tpie::uncompressed_stream<uint64_t> fs;
+		fs.open(tmp);
+		for (size_t i = 0; i < items; ++i) fs.write(ITEM(i));
+	}
+
+	accessor_t * accessor = new accessor_t();
+	tpie::file<uint64_t> f(1.0, accessor);
+	f.open(tmp, tpie::access_read, 0, tpie::access_random);
+	{
+		// Two streams scanning the same mapped blocks.
+		tpie::file<uint64_t>::stream a(f);
+		tpie::file<uint64_t>::stream b(f);
+		for (size_t i = 0; i < items; ++i) {
+			TEST_ENSURE_EQUALITY(ITEM(i), a.read(), "Wrong item in first stream");
+			if (i % 2 == 0) {
+				b.seek(items - 1 - i);
+				TEST_ENSURE_EQUALITY(ITEM(items - 1 - i), b.read(), "Wrong item in second stream");
+			}
+		}
+		TEST_ENSURE(!a.can_read(), "can_read() at end of stream");
+	}
+	TEST_ENSURE(accessor->is_mapped(), "Read-only file was not mapped");
+	f.close();
+	TEST_ENSURE(!accessor->is_mapped(), "Mapping survived close()");
+
+	// Opened for writing, the accessor behaves like the default one.
+	f.open(tmp);
+	{
+		tpie::file<uint64_t>::stream s(f);
+		s.seek(0, tpie::file<uint64_t>::stream::end);
+		s.write(42);
+		s.seek(0);
+		for (size_t i = 0; i < items; ++i)
+			TEST_ENSURE_EQUALITY(ITEM(i), s.read(), "Wrong item in writable stream");
+		TEST_ENSURE_EQUALITY(static_cast<uint64_t>(42), s.read(), "Wrong appended item");
+	}
+	TEST_ENSURE(!accessor->is_mapped(), "Writable file was mapped");
+	return true;
+}
+
+tpie::stream_size_type allocated_bytes(const std::string & path) {
+	struct stat st;
+	if (::stat(path.c_str(), &st) != 0) return 0;
+	return static_cast<tpie::stream_size_type>(st.st_blocks) * 512;
+}
+
+template <typename Stream>
+bool reserve_test_inner(Stream & fs, tpie::temp_file & tmp) {
+	const size_t items = 1024*1024;
+	const size_t written = items/16;
+	fs.reserve(items);
+	bool reserved = allocated_bytes(tmp.path()) >= items*sizeof(uint64_t);
+	if (!reserved)
+		tpie::log_debug() << "File system did not reserve space" << std::endl;
+	TEST_ENSURE_EQUALITY(0, fs.size(), "reserve() changed the size");
+	for (size_t i = 0; i < written; ++i) fs.write(ITEM(i));
+	fs.close();
+	if (reserved)
+		TEST_ENSURE(allocated_bytes(tmp.path()) < items*sizeof(uint64_t)/2,
+					"Unused reserved space was not given back on close");
+	fs.open(tmp);
+	TEST_ENSURE_EQUALITY(written, fs.size(), "Wrong size after reopen");
+	for (size_t i = 0; i < written; ++i)
+		TEST_ENSURE_EQUALITY(ITEM(i), fs.read(), "Wrong item after reopen");
+	return true;
+}
+
+bool reserve_test() {
+	{
+		tpie::temp_file tmp;
+		tpie::uncompressed_stream<uint64_t> fs;
+		fs.open(tmp);
+		if (!reserve_test_inner(fs, tmp)) return false;
+	}
+	{
+		tpie::temp_file tmp;
+		tpie::file_stream<uint64_t> fs;
+		fs.open(tmp, tpie::access_read_write, 0, tpie::access_sequential, tpie::compression_none);
+		if (!reserve_test_inner(fs, tmp)) return false;
+	}
+	{
+		// The compressed size is unknown, so nothing is reserved.
+		tpie::temp_file tmp;
+		tpie::file_stream<uint64_t> fs;
+		fs.open(tmp, tpie::access_read_write, 0, tpie::access_sequential, tpie::compression_normal);
+		fs.reserve(1024*1024);
+		TEST_ENSURE(allocated_bytes(tmp.path()) < 1024*1024*sizeof(uint64_t)/2,
+					"Compressed stream reserved its uncompressed size");
+	}
+	return true;
+}
+
+bool uring_random_test() {
+	typedef tpie::file_accessor::uring_stream_accessor accessor_t;
+	tpie::temp_file tmp;
+	const tpie::memory_size_type bound =
+		accessor_t::memory_usage(tpie::file<uint64_t>::block_size(1.0), 4)
+		+ tpie::file<uint64_t>::memory_usage(false)
+		+ tpie::file<uint64_t>::stream::memory_usage();
+	const tpie::memory_size_type before = tpie::get_memory_manager().used();
+	accessor_t * accessor = new accessor_t(4);
+	tpie::file<uint64_t> f(1.0, accessor);
+	bool threw = false;
+	try {
+		f.set_write_behind(2);
+	} catch (tpie::stream_exception &) {
+		threw = true;
+	}
+	TEST_ENSURE(threw, "set_write_behind() accepted the io_uring accessor");
+	f.open(tmp);
+	tpie::log_debug() << "io_uring " << (accessor->is_asynchronous() ? "enabled" : "disabled") << std::endl;
+	const tpie::stream_size_type blockItems = tpie::file<uint64_t>::block_size(1.0)/sizeof(uint64_t);
+	const tpie::stream_size_type items = 10*blockItems + 17;
+	std::vector<uint64_t> expected(items);
+	std::mt19937 rng(42);
+	{
+		tpie::file<uint64_t>::stream s(f);
+		for (size_t i = 0; i < items; ++i) s.write(expected[i] = ITEM(i));
+		// Jump between blocks, overwriting some items, so that blocks read
+		// ahead and blocks still being written are both requested again.
+		std::uniform_int_distribution<tpie::stream_size_type> pos(0, items - 1);
+		for (size_t i = 0; i < 1000; ++i) {
+			tpie::stream_size_type p = pos(rng);
+			s.seek(p);
+			if (i % 3 == 0) {
+				s.write(expected[p] = rng());
+			} else {
+				uint64_t got = s.read();
+				TEST_ENSURE_EQUALITY(expected[p], got, "Wrong item after random seek");
+			}
+			TEST_ENSURE(tpie::get_memory_manager().used() - before <= bound,
+						"io_uring accessor used more memory than reported");
+		}
+	}
+	f.close();
+	f.open(tmp);
+	tpie::file<uint64_t>::stream s(f);
+	for (size_t i = 0; i < items; ++i) {
+		uint64_t got = s.read();
+		TEST_ENSURE_EQUALITY(expected[i], got, "Wrong item after reopen");
+	}
+	TEST_ENSURE(!s.can_read(), "can_read() at end of stream");
+	return true;
+}
+#endif
+
 bool reopen() {
 	tpie::temp_file tf;
 
@@ -818,5 +1212,38 @@ int main(int argc, char **argv) {
 		.test(stream_tester<file_colon_colon_stream>::user_data_test, "user_data_file")
 		.test(peek_skip_test_1, "peek_skip_1")
 		.test(peek_skip_test_2, "peek_skip_2")
+		.test(concurrent_read_test, "concurrent_read")
+		.test(stream_tester<direct_file_stream>::array_test, "array_direct")
+		.test(stream_tester<direct_file_colon_colon_stream>::array_test, "array_file_direct")
+		.test(stream_tester<direct_file_stream>::odd_block_test, "odd_direct")
+		.test(stream_tester<direct_file_colon_colon_stream>::odd_block_test, "odd_file_direct")
+		.test(stream_tester<direct_file_stream>::truncate_test, "truncate_direct")
+		.test(stream_tester<direct_file_stream>::extend_test, "extend_direct")
+		.test(stream_tester<direct_file_colon_colon_stream>::extend_test, "extend_file_direct")
+		.test(stream_tester<direct_file_stream>::backwards_test, "backwards_direct")
+		.test(stream_tester<direct_file_stream>::user_data_test, "user_data_direct")
+		.test(direct_padding_test, "direct_padding")
+		.test(stream_tester<write_behind_file_stream>::array_test, "array_write_behind")
+		.test(stream_tester<write_behind_file_colon_colon_stream>::array_test, "array_file_write_behind")
+		.test(stream_tester<write_behind_file_stream>::odd_block_test, "odd_write_behind")
+		.test(stream_tester<write_behind_file_colon_colon_stream>::odd_block_test, "odd_file_write_behind")
+		.test(stream_tester<write_behind_file_stream>::truncate_test, "truncate_write_behind")
+		.test(stream_tester<write_behind_file_colon_colon_stream>::truncate_test, "truncate_file_write_behind")
+		.test(stream_tester<write_behind_file_stream>::extend_test, "extend_write_behind")
+		.test(stream_tester<write_behind_file_colon_colon_stream>::extend_test, "extend_file_write_behind")
+		.test(stream_tester<write_behind_file_stream>::backwards_test, "backwards_write_behind")
+		.test(write_behind_test, "write_behind")
+		.test(concatenate_test, "concatenate")
+#ifndef WIN32
+		.test(stream_tester<uring_file_stream>::array_test, "array_uring")
+		.test(stream_tester<uring_file_stream>::odd_block_test, "odd_uring")
+		.test(stream_tester<uring_file_stream>::truncate_test, "truncate_uring")
+		.test(stream_tester<uring_file_stream>::extend_test, "extend_uring")
+		.test(stream_tester<uring_file_stream>::backwards_test, "backwards_uring")
+		.test(stream_tester<uring_file_stream>::user_data_test, "user_data_uring")
+		.test(uring_random_test, "random_uring")
+		.test(reserve_test, "reserve")
+		.test(mmap_test, "mmap")
+#endif
 		;
 }
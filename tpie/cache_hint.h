@@ -37,7 +37,14 @@ enum cache_hint {
 
 	/** Random access is intended.
 	 * Corresponds to POSIX_FADV_RANDOM and FILE_FLAG_RANDOM_ACCESS (Win32). */
-	access_random
+	access_random,
+
+	/** Blocks should bypass the OS page cache, e.g. for data that is read
+	 * exactly once. Block reads and writes use O_DIRECT where the file
+	 * system supports it; elsewhere this is the same as access_sequential.
+	 * Only uncompressed streams (tpie::file and uncompressed_stream) do
+	 * direct I/O; compressed streams treat this as access_sequential. */
+	access_direct
 };
 
 } // namespace tpie
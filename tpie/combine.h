@@ -0,0 +1,80 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet cino+=(0 :
+// Copyright 2013, The TPIE development team
+// 
+// This file is part of TPIE.
+// 
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+// 
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file combine.h
+/// Combine functions for sorters that aggregate items with equal keys.
+///
+/// A combine function is called as combine(a, b) with two items that are
+/// equal by the sort predicate, and merges b into a, e.g. by adding the count
+/// of b to the count of a. A sorter with a combine function reports a single
+/// item for every key.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __TPIE_COMBINE_H__
+#define __TPIE_COMBINE_H__
+
+#include <type_traits>
+#include <utility>
+#include <tpie/config.h>
+
+namespace tpie {
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief The combine function of sorters that keep items with equal keys
+/// apart. This is the default.
+///////////////////////////////////////////////////////////////////////////////
+struct no_combine {
+	template <typename T, typename U>
+	void operator()(T &, U &&) const {}
+};
+
+namespace bits {
+
+template <typename combine_t>
+struct is_combining : std::true_type {};
+
+template <>
+struct is_combining<no_combine> : std::false_type {};
+
+} // namespace bits
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Combine every group of equal items in the sorted range [a,b) into
+/// its first item, and move the combined items to the front like
+/// std::unique does.
+/// \returns The end of the combined items.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename pred_t, typename combine_t>
+T * combine_sorted(T * a, T * b, pred_t pred, combine_t combine) {
+	if (a == b) return b;
+	T * out = a;
+	for (T * i = a + 1; i != b; ++i) {
+		if (!pred(*out, *i)) {
+			combine(*out, std::move(*i));
+		} else if (++out != i) {
+			*out = std::move(*i);
+		}
+	}
+	return out + 1;
+}
+
+} // namespace tpie
+
+#endif // __TPIE_COMBINE_H__
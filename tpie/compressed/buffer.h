@@ -250,6 +250,7 @@ public:
 	stream_buffers(memory_size_type blockSize)
 		: m_blockSize(blockSize)
 		, m_ownBuffers(0)
+		, m_readAhead(0)
 	{
 	}
 
@@ -259,12 +260,24 @@ public:
 		}
 	}
 
-	static memory_size_type memory_usage(memory_size_type blockSize) {
-		return blockSize;
+	static memory_size_type memory_usage(memory_size_type blockSize, memory_size_type readAhead = 0) {
+		return blockSize * (OWN_BUFFERS + readAhead);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// \brief  Set the number of blocks that may be read ahead of the block
+	/// in use, each in an own buffer of its own.
+	///////////////////////////////////////////////////////////////////////////////
+	void set_read_ahead(memory_size_type blocks) {
+		m_readAhead = blocks;
+	}
+
+	memory_size_type read_ahead() const {
+		return m_readAhead;
 	}
 
 	buffer_t get_buffer(compressor_thread_lock & lock, stream_size_type blockNumber) {
-		if (!(m_ownBuffers < OWN_BUFFERS || can_take_shared_buffer())) {
+		if (!(m_ownBuffers < own_buffer_limit() || can_take_shared_buffer())) {
 			// First, search for the buffer in the map.
 			buffermapit target = m_buffers.find(blockNumber);
 			if (target != m_buffers.end()) return target->second;
@@ -311,7 +324,7 @@ public:
 
 			if (i == m_buffers.end()) {
 				// No free found: allocate new buffer.
-				if (m_ownBuffers < OWN_BUFFERS) {
+				if (m_ownBuffers < own_buffer_limit()) {
 					target->second = allocate_own_buffer();
 				} else if (can_take_shared_buffer()) {
 					target->second = take_shared_buffer();
@@ -335,6 +348,52 @@ public:
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	/// \brief  Get a buffer in which to read the given block ahead of time.
+	///
+	/// Unlike get_buffer, this never waits, and it only reuses buffers of
+	/// blocks numbered below \c current, so blocks read ahead earlier are
+	/// kept until they are used.
+	/// \returns The buffer, or an empty pointer if the block already has a
+	/// buffer or no buffer is free.
+	///////////////////////////////////////////////////////////////////////////////
+	buffer_t get_read_ahead_buffer(stream_size_type blockNumber, stream_size_type current) {
+		if (m_buffers.count(blockNumber)) return buffer_t();
+		buffer_t b;
+		for (buffermapit i = m_buffers.begin(); i != m_buffers.end() && i->first < current; ++i) {
+			if (i->second.unique()) {
+				b.swap(i->second);
+				m_buffers.erase(i);
+				break;
+			}
+		}
+		if (!b) {
+			if (m_ownBuffers >= own_buffer_limit()) return buffer_t();
+			b = allocate_own_buffer();
+		}
+		b->reset();
+		m_buffers.insert(std::make_pair(blockNumber, b));
+		return b;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// \brief  Get the buffer of the given block, if it has one.
+	///////////////////////////////////////////////////////////////////////////////
+	buffer_t find_buffer(stream_size_type blockNumber) {
+		buffermapit i = m_buffers.find(blockNumber);
+		return i == m_buffers.end() ? buffer_t() : i->second;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	/// \brief  Whether a read request is pending for any of the buffers.
+	///////////////////////////////////////////////////////////////////////////////
+	bool reading() const {
+		for (buffermap_t::const_iterator i = m_buffers.begin(); i != m_buffers.end(); ++i)
+			if (i->second && i->second->get_state() == compressor_buffer_state::reading)
+				return true;
+		return false;
+	}
+
 	bool empty() const {
 		return m_buffers.empty();
 	}
@@ -364,6 +423,10 @@ private:
 		return m_ownBuffers;
 	}
 
+	memory_size_type own_buffer_limit() const {
+		return OWN_BUFFERS + m_readAhead;
+	}
+
 	memory_size_type shared_buffers() {
 		return m_buffers.size() - m_ownBuffers;
 	}
@@ -406,6 +469,9 @@ private:
 
 	/** Number of own buffers currently allocated inside m_buffers. */
 	memory_size_type m_ownBuffers;
+
+	/** Number of blocks that may be read ahead; see set_read_ahead. */
+	memory_size_type m_readAhead;
 };
 
 } // namespace tpie
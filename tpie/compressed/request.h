@@ -25,6 +25,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include <memory>
+#include <vector>
 #include <thread>
 #include <condition_variable>
 #include <tpie/tpie_assert.h>
@@ -33,6 +34,7 @@
 #include <tpie/file_accessor/byte_stream_accessor.h>
 #include <tpie/compressed/predeclare.h>
 #include <tpie/compressed/direction.h>
+#include <tpie/compressed/scheme.h>
 
 namespace tpie {
 
@@ -52,10 +54,12 @@ class compressor_response {
 public:
 	compressor_response()
 		: m_done(false)
+		, m_compressedSize(0)
 		, m_blockNumber(std::numeric_limits<stream_size_type>::max())
 		, m_readOffset(0)
 		, m_blockSize(0)
 		, m_endOfStream(false)
+		, m_rawBlocks(0)
 		, m_nextReadOffset(0)
 		, m_nextBlockSize(0)
 	{
@@ -94,8 +98,9 @@ public:
 			m_blockNumber = blockNumber;
 			m_readOffset = readOffset;
 			m_blockSize = blockSize;
-			m_changed.notify_all();
 		}
+		// Also wakes up streams waiting for their block index.
+		m_changed.notify_all();
 	}
 
 	// write, stream
@@ -146,6 +151,15 @@ public:
 		return m_nextReadOffset;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief State of the adaptive compression policy of the stream.
+	///
+	/// Only used by the compressor thread serving the stream, and since
+	/// requests of a stream are never served concurrently, it needs no lock.
+	///////////////////////////////////////////////////////////////////////////
+	uint32_t & compressed_size() { return m_compressedSize; }
+	uint32_t & raw_blocks() { return m_rawBlocks; }
+
 	// read, thread
 	void set_next_block_offset(stream_size_type offset) {
 		m_done = true;
@@ -159,6 +173,10 @@ private:
 	// Information about either read or write
 	bool m_done;
 
+	// Moving average of the compressed size of recently compressed blocks,
+	// in 1/1024ths of their uncompressed size; 0 if unknown.
+	uint32_t m_compressedSize;
+
 	// Information about the write
 	stream_size_type m_blockNumber;
 	stream_size_type m_readOffset;
@@ -166,6 +184,10 @@ private:
 
 	// Information about the read
 	bool m_endOfStream;
+
+	// Number of blocks to store uncompressed before compression is tried
+	// again.
+	uint32_t m_rawBlocks;
 	stream_size_type m_nextReadOffset;
 	memory_size_type m_nextBlockSize;
 };
@@ -208,12 +230,16 @@ public:
 				 file_accessor_t * fileAccessor,
 				 stream_size_type readOffset,
 				 read_direction::type readDirection,
-				 compressor_response * response)
+				 memory_size_type itemSize,
+				 compressor_response * response,
+				 buffer_t previous)
 		: request_base(response)
 		, m_buffer(buffer)
+		, m_previous(previous)
 		, m_fileAccessor(fileAccessor)
 		, m_readOffset(readOffset)
 		, m_readDirection(readDirection)
+		, m_itemSize(itemSize)
 	{
 	}
 
@@ -225,6 +251,16 @@ public:
 		return *m_fileAccessor;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief For read-ahead: The buffer of the block preceding the block
+	/// to read, or null. The block is then read right after the preceding
+	/// block, whose read request has been handled before this one, and
+	/// read_offset() is ignored.
+	///////////////////////////////////////////////////////////////////////////
+	buffer_t previous() {
+		return m_previous;
+	}
+
 	stream_size_type read_offset() {
 		return m_readOffset;
 	}
@@ -233,15 +269,21 @@ public:
 		return m_readDirection;
 	}
 
+	memory_size_type item_size() {
+		return m_itemSize;
+	}
+
 	void set_next_block_offset(stream_size_type offset) {
 		m_response->set_next_block_offset(offset);
 	}
 
 private:
 	buffer_t m_buffer;
+	buffer_t m_previous;
 	file_accessor_t * m_fileAccessor;
 	const stream_size_type m_readOffset;
 	const read_direction::type m_readDirection;
+	const memory_size_type m_itemSize;
 };
 
 class write_request : public request_base {
@@ -255,7 +297,11 @@ public:
 				  stream_size_type writeOffset,
 				  memory_size_type blockItems,
 				  stream_size_type blockNumber,
-				  compressor_response * response)
+				  compressor_response * response,
+				  std::vector<stream_size_type> * blockIndex,
+				  compression_scheme::type scheme,
+				  bool hasScheme,
+				  bool shuffle)
 		: request_base(response)
 		, m_buffer(buffer)
 		, m_fileAccessor(fileAccessor)
@@ -263,6 +309,10 @@ public:
 		, m_writeOffset(writeOffset)
 		, m_blockItems(blockItems)
 		, m_blockNumber(blockNumber)
+		, m_blockIndex(blockIndex)
+		, m_scheme(scheme)
+		, m_hasScheme(hasScheme)
+		, m_shuffle(shuffle)
 	{
 	}
 
@@ -278,6 +328,10 @@ public:
 		return m_tempFile;
 	}
 
+	compressor_response & response() {
+		return *m_response;
+	}
+
 	memory_size_type block_items() {
 		return m_blockItems;
 	}
@@ -290,10 +344,35 @@ public:
 		return m_writeOffset;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether the stream chose its own compression scheme instead
+	/// of the preferred compression of the compressor.
+	///////////////////////////////////////////////////////////////////////////
+	bool has_compression_scheme() {
+		return m_hasScheme;
+	}
+
+	compression_scheme::type get_compression_scheme() {
+		return m_scheme;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether the bytes of the items should be regrouped by byte
+	/// position before the block is compressed.
+	///////////////////////////////////////////////////////////////////////////
+	bool shuffle() {
+		return m_shuffle;
+	}
+
 	// must have lock!
 	void set_block_info(stream_size_type readOffset,
 						memory_size_type blockSize)
 	{
+		if (m_blockIndex != 0) {
+			if (m_blockIndex->size() <= m_blockNumber)
+				m_blockIndex->resize(m_blockNumber + 1, std::numeric_limits<stream_size_type>::max());
+			(*m_blockIndex)[m_blockNumber] = readOffset;
+		}
 		m_response->set_block_info(m_blockNumber, readOffset, blockSize);
 	}
 
@@ -316,6 +395,11 @@ private:
 	const stream_size_type m_writeOffset;
 	const memory_size_type m_blockItems;
 	const stream_size_type m_blockNumber;
+	/** If not null, the read offset of the block is recorded here. */
+	std::vector<stream_size_type> * m_blockIndex;
+	const compression_scheme::type m_scheme;
+	const bool m_hasScheme;
+	const bool m_shuffle;
 };
 
 class compressor_request_kind {
@@ -373,12 +457,15 @@ public:
 									read_request::file_accessor_t * fileAccessor,
 									stream_size_type readOffset,
 									read_direction::type readDirection,
-									compressor_response * response)
+									memory_size_type itemSize,
+									compressor_response * response,
+									const read_request::buffer_t & previous = read_request::buffer_t())
 	{
 		destruct();
 		m_kind = compressor_request_kind::READ;
 		return *new (m_payload) read_request(buffer, fileAccessor, readOffset,
-											 readDirection, response);
+											 readDirection, itemSize, response,
+											 previous);
 	}
 
 	read_request & set_read_request(const read_request & other) {
@@ -393,13 +480,18 @@ public:
 									  stream_size_type writeOffset,
 									  memory_size_type blockItems,
 									  stream_size_type blockNumber,
-									  compressor_response * response)
+									  compressor_response * response,
+									  std::vector<stream_size_type> * blockIndex = 0,
+									  compression_scheme::type scheme = compression_scheme::none,
+									  bool hasScheme = false,
+									  bool shuffle = false)
 	{
 		destruct();
 		m_kind = compressor_request_kind::WRITE;
 		return *new (m_payload) write_request(buffer, fileAccessor, tempFile,
 											  writeOffset, blockItems,
-											  blockNumber, response);
+											  blockNumber, response, blockIndex,
+											  scheme, hasScheme, shuffle);
 	}
 
 	write_request & set_write_request(const write_request & other) {
@@ -51,7 +51,13 @@ class compression_scheme {
 public:
 	enum type {
 		none = 0,
-		snappy = 1
+		snappy = 1,
+		/** Delta encoding and bit-packing of 32-bit words; for streams of
+		 * sorted or nearby 32-bit integers. */
+		delta32 = 2,
+		/** Delta encoding and bit-packing of 64-bit words; for streams of
+		 * sorted or nearby 64-bit integers. */
+		delta64 = 3
 	};
 
 	///////////////////////////////////////////////////////////////////////////
@@ -85,6 +91,8 @@ protected:
 
 const compression_scheme & get_compression_scheme_none();
 const compression_scheme & get_compression_scheme_snappy();
+const compression_scheme & get_compression_scheme_delta32();
+const compression_scheme & get_compression_scheme_delta64();
 
 inline const compression_scheme & get_compression_scheme(compression_scheme::type t) {
 	switch (t) {
@@ -92,6 +100,10 @@ inline const compression_scheme & get_compression_scheme(compression_scheme::typ
 			return get_compression_scheme_none();
 		case compression_scheme::snappy:
 			return get_compression_scheme_snappy();
+		case compression_scheme::delta32:
+			return get_compression_scheme_delta32();
+		case compression_scheme::delta64:
+			return get_compression_scheme_delta64();
 	}
 	return get_compression_scheme_none();
 }
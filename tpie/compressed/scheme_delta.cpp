@@ -0,0 +1,224 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2013, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <tpie/config.h>
+#include <tpie/types.h>
+#include <tpie/exception.h>
+#include <tpie/compressed/scheme.h>
+#include <tpie/stats.h>
+
+namespace {
+
+/** Number of words that share a bit width and a reference value. */
+const size_t frame_words = 128;
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief  Delta encoding followed by frame-of-reference bit-packing of
+/// unsigned integer words of type \c word_t.
+///
+/// The block is read as an array of native-endian words, and each word is
+/// replaced by its difference to the previous word. The differences are
+/// packed in frames of frame_words words. A frame stores a bit width and the
+/// smallest difference (as a signed number), followed by each difference
+/// minus the smallest one using the bit width. Trailing bytes that do not
+/// make up a whole word are stored as they are, and the compressed block
+/// begins with the uncompressed length.
+///
+/// Sorted streams and streams of nearby ids have small differences and
+/// pack to a few bits per word.
+///////////////////////////////////////////////////////////////////////////////
+template <typename word_t>
+class compression_scheme_impl : public tpie::compression_scheme {
+public:
+	typedef typename std::make_signed<word_t>::type signed_word_t;
+	typedef tpie::uint32_t length_t;
+
+	enum {
+		word_bits = 8 * sizeof(word_t),
+		/** Bytes of bit width and reference value in front of each frame. */
+		frame_header = 1 + sizeof(word_t)
+	};
+
+virtual size_t max_compressed_length(size_t srcSize) const override {
+	const size_t frames = (srcSize / sizeof(word_t) + frame_words - 1) / frame_words;
+	return sizeof(length_t) + frames * frame_header + srcSize;
+}
+
+virtual void compress(char * dest, const char * src, size_t srcSize, size_t * destSize) const override {
+	tpie::stat_timer t(5); // Time compressing
+	const length_t length = static_cast<length_t>(srcSize);
+	char * out = dest;
+	memcpy(out, &length, sizeof(length));
+	out += sizeof(length);
+
+	const size_t words = srcSize / sizeof(word_t);
+	word_t deltas[frame_words];
+	word_t packed[frame_words];
+	word_t previous = 0;
+	for (size_t i = 0; i < words; i += frame_words) {
+		const size_t n = std::min(frame_words, words - i);
+		memcpy(deltas, src + i * sizeof(word_t), n * sizeof(word_t));
+		signed_word_t lowest = std::numeric_limits<signed_word_t>::max();
+		for (size_t j = 0; j < n; ++j) {
+			const word_t x = deltas[j];
+			deltas[j] = x - previous;
+			previous = x;
+			lowest = std::min(lowest, static_cast<signed_word_t>(deltas[j]));
+		}
+		const word_t reference = static_cast<word_t>(lowest);
+		word_t spread = 0;
+		for (size_t j = 0; j < n; ++j) {
+			deltas[j] -= reference;
+			spread |= deltas[j];
+		}
+		unsigned char bits = 0;
+		while (spread != 0) {
+			++bits;
+			spread >>= 1;
+		}
+
+		*out++ = static_cast<char>(bits);
+		memcpy(out, &reference, sizeof(reference));
+		out += sizeof(reference);
+		const size_t packedWords = pack(packed, deltas, n, bits);
+		memcpy(out, packed, packedWords * sizeof(word_t));
+		out += packedWords * sizeof(word_t);
+	}
+	const size_t tail = srcSize - words * sizeof(word_t);
+	memcpy(out, src + words * sizeof(word_t), tail);
+	out += tail;
+	*destSize = out - dest;
+}
+
+virtual size_t uncompressed_length(const char * src, size_t srcSize) const override {
+	length_t length;
+	if (srcSize < sizeof(length))
+		throw tpie::stream_exception("Internal error; delta block is truncated");
+	memcpy(&length, src, sizeof(length));
+	return length;
+}
+
+virtual void uncompress(char * dest, const char * src, size_t srcSize) const override {
+	tpie::stat_timer t(6); // Time uncompressing
+	const size_t length = uncompressed_length(src, srcSize);
+	const char * in = src + sizeof(length_t);
+	const char * end = src + srcSize;
+
+	const size_t words = length / sizeof(word_t);
+	word_t deltas[frame_words];
+	word_t packed[frame_words];
+	word_t previous = 0;
+	for (size_t i = 0; i < words; i += frame_words) {
+		const size_t n = std::min(frame_words, words - i);
+		if (end - in < static_cast<std::ptrdiff_t>(frame_header))
+			throw tpie::stream_exception("Internal error; delta block is truncated");
+		const unsigned bits = static_cast<unsigned char>(*in++);
+		word_t reference;
+		memcpy(&reference, in, sizeof(reference));
+		in += sizeof(reference);
+		const size_t packedWords = (n * bits + word_bits - 1) / word_bits;
+		if (bits > word_bits || end - in < static_cast<std::ptrdiff_t>(packedWords * sizeof(word_t)))
+			throw tpie::stream_exception("Internal error; delta block is corrupt");
+		memcpy(packed, in, packedWords * sizeof(word_t));
+		in += packedWords * sizeof(word_t);
+
+		unpack(deltas, packed, n, bits);
+		for (size_t j = 0; j < n; ++j) {
+			previous += deltas[j] + reference;
+			deltas[j] = previous;
+		}
+		memcpy(dest + i * sizeof(word_t), deltas, n * sizeof(word_t));
+	}
+	const size_t tail = length - words * sizeof(word_t);
+	if (static_cast<size_t>(end - in) < tail)
+		throw tpie::stream_exception("Internal error; delta block is truncated");
+	memcpy(dest + words * sizeof(word_t), in, tail);
+}
+
+private:
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Pack the low \c bits bits of each of the \c n words of \c in.
+	/// \returns The number of words written to \c out.
+	///////////////////////////////////////////////////////////////////////////
+	static size_t pack(word_t * out, const word_t * in, size_t n, unsigned bits) {
+		const size_t outWords = (n * bits + word_bits - 1) / word_bits;
+		std::fill(out, out + outWords, word_t(0));
+		if (bits == 0) return 0;
+		for (size_t j = 0; j < n; ++j) {
+			const size_t pos = j * bits;
+			const size_t w = pos / word_bits;
+			const unsigned offset = pos % word_bits;
+			out[w] |= static_cast<word_t>(in[j] << offset);
+			if (offset + bits > word_bits)
+				out[w + 1] |= static_cast<word_t>(in[j] >> (word_bits - offset));
+		}
+		return outWords;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Inverse of pack.
+	///
+	/// When the bit width divides the word size, no value straddles two
+	/// words, and the loop has no branches so that the compiler can
+	/// vectorize it.
+	///////////////////////////////////////////////////////////////////////////
+	static void unpack(word_t * out, const word_t * in, size_t n, unsigned bits) {
+		if (bits == 0) {
+			std::fill(out, out + n, word_t(0));
+			return;
+		}
+		const word_t mask = (bits == word_bits) ? ~word_t(0) : static_cast<word_t>((word_t(1) << bits) - 1);
+		if (word_bits % bits == 0) {
+			const size_t perWord = word_bits / bits;
+			for (size_t j = 0; j < n; ++j)
+				out[j] = static_cast<word_t>(in[j / perWord] >> ((j % perWord) * bits)) & mask;
+			return;
+		}
+		for (size_t j = 0; j < n; ++j) {
+			const size_t pos = j * bits;
+			const size_t w = pos / word_bits;
+			const unsigned offset = pos % word_bits;
+			word_t v = static_cast<word_t>(in[w] >> offset);
+			if (offset + bits > word_bits)
+				v |= static_cast<word_t>(in[w + 1] << (word_bits - offset));
+			out[j] = v & mask;
+		}
+	}
+};
+
+compression_scheme_impl<tpie::uint32_t> the_compression_scheme_32;
+compression_scheme_impl<tpie::uint64_t> the_compression_scheme_64;
+
+} // unnamed namespace
+
+namespace tpie {
+
+const compression_scheme & get_compression_scheme_delta32() {
+	return the_compression_scheme_32;
+}
+
+const compression_scheme & get_compression_scheme_delta64() {
+	return the_compression_scheme_64;
+}
+
+} // namespace tpie
@@ -59,6 +59,9 @@ struct open {
 		 * which can be set using
 		 * tpie::the_compressor_thread().set_preferred_compression(). */
 		compression_all = 00000040,
+		/** Keep an index of the compressed blocks so that
+		 * seek() works for any offset. */
+		block_index = 00000100,
 
 		defaults = 0
 	};
@@ -290,6 +293,15 @@ public:
 	///     scheme, which can be set using
 	///     tpie::the_compressor_thread().set_preferred_compression().
 	///
+	/// open::block_index
+	///     Keep the read offset of every compressed block in memory and
+	///     store it after the last block when the stream is closed, so that
+	///     seek() to any offset costs a single block decompression. If the
+	///     stream was written without an index, it is built when opening by
+	///     reading the header of every block. Streams that were closed with
+	///     an index keep it even when this flag is not given. Uncompressed
+	///     streams need no index and ignore the flag.
+	///
 	/// \param path  The path to the file to open
 	/// \param openFlags  A bit-wise combination of the flags; see above.
 	/// \param userDataSize  Required user data capacity in stream header.
@@ -315,6 +327,54 @@ public:
 
 	void close();
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Reserve disk space for the stream to grow to the given number
+	/// of items; space that is not used is given back on close. Does nothing
+	/// with compression, as the compressed size is not known in advance.
+	/// \sa file_base_crtp::reserve
+	///////////////////////////////////////////////////////////////////////////
+	void reserve(stream_size_type items);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether the stream keeps a block index; see open::block_index.
+	///////////////////////////////////////////////////////////////////////////
+	bool has_block_index() const { return m_useBlockIndex; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Compress the blocks written from now on with the given scheme
+	/// instead of the preferred compression of the compressor thread.
+	///
+	/// Every block records its scheme, so the stream may be read without
+	/// knowing which schemes were used. With compression_normal, blocks may
+	/// still be stored uncompressed.
+	///////////////////////////////////////////////////////////////////////////
+	void set_compression_scheme(compression_scheme::type scheme) {
+		m_compressionScheme = scheme;
+		m_hasCompressionScheme = true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether to regroup byte k of every item together before the
+	/// blocks written from now on are compressed.
+	///
+	/// This helps the compression of records of several fields, such as
+	/// coordinates and weights, whose bytes in the same position are similar.
+	/// Blocks are unshuffled when read, whatever the setting.
+	///////////////////////////////////////////////////////////////////////////
+	void set_shuffle(bool shuffle) { m_shuffle = shuffle; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Keep up to the given number of blocks following the current
+	/// one in flight when reading a compressed stream forwards, so that
+	/// reading and decompression overlap with the use of the current block.
+	///
+	/// Each block read ahead takes a block buffer of its own; see
+	/// memory_usage. Only streams that are not writable read ahead.
+	///////////////////////////////////////////////////////////////////////////
+	void set_read_ahead(memory_size_type blocks) { m_buffers.set_read_ahead(blocks); }
+
+	memory_size_type read_ahead() const { return m_buffers.read_ahead(); }
+
 protected:
 	void finish_requests(compressor_thread_lock & l);
 
@@ -336,6 +396,32 @@ protected:
 	///////////////////////////////////////////////////////////////////////////
 	stream_size_type current_file_size(compressor_thread_lock & l);
 
+	///////////////////////////////////////////////////////////////////////////
+	/// Blocks to take the compressor lock, and waits for the block to be
+	/// written if necessary.
+	///
+	/// Precondition: has_block_index()
+	/// Precondition: blockNumber < m_streamBlocks
+	///////////////////////////////////////////////////////////////////////////
+	stream_size_type block_read_offset(stream_size_type blockNumber);
+
+private:
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Read the block index stored after the last block, or build it
+	/// from the block headers. When writing, the stored index is cut off so
+	/// that new blocks are appended after the last block.
+	///////////////////////////////////////////////////////////////////////////
+	void load_block_index();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Append the block index after the last block.
+	///
+	/// Precondition: All requests are finished.
+	///////////////////////////////////////////////////////////////////////////
+	void write_block_index();
+
+protected:
+
 	bool use_compression() { return m_byteStreamAccessor.get_compressed(); }
 
 	///////////////////////////////////////////////////////////////////////////
@@ -369,6 +455,10 @@ public:
 	}
 
 protected:
+	/** Number of items in a logical block. */
+	memory_size_type m_blockItems;
+	/** Size (in bytes) of a logical (uncompressed) block. */
+	memory_size_type m_blockSize;
 	/** Whether the current block must be written out to disk before being ejected.
 	 * Invariants:
 	 * If m_bufferDirty is true and use_compression() is true,
@@ -376,16 +466,28 @@ protected:
 	 * If block_number() is m_streamBlocks, m_bufferDirty is true.
 	 */
 	bool m_bufferDirty;
-	/** Number of items in a logical block. */
-	memory_size_type m_blockItems;
-	/** Size (in bytes) of a logical (uncompressed) block. */
-	memory_size_type m_blockSize;
 	/** Whether we are open for reading. */
 	bool m_canRead;
 	/** Whether we are open for writing. */
 	bool m_canWrite;
 	/** Whether we are open. */
 	bool m_open;
+	/** When use_compression() is true:
+	 * Indicates whether m_response is the response to a write request.
+	 * Used for knowing where to read next in read/read_back.
+	 * */
+	bool m_updateReadOffsetFromWrite = false;
+	/** Whether the read offset of every block is kept in m_blockIndex. */
+	bool m_useBlockIndex;
+	/** Whether set_compression_scheme has been called. */
+	bool m_hasCompressionScheme;
+	/** Whether the bytes of items are shuffled before compression. */
+	bool m_shuffle;
+
+	seek_state::type m_seekState;
+	/** Scheme of written blocks when m_hasCompressionScheme is true. */
+	compression_scheme::type m_compressionScheme;
+
 	/** Size of a single item. itemSize * blockItems == blockSize. */
 	memory_size_type m_itemSize;
 	/** Number of cheap, unchecked reads we can do next. */
@@ -419,14 +521,12 @@ protected:
 	/** Response from compressor thread; protected by compressor thread mutex. */
 	compressor_response m_response;
 
-	/** When use_compression() is true:
-	 * Indicates whether m_response is the response to a write request.
-	 * Used for knowing where to read next in read/read_back.
-	 * */
-	bool m_updateReadOffsetFromWrite = false;
 	stream_size_type m_lastWriteBlockNumber;
 
-	seek_state::type m_seekState;
+	/** When m_useBlockIndex is true: Read offset of each block, filled in by
+	 * the compressor as blocks are written; protected by compressor thread
+	 * mutex. */
+	tpie::unique_ptr<std::vector<stream_size_type> > m_blockIndex;
 
 	/** Position relating to the currently loaded buffer.
 	 * readOffset is only valid during reading.
@@ -542,11 +642,15 @@ public:
 		}
 	}
 
-	static memory_size_type memory_usage(double blockFactor=1.0) {
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Memory usage of a stream that reads at most readAhead blocks
+	/// ahead; see set_read_ahead.
+	///////////////////////////////////////////////////////////////////////////
+	static memory_size_type memory_usage(double blockFactor=1.0, memory_size_type readAhead=0) {
 		// m_buffer is included in m_buffers memory usage
 		return sizeof(file_stream)
 			+ sizeof(temp_file) // m_ownedTempFile
-			+ stream_buffers::memory_usage(block_size(blockFactor)) // m_buffers
+			+ stream_buffers::memory_usage(block_size(blockFactor), readAhead) // m_buffers
 			;
 	}
 
@@ -622,7 +726,8 @@ public:
 
 	///////////////////////////////////////////////////////////////////////////
 	/// Precondition: is_open()
-	/// Precondition: offset == 0
+	/// Precondition: offset == 0, or the stream is uncompressed or has a
+	/// block index (see open::block_index)
 	///////////////////////////////////////////////////////////////////////////
 	void seek(stream_offset_type offset, offset_type whence=beginning) {
 		tp_assert(is_open(), "seek: !is_open");
@@ -644,7 +749,21 @@ public:
 			return;
 		}
 		// Otherwise, we are in a compressed stream.
-		if (offset != 0) throw stream_exception("Random seeks are not supported");
+		if (offset != 0) {
+			if (!m_useBlockIndex) throw stream_exception("Random seeks are not supported");
+			switch (whence) {
+			case beginning:
+				break;
+			case end:
+				offset += size();
+				break;
+			case current:
+				offset += this->offset();
+				break;
+			}
+			seek_indexed(offset);
+			return;
+		}
 		switch (whence) {
 		case beginning:
 			if (m_buffer.get() != 0 && buffer_block_number() == 0) {
@@ -689,6 +808,30 @@ public:
 		tp_assert(false, "seek: Unknown whence");
 	}
 
+private:
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Seek to an arbitrary item of a compressed stream by looking up
+	/// its block in the block index.
+	///
+	/// Precondition: has_block_index()
+	///////////////////////////////////////////////////////////////////////////
+	void seek_indexed(stream_size_type offset) {
+		if (offset > size())
+			throw stream_exception("seek: Invalid offset, offset > size");
+		if (offset == size()) {
+			seek(0, end);
+			return;
+		}
+		const stream_size_type blockNumber = block_number(offset);
+		if (m_buffer.get() != 0 && blockNumber == buffer_block_number()) {
+			// The block is loaded, and it may not have been written yet.
+			set_position(stream_position(m_readOffset, offset));
+			return;
+		}
+		set_position(stream_position(block_read_offset(blockNumber), offset));
+	}
+
+public:
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief  Truncate to given size.
 	///
@@ -742,6 +885,7 @@ private:
 		get_buffer(l, 0);
 		m_size = 0;
 		m_streamBlocks = 0;
+		if (m_useBlockIndex) m_blockIndex->clear();
 		m_byteStreamAccessor.truncate(0);
 
 		m_readOffset = 0;
@@ -1292,7 +1436,11 @@ private:
 							writeOffset,
 							blockItems,
 							blockNumber,
-							&m_response);
+							&m_response,
+							m_blockIndex.get(),
+							m_compressionScheme,
+							m_hasCompressionScheme,
+							m_shuffle);
 		compressor().request(r);
 		m_bufferDirty = false;
 
@@ -1378,9 +1526,47 @@ private:
 			}
 		}
 
+		if (use_compression() && !this->m_canWrite && this->m_buffers.read_ahead() > 0)
+			request_read_ahead(lock, blockNumber);
+
 		m_nextItem = m_bufferBegin;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Request the blocks following the given block, which is in
+	/// m_buffer, that are not yet read, up to read_ahead() blocks.
+	///
+	/// Each block is read right after the block before it, so its read offset
+	/// need not be known yet. The stream must not be writable, so that the
+	/// blocks cannot change after they are read.
+	///////////////////////////////////////////////////////////////////////////
+	void request_read_ahead(compressor_thread_lock & /*lock*/, stream_size_type blockNumber) {
+		buffer_t previous = m_buffer;
+		const stream_size_type end =
+			std::min(m_streamBlocks, blockNumber + 1 + this->m_buffers.read_ahead());
+		for (stream_size_type b = blockNumber + 1; b < end; ++b) {
+			buffer_t next = this->m_buffers.find_buffer(b);
+			if (!next) {
+				next = this->m_buffers.get_read_ahead_buffer(b, blockNumber);
+				if (!next) break;
+				next->transition_state(compressor_buffer_state::dirty,
+									   compressor_buffer_state::reading);
+				compressor_request r;
+				r.set_read_request(next,
+								   &m_byteStreamAccessor,
+								   0,
+								   read_direction::forward,
+								   m_itemSize,
+								   &m_response,
+								   previous);
+				compressor().request(r);
+			} else if (next->get_state() == compressor_buffer_state::dirty) {
+				break;
+			}
+			previous.swap(next);
+		}
+	}
+
 	void read_previous_block(compressor_thread_lock & lock, stream_size_type blockNumber) {
 		uncache_read_writes();
 		tp_assert(use_compression(), "read_previous_block: !use_compression");
@@ -1412,11 +1598,14 @@ private:
 					stream_size_type readOffset,
 					read_direction::type readDirection)
 	{
+		// Blocks read ahead report to m_response as well, so wait for them.
+		while (this->m_buffers.reading()) compressor().wait_for_request_done(lock);
 		compressor_request r;
 		r.set_read_request(m_buffer,
 						   &m_byteStreamAccessor,
 						   readOffset,
 						   readDirection,
+						   m_itemSize,
 						   &m_response);
 		m_buffer->transition_state(compressor_buffer_state::dirty,
 								   compressor_buffer_state::reading);
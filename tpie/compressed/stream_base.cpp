@@ -24,12 +24,17 @@ namespace tpie {
 
 compressed_stream_base::compressed_stream_base(memory_size_type itemSize,
 											   double blockFactor)
-	: m_bufferDirty(false)
-	, m_blockItems(block_size(blockFactor) / itemSize)
+	: m_blockItems(block_size(blockFactor) / itemSize)
 	, m_blockSize(block_size(blockFactor))
+	, m_bufferDirty(false)
 	, m_canRead(false)
 	, m_canWrite(false)
 	, m_open(false)
+	, m_useBlockIndex(false)
+	, m_hasCompressionScheme(false)
+	, m_shuffle(false)
+	, m_seekState(seek_state::beginning)
+	, m_compressionScheme(compression_scheme::none)
 	, m_itemSize(itemSize)
 	, m_cachedReads(0)
 	, m_cachedWrites(0)
@@ -43,7 +48,6 @@ compressed_stream_base::compressed_stream_base(memory_size_type itemSize,
 	, m_lastBlockReadOffset(0)
 	, m_currentFileSize(0)
 	, m_response()
-	, m_seekState(seek_state::beginning)
 	, m_readOffset(0)
 	, m_offset(0)
 	, m_nextPosition(/* not a position */)
@@ -90,6 +94,14 @@ void compressed_stream_base::open_inner(const std::string & path,
 	m_currentFileSize = m_byteStreamAccessor.file_size();
 	m_response.clear_block_info();
 
+	if (use_compression()
+		&& ((openFlags & open::block_index) || m_byteStreamAccessor.has_block_index()))
+	{
+		close_on_fail_guard closeOnFail(this);
+		load_block_index();
+		closeOnFail.commit();
+	}
+
 	this->post_open();
 }
 
@@ -177,10 +189,14 @@ void compressed_stream_base::close() {
 		if (use_compression()) {
 			m_byteStreamAccessor.set_last_block_read_offset(last_block_read_offset(l));
 		}
+		if (m_useBlockIndex && m_canWrite)
+			write_block_index();
 		m_byteStreamAccessor.set_size(m_size);
 		m_byteStreamAccessor.close();
 	}
 	m_open = false;
+	m_useBlockIndex = false;
+	m_blockIndex.reset();
 	m_tempFile = NULL;
 	m_ownedTempFile.reset();
 
@@ -189,6 +205,14 @@ void compressed_stream_base::close() {
 	m_seekState = seek_state::beginning;
 }
 
+void compressed_stream_base::reserve(stream_size_type items) {
+	tp_assert(is_open(), "reserve: !is_open");
+	// The compressed size is not known in advance, and reserving the
+	// uncompressed size would claim far more disk than the stream uses.
+	if (use_compression()) return;
+	m_byteStreamAccessor.reserve(items);
+}
+
 void compressed_stream_base::finish_requests(compressor_thread_lock & l) {
 	tp_assert(!(m_buffer.get() != 0), "finish_requests called when own buffer is still held");
 	m_buffers.clean();
@@ -211,6 +235,70 @@ stream_size_type compressed_stream_base::last_block_read_offset(compressor_threa
 	return m_response.get_read_offset(m_streamBlocks - 1);
 }
 
+void compressed_stream_base::load_block_index() {
+	const stream_size_type unknown = std::numeric_limits<stream_size_type>::max();
+	tpie::unique_ptr<std::vector<stream_size_type> > blockIndex =
+		tpie::make_unique<std::vector<stream_size_type> >(m_streamBlocks, unknown);
+	std::vector<stream_size_type> & index = *blockIndex;
+	if (m_byteStreamAccessor.has_block_index()) {
+		// The index is the read offsets followed by the number of blocks.
+		const stream_size_type fileSize = m_byteStreamAccessor.file_size();
+		const stream_size_type indexSize = (m_streamBlocks + 1) * sizeof(stream_size_type);
+		stream_size_type blocks = 0;
+		if (fileSize < indexSize
+			|| m_byteStreamAccessor.read(fileSize - sizeof(blocks), &blocks, sizeof(blocks)) != sizeof(blocks)
+			|| blocks != m_streamBlocks)
+			throw invalid_file_exception("Invalid file, block index is corrupt");
+		const stream_size_type dataSize = fileSize - indexSize;
+		const memory_size_type entries = static_cast<memory_size_type>(m_streamBlocks * sizeof(stream_size_type));
+		if (entries > 0 && m_byteStreamAccessor.read(dataSize, &index[0], entries) != entries)
+			throw invalid_file_exception("Invalid file, block index is corrupt");
+		if (m_streamBlocks > 1 && index.back() != m_lastBlockReadOffset)
+			throw invalid_file_exception("Invalid file, block index does not match the header");
+		if (m_canWrite) {
+			m_byteStreamAccessor.truncate_bytes(dataSize);
+			m_byteStreamAccessor.set_block_index(false);
+		}
+		m_currentFileSize = dataSize;
+	} else {
+		stream_size_type readOffset = 0;
+		for (stream_size_type i = 0; i < m_streamBlocks; ++i) {
+			index[i] = readOffset;
+			readOffset = compressor_thread::next_block_offset(m_byteStreamAccessor, readOffset);
+		}
+		if (m_streamBlocks > 1 && index.back() != m_lastBlockReadOffset)
+			throw invalid_file_exception("Invalid file, block headers do not match the header");
+	}
+	m_blockIndex = std::move(blockIndex);
+	m_useBlockIndex = true;
+}
+
+void compressed_stream_base::write_block_index() {
+	std::vector<stream_size_type> & index = *m_blockIndex;
+	index.resize(m_streamBlocks, std::numeric_limits<stream_size_type>::max());
+	for (stream_size_type i = 0; i < m_streamBlocks; ++i) {
+		if (index[i] == std::numeric_limits<stream_size_type>::max())
+			throw exception("write_block_index: Read offset of a block is unknown");
+	}
+	if (m_streamBlocks > 0)
+		m_byteStreamAccessor.append(&index[0], static_cast<memory_size_type>(m_streamBlocks * sizeof(stream_size_type)));
+	const stream_size_type blocks = m_streamBlocks;
+	m_byteStreamAccessor.append(&blocks, sizeof(blocks));
+	m_byteStreamAccessor.set_block_index(true);
+	if (m_tempFile) m_tempFile->update_recorded_size(m_byteStreamAccessor.file_size());
+}
+
+stream_size_type compressed_stream_base::block_read_offset(stream_size_type blockNumber) {
+	tp_assert(m_useBlockIndex, "block_read_offset: !has_block_index");
+	tp_assert(blockNumber < m_streamBlocks, "block_read_offset: Block not written");
+	const std::vector<stream_size_type> & index = *m_blockIndex;
+	compressor_thread_lock l(compressor());
+	while (blockNumber >= index.size()
+		   || index[blockNumber] == std::numeric_limits<stream_size_type>::max())
+		m_response.wait(l);
+	return index[blockNumber];
+}
+
 stream_size_type compressed_stream_base::current_file_size(compressor_thread_lock & l) {
 	tp_assert(use_compression(), "current_file_size: !use_compression");
 	if (m_streamBlocks == 0)
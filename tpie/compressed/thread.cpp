@@ -17,11 +17,14 @@
 // You should have received a copy of the GNU Lesser General Public License
 // along with TPIE.  If not, see <http://www.gnu.org/licenses/>
 
-#include <queue>
+#include <deque>
+#include <vector>
+#include <algorithm>
 #include <tpie/compressed/thread.h>
 #include <tpie/compressed/request.h>
 #include <tpie/compressed/buffer.h>
 #include <tpie/compressed/scheme.h>
+#include <tpie/job.h>
 #include <condition_variable>
 namespace {
 
@@ -56,6 +59,15 @@ public:
 		m_payload |= scheme << BLOCK_SIZE_BITS;
 	}
 
+	bool get_shuffled() const {
+		return (m_payload & SHUFFLE_MASK) != 0;
+	}
+
+	void set_shuffled(bool shuffled) {
+		m_payload &= ~SHUFFLE_MASK;
+		if (shuffled) m_payload |= SHUFFLE_MASK;
+	}
+
 	bool operator==(const block_header & other) const {
 		return m_payload == other.m_payload;
 	}
@@ -67,12 +79,71 @@ private:
 	static const tpie::uint32_t BLOCK_SIZE_MASK = (1 << BLOCK_SIZE_BITS) - 1;
 	static const tpie::memory_size_type BLOCK_SIZE_MAX =
 		static_cast<tpie::memory_size_type>(1 << BLOCK_SIZE_BITS) - 1;
-	static const tpie::uint32_t COMPRESSION_BITS = 8;
+	static const tpie::uint32_t COMPRESSION_BITS = 7;
 	static const tpie::uint32_t COMPRESSION_MASK = ((1 << COMPRESSION_BITS) - 1) << BLOCK_SIZE_BITS;
+	// Set if the bytes of the items were shuffled before compression.
+	static const tpie::uint32_t SHUFFLE_MASK = 1u << (BLOCK_SIZE_BITS + COMPRESSION_BITS);
 
 	tpie::uint32_t m_payload;
 };
 
+// compression_normal stores a block uncompressed unless compression saves
+// at least 1/8 of its size.
+const tpie::memory_size_type minimum_savings = 8;
+
+// After a stream's blocks have failed to compress this well on average,
+// this many blocks are stored uncompressed before compression is tried again.
+const tpie::uint32_t incompressible_raw_blocks = 16;
+
+// Byte shuffling of fixed-size items, as done by Blosc: byte k of item i
+// is moved to k * items + i. Trailing bytes that do not make up a whole
+// item are left at the end. The loops for common item sizes have
+// constant strides so that the compiler can vectorize them.
+
+template <tpie::memory_size_type itemSize>
+void shuffle_fixed(char * dest, const char * src, tpie::memory_size_type items) {
+	for (tpie::memory_size_type i = 0; i < items; ++i)
+		for (tpie::memory_size_type k = 0; k < itemSize; ++k)
+			dest[k * items + i] = src[i * itemSize + k];
+}
+
+template <tpie::memory_size_type itemSize>
+void unshuffle_fixed(char * dest, const char * src, tpie::memory_size_type items) {
+	for (tpie::memory_size_type i = 0; i < items; ++i)
+		for (tpie::memory_size_type k = 0; k < itemSize; ++k)
+			dest[i * itemSize + k] = src[k * items + i];
+}
+
+void shuffle(char * dest, const char * src, tpie::memory_size_type size, tpie::memory_size_type itemSize) {
+	const tpie::memory_size_type items = size / itemSize;
+	switch (itemSize) {
+		case 2: shuffle_fixed<2>(dest, src, items); break;
+		case 4: shuffle_fixed<4>(dest, src, items); break;
+		case 8: shuffle_fixed<8>(dest, src, items); break;
+		case 16: shuffle_fixed<16>(dest, src, items); break;
+		default:
+			for (tpie::memory_size_type k = 0; k < itemSize; ++k)
+				for (tpie::memory_size_type i = 0; i < items; ++i)
+					dest[k * items + i] = src[i * itemSize + k];
+	}
+	memcpy(dest + items * itemSize, src + items * itemSize, size - items * itemSize);
+}
+
+void unshuffle(char * dest, const char * src, tpie::memory_size_type size, tpie::memory_size_type itemSize) {
+	const tpie::memory_size_type items = size / itemSize;
+	switch (itemSize) {
+		case 2: unshuffle_fixed<2>(dest, src, items); break;
+		case 4: unshuffle_fixed<4>(dest, src, items); break;
+		case 8: unshuffle_fixed<8>(dest, src, items); break;
+		case 16: unshuffle_fixed<16>(dest, src, items); break;
+		default:
+			for (tpie::memory_size_type k = 0; k < itemSize; ++k)
+				for (tpie::memory_size_type i = 0; i < items; ++i)
+					dest[i * itemSize + k] = src[k * items + i];
+	}
+	memcpy(dest + items * itemSize, src + items * itemSize, size - items * itemSize);
+}
+
 }
 
 namespace tpie {
@@ -81,6 +152,16 @@ namespace tpie {
 	return dataOffset - sizeof(block_header);
 }
 
+/*static*/ stream_size_type compressor_thread::next_block_offset(file_accessor_t & fileAccessor,
+																 stream_size_type readOffset) {
+	block_header blockHeader;
+	if (fileAccessor.read(readOffset, &blockHeader, sizeof(blockHeader)) != sizeof(blockHeader))
+		throw exception("next_block_offset: Unexpected end of file");
+	if (blockHeader.get_block_size() == 0)
+		throw exception("Block size was unexpectedly zero");
+	return readOffset + sizeof(blockHeader) + blockHeader.get_block_size() + sizeof(blockHeader);
+}
+
 class compressor_thread::impl {
 public:
 	impl()
@@ -91,7 +172,11 @@ public:
 
 	void stop(compressor_thread_lock & /*lock*/) {
 		m_done = true;
-		m_newRequest.notify_one();
+		m_newRequest.notify_all();
+	}
+
+	void restart(compressor_thread_lock & /*lock*/) {
+		m_done = false;
 	}
 
 	bool request_valid(const compressor_request & r) {
@@ -105,32 +190,76 @@ public:
 		tp_assert(false, "Unknown request type");
 	}
 
+	///////////////////////////////////////////////////////////////////////
+	/// \brief Identifies the stream a request belongs to.
+	///////////////////////////////////////////////////////////////////////
+	static const void * stream_of(compressor_request & r) {
+		switch (r.kind()) {
+			case compressor_request_kind::NONE:
+				break;
+			case compressor_request_kind::READ:
+				return &r.get_read_request().file_accessor();
+			case compressor_request_kind::WRITE:
+				return &r.get_write_request().file_accessor();
+		}
+		return 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	/// \brief Find the oldest request whose stream is not being served by
+	/// another worker. Requests of a single stream are thereby handled
+	/// one at a time in the order they were made.
+	///////////////////////////////////////////////////////////////////////
+	std::deque<compressor_request>::iterator next_request() {
+		std::deque<compressor_request>::iterator i = m_requests.begin();
+		for (; i != m_requests.end(); ++i) {
+			if (std::find(m_busy.begin(), m_busy.end(), stream_of(*i)) == m_busy.end())
+				break;
+		}
+		return i;
+	}
+
 	void run() {
 		while (true) {
 			compressor_thread_lock::lock_t lock(mutex());
-			m_idle = false;
-			while (!m_done && m_requests.empty()) {
-				m_idle = true;
+			std::deque<compressor_request>::iterator i;
+			while ((i = next_request()) == m_requests.end()) {
+				if (m_done && m_requests.empty()) break;
 				m_newRequest.wait(lock);
 			}
-			if (m_done && m_requests.empty()) break;
+			if (i == m_requests.end()) break;
 			{
-				compressor_request r = m_requests.front();
-				m_requests.pop();
+				compressor_request r = *i;
+				m_requests.erase(i);
+				const void * stream = stream_of(r);
+				m_busy.push_back(stream);
+				// Number of later requests of the same stream already waiting.
+				memory_size_type backlog = 0;
+				for (i = m_requests.begin(); i != m_requests.end(); ++i)
+					if (stream_of(*i) == stream) ++backlog;
 				lock.unlock();
 
-				switch (r.kind()) {
-					case compressor_request_kind::NONE:
-						throw exception("Invalid request");
-					case compressor_request_kind::READ:
-						process_read_request(r.get_read_request());
-						break;
-					case compressor_request_kind::WRITE:
-						process_write_request(r.get_write_request());
-						break;
+				try {
+					switch (r.kind()) {
+						case compressor_request_kind::NONE:
+							throw exception("Invalid request");
+						case compressor_request_kind::READ:
+							process_read_request(r.get_read_request());
+							break;
+						case compressor_request_kind::WRITE:
+							process_write_request(r.get_write_request(), backlog);
+							break;
+					}
+				} catch (...) {
+					lock.lock();
+					m_busy.erase(std::find(m_busy.begin(), m_busy.end(), stream));
+					throw;
 				}
+				lock.lock();
+				m_busy.erase(std::find(m_busy.begin(), m_busy.end(), stream));
 			}
-			lock.lock();
+			// Requests of this stream may now be picked up by other workers.
+			if (!m_requests.empty()) m_newRequest.notify_all();
 			m_requestDone.notify_all();
 		}
 	}
@@ -150,6 +279,10 @@ private:
 		tp_assert(!(backward && !useCompression), "backward && !useCompression");
 
 		stream_size_type readOffset = rr.read_offset();
+		if (rr.previous()) {
+			compressor_thread_lock::lock_t lock(mutex());
+			readOffset = rr.previous()->get_read_offset() + rr.previous()->get_block_size();
+		}
 		if (!useCompression) {
 			memory_size_type blockSize = rr.buffer()->size();
 			if (blockSize > rr.buffer()->capacity()) {
@@ -208,7 +341,13 @@ private:
 		size_t uncompressedLength = compressionScheme.uncompressed_length(compressed, blockSize);
 		if (uncompressedLength > rr.buffer()->capacity())
 			throw exception("uncompressedLength exceeds the buffer capacity");
-		compressionScheme.uncompress(rr.buffer()->get(), compressed, blockSize);
+		if (blockHeader.get_shuffled()) {
+			array<char> shuffled(uncompressedLength);
+			compressionScheme.uncompress(shuffled.get(), compressed, blockSize);
+			unshuffle(rr.buffer()->get(), shuffled.get(), uncompressedLength, rr.item_size());
+		} else {
+			compressionScheme.uncompress(rr.buffer()->get(), compressed, blockSize);
+		}
 
 		compressor_thread_lock::lock_t lock(mutex());
 		rr.buffer()->transition_state(compressor_buffer_state::reading,
@@ -219,7 +358,43 @@ private:
 		rr.set_next_block_offset(nextReadOffset);
 	}
 
-	void process_write_request(write_request & wr) {
+	///////////////////////////////////////////////////////////////////////
+	/// \brief Choose the compression scheme of a block before compressing
+	/// it, according to the adaptive policy of compression_normal.
+	///
+	/// The block is not compressed if more blocks of the stream are waiting
+	/// to be written, or if recent blocks of the stream did not compress.
+	///////////////////////////////////////////////////////////////////////
+	compression_scheme::type adaptive_scheme(write_request & wr, compression_scheme::type preferred,
+											 memory_size_type backlog) {
+		compressor_response & state = wr.response();
+		if (preferred == compression_scheme::none)
+			return compression_scheme::none;
+		if (backlog > 0)
+			return compression_scheme::none;
+		if (state.raw_blocks() > 0) {
+			--state.raw_blocks();
+			return compression_scheme::none;
+		}
+		return preferred;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	/// \brief Record how well a block compressed under the adaptive policy.
+	/// \returns Whether the block should be stored compressed.
+	///////////////////////////////////////////////////////////////////////
+	bool adaptive_result(write_request & wr, memory_size_type inputLength, memory_size_type blockSize) {
+		compressor_response & state = wr.response();
+		if (inputLength == 0) return true;
+		const uint32_t size = static_cast<uint32_t>(std::min<memory_size_type>(1024, blockSize * 1024 / inputLength));
+		uint32_t & average = state.compressed_size();
+		average = (average == 0) ? size : (3 * average + size) / 4;
+		if (average > 1024 - 1024 / minimum_savings)
+			state.raw_blocks() = incompressible_raw_blocks;
+		return blockSize <= inputLength - inputLength / minimum_savings;
+	}
+
+	void process_write_request(write_request & wr, memory_size_type backlog) {
 		stat_timer t(4); // Time writing
 		size_t inputLength = wr.buffer()->size();
 		if (!wr.file_accessor().get_compressed()) {
@@ -236,26 +411,49 @@ private:
 			wr.file_accessor().get_compression_flags() != compression_all;
 		block_header blockHeader;
 		block_header & blockTrailer = blockHeader;
-		compression_scheme::type schemeType = m_preferredCompression;
-		if (adaptiveCompression && !m_idle) {
-			schemeType = compression_scheme::none;
-		}
-		if (schemeType == compression_scheme::snappy)
-			increment_user(7, 1);
-		if (schemeType == compression_scheme::none)
-			increment_user(8, 1);
+		compression_scheme::type schemeType =
+			wr.has_compression_scheme() ? wr.get_compression_scheme() : m_preferredCompression;
+		if (adaptiveCompression)
+			schemeType = adaptive_scheme(wr, schemeType, backlog);
 		const compression_scheme & compressionScheme = get_compression_scheme(schemeType);
+		// At least inputLength, so the block also fits if stored uncompressed.
 		const memory_size_type maxBlockSize = compressionScheme.max_compressed_length(inputLength);
 		if (maxBlockSize > blockHeader.max_block_size())
 			throw exception("process_write_request: MaxCompressedLength > max_block_size");
 		array<char> scratch(sizeof(blockHeader) + maxBlockSize + sizeof(blockTrailer));
+		const char * input = reinterpret_cast<const char *>(wr.buffer()->get());
+		// The buffer holds exactly block_items() items.
+		const memory_size_type itemSize = wr.block_items() ? inputLength / wr.block_items() : 1;
+		bool shuffled = wr.shuffle() && schemeType != compression_scheme::none && itemSize > 1;
+		array<char> shuffledInput;
+		if (shuffled) {
+			shuffledInput.resize(inputLength);
+			shuffle(shuffledInput.get(), input, inputLength, itemSize);
+			input = shuffledInput.get();
+		}
 		memory_size_type blockSize;
 		compressionScheme.compress(scratch.get() + sizeof(blockHeader),
-								   reinterpret_cast<const char *>(wr.buffer()->get()),
+								   input,
 								   inputLength,
 								   &blockSize);
+		if (adaptiveCompression && schemeType != compression_scheme::none
+			&& !adaptive_result(wr, inputLength, blockSize))
+		{
+			// Not worth decompressing when read; store the block as it is.
+			schemeType = compression_scheme::none;
+			shuffled = false;
+			get_compression_scheme(schemeType).compress(scratch.get() + sizeof(blockHeader),
+														reinterpret_cast<const char *>(wr.buffer()->get()),
+														inputLength,
+														&blockSize);
+		}
+		if (schemeType != compression_scheme::none)
+			increment_user(7, 1);
+		if (schemeType == compression_scheme::none)
+			increment_user(8, 1);
 		blockHeader.set_block_size(blockSize);
 		blockHeader.set_compression_scheme(schemeType);
+		blockHeader.set_shuffled(shuffled);
 		memcpy(scratch.get(), &blockHeader, sizeof(blockHeader));
 		memcpy(scratch.get() + sizeof(blockHeader) + blockSize, &blockTrailer, sizeof(blockTrailer));
 		const memory_size_type writeSize = sizeof(blockHeader) + blockSize + sizeof(blockTrailer);
@@ -286,7 +484,7 @@ public:
 	void request(const compressor_request & r) {
 		tp_assert(request_valid(r), "Invalid request");
 
-		m_requests.push(r);
+		m_requests.push_back(r);
 		m_requests.back().get_request_base().initiate_request();
 		m_newRequest.notify_one();
 	}
@@ -303,14 +501,13 @@ public:
 
 private:
 	mutex_t m_mutex;
-	std::queue<compressor_request> m_requests;
+	std::deque<compressor_request> m_requests;
+	/** Streams whose requests are currently being handled by a worker. */
+	std::vector<const void *> m_busy;
 	std::condition_variable m_newRequest;
 	std::condition_variable m_requestDone;
 	bool m_done;
 	compression_scheme::type m_preferredCompression;
-
-	// Whether the thread was idle prior to handling the current request.
-	bool m_idle;
 };
 
 } // namespace tpie
@@ -318,8 +515,9 @@ private:
 namespace {
 
 tpie::compressor_thread the_compressor_thread;
-std::thread the_compressor_thread_handle;
+std::vector<std::thread> the_compressor_thread_handles;
 bool compressor_thread_already_finished = false;
+tpie::memory_size_type compressor_thread_count = 0;
 
 void run_the_compressor_thread() {
 	the_compressor_thread.run();
@@ -333,18 +531,35 @@ compressor_thread & the_compressor_thread() {
 	return ::the_compressor_thread;
 }
 
+memory_size_type get_compressor_threads() {
+	if (compressor_thread_count != 0) return compressor_thread_count;
+	return default_worker_count();
+}
+
+void set_compressor_threads(memory_size_type threads) {
+	const bool running = !the_compressor_thread_handles.empty();
+	if (running) finish_compressor();
+	compressor_thread_count = threads;
+	if (running) init_compressor();
+}
+
 void init_compressor() {
-	if (the_compressor_thread_handle.get_id() != std::thread::id()) {
+	if (!the_compressor_thread_handles.empty()) {
 		log_debug() << "Attempted to initiate compressor thread twice" << std::endl;
 		return;
 	}
-	std::thread t(run_the_compressor_thread);
-	the_compressor_thread_handle.swap(t);
+	{
+		compressor_thread_lock lock(the_compressor_thread());
+		the_compressor_thread().restart(lock);
+	}
+	const memory_size_type threads = std::max<memory_size_type>(1, get_compressor_threads());
+	for (memory_size_type i = 0; i < threads; ++i)
+		the_compressor_thread_handles.push_back(std::thread(run_the_compressor_thread));
 	compressor_thread_already_finished = false;
 }
 
 void finish_compressor() {
-	if (the_compressor_thread_handle.get_id() == std::thread::id()) {
+	if (the_compressor_thread_handles.empty()) {
 		if (compressor_thread_already_finished) {
 			log_debug() << "Compressor thread already finished" << std::endl;
 		} else {
@@ -356,9 +571,9 @@ void finish_compressor() {
 		compressor_thread_lock lock(the_compressor_thread());
 		the_compressor_thread().stop(lock);
 	}
-	the_compressor_thread_handle.join();
-	std::thread t;
-	the_compressor_thread_handle.swap(t);
+	for (size_t i = 0; i < the_compressor_thread_handles.size(); ++i)
+		the_compressor_thread_handles[i].join();
+	the_compressor_thread_handles.clear();
 	compressor_thread_already_finished = true;
 }
 
@@ -391,6 +606,10 @@ void compressor_thread::stop(compressor_thread_lock & lock) {
 	pimpl->stop(lock);
 }
 
+void compressor_thread::restart(compressor_thread_lock & lock) {
+	pimpl->restart(lock);
+}
+
 void compressor_thread::set_preferred_compression(compressor_thread_lock & lock, compression_scheme::type scheme) {
 	pimpl->set_preferred_compression(lock, scheme);
 }
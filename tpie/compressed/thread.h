@@ -21,7 +21,7 @@
 #define TPIE_COMPRESSED_THREAD_H
 
 ///////////////////////////////////////////////////////////////////////////////
-/// \file compressed/thread.h  Interface to the compressor thread.
+/// \file compressed/thread.h  Interface to the compressor thread pool.
 ///////////////////////////////////////////////////////////////////////////////
 
 #include <thread>
@@ -35,6 +35,24 @@
 
 namespace tpie {
 
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Number of worker threads compressing and decompressing blocks.
+///
+/// Unless set with set_compressor_threads(), this is default_worker_count().
+///////////////////////////////////////////////////////////////////////////////
+memory_size_type get_compressor_threads();
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Set the number of compressor worker threads, 0 meaning the
+/// default.
+///
+/// Requests of a single stream are handled one at a time and in order, so
+/// more workers help when several compressed streams are in use at once. If
+/// the workers are running, they are stopped after finishing all pending
+/// requests and restarted.
+///////////////////////////////////////////////////////////////////////////////
+void set_compressor_threads(memory_size_type threads);
+
 class compressor_thread {
 	class impl;
 	impl * pimpl;
@@ -46,6 +64,11 @@ public:
 
 	static stream_size_type subtract_block_header(stream_size_type dataOffset);
 
+	// Read offset of the block following the compressed block at the given
+	// read offset, found by reading only the block header.
+	static stream_size_type next_block_offset(file_accessor_t & fileAccessor,
+											  stream_size_type readOffset);
+
 	compressor_thread();
 	~compressor_thread();
 
@@ -60,6 +83,9 @@ public:
 
 	void stop(compressor_thread_lock & lock);
 
+	// Allow run() to be called again after stop().
+	void restart(compressor_thread_lock & lock);
+
 	void set_preferred_compression(compressor_thread_lock &, compression_scheme::type);
 };
 
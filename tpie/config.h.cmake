@@ -5,6 +5,9 @@
 
 #cmakedefine TPIE_HAVE_UNISTD_H
 #cmakedefine TPIE_HAVE_SYS_UNISTD_H
+#cmakedefine TPIE_HAVE_IO_URING
+#cmakedefine TPIE_HAVE_FALLOCATE
+#cmakedefine TPIE_HAVE_COPY_FILE_RANGE
 
 #cmakedefine TPIE_DEPRECATED_WARNINGS
 #cmakedefine TPIE_PARALLEL_SORT
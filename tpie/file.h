@@ -48,11 +48,18 @@ public:
 
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Calculate the memory usage of a file.
+	///
+	/// Block buffers are accounted for by the streams, except for the extra
+	/// buffers used with the given number of write-behind blocks.
+	/// \sa file_base_crtp::set_write_behind
 	///////////////////////////////////////////////////////////////////////////
-	static inline memory_size_type memory_usage(bool includeDefaultFileAccessor=true) {
+	static inline memory_size_type memory_usage(bool includeDefaultFileAccessor=true,
+												double blockFactor=1.0,
+												memory_size_type writeBehindBlocks=0) {
 		memory_size_type x = sizeof(file);
 		if (includeDefaultFileAccessor)
 			x += default_file_accessor::memory_usage();
+		x += write_behind_memory_usage(blockFactor, writeBehindBlocks);
 		return x;
 	}
 
@@ -87,7 +94,7 @@ public:
 		/// \brief Calculate the memory usage of a stream.
 		///////////////////////////////////////////////////////////////////////
 		inline static memory_size_type memory_usage(double blockFactor=1.0) {
-			return sizeof(stream) + block_size(blockFactor) +  sizeof(block_t);
+			return sizeof(stream) + block_memory_usage(blockFactor) + sizeof(block_t);
 		}
 
 		stream() {}
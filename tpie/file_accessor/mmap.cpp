@@ -0,0 +1,108 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2016, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+#include <tpie/file_accessor/mmap.h>
+#include <tpie/stats.h>
+#include <tpie/tpie_log.h>
+#include <cstring>
+#include <errno.h>
+#include <sys/mman.h>
+
+namespace tpie {
+namespace file_accessor {
+
+mmap_stream_accessor::mmap_stream_accessor()
+	: m_mapping(0)
+	, m_mappingSize(0)
+	, m_mapFailed(false)
+{
+}
+
+mmap_stream_accessor::~mmap_stream_accessor() {
+	// Unmap while our override of finish_pending_io is still reachable.
+	close();
+}
+
+bool mmap_stream_accessor::map() {
+	if (m_mapping != 0) return true;
+	if (m_mapFailed || is_writable() || size() == 0) return false;
+
+	m_mappingSize = m_fileAccessor.file_size_i();
+	// MAP_PRIVATE with PROT_WRITE lets callers scribble on a block buffer
+	// as they may on a copied block, without touching the file.
+	void * res = ::mmap(0, static_cast<size_t>(m_mappingSize), PROT_READ | PROT_WRITE,
+						MAP_PRIVATE, m_fileAccessor.file_descriptor(), 0);
+	if (res == MAP_FAILED) {
+		log_debug() << "Could not map " << path() << ": " << strerror(errno) << std::endl;
+		m_mapFailed = true;
+		return false;
+	}
+	m_mapping = static_cast<char *>(res);
+
+	int advice;
+	switch (m_fileAccessor.get_cache_hint()) {
+		case access_sequential:
+		case access_direct:
+			advice = MADV_SEQUENTIAL;
+			break;
+		case access_random:
+			advice = MADV_RANDOM;
+			break;
+		default:
+			advice = MADV_NORMAL;
+			break;
+	}
+	::madvise(m_mapping, static_cast<size_t>(m_mappingSize), advice);
+	return true;
+}
+
+void mmap_stream_accessor::unmap() {
+	if (m_mapping != 0) ::munmap(m_mapping, static_cast<size_t>(m_mappingSize));
+	m_mapping = 0;
+	m_mappingSize = 0;
+	m_mapFailed = false;
+}
+
+char * mmap_stream_accessor::map_block(stream_size_type blockNumber) {
+	if (!map()) return 0;
+	stream_size_type offset = blockNumber * block_items();
+	stream_size_type items = std::min(static_cast<stream_size_type>(block_items()), size() - offset);
+	stream_size_type loc = header_size() + blockNumber * block_size();
+	if (loc + items * item_size() > m_mappingSize) return 0;
+	increment_bytes_read(items * item_size());
+	return m_mapping + loc;
+}
+
+memory_size_type mmap_stream_accessor::read_block(void * data,
+												  stream_size_type blockNumber,
+												  memory_size_type itemCount) {
+	stream_size_type offset = blockNumber * block_items();
+	if (offset + itemCount > size()) itemCount = static_cast<memory_size_type>(size() - offset);
+	const char * block = map_block(blockNumber);
+	if (block == 0) return p_t::read_block(data, blockNumber, itemCount);
+	memcpy(data, block, itemCount * item_size());
+	return itemCount;
+}
+
+void mmap_stream_accessor::finish_pending_io() {
+	unmap();
+}
+
+} // namespace file_accessor
+} // namespace tpie
@@ -0,0 +1,84 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2016, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file mmap.h  Block accessor serving read-only streams from a memory map
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TPIE_FILE_ACCESSOR_MMAP_H
+#define TPIE_FILE_ACCESSOR_MMAP_H
+
+#include <tpie/config.h>
+#include <tpie/file_accessor/posix.h>
+#include <tpie/file_accessor/stream_accessor.h>
+
+namespace tpie {
+namespace file_accessor {
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Block accessor that maps read-only streams into memory.
+///
+/// Pass an instance to the constructor of \ref file or
+/// \ref uncompressed_stream; the stream takes ownership. When the stream is
+/// opened with access_read, the whole file is mapped on the first block
+/// request and blocks are handed out as pointers into the mapping, so
+/// repeated scans cost neither system calls nor copying. The cache hint of
+/// the stream is passed on to madvise.
+///
+/// Streams opened for writing, and files that cannot be mapped, use the
+/// ordinary stream_accessor code paths.
+///////////////////////////////////////////////////////////////////////////////
+class mmap_stream_accessor : public stream_accessor<posix> {
+	typedef stream_accessor<posix> p_t;
+public:
+	mmap_stream_accessor();
+	virtual ~mmap_stream_accessor();
+
+	virtual char * map_block(stream_size_type blockNumber) override;
+
+	virtual memory_size_type read_block(void * data,
+										stream_size_type blockNumber,
+										memory_size_type itemCount) override;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether the file is currently mapped.
+	///////////////////////////////////////////////////////////////////////////
+	bool is_mapped() const { return m_mapping != 0; }
+
+protected:
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Unmap the file. Blocks handed out by map_block are not in use
+	/// when the file is truncated or closed.
+	///////////////////////////////////////////////////////////////////////////
+	virtual void finish_pending_io() override;
+
+private:
+	bool map();
+	void unmap();
+
+	char * m_mapping;
+	stream_size_type m_mappingSize;
+	/** Whether mapping the current file failed, so we do not retry. */
+	bool m_mapFailed;
+};
+
+} // namespace file_accessor
+} // namespace tpie
+
+#endif // TPIE_FILE_ACCESSOR_MMAP_H
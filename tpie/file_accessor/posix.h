@@ -35,6 +35,7 @@ namespace file_accessor {
 class posix {
 private:
 	int m_fd;
+	int m_directFd;
 	cache_hint m_cacheHint;
 
 public:
@@ -49,11 +50,79 @@ public:
 	inline void read_i(void * data, memory_size_type size);
 	inline void write_i(const void * data, memory_size_type size);
 	inline void seek_i(stream_size_type offset);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Read size bytes at the given byte offset without moving the
+	/// file offset. Several threads may call this concurrently.
+	///////////////////////////////////////////////////////////////////////////
+	inline void read_at_i(void * data, memory_size_type size, stream_size_type offset);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Write size bytes at the given byte offset without moving the
+	/// file offset. Writing beyond the end of the file pads it with zeroes.
+	///////////////////////////////////////////////////////////////////////////
+	inline void write_at_i(const void * data, memory_size_type size, stream_size_type offset);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether block transfers can bypass the page cache, that is,
+	/// the cache hint is access_direct and the file system accepted O_DIRECT.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool direct_io() const {return m_directFd != -1;}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Read at least size bytes at the given offset, bypassing the
+	/// page cache. Precondition: direct_io(), and data, offset and
+	/// transferSize are aligned to the device's logical block size.
+	/// \param transferSize Size of the request; at least size, but may
+	/// extend beyond the end of the file.
+	///////////////////////////////////////////////////////////////////////////
+	inline void read_direct_i(void * data, memory_size_type size,
+							  memory_size_type transferSize, stream_size_type offset);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Write size bytes at the given offset, bypassing the page cache.
+	/// Precondition: direct_io(), and data, offset and size are aligned to
+	/// the device's logical block size.
+	///////////////////////////////////////////////////////////////////////////
+	inline void write_direct_i(const void * data, memory_size_type size, stream_size_type offset);
+
 	inline stream_size_type file_size_i();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Allocate disk space for the first size bytes of the file
+	/// without changing its size, so that the file is laid out contiguously
+	/// as it grows.
+	///
+	/// This is only a hint: it does nothing where fallocate is unavailable or
+	/// fails.
+	/// \returns Whether space was reserved.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool reserve_i(stream_size_type size);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Give back space reserved beyond the end of the file.
+	///////////////////////////////////////////////////////////////////////////
+	inline void release_reserved_i();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Copy size bytes at fromOffset in another file to toOffset in
+	/// this file inside the kernel, using copy_file_range.
+	/// \returns The number of bytes copied. If this is less than size, the
+	/// kernel cannot copy between these files and the caller must copy the
+	/// rest itself.
+	///////////////////////////////////////////////////////////////////////////
+	inline stream_size_type copy_range_i(posix & from, stream_size_type fromOffset,
+										 stream_size_type toOffset, stream_size_type size);
+
 	inline void close_i();
 	inline void truncate_i(stream_size_type bytes);
 	inline bool is_open() const;
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief The underlying file descriptor, or -1 if no file is open.
+	///////////////////////////////////////////////////////////////////////////
+	inline int file_descriptor() const {return m_fd;}
+
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Check the global errno variable and throw an exception that
 	/// matches its value.
@@ -62,9 +131,12 @@ public:
 
 	inline void set_cache_hint(cache_hint cacheHint);
 
+	inline cache_hint get_cache_hint() const {return m_cacheHint;}
+
 private:
 	inline void _open(const std::string & path, int flags, mode_t mode);
 	inline void give_advice();
+	inline void open_direct(const std::string & path, int flags);
 };
 
 }
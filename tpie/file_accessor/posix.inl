@@ -20,6 +20,8 @@
 #include <string.h>
 #include <tpie/exception.h>
 #include <tpie/file_manager.h>
+#include <tpie/tpie_log.h>
+#include <tpie/util.h>
 #include <tpie/file_accessor/posix.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -41,6 +43,7 @@ void posix::throw_errno(std::string path /*=std::string()*/) {
 
 posix::posix()
 	: m_fd(-1)
+	, m_directFd(-1)
 	, m_cacheHint(access_normal)
 {
 }
@@ -94,6 +97,75 @@ inline void posix::write_i(const void * data, memory_size_type size) {
 	} while(size != 0);
 }
 
+inline void posix::read_at_i(void * data, memory_size_type size, stream_size_type offset) {
+	memory_size_type bytesRead = 0;
+	while (bytesRead < size) {
+		ssize_t res = ::pread(m_fd, static_cast<char*>(data) + bytesRead,
+							  size - bytesRead, offset + bytesRead);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			throw_errno();
+		}
+		if (res == 0) {
+			std::stringstream ss;
+			ss << "Wrong number of bytes read: Expected " << size << " but got " << bytesRead;
+			throw io_exception(ss.str());
+		}
+		bytesRead += res;
+	}
+	increment_bytes_read(size);
+}
+
+inline void posix::write_at_i(const void * data, memory_size_type size, stream_size_type offset) {
+	do {
+		ssize_t res = ::pwrite(m_fd, data, size, offset);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			throw_errno();
+		}
+		data = static_cast<const char*>(data) + res;
+		size -= res;
+		offset += res;
+		increment_bytes_written(res);
+	} while (size != 0);
+}
+
+inline void posix::read_direct_i(void * data, memory_size_type size,
+								 memory_size_type transferSize, stream_size_type offset) {
+	memory_size_type bytesRead = 0;
+	while (bytesRead < size) {
+		// Partial reads only happen at the end of the file, so the remaining
+		// request stays aligned.
+		ssize_t res = ::pread(m_directFd, static_cast<char*>(data) + bytesRead,
+							  transferSize - bytesRead, offset + bytesRead);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			throw_errno();
+		}
+		if (res == 0) {
+			std::stringstream ss;
+			ss << "Wrong number of bytes read: Expected " << size << " but got " << bytesRead;
+			throw io_exception(ss.str());
+		}
+		bytesRead += res;
+	}
+	increment_bytes_read(size);
+}
+
+inline void posix::write_direct_i(const void * data, memory_size_type size, stream_size_type offset) {
+	do {
+		ssize_t res = ::pwrite(m_directFd, data, size, offset);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			throw_errno();
+		}
+		data = static_cast<const char*>(data) + res;
+		size -= res;
+		offset += res;
+		increment_bytes_written(res);
+	} while (size != 0);
+}
+
 inline void posix::seek_i(stream_size_type size) {
 	if (::lseek(m_fd, size, SEEK_SET) == -1) throw_errno();
 }
@@ -112,6 +184,38 @@ void posix::_open(const std::string & path, int flags, mode_t mode = 0755) {
 	}
 	get_file_manager().increment_open_file_count();
 	give_advice();
+	if (m_cacheHint == access_direct)
+		open_direct(path, flags);
+}
+
+void posix::open_direct(const std::string & path, int flags) {
+#ifdef O_DIRECT
+	// Header and user data are small and unaligned, so they keep using m_fd.
+	// Block transfers go through a second descriptor opened with O_DIRECT.
+	m_directFd = ::open(path.c_str(), (flags & ~(O_CREAT | O_TRUNC)) | O_DIRECT);
+	if (m_directFd == -1) {
+		log_debug() << "Direct I/O not supported for " << path << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	get_file_manager().increment_open_file_count();
+#ifdef STATX_DIOALIGN
+	// Blocks are aligned to the 4096 byte boundary of stream_accessor_base.
+	struct statx stx;
+	if (::statx(m_directFd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+		&& (stx.stx_mask & STATX_DIOALIGN)
+		&& (stx.stx_dio_offset_align == 0
+			|| stx.stx_dio_offset_align > 4096
+			|| stx.stx_dio_mem_align > 4096)) {
+		log_debug() << "Direct I/O alignment of " << path << " not supported" << std::endl;
+		::close(m_directFd);
+		get_file_manager().decrement_open_file_count();
+		m_directFd = -1;
+	}
+#endif // STATX_DIOALIGN
+#else // O_DIRECT
+	unused(path);
+	unused(flags);
+#endif // O_DIRECT
 }
 
 void posix::open_wo(const std::string & path) {
@@ -142,8 +246,64 @@ bool posix::is_open() const {
 	return m_fd != -1;
 }
 
+bool posix::reserve_i(stream_size_type size) {
+#ifdef TPIE_HAVE_FALLOCATE
+	if (::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, size) == -1) {
+		log_debug() << "fallocate: " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+#else
+	unused(size);
+	return false;
+#endif
+}
+
+void posix::release_reserved_i() {
+	// Truncating to the current size drops blocks allocated beyond it.
+	if (ftruncate(m_fd, file_size_i()) == -1)
+		log_debug() << "ftruncate: " << strerror(errno) << std::endl;
+}
+
+stream_size_type posix::copy_range_i(posix & from, stream_size_type fromOffset,
+									 stream_size_type toOffset, stream_size_type size) {
+#ifdef TPIE_HAVE_COPY_FILE_RANGE
+	stream_size_type copied = 0;
+	while (copied < size) {
+		loff_t in = static_cast<loff_t>(fromOffset + copied);
+		loff_t out = static_cast<loff_t>(toOffset + copied);
+		ssize_t res = ::copy_file_range(from.m_fd, &in, m_fd, &out,
+										static_cast<size_t>(size - copied), 0);
+		if (res == -1) {
+			if (errno == EINTR) continue;
+			// Not supported between these files; let the caller copy.
+			if (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP
+				|| errno == EINVAL || errno == EBADF)
+				break;
+			throw_errno();
+		}
+		if (res == 0) throw io_exception("Unexpected end of file while copying");
+		copied += res;
+	}
+	increment_bytes_read(copied);
+	increment_bytes_written(copied);
+	return copied;
+#else
+	unused(from);
+	unused(fromOffset);
+	unused(toOffset);
+	unused(size);
+	return 0;
+#endif
+}
+
 void posix::close_i() {
 	if (m_fd == -1) return;
+	if (m_directFd != -1) {
+		if (::close(m_directFd) == -1) throw_errno();
+		get_file_manager().decrement_open_file_count();
+		m_directFd = -1;
+	}
 	if (::close(m_fd) == -1) throw_errno();
 	get_file_manager().decrement_open_file_count();
 	m_fd = -1;
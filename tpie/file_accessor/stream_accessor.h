@@ -25,6 +25,21 @@
 namespace tpie {
 namespace file_accessor {
 
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Block accessor reading and writing whole blocks with positional
+/// I/O.
+///
+/// Blocks are transferred with pread/pwrite (or overlapped ReadFile/WriteFile
+/// on Windows), which never touch the shared file offset. Hence several
+/// threads may call read_block on disjoint blocks of the same open stream
+/// concurrently, as long as no thread writes, truncates or closes it
+/// meanwhile.
+///
+/// When the stream is opened with access_direct, blocks whose buffer is
+/// aligned to boundary() bypass the page cache. The transfer is then padded
+/// to the boundary, so such a buffer must hold align_to_boundary(block_size())
+/// bytes, and the padding following the last item is written to disk.
+///////////////////////////////////////////////////////////////////////////////
 template <typename file_accessor_t>
 class stream_accessor : public stream_accessor_base<file_accessor_t> {
 public:
@@ -33,11 +48,13 @@ public:
 										memory_size_type itemCount) override
 	{
 		stream_size_type loc = this->header_size() + blockNumber*this->block_size();
-		this->m_fileAccessor.seek_i(loc);
 		stream_size_type offset = blockNumber*this->block_items();
 		if (offset + itemCount > this->size()) itemCount = static_cast<memory_size_type>(this->size() - offset);
 		memory_size_type z=itemCount*this->item_size();
-		this->m_fileAccessor.read_i(data, z);
+		if (direct(data, loc))
+			this->m_fileAccessor.read_direct_i(data, z, this->align_to_boundary(z), loc);
+		else
+			this->m_fileAccessor.read_at_i(data, z, loc);
 		return itemCount;
 	}
 
@@ -46,14 +63,33 @@ public:
 							 memory_size_type itemCount) override
 	{
 		stream_size_type loc = this->header_size() + blockNumber*this->block_size();
-		// Here, we may seek beyond the file size.
-		// However, lseek(2) specifies that the file will be padded with zeroes in this case,
+		// Here, we may write beyond the file size.
+		// However, pwrite(2) specifies that the file will be padded with zeroes in this case,
 		// and on Windows, the file is padded with arbitrary garbage (which is ok).
-		this->m_fileAccessor.seek_i(loc);
 		stream_size_type offset = blockNumber*this->block_items();
 		memory_size_type z=itemCount*this->item_size();
-		this->m_fileAccessor.write_i(data, z);
-		if (offset+itemCount > this->size()) this->set_size(offset+itemCount);
+		if (direct(data, loc))
+			this->m_fileAccessor.write_direct_i(data, this->align_to_boundary(z), loc);
+		else
+			this->m_fileAccessor.write_at_i(data, z, loc);
+		this->grow_size(offset+itemCount);
+	}
+
+private:
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether the block at the given file offset can be transferred
+	/// to or from the given buffer bypassing the page cache.
+	///
+	/// Block sizes that are not a multiple of the boundary would make the
+	/// padded transfer overlap the next block, so they always go through the
+	/// page cache.
+	///////////////////////////////////////////////////////////////////////////
+	bool direct(const void * data, stream_size_type loc) const {
+		const memory_size_type b = this->boundary();
+		return this->m_fileAccessor.direct_io()
+			&& reinterpret_cast<size_t>(data) % b == 0
+			&& loc % b == 0
+			&& this->block_size() % b == 0;
 	}
 };
 
@@ -26,6 +26,7 @@
 
 #include <tpie/stream_header.h>
 #include <tpie/cache_hint.h>
+#include <atomic>
 
 namespace tpie {
 namespace file_accessor {
@@ -38,13 +39,18 @@ private:
 
 	bool m_open;
 	bool m_write;
+	/** Whether disk space beyond the end of the file may have been reserved. */
+	bool m_reserved;
+	/** Whether a block index follows the last block of the stream. */
+	bool m_blockIndex;
 
 protected:
 	file_accessor_t m_fileAccessor;
 
 private:
-	/** Number of logical items in stream. */
-	stream_size_type m_size;
+	/** Number of logical items in stream. Atomic since blocks may be
+	 * written by a write-behind thread. */
+	std::atomic<stream_size_type> m_size;
 
 	/** Size (in bytes) of user data. */
 	memory_size_type m_userDataSize;
@@ -85,17 +91,6 @@ private:
 	inline void write_header(bool clean);
 
 protected:
-	///////////////////////////////////////////////////////////////////////////
-	/// \brief Returns the boundary on which we align blocks.
-	///////////////////////////////////////////////////////////////////////////
-	inline memory_size_type boundary() const { return 4096; }
-
-	///////////////////////////////////////////////////////////////////////////
-	/// \brief Given a memory offset, rounds up to the nearest alignment
-	/// boundary.
-	///////////////////////////////////////////////////////////////////////////
-	inline memory_size_type align_to_boundary(memory_size_type z) const { return (z+boundary()-1)/boundary()*boundary(); }
-
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief The size of header and user data with padding included. This is
 	/// the offset at which the first logical block begins.
@@ -108,15 +103,49 @@ protected:
 
 	void set_size(stream_size_type s) { m_size = s; }
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Raise the number of items to at least s. Unlike a check
+	/// followed by set_size, this may race with other calls of grow_size.
+	///////////////////////////////////////////////////////////////////////////
+	void grow_size(stream_size_type s) {
+		stream_size_type old = m_size.load();
+		while (old < s && !m_size.compare_exchange_weak(old, s)) {}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Wait for outstanding asynchronous block operations.
+	///
+	/// Called before the header is written on close and before the file is
+	/// truncated. The default block accessors are synchronous, so this does
+	/// nothing unless overridden.
+	///////////////////////////////////////////////////////////////////////////
+	virtual void finish_pending_io() {}
+
 public:
 	inline stream_accessor_base()
 		: m_open(false)
 		, m_write(false)
+		, m_reserved(false)
+		, m_blockIndex(false)
 	{
 	}
 
 	virtual ~stream_accessor_base() {close();}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Returns the boundary on which we align blocks.
+	///
+	/// This is a multiple of the logical block size of any device we know
+	/// of, so block buffers aligned to it are suitable for direct I/O.
+	///////////////////////////////////////////////////////////////////////////
+	static inline memory_size_type boundary() { return 4096; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Given a memory offset, rounds up to the nearest alignment
+	/// boundary.
+	///////////////////////////////////////////////////////////////////////////
+	static inline memory_size_type align_to_boundary(memory_size_type z) { return (z+boundary()-1)/boundary()*boundary(); }
+
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Open file for reading and/or writing.
 	///////////////////////////////////////////////////////////////////////////
@@ -153,6 +182,23 @@ public:
 	///////////////////////////////////////////////////////////////////////////
 	virtual void write_block(const void * data, stream_size_type blockNumber, memory_size_type itemCount) = 0;
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Get a pointer to the given block in a memory mapping of the
+	/// file, avoiding the copy done by read_block.
+	///
+	/// Only read-only streams are mapped. The pointer stays valid until the
+	/// file is truncated or closed. Changes made through it are private to
+	/// the process and are never written to the file.
+	/// \returns The block, or 0 if the block must be read with read_block.
+	///////////////////////////////////////////////////////////////////////////
+	virtual char * map_block(stream_size_type /*blockNumber*/) { return 0; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether write_block may be called from a write-behind thread
+	/// while the owning thread keeps calling write_block on other blocks.
+	///////////////////////////////////////////////////////////////////////////
+	virtual bool concurrent_writes() const { return true; }
+
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Read user data into the given buffer.
 	/// \param data Buffer in which to store user data.
@@ -207,11 +253,72 @@ public:
 
 	inline void truncate(stream_size_type items);
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Reserve disk space for a stream of the given number of items,
+	/// laid out as by byte_size(). This is only a hint to the file system and
+	/// does not change the size of the stream.
+	///////////////////////////////////////////////////////////////////////////
+	inline void reserve(stream_size_type items) {
+		if (!m_open || !m_write) return;
+		if (m_fileAccessor.reserve_i(((items + m_blockItems - 1)/m_blockItems) * m_blockSize + header_size()))
+			m_reserved = true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Copy count items starting at item fromItem in another stream
+	/// to this stream starting at item toItem, growing this stream if
+	/// necessary.
+	///
+	/// The item sizes must match; block sizes may differ. Bytes are copied
+	/// by the kernel where possible (copy_file_range), and through a buffer
+	/// otherwise. Neither stream may have blocks buffered elsewhere that
+	/// have not been written.
+	///////////////////////////////////////////////////////////////////////////
+	inline void copy_items(stream_accessor_base & from, stream_size_type fromItem,
+						   stream_size_type toItem, stream_size_type count);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Copy the user data of another stream to this stream.
+	///////////////////////////////////////////////////////////////////////////
+	inline void copy_user_data(stream_accessor_base & from);
+
+private:
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Byte offset of the given item in the file.
+	///////////////////////////////////////////////////////////////////////////
+	stream_size_type item_offset(stream_size_type item) const {
+		return header_size() + (item / m_blockItems) * m_blockSize + (item % m_blockItems) * m_itemSize;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether items are stored back to back across blocks.
+	///////////////////////////////////////////////////////////////////////////
+	bool contiguous() const { return m_blockItems * m_itemSize == m_blockSize; }
+
+public:
 	void set_last_block_read_offset(stream_size_type n) { m_lastBlockReadOffset = n; }
 	stream_size_type get_last_block_read_offset() { return m_lastBlockReadOffset; }
 
 	bool get_compressed() { return m_useCompression; }
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether whole blocks may bypass the page cache, that is, the
+	/// stream was opened with access_direct and the file system allows it.
+	///////////////////////////////////////////////////////////////////////////
+	bool direct_io() const { return m_fileAccessor.direct_io(); }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether a block index follows the last block of the stream.
+	/// The flag is only stored in the header when the stream is closed.
+	///////////////////////////////////////////////////////////////////////////
+	bool has_block_index() const { return m_blockIndex; }
+	void set_block_index(bool b) { m_blockIndex = b; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether the file is open for writing.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool is_writable() const {return m_write;}
+
 	int get_compression_flags() { return m_compressionFlags; }
 };
 
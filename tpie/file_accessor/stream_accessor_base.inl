@@ -28,6 +28,8 @@
 #include <limits>
 #include <tpie/compressed/scheme.h>
 #include <tpie/file_manager.h>
+#include <tpie/array.h>
+#include <algorithm>
 
 namespace tpie {
 namespace file_accessor {
@@ -43,6 +45,7 @@ void stream_accessor_base<file_accessor_t>::read_header() {
 	m_maxUserDataSize = (size_t)header.maxUserDataSize;
 	m_lastBlockReadOffset = header.lastBlockReadOffset;
 	m_useCompression = header.get_compressed();
+	m_blockIndex = header.get_block_index();
 }
 
 template <typename file_accessor_t>
@@ -108,6 +111,7 @@ void stream_accessor_base<file_accessor_t>::fill_header(stream_header_t & header
 	header.size = m_size;
 	header.lastBlockReadOffset = m_lastBlockReadOffset;
 	header.set_compressed(m_useCompression);
+	header.set_block_index(clean && m_blockIndex);
 }
 
 template <typename file_accessor_t>
@@ -132,6 +136,7 @@ void stream_accessor_base<file_accessor_t>::open(const std::string & path,
 	m_compressionFlags = compressionFlags;
 	m_useCompression = compressionFlags != compression_scheme::none;
 	m_lastBlockReadOffset = std::numeric_limits<stream_size_type>::max();
+	m_blockIndex = false;
 	if (!write && !read)
 		throw invalid_argument_exception("Either read or write must be specified");
 	if (write && !read) {
@@ -158,12 +163,72 @@ void stream_accessor_base<file_accessor_t>::open(const std::string & path,
 	}
 }
 
+template <typename file_accessor_t>
+void stream_accessor_base<file_accessor_t>::copy_items(stream_accessor_base & from,
+													   stream_size_type fromItem,
+													   stream_size_type toItem,
+													   stream_size_type count) {
+	if (from.m_itemSize != m_itemSize)
+		throw stream_exception("Cannot copy items between streams of different item size");
+	if (m_useCompression || from.m_useCompression)
+		throw stream_exception("Cannot copy items between compressed streams");
+	from.finish_pending_io();
+	finish_pending_io();
+
+	const bool contiguousCopy = contiguous() && from.contiguous();
+	bool kernelCopy = true;
+	array<char> buffer;
+	while (count > 0) {
+		// The largest piece that is contiguous in both files
+		stream_size_type items = count;
+		if (!contiguousCopy) {
+			items = std::min(items, from.m_blockItems - fromItem % from.m_blockItems);
+			items = std::min(items, m_blockItems - toItem % m_blockItems);
+		}
+		const stream_size_type fromOffset = from.item_offset(fromItem);
+		const stream_size_type toOffset = item_offset(toItem);
+		const stream_size_type bytes = items * m_itemSize;
+
+		stream_size_type copied = 0;
+		if (kernelCopy) {
+			copied = m_fileAccessor.copy_range_i(from.m_fileAccessor, fromOffset, toOffset, bytes);
+			kernelCopy = copied == bytes;
+		}
+		if (copied < bytes && buffer.size() == 0)
+			buffer.resize(std::max(m_blockSize, from.m_blockSize));
+		while (copied < bytes) {
+			memory_size_type n = static_cast<memory_size_type>(
+				std::min(bytes - copied, static_cast<stream_size_type>(buffer.size())));
+			from.m_fileAccessor.read_at_i(buffer.get(), n, fromOffset + copied);
+			m_fileAccessor.write_at_i(buffer.get(), n, toOffset + copied);
+			copied += n;
+		}
+
+		fromItem += items;
+		toItem += items;
+		count -= items;
+	}
+	if (toItem > m_size) m_size = toItem;
+}
+
+template <typename file_accessor_t>
+void stream_accessor_base<file_accessor_t>::copy_user_data(stream_accessor_base & from) {
+	array<char> buffer(from.user_data_size());
+	from.read_user_data(buffer.get(), buffer.size());
+	write_user_data(buffer.get(), buffer.size());
+}
+
 template <typename file_accessor_t>
 void stream_accessor_base<file_accessor_t>::close() {
 	if (!m_open)
 		return;
+	finish_pending_io();
 	if (m_write)
 		write_header(true);
+	if (m_reserved) {
+		m_fileAccessor.release_reserved_i();
+		m_reserved = false;
+	}
 	m_fileAccessor.close_i();
 	m_open = false;
 }
@@ -172,6 +237,7 @@ template <typename file_accessor_t>
 void stream_accessor_base<file_accessor_t>::truncate(stream_size_type items) {
 	if (m_useCompression && items != 0)
 		throw exception("stream_accessor_base cannot truncate compressed stream");
+	finish_pending_io();
 	stream_size_type blocks = items/m_blockItems;
 	stream_size_type blockIndex = items%m_blockItems;
 	stream_size_type bytes = header_size() + blocks*m_blockSize + blockIndex*m_itemSize;
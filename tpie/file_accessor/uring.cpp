@@ -0,0 +1,446 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2016, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+#include <tpie/file_accessor/uring.h>
+#include <tpie/exception.h>
+#include <tpie/memory.h>
+#include <tpie/stats.h>
+#include <tpie/tpie_assert.h>
+#include <tpie/tpie_log.h>
+#include <limits>
+#include <cstring>
+#include <sstream>
+#include <errno.h>
+
+#ifdef TPIE_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif // TPIE_HAVE_IO_URING
+
+namespace {
+
+const tpie::memory_size_type no_slot = std::numeric_limits<tpie::memory_size_type>::max();
+
+#ifdef TPIE_HAVE_IO_URING
+
+int sys_io_uring_setup(unsigned entries, io_uring_params * p) {
+	return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0));
+}
+
+void * map_ring(int fd, tpie::memory_size_type size, off_t offset) {
+	void * res = ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	return (res == MAP_FAILED) ? 0 : res;
+}
+
+template <typename T>
+T * ring_ptr(void * ring, unsigned offset) {
+	return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+}
+
+#endif // TPIE_HAVE_IO_URING
+
+} // unnamed namespace
+
+namespace tpie {
+namespace file_accessor {
+
+uring_queue::uring_queue()
+	: m_ringFd(-1)
+	, m_sqRing(0)
+	, m_sqRingSize(0)
+	, m_cqRing(0)
+	, m_cqRingSize(0)
+	, m_sqes(0)
+	, m_sqesSize(0)
+{
+}
+
+uring_queue::~uring_queue() {
+	close();
+}
+
+#ifdef TPIE_HAVE_IO_URING
+
+bool uring_queue::open(memory_size_type entries) {
+	close();
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = sys_io_uring_setup(static_cast<unsigned>(entries), &p);
+	if (fd < 0) {
+		log_debug() << "io_uring_setup failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+	// IORING_OP_READ and IORING_OP_WRITE arrived in the same kernel release
+	// as this feature flag.
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		log_debug() << "io_uring does not support IORING_OP_READ" << std::endl;
+		::close(fd);
+		return false;
+	}
+	m_ringFd = fd;
+
+	m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	const bool singleMap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMap)
+		m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+	m_sqRing = map_ring(fd, m_sqRingSize, IORING_OFF_SQ_RING);
+	if (m_sqRing && singleMap)
+		m_cqRing = m_sqRing;
+	else if (m_sqRing)
+		m_cqRing = map_ring(fd, m_cqRingSize, IORING_OFF_CQ_RING);
+	m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+	if (m_cqRing)
+		m_sqes = map_ring(fd, m_sqesSize, IORING_OFF_SQES);
+	if (!m_sqes) {
+		log_debug() << "io_uring mmap failed: " << strerror(errno) << std::endl;
+		close();
+		return false;
+	}
+
+	m_sqTail = ring_ptr<unsigned>(m_sqRing, p.sq_off.tail);
+	m_sqMask = ring_ptr<unsigned>(m_sqRing, p.sq_off.ring_mask);
+	m_sqArray = ring_ptr<unsigned>(m_sqRing, p.sq_off.array);
+	m_cqHead = ring_ptr<unsigned>(m_cqRing, p.cq_off.head);
+	m_cqTail = ring_ptr<unsigned>(m_cqRing, p.cq_off.tail);
+	m_cqMask = ring_ptr<unsigned>(m_cqRing, p.cq_off.ring_mask);
+	m_cqes = ring_ptr<void>(m_cqRing, p.cq_off.cqes);
+	get_memory_manager().register_allocation(mapped_size());
+	return true;
+}
+
+void uring_queue::close() {
+	if (m_sqes) get_memory_manager().register_deallocation(mapped_size());
+	if (m_sqes) ::munmap(m_sqes, m_sqesSize);
+	if (m_cqRing && m_cqRing != m_sqRing) ::munmap(m_cqRing, m_cqRingSize);
+	if (m_sqRing) ::munmap(m_sqRing, m_sqRingSize);
+	m_sqes = m_cqRing = m_sqRing = 0;
+	if (m_ringFd != -1) ::close(m_ringFd);
+	m_ringFd = -1;
+}
+
+void uring_queue::submit(int opcode, int fd, const void * data, memory_size_type size,
+						 stream_size_type offset, memory_size_type userData) {
+	const unsigned tail = *m_sqTail;
+	const unsigned index = tail & *m_sqMask;
+	io_uring_sqe * sqe = static_cast<io_uring_sqe *>(m_sqes) + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = static_cast<__u8>(opcode);
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = reinterpret_cast<__u64>(data);
+	sqe->len = static_cast<__u32>(size);
+	sqe->user_data = userData;
+	m_sqArray[index] = index;
+	// Publish the entry before the new tail.
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	int res;
+	do {
+		res = sys_io_uring_enter(m_ringFd, 1, 0, 0);
+	} while (res == -1 && errno == EINTR);
+	if (res == -1) posix::throw_errno();
+}
+
+void uring_queue::read(int fd, void * data, memory_size_type size,
+					   stream_size_type offset, memory_size_type userData) {
+	submit(IORING_OP_READ, fd, data, size, offset, userData);
+}
+
+void uring_queue::write(int fd, const void * data, memory_size_type size,
+						stream_size_type offset, memory_size_type userData) {
+	submit(IORING_OP_WRITE, fd, data, size, offset, userData);
+}
+
+int uring_queue::wait(memory_size_type & userData) {
+	while (true) {
+		const unsigned head = *m_cqHead;
+		if (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+			const io_uring_cqe * cqe = static_cast<io_uring_cqe *>(m_cqes) + (head & *m_cqMask);
+			userData = static_cast<memory_size_type>(cqe->user_data);
+			int res = cqe->res;
+			__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+			return res;
+		}
+		int res = sys_io_uring_enter(m_ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+		if (res == -1 && errno != EINTR) posix::throw_errno();
+	}
+}
+
+#else // TPIE_HAVE_IO_URING
+
+bool uring_queue::open(memory_size_type) {
+	return false;
+}
+
+void uring_queue::close() {
+}
+
+void uring_queue::submit(int, int, const void *, memory_size_type, stream_size_type, memory_size_type) {
+	throw exception("io_uring is not supported");
+}
+
+void uring_queue::read(int, void *, memory_size_type, stream_size_type, memory_size_type) {
+	throw exception("io_uring is not supported");
+}
+
+void uring_queue::write(int, const void *, memory_size_type, stream_size_type, memory_size_type) {
+	throw exception("io_uring is not supported");
+}
+
+int uring_queue::wait(memory_size_type &) {
+	throw exception("io_uring is not supported");
+}
+
+#endif // TPIE_HAVE_IO_URING
+
+memory_size_type uring_queue::mapped_size() const {
+	return m_sqesSize + m_sqRingSize + (m_cqRing == m_sqRing ? 0 : m_cqRingSize);
+}
+
+/*static*/ memory_size_type uring_queue::memory_usage(memory_size_type entries) {
+	// The kernel rounds the entries up to a power of two and makes room for
+	// twice as many completions. A submission entry is 64 bytes, a
+	// completion entry 16 bytes, and the ring headers fit in a page each.
+	memory_size_type n = 1;
+	while (n < entries) n *= 2;
+	return 2*4096 + n*(64 + sizeof(unsigned) + 2*16);
+}
+
+/*************************> uring_stream_accessor <***************************/
+
+uring_stream_accessor::uring_stream_accessor(memory_size_type queueDepth)
+	: m_queueDepth(std::max(queueDepth, static_cast<memory_size_type>(2)))
+	, m_pending(0)
+	, m_lastBlockRead(std::numeric_limits<stream_size_type>::max())
+{
+	m_queue.open(m_queueDepth);
+}
+
+uring_stream_accessor::~uring_stream_accessor() {
+	// Drain the ring while our slots are still alive.
+	close();
+}
+
+/*static*/ memory_size_type uring_stream_accessor::memory_usage(memory_size_type blockSize,
+																 memory_size_type queueDepth) {
+	queueDepth = std::max(queueDepth, static_cast<memory_size_type>(2));
+	return sizeof(uring_stream_accessor)
+		+ uring_queue::memory_usage(queueDepth)
+		+ array<slot>::memory_usage(queueDepth)
+		+ queueDepth * array<char>::memory_usage(blockSize);
+}
+
+void uring_stream_accessor::allocate_slots() {
+	if (m_slots.size() == m_queueDepth && m_slots[0].buffer.size() == block_size())
+		return;
+	m_slots.resize(m_queueDepth);
+	for (memory_size_type i = 0; i < m_slots.size(); ++i)
+		m_slots[i].buffer.resize(block_size());
+}
+
+stream_size_type uring_stream_accessor::block_offset(stream_size_type blockNumber) {
+	return header_size() + blockNumber * block_size();
+}
+
+memory_size_type uring_stream_accessor::block_bytes(stream_size_type blockNumber) {
+	stream_size_type offset = blockNumber * block_items();
+	if (offset >= size()) return 0;
+	stream_size_type items = std::min(static_cast<stream_size_type>(block_items()), size() - offset);
+	return static_cast<memory_size_type>(items) * item_size();
+}
+
+memory_size_type uring_stream_accessor::find_slot(stream_size_type blockNumber) {
+	for (memory_size_type i = 0; i < m_slots.size(); ++i)
+		if (m_slots[i].state != slot::idle && m_slots[i].blockNumber == blockNumber)
+			return i;
+	return no_slot;
+}
+
+void uring_stream_accessor::complete_one() {
+	tp_assert(m_pending > 0, "complete_one: No pending requests");
+	memory_size_type i;
+	int res = m_queue.wait(i);
+	--m_pending;
+	slot & s = m_slots[i];
+	const bool write = s.state == slot::writing;
+	if (res < 0) {
+		s.state = slot::idle;
+		errno = -res;
+		posix::throw_errno(path());
+	}
+	memory_size_type done = static_cast<memory_size_type>(res);
+	// Short transfers are rare; finish them synchronously.
+	while (done < s.bytes) {
+		ssize_t r = write
+			? ::pwrite(m_fileAccessor.file_descriptor(), s.buffer.get() + done,
+					   s.bytes - done, block_offset(s.blockNumber) + done)
+			: ::pread(m_fileAccessor.file_descriptor(), s.buffer.get() + done,
+					  s.bytes - done, block_offset(s.blockNumber) + done);
+		if (r <= 0) {
+			s.state = slot::idle;
+			if (r == 0) throw io_exception("Wrong number of bytes read");
+			posix::throw_errno(path());
+		}
+		done += static_cast<memory_size_type>(r);
+	}
+	if (write) {
+		increment_bytes_written(s.bytes);
+		s.state = slot::idle;
+	} else {
+		increment_bytes_read(s.bytes);
+		s.state = slot::ready;
+	}
+}
+
+void uring_stream_accessor::wait_for(memory_size_type i) {
+	while (m_slots[i].state == slot::reading || m_slots[i].state == slot::writing)
+		complete_one();
+}
+
+memory_size_type uring_stream_accessor::acquire_slot() {
+	while (true) {
+		memory_size_type ready = no_slot;
+		for (memory_size_type i = 0; i < m_slots.size(); ++i) {
+			if (m_slots[i].state == slot::idle) return i;
+			if (m_slots[i].state == slot::ready && ready == no_slot) ready = i;
+		}
+		if (ready != no_slot) {
+			// Drop a block that was read ahead but not yet consumed.
+			m_slots[ready].state = slot::idle;
+			return ready;
+		}
+		complete_one();
+	}
+}
+
+void uring_stream_accessor::start_read(memory_size_type i, stream_size_type blockNumber) {
+	slot & s = m_slots[i];
+	s.blockNumber = blockNumber;
+	s.bytes = block_bytes(blockNumber);
+	s.state = slot::reading;
+	m_queue.read(m_fileAccessor.file_descriptor(), s.buffer.get(), s.bytes,
+				 block_offset(blockNumber), i);
+	++m_pending;
+}
+
+void uring_stream_accessor::read_ahead(stream_size_type firstBlock) {
+	// Keep one slot free for the writer or for a random read.
+	for (stream_size_type b = firstBlock; b < firstBlock + m_queueDepth - 1; ++b) {
+		if (block_bytes(b) == 0) return;
+		if (find_slot(b) != no_slot) continue;
+		memory_size_type i = no_slot;
+		for (memory_size_type j = 0; j < m_slots.size(); ++j) {
+			if (m_slots[j].state == slot::idle) {
+				i = j;
+				break;
+			}
+		}
+		if (i == no_slot) return;
+		start_read(i, b);
+	}
+}
+
+memory_size_type uring_stream_accessor::read_block(void * data,
+												   stream_size_type blockNumber,
+												   memory_size_type itemCount) {
+	if (!m_queue.is_open()) return p_t::read_block(data, blockNumber, itemCount);
+	allocate_slots();
+
+	stream_size_type offset = blockNumber * block_items();
+	if (offset + itemCount > size()) itemCount = static_cast<memory_size_type>(size() - offset);
+	memory_size_type bytes = itemCount * item_size();
+
+	memory_size_type i = find_slot(blockNumber);
+	if (i != no_slot && m_slots[i].state == slot::writing) {
+		// The block must hit the disk before we read it back.
+		wait_for(i);
+		m_slots[i].state = slot::idle;
+		i = no_slot;
+	}
+
+	const bool sequential =
+		blockNumber == 0 || blockNumber == m_lastBlockRead + 1;
+	m_lastBlockRead = blockNumber;
+	if (sequential) read_ahead(blockNumber + 1);
+
+	if (i == no_slot) {
+		// The block was not read ahead, so read it straight into the
+		// caller's buffer while the blocks following it are on their way.
+		return p_t::read_block(data, blockNumber, itemCount);
+	}
+
+	wait_for(i);
+	slot & s = m_slots[i];
+	if (s.bytes < bytes) {
+		std::stringstream ss;
+		ss << "Wrong number of bytes read: Expected " << bytes << " but got " << s.bytes;
+		s.state = slot::idle;
+		throw io_exception(ss.str());
+	}
+	memcpy(data, s.buffer.get(), bytes);
+	s.state = slot::idle;
+	return itemCount;
+}
+
+void uring_stream_accessor::write_block(const void * data,
+										stream_size_type blockNumber,
+										memory_size_type itemCount) {
+	if (!m_queue.is_open()) return p_t::write_block(data, blockNumber, itemCount);
+	allocate_slots();
+
+	// An earlier write of this block must not overtake this one,
+	// and a block read ahead of the reader is now stale.
+	memory_size_type i = find_slot(blockNumber);
+	if (i != no_slot) {
+		wait_for(i);
+		m_slots[i].state = slot::idle;
+	} else {
+		i = acquire_slot();
+	}
+
+	slot & s = m_slots[i];
+	s.blockNumber = blockNumber;
+	s.bytes = itemCount * item_size();
+	memcpy(s.buffer.get(), data, s.bytes);
+	s.state = slot::writing;
+	// As in stream_accessor, the file is padded with zeroes if we write
+	// beyond its end.
+	m_queue.write(m_fileAccessor.file_descriptor(), s.buffer.get(), s.bytes,
+				  block_offset(blockNumber), i);
+	++m_pending;
+
+	grow_size(blockNumber * block_items() + itemCount);
+}
+
+void uring_stream_accessor::finish_pending_io() {
+	while (m_pending > 0) complete_one();
+	for (memory_size_type i = 0; i < m_slots.size(); ++i)
+		m_slots[i].state = slot::idle;
+	m_lastBlockRead = std::numeric_limits<stream_size_type>::max();
+}
+
+} // namespace file_accessor
+} // namespace tpie
@@ -0,0 +1,210 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2016, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file uring.h  Asynchronous block accessor using Linux io_uring
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef TPIE_FILE_ACCESSOR_URING_H
+#define TPIE_FILE_ACCESSOR_URING_H
+
+#include <tpie/config.h>
+#include <tpie/array.h>
+#include <tpie/file_accessor/posix.h>
+#include <tpie/file_accessor/stream_accessor.h>
+
+namespace tpie {
+namespace file_accessor {
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Minimal submission/completion queue pair on top of the io_uring
+/// system calls.
+///
+/// If the kernel (or the build) does not support io_uring, open() returns
+/// false and the queue must not be used.
+///////////////////////////////////////////////////////////////////////////////
+class uring_queue {
+public:
+	uring_queue();
+	~uring_queue();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Set up a ring with room for at least the given number of
+	/// outstanding requests. Returns false if io_uring is unavailable.
+	///////////////////////////////////////////////////////////////////////////
+	bool open(memory_size_type entries);
+
+	void close();
+
+	bool is_open() const { return m_ringFd != -1; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Queue and submit a read of size bytes at the given offset.
+	/// Precondition: fewer than entries requests are outstanding.
+	///////////////////////////////////////////////////////////////////////////
+	void read(int fd, void * data, memory_size_type size,
+			  stream_size_type offset, memory_size_type userData);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Queue and submit a write of size bytes at the given offset.
+	/// Precondition: fewer than entries requests are outstanding.
+	///////////////////////////////////////////////////////////////////////////
+	void write(int fd, const void * data, memory_size_type size,
+			   stream_size_type offset, memory_size_type userData);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Block until a request completes.
+	/// \param userData Set to the userData given when submitting.
+	/// \returns The number of bytes transferred, or minus errno.
+	///////////////////////////////////////////////////////////////////////////
+	int wait(memory_size_type & userData);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Upper bound on the memory mapped for a ring with the given
+	/// number of entries. The mapping of an open ring is registered with the
+	/// memory manager.
+	///////////////////////////////////////////////////////////////////////////
+	static memory_size_type memory_usage(memory_size_type entries);
+
+private:
+	memory_size_type mapped_size() const;
+
+	void submit(int opcode, int fd, const void * data, memory_size_type size,
+				stream_size_type offset, memory_size_type userData);
+
+	int m_ringFd;
+
+	void * m_sqRing;
+	memory_size_type m_sqRingSize;
+	void * m_cqRing;
+	memory_size_type m_cqRingSize;
+	void * m_sqes;
+	memory_size_type m_sqesSize;
+
+	unsigned * m_sqTail;
+	unsigned * m_sqMask;
+	unsigned * m_sqArray;
+	unsigned * m_cqHead;
+	unsigned * m_cqTail;
+	unsigned * m_cqMask;
+	void * m_cqes;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Block accessor that submits block reads and writes through
+/// io_uring and reads ahead of a sequential reader.
+///
+/// Pass an instance to the constructor of \ref file or
+/// \ref uncompressed_stream to use it instead of the default accessor; the
+/// stream takes ownership. Up to queueDepth blocks are in flight at any time.
+/// When a block is read that directly follows the previously read block,
+/// the blocks following it are requested as well, so that a later
+/// read_block is served from a block that has already arrived. A block that
+/// was not read ahead is read directly into the caller's buffer.
+///
+/// Writes are asynchronous: write_block copies the block and returns
+/// immediately. Pending writes are completed before a block they overwrite
+/// is read back, before truncating and before closing.
+///
+/// If io_uring is not available at runtime, the accessor silently falls back
+/// to the synchronous behaviour of stream_accessor.
+///////////////////////////////////////////////////////////////////////////////
+class uring_stream_accessor : public stream_accessor<posix> {
+	typedef stream_accessor<posix> p_t;
+public:
+	static const memory_size_type default_queue_depth = 8;
+
+	uring_stream_accessor(memory_size_type queueDepth = default_queue_depth);
+	virtual ~uring_stream_accessor();
+
+	virtual memory_size_type read_block(void * data,
+										stream_size_type blockNumber,
+										memory_size_type itemCount) override;
+
+	virtual void write_block(const void * data,
+							 stream_size_type blockNumber,
+							 memory_size_type itemCount) override;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief The slots and the ring are not shared between threads, so
+	/// write-behind is not supported.
+	///////////////////////////////////////////////////////////////////////////
+	virtual bool concurrent_writes() const override { return false; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether requests actually go through io_uring.
+	///////////////////////////////////////////////////////////////////////////
+	bool is_asynchronous() const { return m_queue.is_open(); }
+
+	memory_size_type queue_depth() const { return m_queueDepth; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Memory used by an accessor with the given block size (in bytes)
+	/// and queue depth: the slot buffers and the ring, in addition to the
+	/// block buffers accounted for by the stream. Pass it along with
+	/// includeDefaultFileAccessor=false to the memory_usage of the stream.
+	///////////////////////////////////////////////////////////////////////////
+	static memory_size_type memory_usage(memory_size_type blockSize,
+										 memory_size_type queueDepth = default_queue_depth);
+
+protected:
+	virtual void finish_pending_io() override;
+
+private:
+	struct slot {
+		enum state_type {
+			/** Buffer is unused. */
+			idle,
+			/** A read into the buffer has been submitted. */
+			reading,
+			/** The buffer holds a block read ahead of the reader. */
+			ready,
+			/** A write from the buffer has been submitted. */
+			writing
+		};
+
+		state_type state;
+		stream_size_type blockNumber;
+		memory_size_type bytes;
+		array<char> buffer;
+
+		slot() : state(idle), blockNumber(0), bytes(0) {}
+	};
+
+	void allocate_slots();
+	memory_size_type find_slot(stream_size_type blockNumber);
+	memory_size_type acquire_slot();
+	void start_read(memory_size_type i, stream_size_type blockNumber);
+	void read_ahead(stream_size_type firstBlock);
+	void complete_one();
+	void wait_for(memory_size_type i);
+	memory_size_type block_bytes(stream_size_type blockNumber);
+	stream_size_type block_offset(stream_size_type blockNumber);
+
+	memory_size_type m_queueDepth;
+	uring_queue m_queue;
+	array<slot> m_slots;
+	memory_size_type m_pending;
+	stream_size_type m_lastBlockRead;
+};
+
+} // namespace file_accessor
+} // namespace tpie
+
+#endif // TPIE_FILE_ACCESSOR_URING_H
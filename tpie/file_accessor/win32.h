@@ -57,7 +57,51 @@ public:
 	inline void read_i(void * data, memory_size_type size);
 	inline void write_i(const void * data, memory_size_type size);
 	inline void seek_i(stream_size_type offset);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Read size bytes at the given byte offset. The offset is passed
+	/// in an OVERLAPPED structure, so concurrent calls do not interfere.
+	///////////////////////////////////////////////////////////////////////////
+	inline void read_at_i(void * data, memory_size_type size, stream_size_type offset);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Write size bytes at the given byte offset.
+	///////////////////////////////////////////////////////////////////////////
+	inline void write_at_i(const void * data, memory_size_type size, stream_size_type offset);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Direct I/O is not implemented on Windows, since
+	/// FILE_FLAG_NO_BUFFERING would also apply to the header and user data.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool direct_io() const {return false;}
+	inline void read_direct_i(void * data, memory_size_type size, memory_size_type transferSize, stream_size_type offset);
+	inline void write_direct_i(const void * data, memory_size_type size, stream_size_type offset);
+
 	inline stream_size_type file_size_i();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Set the allocation size of the file to at least size bytes.
+	/// This is only a hint.
+	/// \returns Whether space was reserved.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool reserve_i(stream_size_type size);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Nothing to do; NTFS frees the allocation beyond the end of the
+	/// file when the handle is closed.
+	///////////////////////////////////////////////////////////////////////////
+	inline void release_reserved_i() {}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Kernel-side copying is not implemented on Windows; the caller
+	/// copies through a buffer.
+	/// \returns 0
+	///////////////////////////////////////////////////////////////////////////
+	inline stream_size_type copy_range_i(win32 &, stream_size_type,
+										 stream_size_type, stream_size_type) {
+		return 0;
+	}
+
 	inline void close_i();
 	inline void truncate_i(stream_size_type bytes);
 	inline bool is_open() const;
@@ -59,6 +59,39 @@ inline void win32::write_i(const void * data, memory_size_type size) {
 	increment_bytes_written(size);
 }
 
+inline void win32::read_at_i(void * data, memory_size_type size, stream_size_type offset) {
+	OVERLAPPED o;
+	memset(&o, 0, sizeof(o));
+	o.Offset = static_cast<DWORD>(offset);
+	o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+	DWORD bytesRead = 0;
+	if (!ReadFile(m_fd, data, (DWORD)size, &bytesRead, &o)) throw_getlasterror();
+	if (bytesRead != size) {
+		std::stringstream ss;
+		ss << "Wrong number of bytes read: Expected " << size << " but got " << bytesRead;
+		throw io_exception(ss.str());
+	}
+	increment_bytes_read(size);
+}
+
+inline void win32::write_at_i(const void * data, memory_size_type size, stream_size_type offset) {
+	OVERLAPPED o;
+	memset(&o, 0, sizeof(o));
+	o.Offset = static_cast<DWORD>(offset);
+	o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+	DWORD bytesWritten = 0;
+	if (!WriteFile(m_fd, data, (DWORD)size, &bytesWritten, &o) || bytesWritten != size) throw_getlasterror();
+	increment_bytes_written(size);
+}
+
+inline void win32::read_direct_i(void * data, memory_size_type size, memory_size_type, stream_size_type offset) {
+	read_at_i(data, size, offset);
+}
+
+inline void win32::write_direct_i(const void * data, memory_size_type size, stream_size_type offset) {
+	write_at_i(data, size, offset);
+}
+
 inline void win32::seek_i(stream_size_type size) {
 	LARGE_INTEGER i;
 	i.QuadPart = size;
@@ -72,6 +105,12 @@ inline stream_size_type win32::file_size_i() {
 	return static_cast<stream_size_type>(i.QuadPart);
 }
 
+inline bool win32::reserve_i(stream_size_type size) {
+	FILE_ALLOCATION_INFO info;
+	info.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+	return SetFileInformationByHandle(m_fd, FileAllocationInfo, &info, sizeof(info)) != 0;
+}
+
 static const DWORD shared_flags = FILE_SHARE_READ | FILE_SHARE_WRITE;
 
 void win32::set_cache_hint(cache_hint cacheHint) {
@@ -80,6 +119,7 @@ void win32::set_cache_hint(cache_hint cacheHint) {
 			m_creationFlag = 0;
 			break;
 		case access_sequential:
+		case access_direct:
 			m_creationFlag = FILE_FLAG_SEQUENTIAL_SCAN;
 			break;
 		case access_random:
@@ -36,18 +36,45 @@ file_base::file_base(memory_size_type itemSize,
 }
 
 
+void file_base::open_inner(const std::string & path,
+							access_type accessType,
+							memory_size_type userDataSize,
+							cache_hint cacheHint) throw(stream_exception) {
+	const bool directBuffers = m_directBuffers;
+	p_t::open_inner(path, accessType, userDataSize, cacheHint);
+	if (m_directBuffers == directBuffers) return;
+
+	// Streams attached while the file was closed hold buffers of the other
+	// kind; they are all free as the file was not open.
+	for (boost::intrusive::list<block_t>::iterator i = m_free.begin(); i != m_free.end(); ++i) {
+		char * allocation;
+		char * data = allocate_block_buffer(allocation);
+		m_directBuffers = directBuffers;
+		free_block_buffer(i->allocation);
+		m_directBuffers = !directBuffers;
+		i->allocation = allocation;
+		i->data = data;
+	}
+}
+
 void file_base::create_block() {
 	// alloc heap block
-	block_t * block = reinterpret_cast<block_t*>( tpie_new_array<char>(sizeof(block_t) + m_itemSize*m_blockItems) );
-
-	// call ctor
-	new (block) block_t();
+	block_t * block = tpie_new<block_t>();
+	try {
+		block->data = allocate_block_buffer(block->allocation);
+	} catch (...) {
+		tpie_delete(block);
+		throw;
+	}
 
 	// push to intrusive list
 	m_free.push_front(*block);
 }
 
 void file_base::delete_block() {
+	// a block may be waiting to be written
+	while (m_free.empty()) write_behind_wait_one();
+
 	// find first block
 	assert(!m_free.empty());
 	block_t * block = &m_free.front();
@@ -55,11 +82,9 @@ void file_base::delete_block() {
 	// remove from intrusive list
 	m_free.pop_front();
 
-	// call dtor
-	block->~block_t();
-
 	// dealloc
-	tpie_delete_array<char>(reinterpret_cast<char*>(block), sizeof(block_t) + m_itemSize*m_blockItems);
+	free_block_buffer(block->allocation);
+	tpie_delete(block);
 }
 
 
@@ -74,6 +99,7 @@ file_base::block_t * file_base::get_block(stream_size_type block) {
 
 	if (i == m_used.end()) {
 		// block not buffered. populate a free buffer.
+		while (m_free.empty()) write_behind_wait_one();
 		assert(!m_free.empty());
 
 		// fetch a free buffer
@@ -103,6 +129,22 @@ void file_base::free_block(block_t * block) {
 
 	if (block->dirty || !m_canRead) {
 		assert(m_canWrite);
+		clear_block_padding(block->data, block->size);
+		if (m_writeBehindBlocks > 0) {
+			// replace the buffer we hand over, up to the write-behind limit
+			if (m_writeBehindAllocated < m_writeBehindBlocks) {
+				create_block();
+				++m_writeBehindAllocated;
+			}
+			m_used.erase(m_used.iterator_to(*block));
+			try {
+				write_behind(block->data, block->number, block->size, block);
+			} catch (...) {
+				m_free.push_back(*block);
+				throw;
+			}
+			return;
+		}
 		m_fileAccessor->write_block(block->data, block->number, block->size);
 	}
 
@@ -113,13 +155,35 @@ void file_base::free_block(block_t * block) {
 	m_free.push_front(*block);
 }
 
+void file_base::write_behind_done(void * tag) {
+	// push to the back, as get_block may be holding on to the front
+	m_free.push_back(*static_cast<block_t *>(tag));
+	if (m_tempFile)
+		m_tempFile->update_recorded_size(m_fileAccessor->byte_size());
+}
+
+void file_base::release_write_behind() {
+	for (; m_writeBehindAllocated > 0; --m_writeBehindAllocated)
+		delete_block();
+	m_writeBehind.reset();
+}
+
 void file_base::close() {
-	assert(m_free.empty());
 	assert(m_used.empty());
+	try {
+		write_behind_finish();
+	} catch (...) {
+		release_write_behind();
+		throw;
+	}
+	release_write_behind();
+	assert(m_free.empty());
 	p_t::close();
 }
 
 file_base::~file_base() {
+	write_behind_collect();
+	release_write_behind();
 	assert(m_free.empty());
 	assert(m_used.empty());
 	delete m_fileAccessor;
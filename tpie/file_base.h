@@ -50,20 +50,16 @@ protected:
 	/// This is the type of our block buffers. We have one per file::stream
 	/// distributed over two linked lists.
 	///////////////////////////////////////////////////////////////////////////
-#ifdef WIN32
-#pragma warning( push )
-#pragma warning( disable : 4200 )
-#endif
 	struct block_t : public boost::intrusive::list_base_hook<> {
 		memory_size_type size;
 		memory_size_type usage;
 		stream_size_type number;
 		bool dirty;
-		char data[0];
+		/** Block buffer, aligned for direct I/O. */
+		char * data;
+		/** Allocation backing data. */
+		char * allocation;
 	};
-#ifdef WIN32
-#pragma warning( pop )
-#endif
 
 	inline void update_size(stream_size_type size) {
 		m_size = std::max(m_size, size);
@@ -76,6 +72,13 @@ public:
 		return file_size();
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \copydoc file_base_crtp::write_behind_memory_usage
+	///////////////////////////////////////////////////////////////////////////
+	static inline memory_size_type write_behind_memory_usage(double blockFactor, memory_size_type blocks) {
+		return p_t::write_behind_memory_usage(blockFactor, blocks) + blocks * sizeof(block_t);
+	}
+
 	void close();
 
 	///////////////////////////////////////////////////////////////////////////
@@ -181,6 +184,7 @@ public:
 		if (!m_used.empty()) {
 			throw io_exception("Tried to truncate a file with one or more open streams");
 		}
+		write_behind_drain();
 		m_size = s;
 		m_fileAccessor->truncate(s);
 		if (m_tempFile)
@@ -198,11 +202,28 @@ protected:
 			  double blockFactor=1.0,
 			  file_accessor::file_accessor * fileAccessor=NULL);
 
+	void open_inner(const std::string & path,
+					access_type accessType,
+					memory_size_type userDataSize,
+					cache_hint cacheHint) throw(stream_exception);
+
 	void create_block();
 	void delete_block();
 	block_t * get_block(stream_size_type block);
 	void free_block(block_t * block);
 
+	friend class file_base_crtp<file_base>;
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Called when a block handed to the write-behind thread has been
+	/// written.
+	///////////////////////////////////////////////////////////////////////////
+	void write_behind_done(void * tag);
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Delete the extra blocks allocated for write-behind. All writes
+	/// must have been collected.
+	///////////////////////////////////////////////////////////////////////////
+	void release_write_behind();
+
 
 	static block_t m_emptyBlock;
 	// TODO This should really be a hash map
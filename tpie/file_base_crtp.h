@@ -33,6 +33,8 @@
 #include <tpie/stream_header.h>
 #include <tpie/file_accessor/file_accessor.h>
 #include <tpie/tempname.h>
+#include <tpie/write_behind.h>
+#include <algorithm>
 
 namespace tpie {
 
@@ -94,9 +96,60 @@ public:
 
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Amount of memory used by a single block given the block factor.
+	/// \param directIO Whether the file is opened with access_direct.
 	///////////////////////////////////////////////////////////////////////////
-	static inline memory_size_type block_memory_usage(double blockFactor) {
-		return block_size(blockFactor);
+	static inline memory_size_type block_memory_usage(double blockFactor, bool directIO=false) {
+		return block_buffer_size(block_size(blockFactor), directIO);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Bytes allocated for a block buffer of the given block size.
+	///
+	/// For direct I/O, block buffers are padded and aligned to the file
+	/// accessor boundary.
+	///////////////////////////////////////////////////////////////////////////
+	static inline memory_size_type block_buffer_size(memory_size_type blockSize, bool directIO) {
+		if (!directIO) return blockSize;
+		return file_accessor::file_accessor::align_to_boundary(blockSize)
+			+ file_accessor::file_accessor::boundary();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Write evicted dirty blocks in the background.
+	///
+	/// With a nonzero number of blocks, a dirty block that is evicted is
+	/// handed to a writer thread together with its buffer, and the stream
+	/// carries on in one of up to the given number of extra block buffers.
+	/// When all of them are being written, the stream waits for the oldest
+	/// write to finish. Pending writes are completed before a block is read
+	/// from the file, on truncate and on close; a failed write is reported
+	/// by the first of these.
+	///
+	/// May only be called while the file is closed. Pass 0 to write blocks
+	/// synchronously, which is the default. Throws if the file accessor does
+	/// not support concurrent writes.
+	///////////////////////////////////////////////////////////////////////////
+	void set_write_behind(memory_size_type blocks) {
+		if (m_open) throw stream_exception("Cannot change write-behind of an open file");
+		if (blocks > 0 && !m_fileAccessor->concurrent_writes())
+			throw stream_exception("File accessor does not support write-behind");
+		m_writeBehindBlocks = blocks;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Number of extra block buffers used for write-behind.
+	///////////////////////////////////////////////////////////////////////////
+	memory_size_type get_write_behind() const {
+		return m_writeBehindBlocks;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Extra memory used by write-behind with the given number of
+	/// blocks.
+	///////////////////////////////////////////////////////////////////////////
+	static inline memory_size_type write_behind_memory_usage(double blockFactor, memory_size_type blocks) {
+		if (blocks == 0) return 0;
+		return sizeof(bits::write_behind_queue) + blocks * block_memory_usage(blockFactor);
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -257,6 +310,16 @@ public:
 		return m_open;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Reserve disk space for the file to grow to the given number of
+	/// items, so that it is laid out contiguously. Does not change the size
+	/// of the file; space that is not used is given back on close.
+	///////////////////////////////////////////////////////////////////////////
+	inline void reserve(stream_size_type items) {
+		assert(m_open);
+		m_fileAccessor->reserve(items);
+	}
+
 	/////////////////////////////////////////////////////////////////////////
 	/// \brief Get the size of the file measured in items.
 	/// If there are streams of this file that have extended the stream length
@@ -285,6 +348,7 @@ protected:
 			throw stream_exception("Tried to open compressed stream as non-compressed");
 		}
 		m_size = m_fileAccessor->size();
+		m_directBuffers = m_fileAccessor->direct_io();
 		m_open = true;
 	}
 
@@ -297,16 +361,126 @@ protected:
 	void read_block(BT & b, stream_size_type block);
 	void get_block_check(stream_size_type block);
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Allocate a block buffer of block_buffer_size() bytes.
+	/// \param allocation Set to the pointer to pass to free_block_buffer.
+	/// \returns The buffer, aligned to the file accessor boundary for direct
+	/// I/O.
+	///////////////////////////////////////////////////////////////////////////
+	char * allocate_block_buffer(char *& allocation) {
+		allocation = tpie_new_array<char>(block_buffer_size());
+		return block_buffer(allocation);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief The buffer within an allocation made by allocate_block_buffer.
+	///////////////////////////////////////////////////////////////////////////
+	char * block_buffer(char * allocation) const {
+		if (!m_directBuffers) return allocation;
+		const memory_size_type b = file_accessor::file_accessor::boundary();
+		size_t misalignment = reinterpret_cast<size_t>(allocation) % b;
+		return allocation + (misalignment ? b - misalignment : 0);
+	}
+
+	void free_block_buffer(char * allocation) {
+		tpie_delete_array(allocation, block_buffer_size());
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Bytes allocated by allocate_block_buffer.
+	///////////////////////////////////////////////////////////////////////////
+	memory_size_type block_buffer_size() const {
+		return block_buffer_size(m_blockSize, m_directBuffers);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Hand a block buffer to the write-behind thread.
+	/// \param tag Passed to child_t::write_behind_done once the buffer may be
+	/// reused.
+	///////////////////////////////////////////////////////////////////////////
+	void write_behind(const char * data, stream_size_type block, memory_size_type items, void * tag) {
+		if (m_writeBehind.get() == 0)
+			m_writeBehind.reset(tpie_new<bits::write_behind_queue>());
+		m_writeBehind->enqueue(m_fileAccessor, data, block, items, tag);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Wait for the oldest pending write and return its buffer via
+	/// child_t::write_behind_done. A failed write is reported by the next
+	/// call to write_behind_drain or write_behind_finish.
+	///////////////////////////////////////////////////////////////////////////
+	void write_behind_wait_one() {
+		self().write_behind_done(m_writeBehind->wait_one());
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Complete all pending writes and return all buffers via
+	/// child_t::write_behind_done, leaving the writer thread running. Throw
+	/// if a write has failed.
+	///////////////////////////////////////////////////////////////////////////
+	void write_behind_drain() {
+		if (m_writeBehind.get() == 0) return;
+		while (m_writeBehind->outstanding() > 0)
+			write_behind_wait_one();
+		m_writeBehind->rethrow_error();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Complete all pending writes, stop the writer thread and return
+	/// all buffers via child_t::write_behind_done. Used when closing the
+	/// file. Does not throw.
+	///////////////////////////////////////////////////////////////////////////
+	void write_behind_collect() {
+		if (m_writeBehind.get() == 0) return;
+		m_writeBehind->finish();
+		while (m_writeBehind->outstanding() > 0)
+			write_behind_wait_one();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Like write_behind_collect, but throw if a write has failed.
+	///////////////////////////////////////////////////////////////////////////
+	void write_behind_finish() {
+		write_behind_collect();
+		if (m_writeBehind.get() != 0) m_writeBehind->rethrow_error();
+	}
+
+	bool write_behind_pending() const {
+		return m_writeBehind.get() != 0 && m_writeBehind->outstanding() > 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Zero the bytes after the given number of items in a block
+	/// buffer up to the next boundary. A direct write transfers them along
+	/// with the block, and they must read back as zeroes if the stream is
+	/// later extended by truncate. Does nothing unless the file uses direct
+	/// I/O.
+	///////////////////////////////////////////////////////////////////////////
+	void clear_block_padding(char * data, memory_size_type items) {
+		if (!m_directBuffers) return;
+		memory_size_type used = items * m_itemSize;
+		memory_size_type padded = file_accessor::file_accessor::align_to_boundary(used);
+		std::fill(data + used, data + padded, 0);
+	}
+
 	memory_size_type m_blockItems;
 	memory_size_type m_blockSize;
 	bool m_canRead;
 	bool m_canWrite;
 	bool m_open;
+	/** Whether block buffers are padded and aligned for direct I/O. Kept
+	 * after close until the next open, as buffers may outlive the open file. */
+	bool m_directBuffers;
 	memory_size_type m_itemSize;
 	file_accessor::file_accessor * m_fileAccessor;
 	tpie::unique_ptr<temp_file> m_ownedTempFile;
 	temp_file * m_tempFile;
 	stream_size_type m_size;
+	/** Maximum number of extra block buffers for write-behind. */
+	memory_size_type m_writeBehindBlocks;
+	/** Number of extra block buffers currently allocated for write-behind. */
+	memory_size_type m_writeBehindAllocated;
+	tpie::unique_ptr<bits::write_behind_queue> m_writeBehind;
 
 private:
 	child_t & self() {return *static_cast<child_t *>(this);}
@@ -38,6 +38,9 @@ file_base_crtp<child_t>::file_base_crtp(
 	m_blockSize = block_size(blockFactor);
 	m_blockItems = m_blockSize/m_itemSize;
 	m_tempFile = 0;
+	m_writeBehindBlocks = 0;
+	m_writeBehindAllocated = 0;
+	m_directBuffers = false;
 }
 
 template <typename child_t>
@@ -51,10 +54,27 @@ void file_base_crtp<child_t>::read_block(BT & b, stream_size_type block) {
 	if (static_cast<stream_size_type>(b.size) + b.number * static_cast<stream_size_type>(m_blockItems) > self().size())
 		b.size = static_cast<memory_size_type>(self().size() - block * m_blockItems);
 
-	// populate buffer data
-	if (b.size > 0 &&
-		m_fileAccessor->read_block(b.data, b.number, b.size) != b.size) {
-		throw io_exception("Incorrect number of items read");
+	// populate buffer data, or point straight into a mapping of the file
+	b.data = block_buffer(b.allocation);
+	if (b.size > 0) {
+		char * mapped = m_canWrite ? 0 : m_fileAccessor->map_block(b.number);
+		if (mapped != 0) {
+			b.data = mapped;
+		} else {
+			// A block still being written is copied from its buffer. Other
+			// blocks are on disk already, so the writer is not waited for.
+			memory_size_type pendingItems = 0;
+			const char * pending = 0;
+			if (write_behind_pending())
+				pending = m_writeBehind->find(b.number, pendingItems);
+			if (pending != 0 && pendingItems >= b.size) {
+				std::copy(pending, pending + b.size * m_itemSize, b.data);
+			} else {
+				if (pending != 0) write_behind_drain();
+				if (m_fileAccessor->read_block(b.data, b.number, b.size) != b.size)
+					throw io_exception("Incorrect number of items read");
+			}
+		}
 	}
 }
 
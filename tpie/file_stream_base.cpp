@@ -32,7 +32,7 @@ file_stream_base::file_stream_base(memory_size_type itemSize,
 	m_nextBlock = std::numeric_limits<stream_size_type>::max();
 	m_nextIndex = std::numeric_limits<memory_size_type>::max();
 	m_index = std::numeric_limits<memory_size_type>::max();
-	m_block.data = 0;
+	m_block.data = m_block.allocation = 0;
 	m_block.dirty = false;
 }
 
@@ -42,10 +42,95 @@ void file_stream_base::get_block(stream_size_type block) {
 }
 
 void file_stream_base::update_block_core() {
-	flush_block();
+	if (m_block.dirty && m_writeBehindBlocks > 0)
+		write_behind_block();
+	else
+		flush_block();
 	get_block(m_nextBlock);
 }
 
+void file_stream_base::concatenate(file_stream_base & from) {
+	assert(m_open && from.m_open);
+	assert(m_canWrite);
+	from.flush_block();
+	from.write_behind_drain();
+	flush_block();
+	write_behind_drain();
+
+	const stream_size_type start = size();
+	const stream_size_type items = from.size();
+	m_fileAccessor->copy_items(*from.m_fileAccessor, 0, start, items);
+	// Drops the cached block and records the new size in the header.
+	truncate(start + items);
+}
+
+void file_stream_base::copy_from(file_stream_base & from) {
+	if (&from == this) return;
+	truncate(0);
+	m_fileAccessor->copy_user_data(*from.m_fileAccessor);
+	concatenate(from);
+}
+
+void file_stream_base::write_behind_block() {
+	assert(m_canWrite);
+	update_vars();
+	clear_block_padding(m_block.data, m_block.size);
+
+	if (m_writeBehindSpare.size() != m_writeBehindBlocks)
+		m_writeBehindSpare.resize(m_writeBehindBlocks, 0);
+
+	char * spare = take_spare();
+	if (spare == 0) {
+		if (m_writeBehindAllocated < m_writeBehindBlocks) {
+			allocate_block_buffer(spare);
+			++m_writeBehindAllocated;
+		} else {
+			write_behind_wait_one();
+			spare = take_spare();
+		}
+	}
+
+	try {
+		write_behind(m_block.data, m_block.number, m_block.size, m_block.allocation);
+	} catch (...) {
+		put_spare(spare);
+		throw;
+	}
+	m_block.allocation = spare;
+	m_block.data = block_buffer(spare);
+	m_block.dirty = false;
+}
+
+char * file_stream_base::take_spare() {
+	for (size_t i = 0; i < m_writeBehindSpare.size(); ++i) {
+		char * spare = m_writeBehindSpare[i];
+		if (spare != 0) {
+			m_writeBehindSpare[i] = 0;
+			return spare;
+		}
+	}
+	return 0;
+}
+
+void file_stream_base::put_spare(char * allocation) {
+	*std::find(m_writeBehindSpare.begin(), m_writeBehindSpare.end(),
+			   static_cast<char *>(0)) = allocation;
+}
+
+void file_stream_base::write_behind_done(void * tag) {
+	put_spare(static_cast<char *>(tag));
+	if (m_tempFile)
+		m_tempFile->update_recorded_size(m_fileAccessor->byte_size());
+}
+
+void file_stream_base::release_write_behind() {
+	for (size_t i = 0; i < m_writeBehindSpare.size(); ++i)
+		free_block_buffer(m_writeBehindSpare[i]);
+	m_writeBehindSpare.resize(0);
+	m_writeBehindAllocated = 0;
+	m_writeBehind.reset();
+}
+
 template class stream_crtp<file_stream_base>;
 template class file_base_crtp<file_stream_base>;
 
@@ -26,6 +26,7 @@
 
 #include <tpie/file_base_crtp.h>
 #include <tpie/stream_crtp.h>
+#include <tpie/array.h>
 #include <algorithm>
 namespace tpie {
 
@@ -40,9 +41,19 @@ public:
 		memory_size_type size;
 		stream_size_type number;
 		bool dirty;
+		/** Block buffer, aligned for direct I/O. */
 		char * data;
+		/** Allocation backing data. */
+		char * allocation;
 	};
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \copydoc file_base_crtp::write_behind_memory_usage
+	///////////////////////////////////////////////////////////////////////////
+	static inline memory_size_type write_behind_memory_usage(double blockFactor, memory_size_type blocks) {
+		return p_t::write_behind_memory_usage(blockFactor, blocks) + blocks * sizeof(char *);
+	}
+
 	/////////////////////////////////////////////////////////////////////////
 	/// \brief Close the file and release resources.
 	///
@@ -50,8 +61,16 @@ public:
 	/////////////////////////////////////////////////////////////////////////
 	inline void close() throw(stream_exception) {
 		if (m_open) flush_block();
-		tpie_delete_array(m_block.data, m_itemSize * m_blockItems);
-		m_block.data = 0;
+		write_behind_collect();
+		try {
+			if (m_writeBehind.get() != 0) m_writeBehind->rethrow_error();
+		} catch (...) {
+			release_write_behind();
+			throw;
+		}
+		release_write_behind();
+		free_block_buffer(m_block.allocation);
+		m_block.data = m_block.allocation = 0;
 		p_t::close();
 	}
 
@@ -66,6 +85,7 @@ public:
 	inline void truncate(stream_size_type size) {
 		stream_size_type o=offset();
 		flush_block();
+		write_behind_drain();
 		m_block.number = std::numeric_limits<stream_size_type>::max();
 		m_nextBlock = std::numeric_limits<stream_size_type>::max();
 		m_nextIndex = std::numeric_limits<memory_size_type>::max();
@@ -77,6 +97,25 @@ public:
 		seek(std::min(o, size));
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Append the items of another stream to the end of this stream.
+	///
+	/// Items are copied directly between the files, by the kernel where the
+	/// platform supports it, instead of through the block buffers. The
+	/// streams must have the same item size and neither may be compressed.
+	/// Block sizes may differ. The position of this stream is unchanged.
+	/// \param from Stream to copy from. May be this stream.
+	///////////////////////////////////////////////////////////////////////////
+	void concatenate(file_stream_base & from);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Replace the contents and user data of this stream by those of
+	/// another stream.
+	///
+	/// \sa concatenate()
+	///////////////////////////////////////////////////////////////////////////
+	void copy_from(file_stream_base & from);
+
 protected:
 	file_stream_base(memory_size_type itemSize,
 					 double blockFactor,
@@ -99,13 +138,19 @@ protected:
 		swap(m_canWrite,        other.m_canWrite);
 		swap(m_itemSize,        other.m_itemSize);
 		swap(m_open,            other.m_open);
+		swap(m_directBuffers,   other.m_directBuffers);
 		swap(m_fileAccessor,    other.m_fileAccessor);
 		swap(m_block.size,      other.m_block.size);
 		swap(m_block.number,    other.m_block.number);
 		swap(m_block.dirty,     other.m_block.dirty);
 		swap(m_block.data,      other.m_block.data);
+		swap(m_block.allocation, other.m_block.allocation);
 		swap(m_ownedTempFile,   other.m_ownedTempFile);
 		swap(m_tempFile,        other.m_tempFile);
+		swap(m_writeBehindBlocks,    other.m_writeBehindBlocks);
+		swap(m_writeBehindAllocated, other.m_writeBehindAllocated);
+		swap(m_writeBehind,          other.m_writeBehind);
+		swap(m_writeBehindSpare,     other.m_writeBehindSpare);
 	}
 
 	inline void open_inner(const std::string & path,
@@ -122,7 +167,7 @@ protected:
 		m_block.size = 0;
 		m_block.number = std::numeric_limits<stream_size_type>::max();
 		m_block.dirty = false;
-		m_block.data = tpie_new_array<char>(m_blockItems * m_itemSize);
+		m_block.data = allocate_block_buffer(m_block.allocation);
 
 		initialize();
 		seek(0);
@@ -140,6 +185,7 @@ protected:
 		if (m_block.dirty) {
 			assert(m_canWrite);
 			update_vars();
+			clear_block_padding(m_block.data, m_block.size);
 			m_fileAccessor->write_block(m_block.data, m_block.number, m_block.size);
 			if (m_tempFile)
 				m_tempFile->update_recorded_size(m_fileAccessor->byte_size());
@@ -147,6 +193,34 @@ protected:
 		m_block.dirty = false;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Hand the dirty block to the write-behind thread and continue
+	/// in a spare buffer.
+	///////////////////////////////////////////////////////////////////////////
+	void write_behind_block();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Called when a buffer handed to the write-behind thread has been
+	/// written.
+	///////////////////////////////////////////////////////////////////////////
+	void write_behind_done(void * tag);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Remove a spare write-behind buffer, or return 0 if there is
+	/// none.
+	///////////////////////////////////////////////////////////////////////////
+	char * take_spare();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Put a write-behind buffer back among the spares.
+	///////////////////////////////////////////////////////////////////////////
+	void put_spare(char * allocation);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Free the spare buffers. All writes must have been collected.
+	///////////////////////////////////////////////////////////////////////////
+	void release_write_behind();
+
 	inline void update_vars() {
 		if (m_block.dirty && m_index != std::numeric_limits<memory_size_type>::max()) {
 			assert(m_index <= m_blockItems);
@@ -167,6 +241,10 @@ protected:
 
 	block_t m_block;
 
+	/** Allocations of write-behind buffers that are not in use, with 0 in
+	 * the remaining slots. One slot per write-behind block. */
+	tpie::array<char *> m_writeBehindSpare;
+
 private:
 	friend class stream_crtp<file_stream_base>;
 	file_stream_base & get_file() {return *this;}
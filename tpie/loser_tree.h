@@ -0,0 +1,232 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2013, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+#ifndef __TPIE_LOSER_TREE_H__
+#define __TPIE_LOSER_TREE_H__
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file loser_tree.h
+/// \brief Tournament tree for merging sorted runs.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <tpie/array.h>
+#include <tpie/util.h>
+#include <tpie/tpie_assert.h>
+#include <functional>
+
+namespace tpie {
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Loser tree (tournament tree) holding the current item of each of a
+/// fixed number of sorted runs.
+///
+/// The item of run i is kept in slot i and is never moved; the internal nodes
+/// of the tree only hold run numbers. Replacing the smallest item costs one
+/// comparison per level of the tree, where a binary heap needs two, and no
+/// items are swapped.
+///
+/// A run without a current item is exhausted and compares greater than any
+/// item. The tree is empty when all runs are exhausted.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename pred_t = std::less<T> >
+class loser_tree : public linear_memory_base<loser_tree<T, pred_t> > {
+public:
+	typedef memory_size_type size_type;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Construct a loser tree with the given number of runs, all of
+	/// which are exhausted.
+	///////////////////////////////////////////////////////////////////////////
+	loser_tree(size_type runs = 0, pred_t pred = pred_t(),
+			   memory_bucket_ref bucket = memory_bucket_ref())
+		: m_items(bucket)
+		, m_active(bucket)
+		, m_tree(bucket)
+		, m_size(0)
+		, m_pred(pred)
+	{
+		resize(runs);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Change the number of runs. All runs become exhausted.
+	///////////////////////////////////////////////////////////////////////////
+	void resize(size_type runs) {
+		m_items.resize(runs);
+		m_active.resize(runs, false);
+		m_tree.resize(runs, 0);
+		m_size = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Set the current item of a run, possibly destroying the
+	/// ordering information. Call make_safe() before using the tree.
+	///////////////////////////////////////////////////////////////////////////
+	void unsafe_set(size_type run, const T & item) {
+		activate(run);
+		m_items[run] = item;
+	}
+
+	void unsafe_set(size_type run, T && item) {
+		activate(run);
+		m_items[run] = std::move(item);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Play the tournament after a sequence of calls to unsafe_set.
+	/// Linear in the number of runs.
+	///////////////////////////////////////////////////////////////////////////
+	void make_safe() {
+		if (runs() == 0) return;
+		m_tree[0] = build(1);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether all runs are exhausted.
+	///////////////////////////////////////////////////////////////////////////
+	bool empty() const { return m_size == 0; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Number of runs that are not exhausted.
+	///////////////////////////////////////////////////////////////////////////
+	size_type size() const { return m_size; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Number of runs, exhausted or not.
+	///////////////////////////////////////////////////////////////////////////
+	size_type runs() const { return m_items.size(); }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief The smallest current item.
+	///////////////////////////////////////////////////////////////////////////
+	const T & top() const { return m_items[top_run()]; }
+
+	T & top() { return m_items[top_run()]; }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief The run holding the smallest current item.
+	///////////////////////////////////////////////////////////////////////////
+	size_type top_run() const {
+		tp_assert(!empty(), "top_run() on empty loser tree");
+		return m_tree[0];
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Replace the smallest item by the next item of its run.
+	///////////////////////////////////////////////////////////////////////////
+	void pop_and_push(const T & item) {
+		m_items[top_run()] = item;
+		replay(top_run());
+	}
+
+	void pop_and_push(T && item) {
+		m_items[top_run()] = std::move(item);
+		replay(top_run());
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Remove the smallest item and mark its run as exhausted.
+	///////////////////////////////////////////////////////////////////////////
+	void pop() {
+		size_type run = top_run();
+		m_active[run] = false;
+		m_items[run] = T();
+		--m_size;
+		replay(run);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \copybrief linear_memory_structure_doc::memory_coefficient()
+	/// \copydetails linear_memory_structure_doc::memory_coefficient()
+	///////////////////////////////////////////////////////////////////////////
+	static double memory_coefficient() {
+		return array<T>::memory_coefficient()
+			+ array<bool>::memory_coefficient()
+			+ array<size_type>::memory_coefficient();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \copybrief linear_memory_structure_doc::memory_overhead()
+	/// \copydetails linear_memory_structure_doc::memory_overhead()
+	///////////////////////////////////////////////////////////////////////////
+	static double memory_overhead() {
+		return sizeof(loser_tree)
+			+ array<T>::memory_overhead() - sizeof(array<T>)
+			+ array<bool>::memory_overhead() - sizeof(array<bool>)
+			+ array<size_type>::memory_overhead() - sizeof(array<size_type>);
+	}
+
+private:
+	void activate(size_type run) {
+		if (!m_active[run]) {
+			m_active[run] = true;
+			++m_size;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether the current item of run a is smaller than that of b.
+	///////////////////////////////////////////////////////////////////////////
+	bool less(size_type a, size_type b) {
+		if (!m_active[b]) return m_active[a];
+		if (!m_active[a]) return false;
+		return m_pred(m_items[a], m_items[b]);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Play the subtree rooted at the given node, storing the losers,
+	/// and return the winner.
+	///
+	/// The leaf of run i is node runs()+i, and node n has children 2n and
+	/// 2n+1, so the internal nodes are 1 to runs()-1 and m_tree[0] is free
+	/// to hold the overall winner.
+	///////////////////////////////////////////////////////////////////////////
+	size_type build(size_type node) {
+		if (node >= runs()) return node - runs();
+		size_type left = build(2*node);
+		size_type right = build(2*node+1);
+		if (less(right, left)) {
+			m_tree[node] = left;
+			return right;
+		}
+		m_tree[node] = right;
+		return left;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Replay the matches from the leaf of the winner to the root
+	/// after its item has changed.
+	///////////////////////////////////////////////////////////////////////////
+	void replay(size_type winner) {
+		for (size_type node = (runs() + winner) / 2; node > 0; node /= 2) {
+			if (less(m_tree[node], winner)) std::swap(m_tree[node], winner);
+		}
+		m_tree[0] = winner;
+	}
+
+	array<T> m_items;
+	array<bool> m_active;
+	array<size_type> m_tree;
+	size_type m_size;
+	pred_t m_pred;
+};
+
+} // namespace tpie
+
+#endif // __TPIE_LOSER_TREE_H__
@@ -0,0 +1,300 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet cino+=(0 :
+// Copyright 2013, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file parallel_radix_sort.h
+/// In-place MSD radix sort of items with unsigned integer keys, using the
+/// job manager for large buckets.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef __TPIE_PARALLEL_RADIX_SORT_H__
+#define __TPIE_PARALLEL_RADIX_SORT_H__
+
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <tpie/parallel_sort.h>
+#include <tpie/job.h>
+#include <tpie/config.h>
+
+namespace tpie {
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Comparator ordering items by a key extracted from them.
+///
+/// The key extractor follows the concept of tiny::bits::IdentityExtract and
+/// tiny::bits::PairExtract. When it returns an unsigned integer, sorters
+/// that use this comparator sort with radix sort.
+///////////////////////////////////////////////////////////////////////////////
+template <typename key_extract_t>
+class key_less {
+public:
+	key_less(key_extract_t extract = key_extract_t()) : m_extract(extract) {}
+
+	template <typename T>
+	bool operator()(const T & a, const T & b) const {
+		return m_extract(a) < m_extract(b);
+	}
+
+	const key_extract_t & extract() const { return m_extract; }
+
+private:
+	key_extract_t m_extract;
+};
+
+namespace bits {
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Maps items of type T to unsigned integer keys whose order is the
+/// order given by pred_t, if there is such a map.
+///
+/// value is true for integral types ordered by std::less or std::greater and
+/// for key_less with a key extractor returning an unsigned integer.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename pred_t, typename Enable = void>
+struct radix_key {
+	static const bool value = false;
+};
+
+template <typename T>
+struct radix_integral : std::integral_constant<bool,
+	std::is_integral<T>::value && !std::is_same<T, bool>::value> {};
+
+template <typename T>
+struct radix_key<T, std::less<T>, typename std::enable_if<radix_integral<T>::value>::type> {
+	static const bool value = true;
+	typedef typename std::make_unsigned<T>::type key_type;
+
+	radix_key(const std::less<T> &) {}
+
+	key_type operator()(const T & x) const {
+		// Flip the sign bit so that negative numbers come first.
+		const key_type signBit = std::is_signed<T>::value
+			? static_cast<key_type>(key_type(1) << (sizeof(key_type)*8-1)) : key_type(0);
+		return static_cast<key_type>(static_cast<key_type>(x) ^ signBit);
+	}
+};
+
+template <typename T>
+struct radix_key<T, std::greater<T>, typename std::enable_if<radix_integral<T>::value>::type> {
+	static const bool value = true;
+	typedef typename std::make_unsigned<T>::type key_type;
+
+	radix_key(const std::greater<T> &) {}
+
+	key_type operator()(const T & x) const {
+		return static_cast<key_type>(~radix_key<T, std::less<T> >(std::less<T>())(x));
+	}
+};
+
+template <typename T, typename key_extract_t>
+struct radix_extracted_key {
+	typedef typename std::decay<
+		decltype(std::declval<const key_extract_t &>()(std::declval<const T &>()))>::type type;
+};
+
+template <typename T, typename key_extract_t>
+struct radix_key<T, key_less<key_extract_t>,
+				 typename std::enable_if<
+					 std::is_unsigned<typename radix_extracted_key<T, key_extract_t>::type>::value
+					 && radix_integral<typename radix_extracted_key<T, key_extract_t>::type>::value
+				 >::type> {
+	static const bool value = true;
+	typedef typename radix_extracted_key<T, key_extract_t>::type key_type;
+
+	radix_key(const key_less<key_extract_t> & pred) : m_extract(pred.extract()) {}
+
+	key_type operator()(const T & x) const { return m_extract(x); }
+
+private:
+	key_extract_t m_extract;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Radix sort of [a,b) by the byte at the given shift and the bytes
+/// below it. Buckets of at least parallelSize items are sorted by child jobs
+/// of the given parent, if any.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename key_t>
+class radix_sort_job : public job {
+public:
+	static const size_t insertionSize = 64;
+	static const size_t parallelSize = 1 << 16;
+
+	radix_sort_job(T * a, T * b, key_t key, int shift)
+		: a(a), b(b), key(key), shift(shift) {
+	}
+
+	~radix_sort_job() {
+		for (size_t i = 0; i < children.size(); ++i) delete children[i];
+	}
+
+	virtual void operator()() override {
+		sort(a, b, shift, this);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sort [a,b); with a parent job, large buckets become its
+	/// children.
+	///////////////////////////////////////////////////////////////////////////
+	void sort(T * a, T * b, int shift, radix_sort_job * parent) {
+		while (true) {
+			const size_t n = b - a;
+			if (n < insertionSize) {
+				std::sort(a, b, key_order(key));
+				return;
+			}
+
+			size_t count[256] = {0};
+			for (T * i = a; i != b; ++i) ++count[digit(*i, shift)];
+
+			// Skip bytes that are equal in all keys.
+			if (count[digit(*a, shift)] == n) {
+				if (shift == 0) return;
+				shift -= 8;
+				continue;
+			}
+
+			size_t head[256];
+			size_t tail[256];
+			size_t sum = 0;
+			for (size_t d = 0; d < 256; ++d) {
+				head[d] = sum;
+				sum += count[d];
+				tail[d] = sum;
+			}
+
+			// American flag sort: cycle every item into its bucket.
+			for (size_t d = 0; d < 256; ++d) {
+				while (head[d] < tail[d]) {
+					T x = std::move(a[head[d]]);
+					size_t e = digit(x, shift);
+					while (e != d) {
+						std::swap(x, a[head[e]++]);
+						e = digit(x, shift);
+					}
+					a[head[d]++] = std::move(x);
+				}
+			}
+
+			if (shift == 0) return;
+			T * bucket = a;
+			for (size_t d = 0; d < 256; ++d) {
+				T * next = bucket + count[d];
+				if (parent && count[d] >= parallelSize) {
+					radix_sort_job * j = new radix_sort_job(bucket, next, key, shift - 8);
+					j->enqueue(parent);
+					parent->children.push_back(j);
+				} else if (count[d] > 1) {
+					sort(bucket, next, shift - 8, parent);
+				}
+				bucket = next;
+			}
+			return;
+		}
+	}
+
+private:
+	class key_order {
+	public:
+		key_order(const key_t & key) : key(key) {}
+		bool operator()(const T & x, const T & y) const { return key(x) < key(y); }
+	private:
+		const key_t & key;
+	};
+
+	size_t digit(const T & x, int shift) const {
+		return static_cast<size_t>((key(x) >> shift) & 0xff);
+	}
+
+	T * a;
+	T * b;
+	key_t key;
+	int shift;
+	std::vector<radix_sort_job *> children;
+};
+
+template <typename T, typename pred_t>
+void radix_or_parallel_sort(T * a, T * b, pred_t pred, std::false_type) {
+	parallel_sort(a, b, pred);
+}
+
+template <typename T, typename pred_t>
+void radix_or_parallel_sort(T * a, T * b, pred_t pred, std::true_type);
+
+} // namespace bits
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Sort the items in [a,b) by unsigned integer keys with an in-place
+/// MSD radix sort in the calling thread. The sort is not stable.
+/// \param key Function object returning the key of an item, with the key
+/// type as key_type; see bits::radix_key.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename key_t>
+void radix_sort(T * a, T * b, key_t key) {
+	const int shift = static_cast<int>(sizeof(typename key_t::key_type)*8) - 8;
+	bits::radix_sort_job<T, key_t>(a, b, key, shift).sort(a, b, shift, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Sort the items in [a,b) like radix_sort, sorting large buckets in
+/// parallel by the job manager.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename key_t>
+void parallel_radix_sort(T * a, T * b, key_t key) {
+#ifdef TPIE_PARALLEL_SORT
+	typedef bits::radix_sort_job<T, key_t> job_t;
+	const int shift = static_cast<int>(sizeof(typename key_t::key_type)*8) - 8;
+	if (static_cast<size_t>(b - a) >= job_t::parallelSize) {
+		job_t * master = new job_t(a, b, key, shift);
+		master->enqueue();
+		master->join();
+		delete master;
+		return;
+	}
+#endif
+	radix_sort(a, b, key);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Sort the items in [a,b) by pred. The sort is a parallel radix sort
+/// when pred orders the items by an unsigned integer key (see
+/// bits::radix_key), and parallel_sort otherwise. The choice is made at
+/// compile time.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename pred_t>
+void radix_or_parallel_sort(T * a, T * b, pred_t pred) {
+	bits::radix_or_parallel_sort(a, b, pred,
+		std::integral_constant<bool, bits::radix_key<T, pred_t>::value>());
+}
+
+namespace bits {
+
+template <typename T, typename pred_t>
+void radix_or_parallel_sort(T * a, T * b, pred_t pred, std::true_type) {
+	parallel_radix_sort(a, b, radix_key<T, pred_t>(pred));
+}
+
+} // namespace bits
+
+} // namespace tpie
+
+#endif // __TPIE_PARALLEL_RADIX_SORT_H__
@@ -0,0 +1,39 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet cino+=(0 :
+// Copyright 2013, The TPIE development team
+// 
+// This file is part of TPIE.
+// 
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+// 
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+#include <tpie/parallel_sort.h>
+#include <atomic>
+
+namespace tpie {
+
+namespace {
+
+std::atomic<int> the_parallel_sort_algorithm(parallel_quick_sort);
+
+} // unnamed namespace
+
+void set_parallel_sort_algorithm(parallel_sort_algorithm algorithm) {
+	the_parallel_sort_algorithm = algorithm;
+}
+
+parallel_sort_algorithm get_parallel_sort_algorithm() {
+	return static_cast<parallel_sort_algorithm>(the_parallel_sort_algorithm.load());
+}
+
+} // namespace tpie
@@ -19,7 +19,8 @@
 
 ///////////////////////////////////////////////////////////////////////////////
 /// \file parallel_sort.h
-/// Simple parallel quick sort implementation with progress tracking.
+/// Simple parallel quick sort and sample sort implementation with progress
+/// tracking.
 ///////////////////////////////////////////////////////////////////////////////
 
 #ifndef __TPIE_PARALLEL_SORT_H__
@@ -31,14 +32,43 @@
 #include <mutex>
 #include <cmath>
 #include <functional>
+#include <random>
+#include <vector>
 #include <tpie/progress_indicator_base.h>
 #include <tpie/dummy_progress.h>
 #include <tpie/internal_queue.h>
+#include <tpie/array.h>
 #include <tpie/job.h>
+#include <tpie/tpie_assert.h>
+#include <tpie/util.h>
 #include <tpie/config.h>
 
 namespace tpie {
 
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Algorithms that parallel_sort can use for large inputs.
+///////////////////////////////////////////////////////////////////////////////
+enum parallel_sort_algorithm {
+	/** Recursive quick sort. The first partition is done by a single
+	 * thread. */
+	parallel_quick_sort,
+	/** Sample sort. The input is distributed into buckets in blocks by all
+	 * threads, and the buckets are sorted by quick sort in parallel. Uses
+	 * a few blocks of extra memory per bucket and thread. */
+	parallel_sample_sort
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Set the algorithm that parallel_sort uses from now on.
+///////////////////////////////////////////////////////////////////////////////
+void set_parallel_sort_algorithm(parallel_sort_algorithm algorithm);
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief The algorithm that parallel_sort uses. The default is
+/// parallel_quick_sort.
+///////////////////////////////////////////////////////////////////////////////
+parallel_sort_algorithm get_parallel_sort_algorithm();
+
 ///////////////////////////////////////////////////////////////////////////////
 /// \brief A simple parallel sort implementation with progress tracking.
 /// The partition step is sequential, as a parallel partition only speeds up
@@ -46,6 +76,10 @@ namespace tpie {
 /// Uses the TPIE job manager to transparently distribute work across the
 /// machine cores.
 /// Uses the pseudo median of nine as pivot.
+///
+/// With the parallel_sample_sort algorithm, the input is first distributed
+/// into buckets by splitters sampled from it, and the buckets are then
+/// quick sorted in parallel. See sample_sort().
 ///////////////////////////////////////////////////////////////////////////////
 template <typename iterator_type, typename comp_type, bool Progress,
 		  size_t min_size=1024*1024*8/sizeof(typename boost::iterator_value<iterator_type>::type)>
@@ -174,7 +208,7 @@ public:
 		///////////////////////////////////////////////////////////////////////
 		/// \brief Construct a qsort_job.
 		///////////////////////////////////////////////////////////////////////
-		qsort_job(iterator_type a, iterator_type b, comp_type comp, qsort_job * parent, progress_t & p)
+		qsort_job(iterator_type a, iterator_type b, comp_type comp, job * parent, progress_t & p)
 			: a(a), b(b), comp(comp), parent(parent), progress(p) {
 
 			// Does nothing.
@@ -224,7 +258,7 @@ public:
 		iterator_type a;
 		iterator_type b;
 		comp_type comp;
-		qsort_job * parent;
+		job * parent;
 		progress_t & progress;
 
 		std::vector<qsort_job *> children;
@@ -235,6 +269,253 @@ public:
 			progress.cond.notify_one();
 		}
 	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sample sort: the number of items moved as a unit.
+	///////////////////////////////////////////////////////////////////////////
+	static const size_t block_items = (2048 + sizeof(value_type) - 1) / sizeof(value_type);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sample sort: the maximum number of splitters.
+	///////////////////////////////////////////////////////////////////////////
+	static const size_t max_splitters = 127;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sample sort: maps items to buckets by sorted, distinct
+	/// splitters. Bucket 2i holds the items between splitter i-1 and i, and
+	/// bucket 2i+1 holds the items equal to splitter i, which need no
+	/// further sorting.
+	///////////////////////////////////////////////////////////////////////////
+	class classifier {
+	public:
+		classifier(const std::vector<value_type> & splitters, comp_type comp)
+			: splitters(splitters), comp(comp) {
+		}
+
+		size_t buckets() const { return 2*splitters.size()+1; }
+
+		size_t operator()(const value_type & x) {
+			size_t i = std::upper_bound(splitters.begin(), splitters.end(), x, comp) - splitters.begin();
+			if (i > 0 && !comp(splitters[i-1], x)) return 2*i-1;
+			return 2*i;
+		}
+
+	private:
+		const std::vector<value_type> & splitters;
+		comp_type comp;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sample sort: classifies one stripe of the input.
+	///
+	/// Items are collected in a buffer block per bucket. Full blocks are
+	/// written back to the front of the stripe, where the items have already
+	/// been read, so the stripe ends up as full blocks followed by free
+	/// space. The partial blocks stay in the buffer.
+	///////////////////////////////////////////////////////////////////////////
+	class classify_job : public job {
+	public:
+		classify_job(iterator_type a, iterator_type b, const classifier & c)
+			: a(a), b(b), write(a), classify(c)
+			, counts(c.buckets(), 0), fill(c.buckets(), 0)
+			, buffer(c.buckets()*block_items) {
+		}
+
+		virtual void operator()() override {
+			for (iterator_type i = a; i != b; ++i) {
+				size_t c = classify(*i);
+				++counts[c];
+				buffer[c*block_items + fill[c]] = std::move(*i);
+				if (++fill[c] == block_items) {
+					std::move(buffer.begin() + c*block_items, buffer.begin() + (c+1)*block_items, write);
+					write += block_items;
+					fill[c] = 0;
+				}
+			}
+		}
+
+		iterator_type a;
+		iterator_type b;
+		/** End of the full blocks at the front of the stripe. */
+		iterator_type write;
+		classifier classify;
+		/** Items of each bucket in the stripe. */
+		std::vector<size_t> counts;
+		/** Items of each bucket in the buffer. */
+		std::vector<size_t> fill;
+		array<value_type> buffer;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sample sort: sorts the buckets after the distribution.
+	///////////////////////////////////////////////////////////////////////////
+	class bucket_job : public job {
+	public:
+		bucket_job(iterator_type a, std::vector<size_t> bounds, comp_type comp, progress_t & p)
+			: a(a), bounds(bounds), comp(comp), progress(p) {
+		}
+
+		~bucket_job() {
+			for (size_t i = 0; i < children.size(); ++i) {
+				delete children[i];
+			}
+		}
+
+		virtual void operator()() override {
+			// Only the even buckets need sorting; see classifier.
+			for (size_t c = 0; c + 1 < bounds.size(); c += 2) {
+				iterator_type lo = a + bounds[c];
+				iterator_type hi = a + bounds[c+1];
+				if (static_cast<size_t>(hi - lo) >= min_size) {
+					qsort_job * j = new qsort_job(lo, hi, comp, this, progress);
+					j->enqueue(this);
+					children.push_back(j);
+				} else {
+					std::sort(lo, hi, comp);
+				}
+			}
+		}
+
+	protected:
+		virtual void on_done() override {
+			std::lock_guard<std::mutex> lock(progress.mutex);
+			progress.work_estimate = progress.total_work_estimate;
+			progress.cond.notify_one();
+		}
+
+	private:
+		iterator_type a;
+		std::vector<size_t> bounds;
+		comp_type comp;
+		progress_t & progress;
+		std::vector<qsort_job *> children;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sample sort: distribute [a,b) into buckets and return the job
+	/// that sorts the buckets.
+	///
+	/// The input is split into one stripe per job thread, and the stripes
+	/// are classified in parallel (see classify_job). The full blocks are
+	/// then moved to the block aligned region of their bucket, following
+	/// cycles of blocks, and finally the parts of the buckets that are not
+	/// block aligned are filled from the partial blocks.
+	///////////////////////////////////////////////////////////////////////////
+	job * sample_sort(iterator_type a, iterator_type b, comp_type comp) {
+		const size_t n = b - a;
+		const size_t B = block_items;
+
+		// Pick distinct splitters from a sorted random sample.
+		const size_t oversampling = 16;
+		size_t splitterCount = std::max(size_t(1), std::min(static_cast<size_t>(max_splitters), n / (4*B)));
+		std::vector<value_type> sample(std::min(n, oversampling*(splitterCount+1)));
+		std::mt19937 prng(42);
+		for (size_t i = 0; i < sample.size(); ++i) sample[i] = a[prng() % n];
+		std::sort(sample.begin(), sample.end(), comp);
+		std::vector<value_type> splitters;
+		for (size_t i = 1; i <= splitterCount; ++i) {
+			const value_type & x = sample[i*sample.size()/(splitterCount+1)];
+			if (splitters.empty() || comp(splitters.back(), x)) splitters.push_back(x);
+		}
+		classifier classify(splitters, comp);
+		const size_t buckets = classify.buckets();
+
+		// Classify the stripes in parallel.
+		size_t threads = std::max(size_t(1), std::min(static_cast<size_t>(default_worker_count()), (n + B - 1) / B));
+		const size_t stripeLength = ((n + threads - 1) / threads + B - 1) / B * B;
+		std::vector<classify_job *> stripes;
+		for (size_t i = 0; i * stripeLength < n; ++i) {
+			iterator_type lo = a + i * stripeLength;
+			iterator_type hi = a + std::min(n, (i+1) * stripeLength);
+			stripes.push_back(new classify_job(lo, hi, classify));
+		}
+		for (size_t i = 0; i < stripes.size(); ++i) stripes[i]->enqueue();
+		for (size_t i = 0; i < stripes.size(); ++i) stripes[i]->join();
+
+		// bounds[c] is the first item of bucket c, and first[c] is the first
+		// block that begins in bucket c.
+		std::vector<size_t> bounds(buckets+1, 0);
+		for (size_t c = 0; c < buckets; ++c) {
+			bounds[c+1] = bounds[c];
+			for (size_t i = 0; i < stripes.size(); ++i) bounds[c+1] += stripes[i]->counts[c];
+		}
+		const size_t blocks = (n + B - 1) / B;
+		std::vector<size_t> first(buckets);
+		std::vector<size_t> next(buckets);
+		for (size_t c = 0; c < buckets; ++c) next[c] = first[c] = (bounds[c] + B - 1) / B;
+
+		// Move the full blocks to their bucket. A block that would end past
+		// the input goes to the overflow buffer.
+		enum { free_block, unplaced_block, placed_block };
+		std::vector<char> state(blocks, free_block);
+		for (size_t i = 0; i < stripes.size(); ++i)
+			for (size_t j = (stripes[i]->a - a) / B; j < static_cast<size_t>(stripes[i]->write - a) / B; ++j)
+				state[j] = unplaced_block;
+		array<value_type> block(B);
+		array<value_type> overflow(0);
+		size_t overflowBucket = buckets;
+		for (size_t i = 0; i < blocks; ++i) {
+			if (state[i] != unplaced_block) continue;
+			std::move(a + i*B, a + (i+1)*B, block.begin());
+			state[i] = free_block;
+			while (true) {
+				size_t c = classify(block[0]);
+				size_t j = next[c]++;
+				if ((j+1)*B > n) {
+					overflow.resize(B);
+					std::move(block.begin(), block.end(), overflow.begin());
+					overflowBucket = c;
+					break;
+				}
+				if (state[j] == unplaced_block) {
+					std::swap_ranges(a + j*B, a + (j+1)*B, block.begin());
+					state[j] = placed_block;
+					continue;
+				}
+				std::move(block.begin(), block.end(), a + j*B);
+				state[j] = placed_block;
+				break;
+			}
+		}
+
+		// Fill the rest of each bucket from the items of its last block that
+		// spill into the next bucket, the partial blocks and the overflow.
+		for (size_t c = 0; c < buckets; ++c) {
+			size_t fullEnd = (c == overflowBucket ? next[c] - 1 : next[c]) * B;
+			size_t begin = bounds[c];
+			size_t end = bounds[c+1];
+			size_t headEnd = std::min(first[c] * B, end);
+			size_t tail = std::max(fullEnd, headEnd);
+			size_t out = begin;
+			size_t written = 0;
+			// Write to the head and then the tail, skipping the full blocks.
+			auto put = [&](value_type & x) {
+				if (out == headEnd) out = tail;
+				a[out++] = std::move(x);
+				++written;
+			};
+			for (size_t k = std::max(end, first[c] * B); k < fullEnd; ++k)
+				put(a[k]);
+			for (size_t i = 0; i < stripes.size(); ++i)
+				for (size_t k = 0; k < stripes[i]->fill[c]; ++k)
+					put(stripes[i]->buffer[c*B + k]);
+			if (c == overflowBucket)
+				for (size_t k = 0; k < B; ++k)
+					put(overflow[k]);
+			tp_assert(written == (headEnd - begin) + (end > tail ? end - tail : 0), "Sample sort lost items");
+			unused(written);
+		}
+
+		for (size_t i = 0; i < stripes.size(); ++i) delete stripes[i];
+
+		std::uint64_t bucketWork = 0;
+		for (size_t c = 0; c < buckets; c += 2) bucketWork += sortWork(bounds[c+1] - bounds[c]);
+		{
+			std::lock_guard<std::mutex> lock(progress.mutex);
+			progress.work_estimate += progress.total_work_estimate - std::min(bucketWork, progress.total_work_estimate);
+		}
+		return new bucket_job(a, bounds, comp, progress);
+	}
 public:
 	parallel_sort_impl(typename P::base * p) {
 		progress.pi = p;
@@ -256,7 +537,11 @@ public:
 			return;
 		}
 
-		qsort_job * master = new qsort_job(a, b, comp, 0, progress);
+		job * master;
+		if (get_parallel_sort_algorithm() == parallel_sample_sort)
+			master = sample_sort(a, b, comp);
+		else
+			master = new qsort_job(a, b, comp, 0, progress);
 		master->enqueue();
 
 		std::uint64_t prev_work_estimate = 0;
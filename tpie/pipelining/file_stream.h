@@ -258,6 +258,11 @@ public:
 		set_minimum_memory(fs.memory_usage());
 	}
 
+	virtual void propagate() override {
+		if (can_fetch("items"))
+			fs.reserve(fs.offset() + fetch<stream_size_type>("items"));
+	}
+
 	void push(const T & item) {
 		fs.write(item);
 	}
@@ -275,14 +280,20 @@ class named_output_t : public node {
 public:
 	typedef T item_type;
 
-	named_output_t(const std::string & path): path(path) {
+	named_output_t(const std::string & path): path(path), items(0) {
 		set_name("Write", PRIORITY_INSIGNIFICANT);
 		set_minimum_memory(file_stream<T>::memory_usage());
 	}
 
+	virtual void propagate() override {
+		if (can_fetch("items"))
+			items = fetch<stream_size_type>("items");
+	}
+
 	void begin() override {
 		fs.construct();
 		fs->open(path, access_write);
+		if (items > 0) fs->reserve(items);
 	}
 	
 	void push(const T & item) {
@@ -296,6 +307,7 @@ public:
 private:
 	maybe<file_stream<T> > fs;
 	std::string path;
+	stream_size_type items;
 };
 
 
@@ -61,7 +61,8 @@ void run_positions::close() {
 }
 
 void run_positions::evacuate() {
-	if (m_evacuated) return;
+	// Nothing to evacuate once closed, e.g. by a partitioned final merge.
+	if (!m_open || m_evacuated) return;
 	m_evacuated = true;
 	if (m_final) {
 		log_debug() << "run_positions::evacuate while final" << std::endl;
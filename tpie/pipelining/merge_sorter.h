@@ -23,11 +23,17 @@
 #include <tpie/compressed/stream.h>
 #include <tpie/pipelining/sort_parameters.h>
 #include <tpie/pipelining/merger.h>
+#include <tpie/combine.h>
 #include <tpie/pipelining/node.h>
 #include <tpie/pipelining/exception.h>
 #include <tpie/dummy_progress.h>
 #include <tpie/array_view.h>
 #include <tpie/parallel_sort.h>
+#include <tpie/parallel_radix_sort.h>
+#include <tpie/job.h>
+#include <algorithm>
+#include <exception>
+#include <vector>
 
 namespace tpie {
 
@@ -145,8 +151,21 @@ private:
 /// of a single run, we are in "report internal" mode, meaning we do not write
 /// anything to disk. This causes phase 2 to be a no-op and phase 3 to be a
 /// simple array traversal.
+///
+/// With a combine function other than no_combine (see combine.h), items that
+/// are equal by the predicate are combined into one when a run is formed and
+/// in every merge, and a single item is reported for every key. Runs then
+/// have arbitrary lengths, which are recorded for the two merge levels in use.
+///
+/// With a limit (see set_limit), only the given number of smallest items are
+/// kept and reported, and the run ends are recorded in the same way.
+///
+/// In distribution mode (see set_distribution), phase 1 distributes the items
+/// into buckets instead of runs, phase 2 is a no-op, and phase 3 sorts one
+/// bucket at a time.
 ///////////////////////////////////////////////////////////////////////////////
-template <typename T, bool UseProgress, typename pred_t = std::less<T>, typename store_t=default_store>
+template <typename T, bool UseProgress, typename pred_t = std::less<T>, typename store_t=default_store,
+		  typename combine_t = no_combine>
 class merge_sorter {
 private:
 	typedef typename store_t::template element_type<T>::type TT;
@@ -155,7 +174,11 @@ private:
 	typedef typename specific_store_t::store_type store_type;
 	typedef typename specific_store_t::element_type element_type;	//Should be the same as TT
 	typedef outer_type item_type;
+	typedef merger<specific_store_t, pred_t, combine_t> merger_type;
+	typedef bits::store_combine<combine_t, specific_store_t> store_combine_t;
+	typedef merge_sorter<T, false, pred_t, store_t, combine_t> bucket_sorter_t;
 	static const size_t item_size = specific_store_t::item_size;
+	static const bool combining = bits::is_combining<combine_t>::value;
 public:
 
 	typedef std::shared_ptr<merge_sorter> ptr;
@@ -168,22 +191,45 @@ public:
 	static const memory_size_type maximumFilesPhase2 = std::numeric_limits<memory_size_type>::max();
 	static const memory_size_type minimumFilesPhase3 = 5;
 	static const memory_size_type maximumFilesPhase3 = std::numeric_limits<memory_size_type>::max();
+	static const memory_size_type runBoundSamples = 16; // Items sampled from each run with a limit
+	static const memory_size_type minimumBucketSamples = 16; // Sampled items per bucket in distribution mode
+	static const memory_size_type sampleFraction = 16; // At most one in this many items of the run buffer is a sample in distribution mode
 
-	inline merge_sorter(pred_t pred = pred_t(), store_t store = store_t())
+	inline merge_sorter(pred_t pred = pred_t(), store_t store = store_t(), combine_t combine = combine_t())
 		: m_bucketPtr(new memory_bucket())
  		, m_bucket(memory_bucket_ref(m_bucketPtr.get()))
 		, m_state(stNotStarted)
 		, p()
 		, m_parametersSet(false)
+		, m_sorterStore(store)
 		, m_store(store.template get_specific<element_type>())
-		, m_merger(pred, m_store, m_bucket)
+		, m_merger(pred, m_store, m_bucket, combine)
 		, m_currentRunItems(m_bucket)
+		, m_runEnds(allocator<stream_size_type>(m_bucket))
+		, m_runEndsLevel(0)
+		, m_mergedRunEnds(allocator<stream_size_type>(m_bucket))
+		, m_heapSize(0)
+		, m_spareRunItems(m_bucket)
 		, m_maxItems(std::numeric_limits<stream_size_type>::max())
+		, m_limit(std::numeric_limits<stream_size_type>::max())
+		, m_hasThreshold(false)
+		, m_runBounds(allocator<std::pair<element_type, stream_size_type> >(m_bucket))
+		, m_givenSamples(false)
 		, pred(pred)
+		, m_combine(combine)
 		, m_evacuated(false)
 		, m_finalMergeInitialized(false)
+		, m_partitionsMerged(false)
+		, m_partitionStreaming(false)
 		, m_owning_node(nullptr)
 		{}
+
+	inline ~merge_sorter() {
+		// Do not let a run job outlive the buffers it works on.
+		if (m_runJob.get() != 0) m_runJob->join();
+		for (memory_size_type j = 0; j < m_partitionJobs.size(); ++j)
+			if (m_partitionJobs[j].get() != 0) m_partitionJobs[j]->join();
+	}
 	
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief  Enable setting run length and fanout manually (for testing
@@ -193,6 +239,8 @@ public:
 		tp_assert(m_state == stNotStarted, "Merge sorting already begun");
 		p.runLength = p.internalReportThreshold = runLength;
 		p.fanout = p.finalFanout = fanout;
+		p.distributionBuckets = 2*fanout;
+		p.distributionSamples = distribution_samples(p.distributionBuckets, runLength);
 		m_parametersSet = true;
 		log_debug() << "Manually set merge sort run length and fanout\n";
 		log_debug() << "Run length =       " << p.runLength << " (uses memory " << (p.runLength*item_size + file_stream<element_type>::memory_usage()) << ")\n";
@@ -282,6 +330,123 @@ public:
 		check_not_started();
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Run up to the given number of merges of a merge level in phase
+	/// 2 concurrently on the job manager.
+	///
+	/// The phase 2 memory and files are split between the concurrent merges,
+	/// so the fanout is smaller than when merging one run at a time.
+	///////////////////////////////////////////////////////////////////////////
+	inline void set_merge_threads(memory_size_type threads) {
+		p.mergeThreads = threads;
+		check_not_started();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Split the final merge into the given number of key ranges and
+	/// merge them concurrently on the job manager.
+	///
+	/// Splitters are sampled from the final runs, and every run is
+	/// partitioned by binary searches on its run file. The first key range
+	/// is reported as it is merged, while the others are merged into files
+	/// of their own, which are reported in order afterwards. The phase 3
+	/// memory and files are split between the concurrent merges, so the
+	/// final fanout is smaller than with a single merge.
+	///////////////////////////////////////////////////////////////////////////
+	inline void set_final_merge_threads(memory_size_type threads) {
+		p.finalMergeThreads = threads;
+		check_not_started();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Form runs by replacement selection instead of sorting a full
+	/// buffer at a time.
+	///
+	/// Once the buffer is full, it is kept as a heap, and every pushed item
+	/// replaces the smallest item, which is written to the current run. A
+	/// pushed item that is smaller than the last item written is held back
+	/// for the next run. On random input the runs are about twice as long as
+	/// the buffer, and input that is nearly sorted becomes a single run.
+	///////////////////////////////////////////////////////////////////////////
+	inline void set_replacement_selection(bool enabled) {
+		p.replacementSelection = enabled;
+		check_not_started();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sort and write each full run in a background job while the
+	/// next run is filled, so that push() does not wait for the sort.
+	///
+	/// The phase 1 memory is split between two run buffers, so runs are half
+	/// as long. The run jobs sort in a single thread. Replacement selection
+	/// takes precedence over this.
+	///////////////////////////////////////////////////////////////////////////
+	inline void set_double_buffering(bool enabled) {
+		p.doubleBuffering = enabled;
+		check_not_started();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sort by distribution instead of merging, for keys that are
+	/// roughly uniform.
+	///
+	/// Splitters are sampled from the first full run buffer, and every full
+	/// buffer is sorted and appended to the buckets between the splitters,
+	/// one temporary file each, whose streams are held open in phase 1. In
+	/// phase 3 the buckets are read, sorted with parallel_sort and reported
+	/// one at a time, so every item is written and read once. There are
+	/// enough buckets for the upper bound given to set_items to fill half of
+	/// the phase 3 memory each, or twice the fanout buckets without one, but
+	/// no more than the phase 1 files and half of the phase 1 memory allow
+	/// streams for. Unless set_available_files says otherwise, phase 1 may
+	/// use defaultFiles files in this mode. An evenly spread sample of the
+	/// pushed items is kept, with enough items to split every bucket into
+	/// as many buckets again, in at most a sixteenth of the run buffer. A
+	/// bucket that does not fit in memory is distributed again by the
+	/// splitters sampled from it, or merge sorted on its own if there are
+	/// too few samples or its buckets would not fit in memory either.
+	/// Replacement selection and double buffering are not used in this mode.
+	///////////////////////////////////////////////////////////////////////////
+	inline void set_distribution(bool enabled) {
+		p.distribution = enabled;
+		check_not_started();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Distribution sort: choose the splitters from the given sorted
+	/// sample of the items rather than from the first run buffer.
+	///
+	/// The given sample replaces the one taken of the pushed items, so a
+	/// bucket that does not fit in memory is merge sorted. If the upper bound
+	/// given to set_items is too large for buckets that fit in memory, the
+	/// items are merge sorted rather than distributed.
+	///////////////////////////////////////////////////////////////////////////
+	inline void set_splitter_samples(const element_type * a, const element_type * b) {
+		check_not_started();
+		m_samples.resize(static_cast<size_t>(b - a));
+		std::copy(a, b, m_samples.get());
+		m_sampleCount = m_samples.size();
+		m_givenSamples = true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Keep only the k smallest items, and report them in order.
+	///
+	/// Runs are cut off after k items, and merges stop after k items. Once k
+	/// items are known to be at most some item, pushed items greater than it
+	/// are discarded right away; such an item is found from the run buffer
+	/// and from samples of the written runs, except for runs written by
+	/// replacement selection or a run job. When k items fit in half of the
+	/// run buffer, nothing is written to disk: the buffer is cut down to k
+	/// items every time it fills. Items that are equal to the k'th smallest
+	/// item are reported in no particular order.
+	///////////////////////////////////////////////////////////////////////////
+	inline void set_limit(stream_size_type k) {
+		check_not_started();
+		m_limit = k;
+		log_debug() << "Merge sorter keeps the " << k << " smallest items" << std::endl;
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Initiate phase 1: Formation of input runs.
 	///////////////////////////////////////////////////////////////////////////
@@ -294,6 +459,29 @@ public:
 		m_runFiles.resize(p.fanout*2);
 		m_currentRunItemCount = 0;
 		m_finishedRuns = 0;
+		m_runEnds.clear();
+		m_runEndsLevel = 0;
+		m_mergedRunEnds.clear();
+		m_hasThreshold = false;
+		m_runBounds.clear();
+		m_itemsReported = 0;
+		m_splitters.resize(0);
+		m_bucketSizes.resize(0);
+		m_bucketIndex = 0;
+		m_bucketPulled = 0;
+		m_bucketLoaded = false;
+		if (!m_givenSamples) {
+			m_samples.resize(p.distribution ? p.distributionSamples : 0);
+			m_sampleCount = 0;
+		}
+		m_sampleStride = 1;
+		m_sampleSkip = 0;
+		if (replacement_selection() || double_buffering())
+			m_runStream.reset(tpie_new<file_stream<element_type> >());
+		if (double_buffering()) {
+			m_spareRunItems = array<store_type>(0, allocator<store_type>(m_bucket));
+			m_spareRunItems.resize((size_t)p.runLength);
+		}
 		m_state = stRunFormation;
 		m_itemCount = 0;
 	}
@@ -302,25 +490,11 @@ public:
 	/// \brief Push item to merge sorter during phase 1.
 	///////////////////////////////////////////////////////////////////////////
 	inline void push(item_type && item) {
-		tp_assert(m_state == stRunFormation, "Wrong phase");
-		if (m_currentRunItemCount >= p.runLength) {
-			sort_current_run();
-			empty_current_run();
-		}
-		m_currentRunItems[m_currentRunItemCount] = m_store.outer_to_store(std::move(item));
-		++m_currentRunItemCount;
-		++m_itemCount;
+		push_store(m_store.outer_to_store(std::move(item)));
 	}
-	
+
 	inline void push(const item_type & item) {
-		tp_assert(m_state == stRunFormation, "Wrong phase");
-		if (m_currentRunItemCount >= p.runLength) {
-			sort_current_run();
-			empty_current_run();
-		}
-		m_currentRunItems[m_currentRunItemCount] = m_store.outer_to_store(item);
-		++m_currentRunItemCount;
-		++m_itemCount;
+		push_store(m_store.outer_to_store(item));
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -328,6 +502,14 @@ public:
 	///////////////////////////////////////////////////////////////////////////
 	inline void end() {
 		tp_assert(m_state == stRunFormation, "Wrong phase");
+		if (double_buffering()) {
+			finish_run_job();
+			m_spareRunItems.resize(0);
+		}
+		if (m_runStream.get() != 0) {
+			if (m_runStream->is_open()) finish_replacement_run();
+			m_runStream.reset();
+		}
 		sort_current_run();
 
 		if (m_itemCount == 0) {
@@ -361,16 +543,26 @@ public:
 
 		} else {
 			m_reportInternal = false;
-			empty_current_run();
+			if (m_currentRunItemCount > 0) empty_current_run();
 			m_currentRunItems.resize(0);
-			log_debug() << "Got " << m_finishedRuns << " runs. External reporting mode." << std::endl;
+			if (p.distribution) {
+				log_debug() << "Got " << m_bucketSizes.size() << " buckets. Distribution reporting mode." << std::endl;
+				if (!m_givenSamples) std::sort(m_samples.get(), m_samples.get() + m_sampleCount, pred);
+			} else {
+				log_debug() << "Got " << m_finishedRuns << " runs. External reporting mode." << std::endl;
+			}
 		}
+		m_bucketStreams.resize(0);
+		// The sample is not needed when reporting internally.
+		if (m_reportInternal && !m_givenSamples) m_samples.resize(0);
+		m_runBounds.clear();
+		m_runBounds.shrink_to_fit();
 		m_state = stMerge;
 	}
 
 	inline bool is_calc_free() const {
 		tp_assert(m_state == stMerge, "Wrong phase");
-		return m_reportInternal || m_finishedRuns <= p.fanout;
+		return m_reportInternal || p.distribution || m_finishedRuns <= p.fanout;
 	}
 	
 	///////////////////////////////////////////////////////////////////////////
@@ -379,7 +571,7 @@ public:
 	///////////////////////////////////////////////////////////////////////////
 	inline void calc(typename Progress::base & pi) {
 		tp_assert(m_state == stMerge, "Wrong phase");
-		if (!m_reportInternal) {
+		if (!m_reportInternal && !p.distribution) {
 			prepare_pull(pi);
 		} else {
 			pi.init(1);
@@ -397,14 +589,27 @@ public:
 			memory_size_type runCount = (m_currentRunItemCount > 0) ? 1 : 0;
 			empty_current_run();
 			m_currentRunItems.resize(0);
-			initialize_final_merger(0, runCount);
+			m_bucketStreams.resize(0);
+			if (!p.distribution) initialize_final_merger(0, runCount);
+		} else if (p.distribution) {
+			log_debug() << "Evacuate merge_sorter (" << this << ") in distribution reporting mode" << std::endl;
+			// The current bucket is sorted again when it is reloaded.
+			m_currentRunItems.resize(0);
+			m_bucketSorter.reset();
+			m_bucketLoaded = false;
+			return;
 		} else if (m_state == stMerge) {
 			log_debug() << "Evacuate merge_sorter (" << this << ") before merge in external reporting mode (noop)" << std::endl;
 			m_runPositions.evacuate();
 			return;
 		}
 		log_debug() << "Evacuate merge_sorter (" << this << ") before reporting in external reporting mode" << std::endl;
+		if (m_partitionStreaming) evacuate_first_partition();
 		m_merger.reset();
+		if (m_partitionStream.get() != 0 && m_partitionStream->is_open()) {
+			m_partitionPosition = m_partitionStream->get_position();
+			m_partitionStream->close();
+		}
 		m_evacuated = true;
 		m_runPositions.evacuate();
 	}
@@ -422,23 +627,464 @@ private:
 	// Phase 1 helpers.
 	///////////////////////////////////////////////////////////////////////////
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Add an item in its store representation to the current run.
+	///////////////////////////////////////////////////////////////////////////
+	inline void push_store(store_type && s) {
+		tp_assert(m_state == stRunFormation, "Wrong phase");
+		++m_itemCount;
+		if (limited() && beyond_limit(s)) {
+			m_store.store_to_element(std::move(s));
+			return;
+		}
+		if (m_currentRunItemCount >= p.runLength) {
+			if (replacement_selection()) {
+				replace_smallest(std::move(s));
+				return;
+			}
+			if (double_buffering()) {
+				start_run_job();
+			} else {
+				sort_current_run();
+				// Combining or limited: aggregate in memory while the items
+				// left fill at most half of the buffer.
+				if (!run_ends_recorded() || m_currentRunItemCount > p.runLength / 2)
+					empty_current_run();
+			}
+		}
+		m_currentRunItems[m_currentRunItemCount] = std::move(s);
+		++m_currentRunItemCount;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sort the current run, combine its equal items and cut it down
+	/// to the limit. Plain stores of items ordered by an unsigned integer key
+	/// (see bits::radix_key) are radix sorted; everything else goes through
+	/// parallel_sort.
+	///////////////////////////////////////////////////////////////////////////
 	inline void sort_current_run() {
-		parallel_sort(m_currentRunItems.begin(), m_currentRunItems.begin()+m_currentRunItemCount, 
-					  bits::store_pred<pred_t, specific_store_t>(pred));
+		store_type * a = m_currentRunItems.get();
+		m_currentRunItemCount = sort_run(a, a + m_currentRunItemCount, true);
+		if (limited() && m_currentRunItemCount > 0 && m_currentRunItemCount >= m_limit)
+			lower_threshold(a[m_currentRunItemCount-1]);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sort the items in [a,b), combine equal items and keep at most
+	/// m_limit items. Without combining, the smallest items are selected
+	/// before they are sorted, so the rest of the range is never sorted.
+	/// \returns The number of items left in the front of the range.
+	///////////////////////////////////////////////////////////////////////////
+	inline memory_size_type sort_run(store_type * a, store_type * b, bool parallel) {
+		memory_size_type items = b - a;
+		if (!combining && items > m_limit) {
+			std::nth_element(a, a + m_limit, b, bits::store_pred<pred_t, specific_store_t>(pred));
+			items = static_cast<memory_size_type>(m_limit);
+			sort_items(a, a + items, parallel);
+		} else {
+			sort_items(a, b, parallel);
+			items = combine_items(a, b);
+			if (items > m_limit) items = static_cast<memory_size_type>(m_limit);
+		}
+		discard_items(a + items, b);
+		return items;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Release the items in [a,b) that are cut off by the limit.
+	///////////////////////////////////////////////////////////////////////////
+	inline void discard_items(store_type * a, store_type * b) {
+		if (std::is_same<store_type, element_type>::value) return;
+		for (store_type * i = a; i != b; ++i)
+			m_store.store_to_element(std::move(*i));
+	}
+
+	inline bool limited() const {
+		return m_limit != std::numeric_limits<stream_size_type>::max();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Whether the item is greater than m_limit items that are known to be
+	/// kept, so that it is not among the smallest m_limit items.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool beyond_limit(const store_type & item) {
+		if (m_limit == 0) return true;
+		return m_hasThreshold && pred(m_threshold, m_store.store_as_element(item));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// At least m_limit items are at most the given item.
+	///////////////////////////////////////////////////////////////////////////
+	inline void lower_threshold(const store_type & item) {
+		const element_type & e = m_store.store_as_element(item);
+		if (m_hasThreshold && !pred(e, m_threshold)) return;
+		m_threshold = e;
+		m_hasThreshold = true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// The sorted run [a, a+items) is about to be written. A few evenly
+	/// spaced items of it are kept in m_runBounds with the number of run
+	/// items from the previous one, so the sum of the counts of the kept
+	/// items that are at most some item is a lower bound on the number of
+	/// written items that are at most it. Once it reaches m_limit, that item
+	/// is a threshold. Combined runs may share keys, so they only count one
+	/// at a time.
+	///////////////////////////////////////////////////////////////////////////
+	inline void add_run_bounds(const store_type * a, memory_size_type items) {
+		if (items >= m_limit) {
+			lower_threshold(a[items-1]);
+			return;
+		}
+		if (combining) return;
+		typedef std::pair<element_type, stream_size_type> bound_t;
+		typedef typename std::vector<bound_t, allocator<bound_t> >::iterator iterator_t;
+		const memory_size_type samples = std::min(items, static_cast<memory_size_type>(runBoundSamples));
+		memory_size_type prev = 0;
+		for (memory_size_type j = 1; j <= samples; ++j) {
+			memory_size_type end = j * items / samples;
+			const element_type & e = m_store.store_as_element(a[end-1]);
+			if (m_hasThreshold && pred(m_threshold, e)) break;
+			iterator_t i = m_runBounds.begin();
+			while (i != m_runBounds.end() && !pred(e, i->first)) ++i;
+			m_runBounds.insert(i, bound_t(e, end - prev));
+			prev = end;
+		}
+		iterator_t i;
+		stream_size_type sum = 0;
+		for (i = m_runBounds.begin(); i != m_runBounds.end(); ++i) {
+			sum += i->second;
+			if (sum >= m_limit) {
+				m_threshold = i->first;
+				m_hasThreshold = true;
+				// Items after the threshold will not lower it.
+				m_runBounds.erase(i + 1, m_runBounds.end());
+				return;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Combine the equal items of the sorted range [a,b).
+	/// \returns The number of items left in the front of the range.
+	///////////////////////////////////////////////////////////////////////////
+	inline memory_size_type combine_items(store_type * a, store_type * b) {
+		if (!combining) return b - a;
+		return combine_sorted(a, b, bits::store_pred<pred_t, specific_store_t>(pred),
+							  store_combine_t(m_combine, m_store)) - a;
+	}
+
+	inline void sort_items(store_type * a, store_type * b, bool parallel = true) {
+		sort_items(a, b, parallel, std::integral_constant<bool,
+			std::is_same<store_type, element_type>::value
+			&& bits::radix_key<element_type, pred_t>::value>());
+	}
+
+	inline void sort_items(store_type * a, store_type * b, bool parallel, std::false_type) {
+		if (parallel)
+			parallel_sort(a, b, bits::store_pred<pred_t, specific_store_t>(pred));
+		else
+			std::sort(a, b, bits::store_pred<pred_t, specific_store_t>(pred));
+	}
+
+	inline void sort_items(store_type * a, store_type * b, bool parallel, std::true_type) {
+		if (parallel)
+			parallel_radix_sort(a, b, bits::radix_key<element_type, pred_t>(pred));
+		else
+			radix_sort(a, b, bits::radix_key<element_type, pred_t>(pred));
 	}
 
 	// postcondition: m_currentRunItemCount = 0
 	inline void empty_current_run() {
+		if (limited() && m_state == stRunFormation && m_currentRunItemCount > 0)
+			add_run_bounds(m_currentRunItems.get(), m_currentRunItemCount);
+		if (p.distribution) {
+			distribute_current_run();
+			return;
+		}
 		if (m_finishedRuns < 10)
 			log_debug() << "Write " << m_currentRunItemCount << " items to run file " << m_finishedRuns << std::endl;
 		else if (m_finishedRuns == 10)
 			log_debug() << "..." << std::endl;
 		file_stream<element_type> fs;
 		open_run_file_write(fs, 0, m_finishedRuns);
+		fs.reserve(fs.size() + m_currentRunItemCount);
 		for (memory_size_type i = 0; i < m_currentRunItemCount; ++i)
 			fs.write(m_store.store_to_element(std::move(m_currentRunItems[i])));
+		finish_run(m_currentRunItemCount);
 		m_currentRunItemCount = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Distribution sort: append the sorted current run to the buckets. The
+	/// splitters are chosen from the first run.
+	/// postcondition: m_currentRunItemCount = 0
+	///////////////////////////////////////////////////////////////////////////
+	inline void distribute_current_run() {
+		store_type * a = m_currentRunItems.get();
+		store_type * b = a + m_currentRunItemCount;
+		if (m_finishedRuns == 0) choose_splitters();
+		sample_current_run();
+		if (m_finishedRuns < 10)
+			log_debug() << "Distribute " << m_currentRunItemCount << " items to " << m_bucketSizes.size() << " buckets" << std::endl;
+		else if (m_finishedRuns == 10)
+			log_debug() << "..." << std::endl;
+		for (memory_size_type i = 0; i < m_bucketSizes.size() && a != b; ++i) {
+			store_type * e = b;
+			if (i < m_splitters.size())
+				e = std::lower_bound(a, b, m_splitters[i], [this](const store_type & x, const element_type & y) {
+					return pred(m_store.store_as_element(x), y);
+				});
+			m_bucketSizes[i] += e - a;
+			for (; a != e; ++a)
+				m_bucketStreams[i].write(m_store.store_to_element(std::move(*a)));
+		}
 		++m_finishedRuns;
+		m_currentRunItemCount = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Distribution sort: add every m_sampleStride'th item of the sorted
+	/// current run to the sample. When the sample is full, every other item
+	/// is dropped from it and items are sampled half as often, so that it
+	/// stays evenly spread over the pushed items.
+	///////////////////////////////////////////////////////////////////////////
+	inline void sample_current_run() {
+		if (m_givenSamples || m_samples.size() < 2) return;
+		stream_size_type i = m_sampleSkip;
+		for (; i < m_currentRunItemCount; i += m_sampleStride) {
+			if (m_sampleCount == m_samples.size()) {
+				for (memory_size_type j = 1; 2*j < m_sampleCount; ++j)
+					m_samples[j] = m_samples[2*j];
+				m_sampleCount = (m_sampleCount + 1) / 2;
+				m_sampleStride *= 2;
+			}
+			m_samples[m_sampleCount++] = m_store.store_as_element(m_currentRunItems[static_cast<size_t>(i)]);
+		}
+		m_sampleSkip = i - m_currentRunItemCount;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Distribution sort: pick evenly spaced splitters from the given sample
+	/// or else from the sorted current run, with at least
+	/// minimumBucketSamples items per bucket, and open the bucket streams.
+	///////////////////////////////////////////////////////////////////////////
+	inline void choose_splitters() {
+		const memory_size_type n = m_givenSamples ? m_sampleCount : m_currentRunItemCount;
+		const memory_size_type capacity = std::max(p.internalReportThreshold, memory_size_type(1));
+		memory_size_type buckets = p.distributionBuckets;
+		if (m_maxItems != std::numeric_limits<stream_size_type>::max())
+			buckets = static_cast<memory_size_type>((2*m_maxItems + capacity - 1) / capacity);
+		buckets = clamp(1, buckets, std::min(p.distributionBuckets, n / minimumBucketSamples));
+		log_debug() << "Distribute items to " << buckets << " buckets" << std::endl;
+		m_bucketSizes.resize(buckets, 0);
+		m_splitters.resize(buckets - 1);
+		for (memory_size_type i = 1; i < buckets; ++i)
+			m_splitters[i-1] = m_givenSamples ? m_samples[i*n/buckets]
+				: m_store.store_as_element(m_currentRunItems[i*n/buckets]);
+		m_bucketStreams.resize(buckets);
+		for (memory_size_type i = 0; i < buckets; ++i)
+			m_bucketStreams[i].open(m_runFiles[i], access_write, 0, access_sequential, compression_normal);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Whether runs are formed by replacement selection.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool replacement_selection() const {
+		return p.replacementSelection && !p.distribution;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Whether full runs are sorted and written by a run job.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool double_buffering() const {
+		return p.doubleBuffering && !p.replacementSelection && !p.distribution;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Job sorting the spare run buffer and writing it to m_runStream.
+	///////////////////////////////////////////////////////////////////////////
+	class run_job : public job {
+	public:
+		run_job(merge_sorter & sorter, memory_size_type items)
+			: m_sorter(sorter)
+			, m_items(items)
+		, m_written(0)
+		{
+		}
+
+		virtual void operator()() override {
+			try {
+				m_written = m_sorter.write_spare_run(m_items);
+			} catch (...) {
+				m_error = std::current_exception();
+			}
+		}
+
+		void rethrow() {
+			if (m_error) std::rethrow_exception(m_error);
+		}
+
+		/** The number of items given to the job. */
+		memory_size_type items() const { return m_items; }
+
+		/** The number of items written after combining and the limit. */
+		memory_size_type written() const { return m_written; }
+
+	private:
+		merge_sorter & m_sorter;
+		memory_size_type m_items;
+		memory_size_type m_written;
+		std::exception_ptr m_error;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Double buffering: hand the full run buffer to a run job and continue
+	/// with the spare buffer. The run file is opened here, so that run files
+	/// and positions are only touched by the calling thread.
+	///////////////////////////////////////////////////////////////////////////
+	inline void start_run_job() {
+		finish_run_job();
+		m_currentRunItems.swap(m_spareRunItems);
+		memory_size_type items = m_currentRunItemCount;
+		m_currentRunItemCount = 0;
+		if (m_finishedRuns < 10)
+			log_debug() << "Sort and write " << items << " items to run file " << m_finishedRuns << " in the background" << std::endl;
+		else if (m_finishedRuns == 10)
+			log_debug() << "..." << std::endl;
+		open_run_file_write(*m_runStream, 0, m_finishedRuns);
+		m_runStream->reserve(m_runStream->size() + items);
+		finish_run(items);
+		m_runJob.reset(tpie_new<run_job>(*this, items));
+		m_runJob->enqueue();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Double buffering: wait for the run job, if any, and rethrow its
+	/// exception.
+	///////////////////////////////////////////////////////////////////////////
+	inline void finish_run_job() {
+		if (m_runJob.get() == 0) return;
+		m_runJob->join();
+		unique_ptr<run_job> j;
+		j.swap(m_runJob);
+		j->rethrow();
+		// The run was recorded with its length before combining and the limit.
+		if (run_ends_recorded()) m_runEnds.back() -= j->items() - j->written();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Run job body. A parallel sort would block this job manager thread
+	/// while waiting for its own jobs, so the sort runs in this thread only.
+	/// \returns The number of items written.
+	///////////////////////////////////////////////////////////////////////////
+	inline memory_size_type write_spare_run(memory_size_type items) {
+		store_type * a = m_spareRunItems.get();
+		items = sort_run(a, a + items, false);
+		for (memory_size_type i = 0; i < items; ++i)
+			m_runStream->write(m_store.store_to_element(std::move(a[i])));
+		m_runStream->close();
+		return items;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Record that a run of the given length has been written in level 0.
+	///////////////////////////////////////////////////////////////////////////
+	inline void finish_run(stream_size_type items) {
+		if (replacement_selection() || run_ends_recorded())
+			m_runEnds.push_back((m_runEnds.empty() ? 0 : m_runEnds.back()) + items);
+		++m_finishedRuns;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Heap order of replacement selection: the smallest item on top.
+	///////////////////////////////////////////////////////////////////////////
+	class heap_order {
+	public:
+		heap_order(pred_t pred) : less(pred) {}
+		bool operator()(const store_type & a, const store_type & b) { return less(b, a); }
+	private:
+		bits::store_pred<pred_t, specific_store_t> less;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Replacement selection: write the smallest item of the heap to the
+	/// current run and put the given item in its place. The heap is
+	/// m_currentRunItems[0, m_heapSize), and the items held back for the next
+	/// run follow it.
+	///////////////////////////////////////////////////////////////////////////
+	inline void replace_smallest(store_type && item) {
+		store_type * a = m_currentRunItems.get();
+		heap_order order(pred);
+		if (!m_runStream->is_open()) {
+			// Start a new run with the items held back from the last one.
+			std::make_heap(a, a + m_currentRunItemCount, order);
+			m_heapSize = m_currentRunItemCount;
+			m_runItems = 0;
+			if (m_finishedRuns < 10)
+				log_debug() << "Replacement selection into run file " << m_finishedRuns << std::endl;
+			open_run_file_write(*m_runStream, 0, m_finishedRuns);
+		}
+		std::pop_heap(a, a + m_heapSize, order);
+		store_type & smallest = a[m_heapSize-1];
+		bool sameRun = !order(smallest, item);
+		write_run_item(std::move(smallest));
+		smallest = std::move(item);
+		if (sameRun) {
+			std::push_heap(a, a + m_heapSize, order);
+		} else if (--m_heapSize == 0) {
+			close_run_stream();
+			finish_run(m_runItems);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Replacement selection: write the rest of the heap to the current run
+	/// and leave the held back items in the front of m_currentRunItems.
+	///////////////////////////////////////////////////////////////////////////
+	inline void finish_replacement_run() {
+		store_type * a = m_currentRunItems.get();
+		sort_items(a, a + m_heapSize);
+		for (memory_size_type i = 0; i < m_heapSize; ++i)
+			write_run_item(std::move(a[i]));
+		close_run_stream();
+		finish_run(m_runItems);
+		std::move(a + m_heapSize, a + m_currentRunItemCount, a);
+		m_currentRunItemCount -= m_heapSize;
+		m_heapSize = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Replacement selection: append an item to the current run. When
+	/// combining, the last item is held back until an item that is not equal
+	/// to it arrives. Items past the limit are discarded.
+	///////////////////////////////////////////////////////////////////////////
+	inline void write_run_item(store_type && item) {
+		if (combining && m_runItems > 0
+			&& !bits::store_pred<pred_t, specific_store_t>(pred)(m_lastRunItem, item)) {
+			store_combine_t(m_combine, m_store)(m_lastRunItem, std::move(item));
+			return;
+		}
+		if (m_runItems >= m_limit) {
+			m_store.store_to_element(std::move(item));
+			return;
+		}
+		if (combining && m_runItems > 0)
+			m_runStream->write(m_store.store_to_element(std::move(m_lastRunItem)));
+		if (combining)
+			m_lastRunItem = std::move(item);
+		else
+			m_runStream->write(m_store.store_to_element(std::move(item)));
+		++m_runItems;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Replacement selection: write the held back item and close the run.
+	///////////////////////////////////////////////////////////////////////////
+	inline void close_run_stream() {
+		if (combining && m_runItems > 0)
+			m_runStream->write(m_store.store_to_element(std::move(m_lastRunItem)));
+		m_runStream->close();
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -446,17 +1092,22 @@ private:
 	/// (runNumber+runCount)'th run in mergeLevel.
 	///////////////////////////////////////////////////////////////////////////
 	inline void initialize_merger(memory_size_type mergeLevel, memory_size_type runNumber, memory_size_type runCount) {
+		initialize_merger(m_merger, mergeLevel, runNumber, runCount);
+	}
+
+	inline void initialize_merger(merger_type & m, memory_size_type mergeLevel, memory_size_type runNumber, memory_size_type runCount) {
 		// runCount is a memory_size_type since we must be able to have that
 		// many file_streams open at the same time.
 
 		// Open files and seek to the first item in the run.
 		array<file_stream<element_type> > in(runCount);
+		array<stream_size_type> lengths(runCount);
 		for (memory_size_type i = 0; i < runCount; ++i) {
 			open_run_file_read(in[i], mergeLevel, runNumber+i);
+			lengths[i] = run_begin(mergeLevel, runNumber+i+1) - run_begin(mergeLevel, runNumber+i);
 		}
-		stream_size_type runLength = calculate_run_length(p.runLength, p.fanout, mergeLevel);
 		// Pass file streams with correct stream offsets to the merger
-		m_merger.reset(in, runLength);
+		m.reset(in, lengths);
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -492,17 +1143,20 @@ public:
 	inline void reinitialize_final_merger() {
 		tp_assert(m_finalMergeInitialized, "reinitialize_final_merger while !m_finalMergeInitialized");
 		m_runPositions.unevacuate();
+		if (parallel_final_merge()) {
+			// The key ranges are merged on the first pull.
+			if (m_partitionsMerged) open_partition();
+			m_evacuated = false;
+			return;
+		}
 		if (m_finalMergeSpecialRunNumber != std::numeric_limits<memory_size_type>::max()) {
 			array<file_stream<element_type> > in(p.finalFanout);
-			for (memory_size_type i = 0; i < p.finalFanout-1; ++i) {
-				open_run_file_read(in[i], m_finalMergeLevel, i);
-				log_debug() << "Run " << i << " is at offset " << in[i].offset() << " and has size " << in[i].size() << std::endl;
+			array<stream_size_type> lengths(p.finalFanout);
+			for (memory_size_type i = 0; i < p.finalFanout; ++i) {
+				lengths[i] = open_final_run(in[i], i);
+				log_debug() << "Run " << i << " is at offset " << in[i].offset() << " and has length " << lengths[i] << std::endl;
 			}
-			open_run_file_read(in[p.finalFanout-1], m_finalMergeLevel+1, m_finalMergeSpecialRunNumber);
-			log_debug() << "Special large run is at offset " << in[p.finalFanout-1].offset() << " and has size " << in[p.finalFanout-1].size() << std::endl;
-			stream_size_type runLength = calculate_run_length(p.runLength, p.fanout, m_finalMergeLevel+1);
-			log_debug() << "Run length " << runLength << std::endl;
-			m_merger.reset(in, runLength);
+			m_merger.reset(in, lengths);
 		} else {
 			initialize_merger(m_finalMergeLevel, 0, m_finalRunCount);
 		}
@@ -511,14 +1165,65 @@ public:
 
 private:
 	///////////////////////////////////////////////////////////////////////////
-	/// initialize_merger helper.
-	///////////////////////////////////////////////////////////////////////////
-	static inline stream_size_type calculate_run_length(stream_size_type initialRunLength, memory_size_type fanout, memory_size_type mergeLevel) {
-		stream_size_type runLength = initialRunLength;
-		for (memory_size_type i = 0; i < mergeLevel; ++i) {
-			runLength *= fanout;
+	/// Number of items before the runNumber'th run in mergeLevel, which may
+	/// be one past the last run. Run j in mergeLevel is the merge of runs
+	/// j*fanout^mergeLevel and on in level 0. These all have the run length,
+	/// except with replacement selection, where their lengths vary and are
+	/// recorded in m_runEnds.
+	///
+	/// When combining or limited, merged runs are shorter than the runs they
+	/// were merged from, so the ends of the runs in level m_runEndsLevel and
+	/// the level above it are recorded instead, and only these levels can be
+	/// asked for.
+	///////////////////////////////////////////////////////////////////////////
+	inline stream_size_type run_begin(memory_size_type mergeLevel, stream_size_type runNumber) const {
+		if (run_ends_recorded()) {
+			tp_assert(mergeLevel == m_runEndsLevel || mergeLevel == m_runEndsLevel + 1,
+					  "Run ends of the merge level are not recorded");
+			const std::vector<stream_size_type, allocator<stream_size_type> > & ends =
+				mergeLevel == m_runEndsLevel ? m_runEnds : m_mergedRunEnds;
+			if (runNumber == 0 || ends.empty()) return 0;
+			if (runNumber >= ends.size()) return ends.back();
+			return ends[static_cast<size_t>(runNumber-1)];
+		}
+		stream_size_type first = runNumber;
+		for (memory_size_type i = 0; i < mergeLevel && first < m_finishedRuns; ++i) {
+			first *= p.fanout;
 		}
-		return runLength;
+		if (first == 0) return 0;
+		if (first >= m_finishedRuns) return m_itemCount;
+		if (!p.replacementSelection) return first * p.runLength;
+		return m_runEnds[static_cast<size_t>(first-1)];
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Whether the run ends of two merge levels are recorded, since merges
+	/// may output fewer items than they are given.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool run_ends_recorded() const {
+		return combining || limited();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Combining or limited: record that the runNumber'th run of the level
+	/// above m_runEndsLevel has been merged into the given number of items.
+	///////////////////////////////////////////////////////////////////////////
+	inline void finish_merged_run(memory_size_type runNumber, stream_size_type items) {
+		if (!run_ends_recorded()) return;
+		tp_assert(runNumber == m_mergedRunEnds.size(), "Merged runs finished out of order");
+		unused(runNumber);
+		m_mergedRunEnds.push_back((m_mergedRunEnds.empty() ? 0 : m_mergedRunEnds.back()) + items);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Combining or limited: the merges of a level are done, so the run ends
+	/// of the level above it become the current ones.
+	///////////////////////////////////////////////////////////////////////////
+	inline void next_run_ends_level() {
+		if (!run_ends_recorded()) return;
+		m_runEnds.swap(m_mergedRunEnds);
+		m_mergedRunEnds.clear();
+		++m_runEndsLevel;
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -532,13 +1237,98 @@ private:
 		file_stream<element_type> out;
 		memory_size_type nextRunNumber = runNumber/p.fanout;
 		open_run_file_write(out, mergeLevel+1, nextRunNumber);
-		while (m_merger.can_pull()) {
+		out.reserve(out.size() + run_begin(mergeLevel, runNumber+runCount) - run_begin(mergeLevel, runNumber));
+		stream_size_type items = 0;
+		while (items < m_limit && m_merger.can_pull()) {
 			pi.step();
 			out.write(m_store.store_to_element(m_merger.pull()));
+			++items;
 		}
+		m_merger.reset();
+		finish_merged_run(nextRunNumber, items);
 		return nextRunNumber;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// Job merging the runs of one merger into an output run of at most
+	/// limit items.
+	///////////////////////////////////////////////////////////////////////////
+	class merge_job : public job {
+	public:
+		merge_job(merger_type & m, file_stream<element_type> & out, specific_store_t store,
+				  stream_size_type limit)
+			: m_merger(m)
+			, m_out(out)
+			, m_store(store)
+			, m_limit(limit)
+			, m_items(0)
+		{
+		}
+
+		virtual void operator()() override {
+			try {
+				while (m_items < m_limit && m_merger.can_pull()) {
+					m_out.write(m_store.store_to_element(m_merger.pull()));
+					++m_items;
+				}
+				m_merger.reset();
+				m_out.close();
+			} catch (...) {
+				m_error = std::current_exception();
+			}
+		}
+
+		stream_size_type items() const { return m_items; }
+
+		void rethrow() {
+			if (m_error) std::rethrow_exception(m_error);
+		}
+
+	private:
+		merger_type & m_merger;
+		file_stream<element_type> & m_out;
+		specific_store_t m_store;
+		stream_size_type m_limit;
+		stream_size_type m_items;
+		std::exception_ptr m_error;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Merge the runCount runs from the runNumber'th in mergeLevel into
+	/// mergeLevel+1, fanout runs at a time with concurrent merges.
+	///
+	/// runNumber must be a multiple of the fanout, and there must be at most
+	/// fanout merges, so that every merge writes to its own run file. The run
+	/// files are opened and positioned in run order before the merges start.
+	///////////////////////////////////////////////////////////////////////////
+	template <typename ProgressIndicator>
+	void merge_runs_concurrently(memory_size_type mergeLevel, memory_size_type runNumber, memory_size_type runCount, ProgressIndicator & pi) {
+		memory_size_type merges = (runCount + p.fanout - 1) / p.fanout;
+		tp_assert(runNumber % p.fanout == 0, "Concurrent merges must start a group of runs");
+		tp_assert(merges <= p.fanout, "Concurrent merges would share run files");
+
+		array<unique_ptr<merger_type> > mergers(merges);
+		array<file_stream<element_type> > out(merges);
+		array<unique_ptr<merge_job> > jobs(merges);
+		for (memory_size_type i = 0; i < merges; ++i) {
+			memory_size_type first = runNumber + i*p.fanout;
+			memory_size_type n = std::min(p.fanout, runNumber + runCount - first);
+			mergers[i].reset(tpie_new<merger_type>(pred, m_store, m_bucket, m_combine));
+			initialize_merger(*mergers[i], mergeLevel, first, n);
+			open_run_file_write(out[i], mergeLevel+1, first/p.fanout);
+			out[i].reserve(out[i].size() + run_begin(mergeLevel, first+n) - run_begin(mergeLevel, first));
+			jobs[i].reset(tpie_new<merge_job>(*mergers[i], out[i], m_store, m_limit));
+		}
+		for (memory_size_type i = 0; i < merges; ++i) jobs[i]->enqueue();
+		for (memory_size_type i = 0; i < merges; ++i) {
+			jobs[i]->join();
+			pi.step(jobs[i]->items());
+		}
+		for (memory_size_type i = 0; i < merges; ++i) jobs[i]->rethrow();
+		for (memory_size_type i = 0; i < merges; ++i)
+			finish_merged_run((runNumber + i*p.fanout)/p.fanout, jobs[i]->items());
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	/// Phase 2: Merge all runs and initialize merger for public pulling.
 	///////////////////////////////////////////////////////////////////////////
@@ -556,8 +1346,19 @@ private:
 			log_debug() << "Merge " << runCount << " runs in merge level " << mergeLevel << '\n';
 			m_runPositions.next_level();
 			memory_size_type newRunCount = 0;
-			for (memory_size_type i = 0; i < runCount; i += p.fanout) {
-				memory_size_type n = std::min(runCount-i, p.fanout);
+			// Groups of up to concurrentMerges*fanout runs are merged at a time.
+			memory_size_type concurrentMerges = std::max(memory_size_type(1), std::min(p.mergeThreads, p.fanout));
+			memory_size_type batch = concurrentMerges*p.fanout;
+			for (memory_size_type i = 0; i < runCount; i += batch) {
+				memory_size_type n = std::min(runCount-i, batch);
+
+				if (n > p.fanout) {
+					log_debug() << "Merge " << n << " runs starting from #" << i
+						<< " in " << (n + p.fanout - 1) / p.fanout << " concurrent merges" << std::endl;
+					merge_runs_concurrently(mergeLevel, i, n, pi);
+					newRunCount += (n + p.fanout - 1) / p.fanout;
+					continue;
+				}
 
 				if (newRunCount < 10)
 					log_debug() << "Merge " << n << " runs starting from #" << i << std::endl;
@@ -569,6 +1370,7 @@ private:
 			}
 			++mergeLevel;
 			runCount = newRunCount;
+			next_run_ends_level();
 		}
 		log_debug() << "Final merge level " << mergeLevel << " has " << runCount << " runs" << std::endl;
 		initialize_final_merger(mergeLevel, runCount);
@@ -577,6 +1379,312 @@ private:
 		pi.done();
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// Whether the final merge is split into concurrently merged key ranges.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool parallel_final_merge() const {
+		return p.finalMergeThreads > 1 && final_run_count() > 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Number of runs in the final merge.
+	///////////////////////////////////////////////////////////////////////////
+	inline memory_size_type final_run_count() const {
+		if (m_finalMergeSpecialRunNumber != std::numeric_limits<memory_size_type>::max())
+			return p.finalFanout;
+		return m_finalRunCount;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Open the i'th run of the final merge, with a block index if it is to
+	/// be searched.
+	/// \returns The number of items in the run.
+	///////////////////////////////////////////////////////////////////////////
+	inline stream_size_type open_final_run(file_stream<element_type> & fs, memory_size_type i, bool blockIndex = false) {
+		if (m_finalMergeSpecialRunNumber != std::numeric_limits<memory_size_type>::max()
+			&& i == p.finalFanout-1) {
+			open_run_file_read(fs, m_finalMergeLevel+1, m_finalMergeSpecialRunNumber, blockIndex);
+			if (run_ends_recorded())
+				return run_begin(m_finalMergeLevel+1, m_finalMergeSpecialRunNumber+1)
+					- run_begin(m_finalMergeLevel+1, m_finalMergeSpecialRunNumber);
+			return m_itemCount - run_begin(m_finalMergeLevel, i);
+		}
+		open_run_file_read(fs, m_finalMergeLevel, i, blockIndex);
+		return run_begin(m_finalMergeLevel, i+1) - run_begin(m_finalMergeLevel, i);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Index of the first item of the run that is not less than the given
+	/// splitter, searching between offsets lo and hi of the run that begins
+	/// at offset start in fs.
+	///////////////////////////////////////////////////////////////////////////
+	inline stream_size_type lower_bound(file_stream<element_type> & fs, stream_size_type start,
+										stream_size_type lo, stream_size_type hi,
+										const store_type & splitter) {
+		bits::store_pred<pred_t, specific_store_t> less(pred);
+		while (lo < hi) {
+			stream_size_type mid = lo + (hi - lo) / 2;
+			fs.seek(start + mid);
+			if (less(m_store.element_to_store(fs.read()), splitter))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Split the final runs into key ranges by splitters sampled from the
+	/// runs. The first key range is reported straight from m_merger, while
+	/// the others are merged concurrently into files of their own.
+	///////////////////////////////////////////////////////////////////////////
+	void merge_final_partitions() {
+		const memory_size_type runs = final_run_count();
+		const memory_size_type partitions = p.finalMergeThreads;
+		const memory_size_type samplesPerRun = 8*partitions;
+		bits::store_pred<pred_t, specific_store_t> less(pred);
+		log_debug() << "Merge " << runs << " final runs in " << partitions << " key ranges" << std::endl;
+
+		// Every run is opened once with a block index, to sample it and to
+		// find where the key ranges begin.
+		array<file_stream<element_type> > indexed(runs);
+		array<stream_size_type> starts(runs);
+		array<stream_size_type> lengths(runs);
+
+		// Sample evenly spaced items from every run and pick splitters.
+		array<store_type> samples(runs*samplesPerRun);
+		memory_size_type sampleCount = 0;
+		for (memory_size_type i = 0; i < runs; ++i) {
+			lengths[i] = open_final_run(indexed[i], i, true);
+			starts[i] = indexed[i].offset();
+			for (memory_size_type j = 0; j < samplesPerRun && lengths[i] > 0; ++j) {
+				indexed[i].seek(starts[i] + j*lengths[i]/samplesPerRun);
+				samples[sampleCount++] = m_store.element_to_store(indexed[i].read());
+			}
+		}
+		std::sort(samples.begin(), samples.begin() + sampleCount, less);
+		array<store_type> splitters(partitions-1);
+		for (memory_size_type j = 1; j < partitions; ++j)
+			splitters[j-1] = std::move(samples[j*sampleCount/partitions]);
+		samples.resize(0);
+
+		// bounds[i*(partitions+1)+j] is the offset in run i where key range j
+		// begins, and positions[i*partitions+j] the stream position there,
+		// so that the merges need not open the runs with a block index.
+		array<stream_size_type> bounds(runs*(partitions+1));
+		array<stream_position> positions(runs*partitions);
+		for (memory_size_type i = 0; i < runs; ++i) {
+			file_stream<element_type> & fs = indexed[i];
+			stream_size_type * b = &bounds[i*(partitions+1)];
+			b[0] = 0;
+			for (memory_size_type j = 1; j < partitions; ++j)
+				b[j] = lower_bound(fs, starts[i], b[j-1], lengths[i], splitters[j-1]);
+			b[partitions] = lengths[i];
+			for (memory_size_type j = 1; j < partitions; ++j) {
+				if (b[j] == b[j+1]) continue;
+				fs.seek(starts[i] + b[j]);
+				positions[i*partitions+j] = fs.get_position();
+			}
+		}
+		splitters.resize(0);
+		indexed.resize(0);
+
+		m_partitionFiles.resize(partitions);
+		m_partitionMergers.resize(partitions);
+		m_partitionOut.resize(partitions);
+		m_partitionJobs.resize(partitions);
+		for (memory_size_type j = 0; j < partitions; ++j) {
+			array<file_stream<element_type> > in(runs);
+			array<stream_size_type> rangeLengths(runs);
+			for (memory_size_type i = 0; i < runs; ++i) {
+				const stream_size_type * b = &bounds[i*(partitions+1)];
+				open_final_run(in[i], i);
+				rangeLengths[i] = b[j+1] - b[j];
+				if (j > 0 && rangeLengths[i] > 0) in[i].set_position(positions[i*partitions+j]);
+			}
+			if (j == 0) {
+				m_merger.reset(in, rangeLengths);
+				continue;
+			}
+			m_partitionMergers[j].reset(tpie_new<merger_type>(pred, m_store, m_bucket, m_combine));
+			m_partitionMergers[j]->reset(in, rangeLengths);
+			m_partitionOut[j].open(m_partitionFiles[j], access_read_write, 0, access_sequential, compression_normal);
+			m_partitionJobs[j].reset(tpie_new<merge_job>(*m_partitionMergers[j], m_partitionOut[j], m_store, m_limit));
+		}
+		for (memory_size_type j = 1; j < partitions; ++j) m_partitionJobs[j]->enqueue();
+
+		m_partitionsMerged = true;
+		m_partitionStreaming = true;
+		m_partition = 0;
+		m_partitionPosition = stream_position::beginning();
+		m_partitionStream.reset(tpie_new<file_stream<element_type> >());
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Wait for the concurrent merges of the key ranges and release them.
+	///////////////////////////////////////////////////////////////////////////
+	void join_partition_jobs() {
+		array<unique_ptr<merge_job> > jobs;
+		jobs.swap(m_partitionJobs);
+		for (memory_size_type j = 0; j < jobs.size(); ++j)
+			if (jobs[j].get() != 0) jobs[j]->join();
+		m_partitionMergers.resize(0);
+		m_partitionOut.resize(0);
+		for (memory_size_type j = 0; j < jobs.size(); ++j)
+			if (jobs[j].get() != 0) jobs[j]->rethrow();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Stop reporting the first key range from m_merger: write the rest of
+	/// it to its file, which is then reported like the others, and wait for
+	/// the other key ranges, so that all mergers can be released.
+	///////////////////////////////////////////////////////////////////////////
+	void evacuate_first_partition() {
+		log_debug() << "Write the rest of the first key range to its file" << std::endl;
+		file_stream<element_type> out;
+		out.open(m_partitionFiles[0], access_read_write, 0, access_sequential, compression_normal);
+		for (stream_size_type i = m_itemsReported; i < m_limit && m_merger.can_pull(); ++i)
+			out.write(m_store.store_to_element(m_merger.pull()));
+		out.close();
+		m_merger.reset();
+		m_partitionStreaming = false;
+		m_partitionPosition = stream_position::beginning();
+		join_partition_jobs();
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Open the current key range file at the saved position.
+	///////////////////////////////////////////////////////////////////////////
+	inline void open_partition() {
+		if (m_partitionStreaming || m_partition >= m_partitionFiles.size()) return;
+		m_partitionStream->open(m_partitionFiles[m_partition], access_read, 0, access_sequential, compression_normal);
+		m_partitionStream->set_position(m_partitionPosition);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Distribution sort: make the next bucket with items the current one. It
+	/// is sorted in memory if it fits within the internal report threshold,
+	/// and by a merge sorter of its own in the phase 3 memory otherwise. The
+	/// first m_bucketPulled items are skipped, as they were reported before
+	/// an evacuation.
+	/// \returns false when all buckets have been reported.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool load_bucket() {
+		while (m_bucketIndex < m_bucketSizes.size() && m_bucketSizes[m_bucketIndex] == 0)
+			++m_bucketIndex;
+		if (m_bucketIndex == m_bucketSizes.size()) return false;
+		const stream_size_type n = m_bucketSizes[m_bucketIndex];
+		file_stream<element_type> fs;
+		fs.open(m_runFiles[m_bucketIndex], access_read, 0, access_sequential, compression_normal);
+		if (n <= p.internalReportThreshold) {
+			log_debug() << "Sort bucket " << m_bucketIndex << " of " << n << " items in memory" << std::endl;
+			m_currentRunItems.resize(static_cast<size_t>(n));
+			store_type * a = m_currentRunItems.get();
+			for (memory_size_type i = 0; i < n; ++i)
+				a[i] = m_store.element_to_store(fs.read());
+			m_bucketItems = sort_run(a, a + n, true);
+			discard_items(a, a + std::min(m_bucketPulled, m_bucketItems));
+		} else {
+			log_debug() << "Bucket " << m_bucketIndex << " of " << n << " items does not fit in memory; sort it on its own" << std::endl;
+			m_bucketSorter.reset(tpie_new<bucket_sorter_t>(pred, m_sorterStore, m_combine));
+			if (p.memoryPhase3 == 0) {
+				// Parameters given by set_parameters come without a budget.
+				m_bucketSorter->set_parameters(std::max(p.internalReportThreshold, memory_size_type(1)),
+											   std::max(p.finalFanout, memory_size_type(2)));
+			} else {
+				// The bucket sorter gets the phase 3 memory and files but
+				// those of m_runFiles, the sample and the bucket being read.
+				const memory_size_type held = m_runFiles.memory_usage(m_runFiles.size())
+					+ m_samples.memory_usage(m_samples.size())
+					+ file_stream<element_type>::memory_usage();
+				m_bucketSorter->set_available_memory(p.memoryPhase3 > held ? p.memoryPhase3 - held : 0);
+				m_bucketSorter->set_available_files(clamp(minimumFilesPhase3, p.filesPhase3 - 1, maximumFilesPhase3));
+			}
+			m_bucketSorter->set_items(n);
+			if (limited()) m_bucketSorter->set_limit(m_limit);
+			// Distribute the bucket again if the sample has enough distinct
+			// items from it; the bucket sorter merge sorts if its buckets
+			// would not fit in memory.
+			const element_type * lo = m_samples.get();
+			const element_type * hi = lo + m_sampleCount;
+			if (m_bucketIndex > 0) lo = std::lower_bound(lo, hi, m_splitters[m_bucketIndex-1], pred);
+			if (m_bucketIndex < m_splitters.size()) hi = std::lower_bound(lo, hi, m_splitters[m_bucketIndex], pred);
+			if (!m_givenSamples && static_cast<memory_size_type>(hi - lo) >= 2*minimumBucketSamples && pred(*lo, *(hi - 1))) {
+				log_debug() << "Distribute bucket " << m_bucketIndex << " by " << (hi - lo) << " sampled items" << std::endl;
+				m_bucketSorter->set_distribution(true);
+				m_bucketSorter->set_splitter_samples(lo, hi);
+			}
+			m_bucketSorter->begin();
+			while (fs.can_read())
+				m_bucketSorter->push(m_store.store_to_outer(m_store.element_to_store(fs.read())));
+			m_bucketSorter->end();
+			dummy_progress_indicator pi;
+			m_bucketSorter->calc(pi);
+			for (stream_size_type i = 0; i < m_bucketPulled && m_bucketSorter->can_pull(); ++i)
+				m_store.store_to_element(m_store.outer_to_store(m_bucketSorter->pull()));
+		}
+		m_bucketLoaded = true;
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Distribution sort: whether there are more items in the buckets,
+	/// moving on to the next bucket when the current one is exhausted.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool can_pull_bucket() {
+		while (true) {
+			if (m_bucketLoaded) {
+				if (m_bucketSorter.get() != 0 ? m_bucketSorter->can_pull() : m_bucketPulled < m_bucketItems)
+					return true;
+				m_currentRunItems.resize(0);
+				m_bucketSorter.reset();
+				m_runFiles[m_bucketIndex].free();
+				++m_bucketIndex;
+				m_bucketPulled = 0;
+				m_bucketLoaded = false;
+			}
+			if (!load_bucket()) return false;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Whether there are more items in the key range files, moving on to the
+	/// next file when the current one is exhausted.
+	///////////////////////////////////////////////////////////////////////////
+	inline bool can_pull_partition() {
+		if (!m_partitionsMerged) merge_final_partitions();
+		if (m_partitionStreaming) {
+			if (m_merger.can_pull()) return true;
+			m_partitionStreaming = false;
+			join_partition_jobs();
+			m_partitionFiles[0].free();
+			m_partition = 1;
+			m_partitionPosition = stream_position::beginning();
+			open_partition();
+		}
+		while (m_partition < m_partitionFiles.size()) {
+			if (m_partitionStream->can_read()) return true;
+			m_partitionStream->close();
+			m_partitionFiles[m_partition].free();
+			++m_partition;
+			m_partitionPosition = stream_position::beginning();
+			open_partition();
+		}
+		return false;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Release the items left in the final merger once the limit has been
+	/// reported, and wait for the key ranges still being merged.
+	///////////////////////////////////////////////////////////////////////////
+	void release_final_merger() {
+		m_merger.reset();
+		if (m_partitionStreaming) {
+			m_partitionStreaming = false;
+			join_partition_jobs();
+		}
+	}
+
 public:
 	///////////////////////////////////////////////////////////////////////////
 	/// In phase 3, return true if there are more items in the final merge
@@ -586,7 +1694,13 @@ public:
 		tp_assert(m_state == stReport, "Wrong phase");
 		if (m_reportInternal) return m_itemsPulled < m_currentRunItemCount;
 		else {
+			if (m_itemsReported >= m_limit) {
+				release_final_merger();
+				return false;
+			}
+			if (p.distribution) return can_pull_bucket();
 			if (m_evacuated) reinitialize_final_merger();
+			if (parallel_final_merge()) return can_pull_partition();
 			return m_merger.can_pull();
 		}
 	}
@@ -600,21 +1714,42 @@ public:
 			store_type el = std::move(m_currentRunItems[m_itemsPulled++]);
 			if (!can_pull()) m_currentRunItems.resize(0);
 			return m_store.store_to_outer(std::move(el));
+		} else if (p.distribution) {
+			bool ok = can_pull_bucket();
+			tp_assert(ok, "pull() while !can_pull()");
+			unused(ok);
+			++m_itemsReported;
+			++m_bucketPulled;
+			if (m_bucketSorter.get() != 0) return m_bucketSorter->pull();
+			return m_store.store_to_outer(std::move(m_currentRunItems[static_cast<size_t>(m_bucketPulled-1)]));
 		} else {
 			if (m_evacuated) reinitialize_final_merger();
 			m_runPositions.close();
+			++m_itemsReported;
+			if (parallel_final_merge()) {
+				bool ok = can_pull_partition();
+				tp_assert(ok, "pull() while !can_pull()");
+				unused(ok);
+				if (m_partitionStreaming) return m_store.store_to_outer(m_merger.pull());
+				return m_store.store_to_outer(m_store.element_to_store(m_partitionStream->read()));
+			}
 			return m_store.store_to_outer(m_merger.pull());
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// The number of items pushed, or the limit if it is smaller.
+	///////////////////////////////////////////////////////////////////////////
 	inline stream_size_type item_count() {
-		return m_itemCount;
+		return std::min(m_itemCount, m_limit);
 	}
 
 	static memory_size_type memory_usage_phase_1(const sort_parameters & params) {
 		return params.runLength * item_size
+			* (params.doubleBuffering && !params.replacementSelection && !params.distribution ? 2 : 1)
 			+ bits::run_positions::memory_usage()
-			+ file_stream<element_type>::memory_usage()
+			+ file_stream<element_type>::memory_usage() * (params.distribution ? params.distributionBuckets : 1)
+			+ (params.distribution ? params.distributionSamples * sizeof(element_type) : 0)
 			+ 2*params.fanout*sizeof(temp_file);
 	}
 
@@ -633,7 +1768,7 @@ public:
 	}
 
 	static memory_size_type memory_usage_phase_2(const sort_parameters & params) {
-		return fanout_memory_usage(params.fanout);
+		return std::max(params.mergeThreads, memory_size_type(1)) * fanout_memory_usage(params.fanout);
 	}
 
 	static memory_size_type minimum_memory_phase_2() {
@@ -641,7 +1776,7 @@ public:
 	}
 
 	static memory_size_type memory_usage_phase_3(const sort_parameters & params) {
-		return fanout_memory_usage(params.finalFanout);
+		return std::max(params.finalMergeThreads, memory_size_type(1)) * fanout_memory_usage(params.finalFanout);
 	}
 
 	static memory_size_type minimum_memory_phase_3() {
@@ -657,12 +1792,24 @@ public:
 		if (m_reportInternal)
 			return m_runFiles.memory_usage(m_runFiles.size())
 				+ m_currentRunItems.memory_usage(m_currentRunItems.size());
-		else
-			return fanout_memory_usage(m_finalRunCount);
+		else if (p.distribution) {
+			memory_size_type m = m_runFiles.memory_usage(m_runFiles.size())
+				+ m_currentRunItems.memory_usage(p.internalReportThreshold)
+				+ m_samples.memory_usage(m_samples.size())
+				+ file_stream<element_type>::memory_usage();
+			// A bucket that does not fit in memory is sorted in the rest of
+			// the phase 3 memory.
+			for (memory_size_type i = 0; i < m_bucketSizes.size(); ++i)
+				if (m_bucketSizes[i] > p.internalReportThreshold) return std::max(m, p.memoryPhase3);
+			return m;
+		} else
+			return std::max(p.finalMergeThreads, memory_size_type(1)) * fanout_memory_usage(m_finalRunCount);
 	}
 
 	inline memory_size_type evacuated_memory_usage() const {
-		return 2*p.fanout*sizeof(temp_file);
+		return 2*p.fanout*sizeof(temp_file)
+			+ (m_runEnds.capacity() + m_mergedRunEnds.capacity())*sizeof(stream_size_type)
+			+ m_samples.size()*sizeof(element_type);
 	}
 
 private:
@@ -677,7 +1824,7 @@ private:
 		tp_assert(m_state == stNotStarted, "Merge sorting already begun");
 
 		if(!p.filesPhase1)
-			p.filesPhase1 = clamp(minimumFilesPhase1, defaultFiles, maximumFilesPhase1);
+			p.filesPhase1 = p.distribution ? defaultFiles : clamp(minimumFilesPhase1, defaultFiles, maximumFilesPhase1);
 		if(!p.filesPhase2)
 			p.filesPhase2 = clamp(minimumFilesPhase2, defaultFiles, maximumFilesPhase2);
 		if(!p.filesPhase3)
@@ -703,25 +1850,36 @@ private:
 		// Phase 2 (merge):
 		// Run length: unbounded
 		// Fanout: determined by the size of our merge heap and the stream memory usage.
+		// Concurrent merges: split memory and files evenly, as long as each
+		// merge gets at least the minimum memory and files.
 		log_debug() << "Phase 2: " << p.memoryPhase2 << " b available memory\n";
-		p.fanout = calculate_fanout(p.memoryPhase2, p.filesPhase2);
-		if (fanout_memory_usage(p.fanout) > p.memoryPhase2) {
-			log_debug() << "Not enough memory for fanout " << p.fanout << "! (" << p.memoryPhase2 << " < " << fanout_memory_usage(p.fanout) << ")\n";
-			p.memoryPhase2 = fanout_memory_usage(p.fanout);
+		p.mergeThreads = std::min(std::max(p.mergeThreads, memory_size_type(1)),
+								  std::min(p.filesPhase2 / minimumFilesPhase2,
+										   p.memoryPhase2 / minimum_memory_phase_2()));
+		p.mergeThreads = std::max(p.mergeThreads, memory_size_type(1));
+		p.fanout = calculate_fanout(p.memoryPhase2 / p.mergeThreads, p.filesPhase2 / p.mergeThreads);
+		if (memory_usage_phase_2(p) > p.memoryPhase2) {
+			log_debug() << "Not enough memory for fanout " << p.fanout << "! (" << p.memoryPhase2 << " < " << memory_usage_phase_2(p) << ")\n";
+			p.memoryPhase2 = memory_usage_phase_2(p);
 		}
 
 		// Phase 3 (final merge & report):
 		// Run length: unbounded
 		// Fanout: determined by the stream memory usage.
+		// Concurrent final merges: split memory and files as in phase 2.
 		log_debug() << "Phase 3: " << p.memoryPhase3 << " b available memory\n";
-		p.finalFanout = calculate_fanout(p.memoryPhase3, p.filesPhase3);
+		p.finalMergeThreads = std::min(std::max(p.finalMergeThreads, memory_size_type(1)),
+									   std::min(p.filesPhase3 / minimumFilesPhase3,
+												p.memoryPhase3 / minimum_memory_phase_3()));
+		p.finalMergeThreads = std::max(p.finalMergeThreads, memory_size_type(1));
+		p.finalFanout = calculate_fanout(p.memoryPhase3 / p.finalMergeThreads, p.filesPhase3 / p.finalMergeThreads);
 
 		if (p.finalFanout > p.fanout)
 			p.finalFanout = p.fanout;
 
-		if (fanout_memory_usage(p.finalFanout) > p.memoryPhase3) {
-			log_debug() << "Not enough memory for fanout " << p.finalFanout << "! (" << p.memoryPhase3 << " < " << fanout_memory_usage(p.finalFanout) << ")\n";
-			p.memoryPhase3 = fanout_memory_usage(p.finalFanout);
+		if (memory_usage_phase_3(p) > p.memoryPhase3) {
+			log_debug() << "Not enough memory for fanout " << p.finalFanout << "! (" << p.memoryPhase3 << " < " << memory_usage_phase_3(p) << ")\n";
+			p.memoryPhase3 = memory_usage_phase_3(p);
 		}
 
 		// Phase 1 (run formation):
@@ -730,14 +1888,24 @@ private:
 
 		memory_size_type streamMemory = file_stream<element_type>::memory_usage();
 		memory_size_type tempFileMemory = 2*p.fanout*sizeof(temp_file);
+		if (p.distribution) {
+			// A stream is held open for every bucket, in at most half of
+			// the memory, and every bucket has a temp_file in m_runFiles.
+			p.distributionBuckets = clamp(1, std::min(2*p.fanout, p.filesPhase1), p.memoryPhase1 / 2 / streamMemory);
+			streamMemory *= p.distributionBuckets;
+		}
 
-		log_debug() << "Phase 1: " << p.memoryPhase1 << " b available memory; " << streamMemory << " b for a single stream; " << tempFileMemory << " b for temp_files\n";
+		log_debug() << "Phase 1: " << p.memoryPhase1 << " b available memory; " << streamMemory << " b for open streams; " << tempFileMemory << " b for temp_files\n";
 		memory_size_type min_m1 = 128*1024 / item_size + bits::run_positions::memory_usage() + streamMemory + tempFileMemory;
 		if (p.memoryPhase1 < min_m1) {
-			log_warning() << "Not enough phase 1 memory for 128 KB items and an open stream! (" << p.memoryPhase1 << " < " << min_m1 << ")\n";
+			log_warning() << "Not enough phase 1 memory for 128 KB items and the open streams! (" << p.memoryPhase1 << " < " << min_m1 << ")\n";
 			p.memoryPhase1 = min_m1;
 		}
 		p.runLength = (p.memoryPhase1 - bits::run_positions::memory_usage() - streamMemory - tempFileMemory)/item_size;
+		if (double_buffering()) {
+			// Split the memory given to us between the two run buffers.
+			p.runLength /= 2;
+		}
 
 		p.internalReportThreshold = (std::min(p.memoryPhase1,
 											  std::min(p.memoryPhase2,
@@ -746,6 +1914,25 @@ private:
 		if (p.internalReportThreshold > p.runLength)
 			p.internalReportThreshold = p.runLength;
 
+		if (p.distribution) {
+			// The sample of the pushed items takes its share of the run
+			// buffer and of the memory of a bucket sorted in memory.
+			p.distributionSamples = distribution_samples(p.distributionBuckets, p.internalReportThreshold);
+			p.runLength -= p.distributionSamples;
+			p.internalReportThreshold -= p.distributionSamples;
+		}
+
+		if (p.distribution && m_givenSamples
+			&& m_maxItems / p.distributionBuckets > p.internalReportThreshold / 2) {
+			// The buckets would not fit in memory, so merge sort instead.
+			log_debug() << "Too many items to distribute by the given samples; merge sort them\n";
+			p.distribution = false;
+			m_givenSamples = false;
+			m_samples.resize(0);
+			calculate_parameters();
+			return;
+		}
+
 		m_parametersSet = true;
 
 			set_items(m_maxItems);
@@ -774,6 +1961,15 @@ private:
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// calculate_parameters helper: enough samples to split every bucket
+	/// into as many buckets again, but at most a sampleFraction'th of the
+	/// given number of items.
+	///////////////////////////////////////////////////////////////////////////
+	static inline memory_size_type distribution_samples(memory_size_type buckets, memory_size_type items) {
+		return std::min(minimumBucketSamples * buckets * buckets, items / sampleFraction);
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	/// calculate_parameters helper
 	///////////////////////////////////////////////////////////////////////////
@@ -796,7 +1992,7 @@ private:
 	/// calculate_parameters helper
 	///////////////////////////////////////////////////////////////////////////
 	static inline memory_size_type fanout_memory_usage(memory_size_type fanout) {
-		return merger<specific_store_t, pred_t>::memory_usage(fanout) // accounts for the `fanout' open streams
+		return merger_type::memory_usage(fanout) // accounts for the `fanout' open streams
 			+ bits::run_positions::memory_usage()
 			+ file_stream<element_type>::memory_usage() // output stream
 			+ 2*sizeof(temp_file); // merge_sorter::m_runFiles
@@ -884,11 +2080,14 @@ private:
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Open an existing run file and seek to the correct offset.
 	///////////////////////////////////////////////////////////////////////////
-	void open_run_file_read(file_stream<element_type> & fs, memory_size_type mergeLevel, memory_size_type runNumber) {
+	void open_run_file_read(file_stream<element_type> & fs, memory_size_type mergeLevel, memory_size_type runNumber, bool blockIndex = false) {
 		// see run_file_index comment about runNumber
 
 		memory_size_type idx = run_file_index(mergeLevel, runNumber);
-		fs.open(m_runFiles[idx], access_read, 0, access_sequential, compression_normal);
+		if (blockIndex)
+			fs.open(m_runFiles[idx], open::translate(access_read, access_sequential, compression_normal) | open::block_index);
+		else
+			fs.open(m_runFiles[idx], access_read, 0, access_sequential, compression_normal);
 		fs.set_position(m_runPositions.get_position(mergeLevel, runNumber));
 	}
 
@@ -910,8 +2109,11 @@ private:
 	sort_parameters p;
 	bool m_parametersSet;
 
+	// The store given to the constructor, for the sorter of a bucket that
+	// does not fit in memory.
+	store_t m_sorterStore;
 	specific_store_t m_store;
-	merger<specific_store_t, pred_t> m_merger;
+	merger_type m_merger;
 
 	bits::run_positions m_runPositions;
 
@@ -927,6 +2129,28 @@ private:
 	// Used to index into m_currentRunItems, so memory_size_type.
 	memory_size_type m_currentRunItemCount;
 
+	// Replacement selection or combining: the number of items in the first
+	// i+1 runs of level 0, or of level m_runEndsLevel when combining.
+	std::vector<stream_size_type, allocator<stream_size_type> > m_runEnds;
+
+	// Combining: the level of m_runEnds, and the run ends of the level above
+	// it, which is being merged into.
+	memory_size_type m_runEndsLevel;
+	std::vector<stream_size_type, allocator<stream_size_type> > m_mergedRunEnds;
+
+	// Replacement selection: the run being written, the number of items
+	// written to it, and the number of items in the heap. When combining,
+	// the last item of the run is held back in m_lastRunItem.
+	unique_ptr<file_stream<element_type> > m_runStream;
+	stream_size_type m_runItems;
+	memory_size_type m_heapSize;
+	store_type m_lastRunItem;
+
+	// Double buffering: the buffer of the run being sorted and written by
+	// m_runJob while m_currentRunItems is filled.
+	array<store_type> m_spareRunItems;
+	unique_ptr<run_job> m_runJob;
+
 	bool m_reportInternal;
 
 	// When doing internal reporting: the number of items already reported
@@ -937,13 +2161,65 @@ private:
 
 	stream_size_type m_maxItems;
 
+	// The number of smallest items kept, and an item that at least m_limit
+	// pushed items are not greater than, if known. The threshold is found
+	// from the current run and, without combining, from the written runs in
+	// m_runBounds: items sampled from them with the number of items up to the
+	// previous sample, ordered by item.
+	stream_size_type m_limit;
+	bool m_hasThreshold;
+	element_type m_threshold;
+	std::vector<std::pair<element_type, stream_size_type>,
+				allocator<std::pair<element_type, stream_size_type> > > m_runBounds;
+
+	// External reporting: the number of items pulled.
+	stream_size_type m_itemsReported;
+
+	// Distribution sort: the splitters between the buckets, the number of
+	// items in every bucket, the bucket streams written in phase 1, the bucket being reported, the number of items
+	// pulled from it and, once it is loaded, the number of items it holds
+	// after combining and the limit, or the sorter of a bucket that does not
+	// fit in memory.
+	array<element_type> m_splitters;
+	array<stream_size_type> m_bucketSizes;
+	array<file_stream<element_type> > m_bucketStreams;
+
+	memory_size_type m_bucketIndex;
+	stream_size_type m_bucketPulled;
+	bool m_bucketLoaded;
+	memory_size_type m_bucketItems;
+	unique_ptr<bucket_sorter_t> m_bucketSorter;
+
+	// Distribution sort: an evenly spread sample of the pushed items, sorted
+	// at the end of phase 1, of which the first m_sampleCount are in use.
+	// Every m_sampleStride'th item is sampled, the next after m_sampleSkip
+	// more items. With given samples, only the splitters are chosen from it.
+	array<element_type> m_samples;
+	memory_size_type m_sampleCount;
+	stream_size_type m_sampleStride;
+	stream_size_type m_sampleSkip;
+	bool m_givenSamples;
+
 	pred_t pred;
+	combine_t m_combine;
 	bool m_evacuated;
 	bool m_finalMergeInitialized;
 	memory_size_type m_finalMergeLevel;
 	memory_size_type m_finalRunCount;
 	memory_size_type m_finalMergeSpecialRunNumber;
 
+	// Concurrent final merge: the key ranges, reported in order. The first
+	// is pulled from m_merger while the others are merged into their files.
+	bool m_partitionsMerged;
+	bool m_partitionStreaming;
+	array<temp_file> m_partitionFiles;
+	array<unique_ptr<merger_type> > m_partitionMergers;
+	array<file_stream<element_type> > m_partitionOut;
+	array<unique_ptr<merge_job> > m_partitionJobs;
+	memory_size_type m_partition;
+	stream_position m_partitionPosition;
+	unique_ptr<file_stream<element_type> > m_partitionStream;
+
 	tpie::pipelining::node * m_owning_node;
 };
 
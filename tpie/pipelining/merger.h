@@ -20,43 +20,48 @@
 #ifndef __TPIE_PIPELINING_MERGER_H__
 #define __TPIE_PIPELINING_MERGER_H__
 
-#include <tpie/internal_priority_queue.h>
+#include <tpie/loser_tree.h>
 #include <tpie/compressed/stream.h>
 #include <tpie/file_stream.h>
 #include <tpie/tpie_assert.h>
 #include <tpie/pipelining/store.h>
 namespace tpie {
 
-template <typename specific_store_t, typename pred_t>
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Merges sorted runs. With a combine function (see combine.h), the
+/// items that are equal by the predicate are pulled as one combined item.
+///////////////////////////////////////////////////////////////////////////////
+template <typename specific_store_t, typename pred_t, typename combine_t = no_combine>
 class merger {
 private:
 	typedef typename specific_store_t::store_type store_type;
 	typedef typename specific_store_t::element_type element_type;
 
 	typedef bits::store_pred<pred_t, specific_store_t> store_pred_t;
+	typedef bits::store_combine<combine_t, specific_store_t> store_combine_t;
+	typedef loser_tree<store_type, store_pred_t> tree_type;
 public:
 	inline merger(pred_t pred, specific_store_t store,
-				  memory_bucket_ref bucket = memory_bucket_ref())
-		: pq(0, predwrap(store_pred_t(pred)), bucket)
+				  memory_bucket_ref bucket = memory_bucket_ref(),
+				  combine_t combine = combine_t())
+		: tree(0, store_pred_t(pred), bucket)
 		, in(bucket)
-		, itemsRead(bucket)
-		, m_store(store) {
+		, itemsLeft(bucket)
+		, m_store(store)
+		, m_pred(pred)
+		, m_combine(combine, store) {
 	}
 
 	inline bool can_pull() {
-		return !pq.empty();
+		return !tree.empty();
 	}
 
  	inline store_type pull() {
 		tp_assert(can_pull(), "pull() while !can_pull()");
-		store_type el = std::move(pq.top().first);
-		size_t i = pq.top().second;
-		if (in[i].can_read() && itemsRead[i] < runLength) {
-			pq.pop_and_push(
-				std::make_pair(m_store.element_to_store(in[i].read()), i));
-			++itemsRead[i];
-		} else {
-			pq.pop();
+		store_type el = pop();
+		if (bits::is_combining<combine_t>::value) {
+			while (can_pull() && !m_pred(el, tree.top()))
+				m_combine(el, pop());
 		}
 		if (!can_pull()) {
 			reset();
@@ -66,8 +71,8 @@ public:
 
 	inline void reset() {
 		in.resize(0);
-		pq.resize(0);
-		itemsRead.resize(0);
+		tree.resize(0);
+		itemsLeft.resize(0);
 	}
 
 	// Initialize merger with given sorted input runs. Each file stream is
@@ -76,58 +81,70 @@ public:
 	// occurs earlier).
 	// Precondition: !can_pull()
 	void reset(array<file_stream<element_type> > & inputs, stream_size_type runLength) {
-		this->runLength = runLength;
-		tp_assert(pq.empty(), "Reset before we are done");
+		tp_assert(tree.empty(), "Reset before we are done");
+		in.swap(inputs);
+		tree.resize(in.size());
+		for (size_t i = 0; i < in.size(); ++i) {
+			tree.unsafe_set(i, m_store.element_to_store(in[i].read()));
+		}
+		tree.make_safe();
+		itemsLeft.resize(in.size(), runLength - 1);
+	}
+
+	// Initialize merger with given sorted input runs of the given lengths.
+	// Each file stream is assumed to have a stream offset pointing to the
+	// first item in the run. Runs may be empty.
+	// Precondition: !can_pull()
+	void reset(array<file_stream<element_type> > & inputs, const array<stream_size_type> & runLengths) {
+		tp_assert(tree.empty(), "Reset before we are done");
+		tp_assert(inputs.size() == runLengths.size(), "Wrong number of run lengths");
 		in.swap(inputs);
-		pq.resize(in.size());
+		tree.resize(in.size());
+		itemsLeft.resize(in.size(), 0);
 		for (size_t i = 0; i < in.size(); ++i) {
-			pq.unsafe_push(
-				std::make_pair(
-					m_store.element_to_store(in[i].read()), i));
+			if (runLengths[i] == 0 || !in[i].can_read()) continue;
+			tree.unsafe_set(i, m_store.element_to_store(in[i].read()));
+			itemsLeft[i] = runLengths[i] - 1;
 		}
-		pq.make_safe();
-		itemsRead.resize(in.size(), 1);
+		tree.make_safe();
+		if (!can_pull()) reset();
 	}
 
 	inline static memory_size_type memory_usage(memory_size_type fanout) {
 		return sizeof(merger)
-			- sizeof(internal_priority_queue<std::pair<store_type, size_t>, predwrap>) // pq
-			+ static_cast<memory_size_type>(internal_priority_queue<std::pair<store_type, size_t>, predwrap>::memory_usage(fanout)) // pq
+			- sizeof(tree_type) // tree
+			+ static_cast<memory_size_type>(tree_type::memory_usage(fanout)) // tree
 			- sizeof(array<file_stream<element_type> >) // in
 			+ static_cast<memory_size_type>(array<file_stream<element_type> >::memory_usage(fanout)) // in
 			- fanout*sizeof(file_stream<element_type>) // in file_streams
 			+ fanout*file_stream<element_type>::memory_usage() // in file_streams
-			- sizeof(array<size_t>) // itemsRead
-			+ static_cast<memory_size_type>(array<size_t>::memory_usage(fanout)) // itemsRead
+			- sizeof(array<size_t>) // itemsLeft
+			+ static_cast<memory_size_type>(array<size_t>::memory_usage(fanout)) // itemsLeft
 			;
 	}
 
-	class predwrap {
-	public:
-		typedef std::pair<store_type, size_t> item_type;
-		typedef item_type first_argument_type;
-		typedef item_type second_argument_type;
-		typedef bool result_type;
-
-		predwrap(store_pred_t pred)
-			: pred(pred)
-		{
-		}
-
-		inline bool operator()(const item_type & lhs, const item_type & rhs) {
-			return pred(lhs.first, rhs.first);
+private:
+	///////////////////////////////////////////////////////////////////////////
+	/// Remove the smallest item and replace it by the next item of its run.
+	///////////////////////////////////////////////////////////////////////////
+	inline store_type pop() {
+		store_type el = std::move(tree.top());
+		size_t i = tree.top_run();
+		if (itemsLeft[i] > 0 && in[i].can_read()) {
+			tree.pop_and_push(m_store.element_to_store(in[i].read()));
+			--itemsLeft[i];
+		} else {
+			tree.pop();
 		}
+		return el;
+	}
 
-	private:
-		store_pred_t pred;
-	};
-
-private:
-	internal_priority_queue<std::pair<store_type, size_t>, predwrap> pq;
+	tree_type tree;
 	array<file_stream<element_type> > in;
-	array<stream_size_type> itemsRead;
-	stream_size_type runLength;
+	array<stream_size_type> itemsLeft;
 	specific_store_t m_store;
+	store_pred_t m_pred;
+	store_combine_t m_combine;
 };
 
 } // namespace tpie
@@ -414,11 +414,13 @@ public:
 		typedef typename store_t::template element_type<item_type>::type element_type;
 		typedef typename constructed<dest_t>::pred_type pred_type;
 
-		sort_output_t<pred_type, dest_t, store_t> output(
-			std::move(dest),
-			std::make_shared<merge_sorter<item_type, true, pred_type, store_t> > (
-				self().template get_pred<element_type>(), 
-				m_store));
+		typedef merge_sorter<item_type, true, pred_type, store_t> sorter_t;
+		typename sorter_t::ptr sorter = std::make_shared<sorter_t>(
+			self().template get_pred<element_type>(),
+			m_store);
+		if (m_limit != std::numeric_limits<stream_size_type>::max())
+			sorter->set_limit(m_limit);
+		sort_output_t<pred_type, dest_t, store_t> output(std::move(dest), std::move(sorter));
 		this->init_sub_node(output);
 		sort_calc_t<item_type, pred_type, store_t> calc(std::move(output));
 		this->init_sub_node(calc);
@@ -428,9 +430,14 @@ public:
 		return std::move(input);
 	}
 
-	sort_factory_base(store_t store): m_store(store) {}
+	sort_factory_base(store_t store, stream_size_type limit)
+		: m_store(store)
+		, m_limit(limit)
+	{
+	}
 private:
 	store_t m_store;
+	stream_size_type m_limit;
 
 };
 
@@ -451,8 +458,9 @@ public:
 		return std::less<T>();
 	}
 
-	default_pred_sort_factory(const store_t & store)
-		: sort_factory_base<default_pred_sort_factory<store_t>, store_t>(store) 
+	default_pred_sort_factory(const store_t & store,
+							  stream_size_type limit = std::numeric_limits<stream_size_type>::max())
+		: sort_factory_base<default_pred_sort_factory<store_t>, store_t>(store, limit)
 	{
 	}
 };
@@ -469,8 +477,9 @@ public:
 		typedef pred_t type;
 	};
 
-	sort_factory(const pred_t & p, const store_t & store)
-		: sort_factory_base<sort_factory<pred_t, store_t>, store_t>(store)
+	sort_factory(const pred_t & p, const store_t & store,
+				 stream_size_type limit = std::numeric_limits<stream_size_type>::max())
+		: sort_factory_base<sort_factory<pred_t, store_t>, store_t>(store, limit)
 		, pred(p)
 	{
 	}
@@ -526,6 +535,27 @@ sort(const pred_t & p, store_t store) {
 	return pipe_middle<fact>(fact(p, store)).name("Sort");
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Pipelining node pushing the k smallest items in order, using
+/// std::less. See merge_sorter::set_limit.
+///////////////////////////////////////////////////////////////////////////////
+inline pipe_middle<bits::default_pred_sort_factory<default_store> >
+partial_sort(stream_size_type k) {
+	typedef bits::default_pred_sort_factory<default_store> fact;
+	return pipe_middle<fact>(fact(default_store(), k)).name("Partial sort");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Pipelining node pushing the k smallest items in order, using the
+/// given predicate.
+///////////////////////////////////////////////////////////////////////////////
+template <typename pred_t>
+inline pipe_middle<bits::sort_factory<pred_t, default_store> >
+partial_sort(stream_size_type k, const pred_t & p) {
+	typedef bits::sort_factory<pred_t, default_store> fact;
+	return pipe_middle<fact>(fact(p, default_store(), k)).name("Partial sort");
+}
+
 template <typename T, typename pred_t=std::less<T>, typename store_t=default_store>
 class passive_sorter;
 
@@ -51,18 +51,49 @@ struct sort_parameters {
 	memory_size_type fanout;
 	/** Fanout of merge tree during phase 3. Less or equal to fanout. */
 	memory_size_type finalFanout;
+	/** Number of merges of a merge level in phase 2 that may run
+	 * concurrently. Zero or one means that the merges run one at a time. */
+	memory_size_type mergeThreads;
+	/** Number of key ranges that the final merge is split into and merged
+	 * concurrently. Zero or one means a single sequential final merge. */
+	memory_size_type finalMergeThreads;
+	/** Whether runs are formed by replacement selection rather than by
+	 * sorting a full buffer at a time. */
+	bool replacementSelection;
+	/** Whether a full run is sorted and written by a background job while
+	 * the next run is filled. Phase 1 memory is split between two run
+	 * buffers. */
+	bool doubleBuffering;
+	/** Whether items are distributed into buckets by splitters sampled from
+	 * the first run, and every bucket is sorted on its own when reported,
+	 * instead of forming and merging runs. */
+	bool distribution;
+	/** Distribution sort: the most buckets, each of which has a stream held
+	 * open in phase 1. At most twice the fanout and the phase 1 files. */
+	memory_size_type distributionBuckets;
+	/** Distribution sort: the size of the sample of the pushed items kept
+	 * until the buckets are reported, to choose the splitters of a bucket
+	 * that does not fit in memory. */
+	memory_size_type distributionSamples;
 
 	void dump(std::ostream & out) const {
 		out << "Merge sort parameters\n"
 			<< "Phase 1 files:               " << filesPhase1 << '\n'
 			<< "Phase 1 memory:              " << memoryPhase1 << '\n'
 			<< "Run length:                  " << runLength << '\n'
+			<< "Replacement selection:       " << replacementSelection << '\n'
+			<< "Double buffered runs:        " << doubleBuffering << '\n'
+			<< "Distribution sort:           " << distribution << '\n'
+			<< "Distribution buckets:        " << distributionBuckets << '\n'
+			<< "Distribution samples:        " << distributionSamples << '\n'
 			<< "Phase 2 files:               " << filesPhase2 << '\n'
 			<< "Phase 2 memory:              " << memoryPhase2 << '\n'
 			<< "Fanout:                      " << fanout << '\n'
+			<< "Concurrent merges:           " << mergeThreads << '\n'
 			<< "Phase 3 files:               " << filesPhase3 << '\n'
 			<< "Phase 3 memory:              " << memoryPhase3 << '\n'
 			<< "Final merge level fanout:    " << finalFanout << '\n'
+			<< "Final merge partitions:      " << finalMergeThreads << '\n'
 			<< "Internal report threshold:   " << internalReportThreshold << '\n';
 	}
 };
@@ -20,6 +20,7 @@
 #ifndef __TPIE_PIPELINING_STORE_H__
 #define __TPIE_PIPELINING_STORE_H__
 #include <tpie/memory.h>
+#include <tpie/combine.h>
 namespace tpie {
 
 namespace bits {
@@ -50,6 +51,26 @@ public:
 			specific_store_t::store_as_element(rhs));
 	}
 };
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Applies a combine function (see combine.h) to stores. The store
+/// that is combined into another is released.
+///////////////////////////////////////////////////////////////////////////////
+template <typename combine_t, typename specific_store_t>
+class store_combine {
+private:
+	typedef typename specific_store_t::store_type store_type;
+	combine_t combine;
+	specific_store_t store;
+public:
+	store_combine(combine_t combine, specific_store_t store): combine(combine), store(store) {}
+
+	void operator()(store_type & into, store_type && from) {
+		combine(specific_store_t::store_as_element(into),
+				specific_store_t::store_as_element(from));
+		store.store_to_element(std::move(from));
+	}
+};
 } //namespace bits
 
 /**
@@ -77,6 +98,7 @@ struct plain_store {
 		element_type store_to_element(const store_type & e) {return e;}
 		store_type element_to_store(const element_type & e) {return e;}
 		static const element_type & store_as_element(const store_type & e) {return e;}
+		static element_type & store_as_element(store_type & e) {return e;}
 		store_type outer_to_store(const outer_type & e) {return e;}
 		outer_type store_to_outer(const store_type & e) {return e;}
 	};
@@ -114,7 +136,7 @@ struct explicit_tpie_pointer_store {
 			return ans;
 		}
 		store_type element_to_store(const element_type & e) {return tpie_new<element_type>(e);}
-		static const element_type & store_as_element(const store_type e) {return *e;}
+		static element_type & store_as_element(const store_type e) {return *e;}
 		store_type outer_to_store(const outer_type & e) {return e;}
 		outer_type store_to_outer(const store_type & e) {return e;}
 	};
@@ -148,7 +170,7 @@ struct explicit_tpie_unique_pointer_store {
 		store_type element_to_store(const element_type & e) {
 			return outer_type(tpie_new<element_type>(e));
 		}
-		static const element_type & store_as_element(const store_type & e) {return *e;}
+		static element_type & store_as_element(const store_type & e) {return *e;}
 		store_type outer_to_store(outer_type e) {return std::move(e);}
 		outer_type store_to_outer(store_type e) {return std::move(e);}
 	};
@@ -183,7 +205,7 @@ struct pointer_store {
 			return ans;
 		}
 		store_type element_to_store(const element_type & e) {return tpie_new<element_type>(e);}
-		static const element_type & store_as_element(const store_type e) {return *e;}
+		static element_type & store_as_element(const store_type e) {return *e;}
 		store_type outer_to_store(const outer_type & e) {return tpie_new<element_type>(e);}
 		outer_type store_to_outer(const store_type & e) {
 			outer_type ans=*e;
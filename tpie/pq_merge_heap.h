@@ -28,6 +28,7 @@
 #include "tpie_log.h"
 #include <cassert>
 #include <tpie/memory.h>
+#include <tpie/loser_tree.h>
 
 namespace tpie{
 
@@ -36,6 +37,10 @@ namespace tpie{
 /// \author Lars Hvam Petersen
 ///
 /// pq_merge_heap
+///
+/// Merges up to a fixed number of runs with a loser tree. The tree is built
+/// when the first element is inspected or removed, so all runs must be
+/// pushed before that.
 ///////////////////////////////////////////////////////////////////////////////
 template<typename T, typename Comparator = std::less<T> >
 class pq_merge_heap {
@@ -72,7 +77,7 @@ class pq_merge_heap {
 		/// another.
 		///
 		/// \param x The item.
-		/// \param run Where it comes from.
+		/// \param run Where it comes from. Must be the run of the top element.
 		///////////////////////////////////////////////////////////////////////
 		void pop_and_push(const T& x, run_type run);
 
@@ -105,16 +110,12 @@ class pq_merge_heap {
 		bool empty() const;
 
 	private:
-		void fixDown();
-		void validate();
-		void dump();
-
-		memory_size_type m_size;
-		Comparator comp_;
+		void build() const;
 
-		T* heap;
-		run_type* runs;
-		memory_size_type maxsize;
+		mutable loser_tree<T, Comparator> m_tree;
+		mutable bool m_built;
+		array<run_type> m_runs;
+		memory_size_type m_pushed;
 };
 
 #include "pq_merge_heap.inl"
@@ -19,88 +19,66 @@
 
 
 template <typename T, typename Comparator>
-pq_merge_heap<T, Comparator>::pq_merge_heap(memory_size_type elements) {
-	maxsize = elements;
-	heap = tpie_new_array<T>(elements);
-	runs = tpie_new_array<run_type>(elements);
-	m_size = 0;
+pq_merge_heap<T, Comparator>::pq_merge_heap(memory_size_type elements)
+	: m_tree(elements)
+	, m_built(false)
+	, m_runs(elements)
+	, m_pushed(0)
+{
 }
 
 template <typename T, typename Comparator>
 pq_merge_heap<T, Comparator>::~pq_merge_heap() {
-  tpie_delete_array(heap, maxsize);
-  tpie_delete_array(runs, maxsize);
 }
 
 template <typename T, typename Comparator>
 void pq_merge_heap<T, Comparator>::push(const T& x, run_type run) {
-	assert(m_size < maxsize);
-	heap[m_size] = x;
-	runs[m_size] = run;
-	stream_offset_type parent;
-	stream_offset_type child;
-	child = m_size;
-	parent = ( child - 1 ) / 2;
-	m_size++;
-	//cout << "pq_merge_heap: push" << endl;
-	while(parent >= 0 && comp_(heap[child],heap[parent])) {
-		//cout << "pq_merge_heap: fixup, child: " << heap[child] << " parent:" << heap[parent] << endl;
-		std::swap(heap[child],heap[parent]);
-		std::swap(runs[child],runs[parent]);
-		child = parent;
-		parent = ( child - 1 ) / 2;
-	}
-#ifndef NDEBUG
-	validate();
-#endif
+	assert(!m_built);
+	assert(m_pushed < m_runs.size());
+	m_tree.unsafe_set(m_pushed, x);
+	m_runs[m_pushed] = run;
+	++m_pushed;
 }
 
 template <typename T, typename Comparator>
 void pq_merge_heap<T, Comparator>::pop() {
-	assert(m_size > 0);
-	m_size--;
-	if(m_size != 0) {
-		heap[0] = heap[m_size];
-		runs[0] = runs[m_size];
-		fixDown();
-	}
-#ifndef NDEBUG
-	validate();
-#endif
+	build();
+	assert(m_tree.size() > 0);
+	m_tree.pop();
 }
 
 template <typename T, typename Comparator>
 void pq_merge_heap<T, Comparator>::pop_and_push(const T& x, run_type run) {
-	assert(m_size > 0);
-	heap[0] = x;
-	runs[0] = run;
-	fixDown();
-#ifndef NDEBUG
-	validate();
-#endif
+	build();
+	assert(m_tree.size() > 0);
+	assert(m_runs[m_tree.top_run()] == run);
+	unused(run);
+	m_tree.pop_and_push(x);
 }
 
 template <typename T, typename Comparator>
 const T& pq_merge_heap<T, Comparator>::top() const {
-	assert(m_size > 0);
-	return heap[0];
+	build();
+	assert(m_tree.size() > 0);
+	return m_tree.top();
 }
 
 template <typename T, typename Comparator>
 typename pq_merge_heap<T, Comparator>::run_type
 pq_merge_heap<T, Comparator>::top_run() const {
-	assert(m_size > 0);
-	return runs[0];
+	build();
+	assert(m_tree.size() > 0);
+	return m_runs[m_tree.top_run()];
 }
 
 template <typename T, typename Comparator>
 memory_size_type pq_merge_heap<T, Comparator>::size() const {
-	return m_size;
+	return m_tree.size();
 }
 
 template <typename T, typename Comparator>
 bool pq_merge_heap<T, Comparator>::empty() const {
-	return m_size == 0;
+	return m_tree.empty();
 }
 
 ///////////////////////////////////////
@@ -108,91 +86,8 @@ bool pq_merge_heap<T, Comparator>::empty() const {
 ///////////////////////////////////////
 
 template <typename T, typename Comparator>
-void pq_merge_heap<T, Comparator>::fixDown() {
-	stream_offset_type parent, child1, child2;
-	assert(m_size > 0);
-	bool done = false;
-	if(m_size == 1) done = true;
-	parent = 0;
-	child1 = parent * 2 + 1;
-	child2 = parent * 2 + 2;
-
-	//cout << "Loop Start, heap size:" << m_size<< endl;
-	while(!done) {
-		//cout << "pq_merge_heap: loop top" << child1 << " " << child2 << " " << m_size << endl;
-		assert(m_size>0);
-		if(child1 == static_cast<stream_offset_type>(m_size-1)) {
-			//cout << "pq_merge_heap: fixdown 0" << endl;
-			if(comp_(heap[child1],heap[parent])) {
-				//cout << "pq_merge_heap: swap, fixdown 0 " << heap[child1] << " " << heap[parent] << endl;
-				assert(child1 < static_cast<stream_offset_type>(maxsize));
-				assert(parent < static_cast<stream_offset_type>(maxsize));
-				std::swap(heap[child1],heap[parent]);
-				std::swap(runs[child1],runs[parent]);
-			}
-			done = true;
-			continue;
-		} 
-		if(child1 > static_cast<stream_offset_type>(m_size-1)) {
-			//cout << "pq_merge_heap done 1" << endl;
-			done = true;
-			continue;
-		}
-		if(child2 > static_cast<stream_offset_type>(m_size-1)) {
-			//cout << "pq_merge_heap done 2" << endl;
-			done = true;
-			continue;
-		}
-		//cout << "pq_merge_heap: loop step " << child1 << " " << child2 << " " << parent << " " << m_size << endl; 
-		if(comp_(heap[child1],heap[child2]) && comp_(heap[child1],heap[parent])) {
-			//cout << "pq_merge_heap: fixdown 1: " << heap[child1] << "(" << child1 << ") " << heap[parent] << "("<<parent << ")" << endl;
-			assert(child1 < static_cast<stream_offset_type>(maxsize));
-			assert(parent < static_cast<stream_offset_type>(maxsize));
-			std::swap(heap[child1],heap[parent]);
-			std::swap(runs[child1],runs[parent]);
-			parent = child1;
-		} else if(comp_(heap[child2],heap[parent])) {
-			//cout << "pq_merge_heap: fixdown 2: " << heap[child2] << "(" << child2 << ") " << heap[parent] << "("<<parent << ")" << endl;
-			assert(child2 < static_cast<stream_offset_type>(maxsize));
-			assert(parent < static_cast<stream_offset_type>(maxsize));
-			std::swap(heap[child2],heap[parent]);
-			std::swap(runs[child2],runs[parent]);
-			parent = child2;
-		} else {
-			done = true; 
-			continue;
-		}
-		child1 = parent * 2 + 1;
-		child2 = parent * 2 + 2;
-	}
-}
-
-template <typename T, typename Comparator>
-void pq_merge_heap<T, Comparator>::validate() {
-#ifndef NDEBUG
-#ifdef PQ_VALIDATE
-	memory_size_type child1, child2;
-	for(memory_size_type i = 0; i<m_size; i++) {
-		child1 = i * 2 + 1;
-		child2 = i * 2 + 2;
-		if(child1<m_size) {
-			if(comp_(heap[child1],heap[i])) dump();
-			assert(!comp_(heap[child1],heap[i]));
-		}
-		if(child2<m_size) {
-			if(comp_(heap[child2],heap[i])) dump();
-			assert(!comp_(heap[child2],heap[i]));
-		}
-	}
-#endif
-#endif
-}
-
-template <typename T, typename Comparator>
-void pq_merge_heap<T, Comparator>::dump() {
-	TP_LOG_DEBUG("pq_merge_heap: "); 
-	for(memory_size_type i = 0; i<m_size; i++) {
-		TP_LOG_DEBUG(heap[i] << ", ");
-	}
-	TP_LOG_DEBUG("\n");
+void pq_merge_heap<T, Comparator>::build() const {
+	if (m_built) return;
+	m_tree.make_safe();
+	m_built = true;
 }
@@ -83,11 +83,16 @@ void priority_queue<T, Comparator, OPQType>::init(memory_size_type mm_avail, str
 
 		memory_size_type alloc_overhead = 0;
 
+		//Per run, the loser tree of the mergeheap keeps an item, an active
+		//flag and a tree node, and the mergeheap keeps the run number
+		const memory_size_type mergeheap_overhead = sizeof(T) + sizeof(bool)
+			+ sizeof(memory_size_type)
+			+ sizeof(typename pq_merge_heap<T, Comparator>::run_type);
 
 		//Compute overhead of the parameters
 		const memory_size_type fanout_overhead = 2*sizeof(stream_size_type)// group state
 			+ (usage+sizeof(file_stream<T>*)+alloc_overhead) //temporary streams
-			+ (sizeof(T)+sizeof(group_type)); //mergeheap
+			+ mergeheap_overhead; //mergeheap
 		const memory_size_type sq_fanout_overhead = 3*sizeof(stream_size_type); //slot_state
 		const memory_size_type heap_m_overhead = sizeof(T) //opg
 			+ sizeof(T) //gbuffer0
@@ -96,7 +101,7 @@ void priority_queue<T, Comparator, OPQType>::init(memory_size_type mm_avail, str
 		const memory_size_type buffer_m_overhead = sizeof(T) + 2*sizeof(T); //buffer
 		const memory_size_type extra_overhead =
 			  2*(usage+sizeof(file_stream<T>*)+alloc_overhead) //temporary streams
-			+ 2*(sizeof(T)+sizeof(group_type)); //mergeheap
+			+ 2*mergeheap_overhead; //mergeheap
 		const memory_size_type additional_overhead = 16*1024; //Just leave a bit unused
 		TP_LOG_DEBUG("fanout_overhead     " << fanout_overhead     << ",\n" <<
 		             "sq_fanout_overhead  " << sq_fanout_overhead  << ",\n" <<
@@ -20,7 +20,6 @@
 #ifndef TPIE_SERIALIZATION_SORTER_H
 #define TPIE_SERIALIZATION_SORTER_H
 
-#include <queue>
 #include <boost/filesystem.hpp>
 
 #include <tpie/array.h>
@@ -28,7 +27,9 @@
 #include <tpie/tempname.h>
 #include <tpie/tpie_log.h>
 #include <tpie/stats.h>
-#include <tpie/parallel_sort.h>
+#include <tpie/parallel_radix_sort.h>
+#include <tpie/loser_tree.h>
+#include <tpie/combine.h>
 
 #include <tpie/serialization2.h>
 #include <tpie/serialization_stream.h>
@@ -56,6 +57,8 @@ struct sort_parameters {
 	memory_size_type minimumItemSize;
 	/** Directory in which temporary files are stored. */
 	std::string tempDir;
+	/** Compression of the run files. */
+	compression_flags runCompression;
 
 	void dump(std::ostream & out) const {
 		out << "Serialization merge sort parameters\n"
@@ -66,7 +69,8 @@ struct sort_parameters {
 			<< "Phase 3 files:               " << filesPhase3 << '\n'
 			<< "Phase 3 memory:              " << memoryPhase3 << '\n'
 			<< "Minimum item size:           " << minimumItemSize << '\n'
-			<< "Temporary directory:         " << tempDir << '\n';
+			<< "Temporary directory:         " << tempDir << '\n'
+			<< "Run compression:             " << static_cast<int>(runCompression) << '\n';
 	}
 };
 
@@ -190,7 +194,15 @@ public:
 	}
 
 	void sort() {
-		parallel_sort(m_buffer.get(), m_buffer.get() + m_items, m_pred);
+		radix_or_parallel_sort(m_buffer.get(), m_buffer.get() + m_items, m_pred);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Combine the equal items of the sorted buffer (see combine.h).
+	///////////////////////////////////////////////////////////////////////////
+	template <typename combine_t>
+	void combine(combine_t combine) {
+		m_items = combine_sorted(m_buffer.get(), m_buffer.get() + m_items, m_pred, combine) - m_buffer.get();
 	}
 
 	const T * begin() const {
@@ -275,6 +287,7 @@ class file_handler {
 
 	serialization_writer m_writer;
 	stream_size_type m_currentWriterByteSize;
+	compression_flags m_compression;
 
 	array<serialization_reader> m_readers;
 
@@ -298,6 +311,7 @@ public:
 
 		, m_writer()
 		, m_currentWriterByteSize(0)
+		, m_compression(compression_none)
 	{
 	}
 
@@ -311,9 +325,13 @@ public:
 		m_tempDir = tempDir;
 	}
 
+	void set_compression(compression_flags compression) {
+		m_compression = compression;
+	}
+
 	void open_new_writer() {
 		if (m_writerOpen) throw exception("open_new_writer: Writer already open");
-		m_writer.open(run_file(m_nextFileOffset++));
+		m_writer.open(run_file(m_nextFileOffset++), m_compression);
 		m_currentWriterByteSize = m_writer.file_size();
 		m_writerOpen = true;
 	}
@@ -427,77 +445,57 @@ private:
 
 template <typename T, typename pred_t>
 class merger {
-	class mergepred_t {
-		pred_t m_pred;
-
-	public:
-		typedef std::pair<T, size_t> item_type;
-
-		mergepred_t(const pred_t & pred) : m_pred(pred) {}
-
-		// Used with std::priority_queue, so invert the original relation.
-		bool operator()(const item_type & a, const item_type & b) const {
-			return m_pred(b.first, a.first);
-		}
-	};
-
-	typedef typename mergepred_t::item_type item_type;
-
 	file_handler<T> & files;
-	pred_t pred;
-	std::vector<serialization_reader> rd;
-	typedef std::priority_queue<item_type, std::vector<item_type>, mergepred_t> priority_queue_type;
-	priority_queue_type pq;
+	loser_tree<T, pred_t> tree;
 
 public:
 	merger(file_handler<T> & files, const pred_t & pred)
 		: files(files)
-		, pred(pred)
-		, pq(mergepred_t(pred))
+		, tree(0, pred)
 	{
 	}
 
 	// Assume files.open_readers(fanout) has just been called
 	void init(size_t fanout) {
-		rd.resize(fanout);
-		for (size_t i = 0; i < fanout; ++i)
-			push_from(i);
+		tree.resize(fanout);
+		for (size_t i = 0; i < fanout; ++i) {
+			if (files.can_read(i))
+				tree.unsafe_set(i, files.read(i));
+		}
+		tree.make_safe();
 	}
 
 	bool empty() const {
-		return pq.empty();
+		return tree.empty();
 	}
 
 	const T & top() const {
-		return pq.top().first;
+		return tree.top();
 	}
 
 	void pop() {
-		size_t idx = pq.top().second;
-		pq.pop();
-		push_from(idx);
+		size_t idx = tree.top_run();
+		if (files.can_read(idx)) {
+			tree.pop_and_push(files.read(idx));
+		} else {
+			tree.pop();
+		}
 	}
 
 	// files.close_readers_and_delete() should be called after this
 	void free() {
-		{
-			priority_queue_type tmp(pred);
-			std::swap(pq, tmp);
-		}
-		rd.resize(0);
-	}
-
-private:
-	void push_from(size_t idx) {
-		if (files.can_read(idx)) {
-			pq.push(std::make_pair(files.read(idx), idx));
-		}
+		tree.resize(0);
 	}
 };
 
 } // namespace serialization_bits
 
-template <typename T, typename pred_t = std::less<T> >
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Merge sorter of serializable items. With a combine function other
+/// than no_combine (see combine.h), items that are equal by the predicate are
+/// combined into one when a run is formed and in every merge.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T, typename pred_t = std::less<T>, typename combine_t = no_combine>
 class serialization_sorter {
 public:
 	typedef std::shared_ptr<serialization_sorter> ptr;
@@ -522,6 +520,10 @@ private:
 	bool m_reportInternal;
 	const T * m_nextInternalItem;
 
+	pred_t m_pred;
+	combine_t m_combine;
+	static const bool combining = bits::is_combining<combine_t>::value;
+
 	static const memory_size_type defaultFiles = 253; // Default number of files available, when not using set_available_files
 	static const memory_size_type minimumFilesPhase1 = 1;
 	static const memory_size_type maximumFilesPhase1 = 1;
@@ -533,7 +535,8 @@ private:
 	const int defaultMaxFiles = 253;
 
 public:
-	serialization_sorter(memory_size_type minimumItemSize = sizeof(T), pred_t pred = pred_t())
+	serialization_sorter(memory_size_type minimumItemSize = sizeof(T), pred_t pred = pred_t(),
+						 combine_t combine = combine_t())
 		: m_buffer_bucket_ptr(new memory_bucket())
 		, m_buffer_bucket(memory_bucket_ref(m_buffer_bucket_ptr.get()))
 		, m_item_bucket_ptr(new memory_bucket())
@@ -547,6 +550,8 @@ public:
 		, m_items(0)
 		, m_reportInternal(false)
 		, m_nextInternalItem(0)
+		, m_pred(pred)
+		, m_combine(combine)
 	{
 		m_params.filesPhase1 = 0;
 		m_params.filesPhase2 = 0;
@@ -555,6 +560,7 @@ public:
 		m_params.memoryPhase2 = 0;
 		m_params.memoryPhase3 = 0;
 		m_params.minimumItemSize = minimumItemSize;
+		m_params.runCompression = compression_none;
 	}
 
 private:
@@ -630,6 +636,17 @@ public:
 		set_phase_3_memory(m3);
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Compress the run files; see serialization_writer::open.
+	/// Readers and writers of compressed runs use more memory, which is
+	/// taken from the memory available to each phase.
+	///////////////////////////////////////////////////////////////////////////
+	void set_run_compression(compression_flags compression) {
+		m_params.runCompression = compression;
+		check_not_started();
+	}
+
+	// The minimum memory is that of a sort that does not compress its runs.
 	static memory_size_type minimum_memory_phase_1() {
 		return serialization_writer::memory_usage()*2;
 	}
@@ -649,7 +666,7 @@ public:
 		if (m_reportInternal)
 			return m_sorter.memory_usage();
 		else
-			return m_files.next_level_runs() * (m_sorter.get_largest_item_size() + serialization_reader::memory_usage());
+			return m_files.next_level_runs() * (m_sorter.get_largest_item_size() + reader_memory_usage());
 	}
 
 	void set_owner(pipelining::node * n) {
@@ -666,6 +683,14 @@ public:
 		m_owning_node = n;
 	}
 private:
+	memory_size_type writer_memory_usage() const {
+		return serialization_writer::memory_usage(m_params.runCompression != compression_none);
+	}
+
+	memory_size_type reader_memory_usage() const {
+		return serialization_reader::memory_usage(m_params.runCompression != compression_none);
+	}
+
 	static memory_size_type clamp(memory_size_type lo, memory_size_type val, memory_size_type hi) {
 		return std::max(lo, std::min(val, hi));
 	}
@@ -689,9 +714,9 @@ private:
 			throw tpie::exception("file limit for phase 3 too small (" + std::to_string(m_params.filesPhase3) + " < " + std::to_string(minimumFilesPhase3) + ")");
 
 		memory_size_type memAvail1 = m_params.memoryPhase1;
-		if (memAvail1 <= serialization_writer::memory_usage()) {
+		if (memAvail1 <= writer_memory_usage()) {
 			log_error() << "Not enough memory for run formation; have " << memAvail1
-				<< " bytes but " << serialization_writer::memory_usage()
+				<< " bytes but " << writer_memory_usage()
 				<< " is required for writing a run." << std::endl;
 			throw exception("Not enough memory for run formation");
 		}
@@ -699,10 +724,10 @@ private:
 		memory_size_type memAvail2 = m_params.memoryPhase2;
 
 		// We have to keep a writer open no matter what.
-		if (memAvail2 <= serialization_writer::memory_usage()) {
+		if (memAvail2 <= writer_memory_usage()) {
 			log_error() << "Not enough memory for merging. "
 				<< "mem avail = " << memAvail2
-				<< ", writer usage = " << serialization_writer::memory_usage()
+				<< ", writer usage = " << writer_memory_usage()
 				<< std::endl;
 			throw exception("Not enough memory for merging.");
 		}
@@ -710,10 +735,10 @@ private:
 		memory_size_type memAvail3 = m_params.memoryPhase3;
 
 		// We have to keep a writer open no matter what.
-		if (memAvail2 <= serialization_writer::memory_usage()) {
+		if (memAvail2 <= writer_memory_usage()) {
 			log_error() << "Not enough memory for outputting. "
 				<< "mem avail = " << memAvail3
-				<< ", writer usage = " << serialization_writer::memory_usage()
+				<< ", writer usage = " << writer_memory_usage()
 				<< std::endl;
 			throw exception("Not enough memory for outputting.");
 		}
@@ -725,10 +750,10 @@ private:
 		// Instead, we assume that all items have minimum size.
 
 		// We have to keep a writer open no matter what.
-		memory_size_type fanoutMemory = memForMerge - serialization_writer::memory_usage();
+		memory_size_type fanoutMemory = memForMerge - writer_memory_usage();
 
 		// This is a lower bound on the memory used per fanout.
-		memory_size_type perFanout = m_params.minimumItemSize + serialization_reader::memory_usage();
+		memory_size_type perFanout = m_params.minimumItemSize + reader_memory_usage();
 
 		// Floored division to compute the largest possible fanout.
 		memory_size_type fanout = std::min(fanoutMemory / perFanout, m_params.filesPhase2 - 1);
@@ -743,6 +768,7 @@ private:
 
 		m_params.tempDir = tempname::tpie_dir_name();
 		m_files.set_temp_dir(m_params.tempDir);
+		m_files.set_compression(m_params.runCompression);
 
 		log_debug() << "Calculated serialization_sorter parameters.\n";
 		m_params.dump(log_debug());
@@ -761,7 +787,7 @@ public:
 
 		log_debug() << "Before begin; mem usage = "
 			<< get_memory_manager().used() << std::endl;
-		m_sorter.begin(m_params.memoryPhase1 - serialization_writer::memory_usage());
+		m_sorter.begin(m_params.memoryPhase1 - writer_memory_usage());
 		log_debug() << "After internal sorter begin; mem usage = "
 			<< get_memory_manager().used() << std::endl;
 		boost::filesystem::create_directory(m_params.tempDir);
@@ -799,7 +825,7 @@ public:
 			&& m_sorter.memory_usage()
 			   <= internalThreshold) {
 
-			m_sorter.sort();
+			sort_run();
 			m_reportInternal = true;
 			m_nextInternalItem = m_sorter.begin();
 			log_debug() << "Got " << m_sorter.current_serialized_size()
@@ -808,7 +834,7 @@ public:
 				   && m_sorter.current_serialized_size() <= internalThreshold
 				   && m_sorter.can_shrink_buffer()) {
 
-			m_sorter.sort();
+			sort_run();
 			m_sorter.shrink_buffer();
 			m_reportInternal = true;
 			m_nextInternalItem = m_sorter.begin();
@@ -865,8 +891,8 @@ public:
 		if (m_reportInternal) return true;
 
 		memory_size_type largestItem = m_sorter.get_largest_item_size();
-		memory_size_type fanoutMemory = m_params.memoryPhase2 - serialization_writer::memory_usage();
-		memory_size_type perFanout = largestItem + serialization_reader::memory_usage();
+		memory_size_type fanoutMemory = m_params.memoryPhase2 - writer_memory_usage();
+		memory_size_type perFanout = largestItem + reader_memory_usage();
 		memory_size_type fanout = std::min(m_params.filesPhase2 - 1, fanoutMemory / perFanout);
 		
 		memory_size_type finalFanoutMemory = m_params.memoryPhase3;
@@ -893,13 +919,13 @@ public:
 			return;
 		}
 
-		if (m_params.memoryPhase2 <= serialization_writer::memory_usage())
+		if (m_params.memoryPhase2 <= writer_memory_usage())
 			throw exception("Not enough memory for merging.");
 
 		// Perform almost the same computation as in calculate_parameters.
 		// Only change the item size to largestItem rather than minimumItemSize.
-		memory_size_type fanoutMemory = m_params.memoryPhase2 - serialization_writer::memory_usage();
-		memory_size_type perFanout = largestItem + serialization_reader::memory_usage();
+		memory_size_type fanoutMemory = m_params.memoryPhase2 - writer_memory_usage();
+		memory_size_type perFanout = largestItem + reader_memory_usage();
 		memory_size_type fanout = std::min(fanoutMemory / perFanout, m_params.filesPhase2 - 1);
 
 		if (fanout < 2) {
@@ -946,8 +972,32 @@ public:
 	}
 
 private:
-	void end_run() {
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Sort the items in the buffer and combine the equal ones.
+	///////////////////////////////////////////////////////////////////////////
+	void sort_run() {
 		m_sorter.sort();
+		if (combining) m_sorter.combine(m_combine);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Pop the smallest item of the merger, combined with the items
+	/// equal to it.
+	///////////////////////////////////////////////////////////////////////////
+	T pop_merged() {
+		T item = m_merger.top();
+		m_merger.pop();
+		if (combining) {
+			while (!m_merger.empty() && !m_pred(item, m_merger.top())) {
+				m_combine(item, m_merger.top());
+				m_merger.pop();
+			}
+		}
+		return item;
+	}
+
+	void end_run() {
+		sort_run();
 		if (m_sorter.begin() == m_sorter.end()) return;
 		m_files.open_new_writer();
 		for (const T * item = m_sorter.begin(); item != m_sorter.end(); ++item) {
@@ -979,6 +1029,10 @@ private:
 		initialize_merger(fanout);
 		m_files.open_new_writer();
 		while (!m_merger.empty()) {
+			if (combining) {
+				m_files.write(pop_merged());
+				continue;
+			}
 			m_files.write(m_merger.top());
 			m_merger.pop();
 		}
@@ -1006,8 +1060,7 @@ public:
 			initialize_merger(m_files.next_level_runs());
 		}
 
-		T item = m_merger.top();
-		m_merger.pop();
+		T item = pop_merged();
 
 		if (m_merger.empty()) {
 			free_merger_and_files();
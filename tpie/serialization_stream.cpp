@@ -19,6 +19,9 @@
 
 #include <tpie/serialization_stream.h>
 #include <tpie/array.h>
+#include <tpie/compressed/thread.h>
+#include <tpie/compressed/buffer.h>
+#include <tpie/compressed/request.h>
 #include <algorithm>
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -83,6 +86,15 @@ public:
 			throw stream_exception("Reverse flag is not a boolean");
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Whether the stream is compressed. The compressor thread writes
+	/// compressed streams through a byte stream accessor, which gives them
+	/// the header of a TPIE stream instead.
+	///////////////////////////////////////////////////////////////////////////
+	bool compressed() {
+		return m_header.magic == tpie::stream_header_t::magicConst;
+	}
+
 	stream_size_type get_size() {
 		return m_header.size;
 	}
@@ -126,6 +138,42 @@ private:
 	file_accessor::raw_file_accessor & m_fileAccessor;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+/// \brief User data of a compressed serialization stream, which tells it
+/// apart from other compressed streams.
+///////////////////////////////////////////////////////////////////////////////
+#pragma pack(push, 1)
+struct serialization_user_data {
+	static const uint64_t magicConst = 0xfa340f49edbada67ll;
+
+	uint64_t magic;
+	char reverse;
+};
+#pragma pack(pop)
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief The parts of a compressed serialization stream that the compressor
+/// thread refers to, which stay in place when the stream is moved.
+///////////////////////////////////////////////////////////////////////////////
+struct serialization_compressed_state {
+	compressor_thread::file_accessor_t fileAccessor;
+	compressor_response response;
+	/** Writers: The block handed to the compressor thread.
+	 * Readers: The block last read. */
+	std::shared_ptr<compressor_buffer> buffer;
+	/** Readers: The block read ahead. */
+	std::shared_ptr<compressor_buffer> nextBuffer;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief Size of the header of a compressed serialization stream, which is
+/// laid out by the byte stream accessor.
+///////////////////////////////////////////////////////////////////////////////
+inline memory_size_type compressed_header_size() {
+	return compressor_thread::file_accessor_t::align_to_boundary(
+		sizeof(stream_header_t) + sizeof(serialization_user_data));
+}
+
 } // namespace bits
 
 } // namespace tpie
@@ -167,18 +215,33 @@ namespace bits {
 serialization_writer_base::serialization_writer_base()
 	: m_blocksWritten(0)
 	, m_size(0)
+	, m_dataSize(0)
 	, m_open(false)
+	, m_compressionFlags(compression_none)
 	, m_tempFile(0)
 {
 }
 
-void serialization_writer_base::open_inner(std::string path, bool reverse) {
+void serialization_writer_base::open_inner(std::string path, bool reverse,
+										   compression_flags compressionFlags) {
 	close(reverse);
+	m_blocksWritten = 0;
+	m_size = 0;
+	m_dataSize = 0;
+	m_compressionFlags = compressionFlags;
+	if (m_compressionFlags != compression_none) {
+		m_compressedState = std::make_shared<serialization_compressed_state>();
+		serialization_compressed_state & c = *m_compressedState;
+		c.fileAccessor.open(path, false, true, 1, block_size(),
+							sizeof(serialization_user_data),
+							access_sequential, m_compressionFlags);
+		c.buffer = std::make_shared<compressor_buffer>(block_size());
+		m_open = true;
+		return;
+	}
 	m_fileAccessor.set_cache_hint(access_sequential);
 	m_fileAccessor.open_wo(path);
 	open_guard guard(m_open, m_fileAccessor);
-	m_blocksWritten = 0;
-	m_size = 0;
 
 	bits::serialization_header header(m_fileAccessor);
 	header.set_reverse(reverse);
@@ -186,39 +249,92 @@ void serialization_writer_base::open_inner(std::string path, bool reverse) {
 	guard.commit();
 }
 
-void serialization_writer_base::open(std::string path, bool reverse) {
+void serialization_writer_base::open(std::string path, bool reverse,
+									 compression_flags compressionFlags) {
 	m_tempFile = 0;
-	open_inner(path, reverse);
+	open_inner(path, reverse, compressionFlags);
 }
 
-void serialization_writer_base::open(temp_file & tempFile, bool reverse) {
+void serialization_writer_base::open(temp_file & tempFile, bool reverse,
+									 compression_flags compressionFlags) {
 	m_tempFile = &tempFile;
-	open_inner(tempFile.path(), reverse);
+	open_inner(tempFile.path(), reverse, compressionFlags);
+}
+
+void serialization_writer_base::wait_for_block(compressor_thread_lock & lock) {
+	serialization_compressed_state & c = *m_compressedState;
+	while (!c.buffer.unique())
+		the_compressor_thread().wait_for_request_done(lock);
+	if (m_blocksWritten > 0 && c.response.has_block_info(m_blocksWritten - 1)) {
+		m_dataSize = c.response.get_read_offset(m_blocksWritten - 1)
+			+ c.response.get_block_size(m_blocksWritten - 1);
+	}
 }
 
 void serialization_writer_base::write_block(const char * const s, const memory_size_type n) {
 	assert(n <= block_size());
 	stream_size_type offset = m_blocksWritten * block_size();
-	m_fileAccessor.seek_i(bits::serialization_header::header_size() + offset);
-	m_fileAccessor.write_i(s, n);
+	if (m_compressionFlags == compression_none) {
+		m_fileAccessor.seek_i(bits::serialization_header::header_size() + offset);
+		m_fileAccessor.write_i(s, n);
+		if (m_tempFile)
+			m_tempFile->update_recorded_size(offset + n);
+	} else {
+		// The compressor thread appends the block and updates the recorded
+		// size of the temporary file. The block is copied, so that it may be
+		// compressed while the next block is filled.
+		serialization_compressed_state & c = *m_compressedState;
+		compressor_thread_lock l(the_compressor_thread());
+		wait_for_block(l);
+		std::copy(s, s + n, c.buffer->get());
+		c.buffer->set_size(n);
+		c.buffer->set_state(compressor_buffer_state::writing);
+		compressor_request r;
+		r.set_write_request(c.buffer,
+							&c.fileAccessor,
+							m_tempFile,
+							std::numeric_limits<stream_size_type>::max(),
+							n,
+							m_blocksWritten,
+							&c.response,
+							0,
+							compression_scheme::none,
+							false,
+							false);
+		the_compressor_thread().request(r);
+	}
 	++m_blocksWritten;
 	m_size = offset + n;
-	if (m_tempFile)
-		m_tempFile->update_recorded_size(m_size);
 }
 
 void serialization_writer_base::close(bool reverse) {
 	if (!m_open) return;
-	bits::serialization_header header(m_fileAccessor);
-	header.set_size(m_size);
-	header.set_reverse(reverse);
-	header.write(true);
-	m_fileAccessor.close_i();
+	if (m_compressionFlags != compression_none) {
+		{
+			compressor_thread_lock l(the_compressor_thread());
+			wait_for_block(l);
+		}
+		serialization_user_data userData;
+		userData.magic = serialization_user_data::magicConst;
+		userData.reverse = reverse;
+		m_compressedState->fileAccessor.write_user_data(&userData, sizeof(userData));
+		m_compressedState->fileAccessor.set_size(m_size);
+		m_compressedState->fileAccessor.close();
+		m_compressedState.reset();
+	} else {
+		bits::serialization_header header(m_fileAccessor);
+		header.set_size(m_size);
+		header.set_reverse(reverse);
+		header.write(true);
+		m_fileAccessor.close_i();
+	}
 	m_open = false;
 	m_tempFile = 0;
 }
 
 stream_size_type serialization_writer_base::file_size() {
+	if (m_compressionFlags != compression_none)
+		return compressed_header_size() + m_dataSize;
 	return serialization_header::header_size() + m_size;
 }
 
@@ -238,14 +354,14 @@ void serialization_writer::write_block() {
 	m_index = 0;
 }
 
-void serialization_writer::open(std::string path) {
-	p_t::open(path, false);
+void serialization_writer::open(std::string path, compression_flags compressionFlags) {
+	p_t::open(path, false, compressionFlags);
 	m_block.resize(block_size());
 	m_index = 0;
 }
 
-void serialization_writer::open(temp_file & tempFile) {
-	p_t::open(tempFile, false);
+void serialization_writer::open(temp_file & tempFile, compression_flags compressionFlags) {
+	p_t::open(tempFile, false, compressionFlags);
 	m_block.resize(block_size());
 	m_index = 0;
 }
@@ -273,14 +389,14 @@ void serialization_reverse_writer::write_block() {
 	m_index = 0;
 }
 
-void serialization_reverse_writer::open(std::string path) {
-	p_t::open(path, true);
+void serialization_reverse_writer::open(std::string path, compression_flags compressionFlags) {
+	p_t::open(path, true, compressionFlags);
 	m_block.resize(block_size());
 	m_index = 0;
 }
 
-void serialization_reverse_writer::open(temp_file & tempFile) {
-	p_t::open(tempFile, true);
+void serialization_reverse_writer::open(temp_file & tempFile, compression_flags compressionFlags) {
+	p_t::open(tempFile, true, compressionFlags);
 	m_block.resize(block_size());
 	m_index = 0;
 }
@@ -296,6 +412,10 @@ namespace bits {
 
 serialization_reader_base::serialization_reader_base()
 	: m_open(false)
+	, m_compressed(false)
+	, m_reverse(false)
+	, m_dataSize(0)
+	, m_nextBlock(0)
 	, m_size(0)
 	, m_index(0)
 	, m_blockSize(0)
@@ -313,6 +433,13 @@ void serialization_reader_base::open(std::string path, bool reverse) {
 
 	bits::serialization_header header(m_fileAccessor);
 	header.read();
+	m_compressed = header.compressed();
+	if (m_compressed) {
+		m_fileAccessor.close_i();
+		open_compressed(path, reverse);
+		guard.commit();
+		return;
+	}
 	header.verify();
 	m_size = header.get_size();
 	if (reverse && !header.get_reverse())
@@ -322,25 +449,111 @@ void serialization_reader_base::open(std::string path, bool reverse) {
 	guard.commit();
 }
 
+void serialization_reader_base::open_compressed(std::string path, bool reverse) {
+	m_compressedState = std::make_shared<serialization_compressed_state>();
+	serialization_compressed_state & c = *m_compressedState;
+	c.fileAccessor.open(path, true, false, 1, block_size(),
+						sizeof(serialization_user_data),
+						reverse ? access_normal : access_sequential,
+						compression_none);
+	serialization_user_data userData;
+	const char * error = 0;
+	if (c.fileAccessor.read_user_data(&userData, sizeof(userData)) != sizeof(userData)
+		|| userData.magic != serialization_user_data::magicConst)
+		error = "Bad header magic";
+	else if (reverse && !userData.reverse)
+		error = "Opened a non-reverse stream for reverse reading";
+	else if (!reverse && userData.reverse)
+		error = "Opened a reverse stream for non-reverse reading";
+	if (error) {
+		c.fileAccessor.close();
+		throw stream_exception(error);
+	}
+	m_reverse = reverse;
+	m_size = c.fileAccessor.size();
+	m_dataSize = c.fileAccessor.file_size();
+	c.buffer = std::make_shared<compressor_buffer>(block_size());
+	c.nextBuffer = std::make_shared<compressor_buffer>(block_size());
+	if (m_size == 0) return;
+	// Read ahead the block that is read first.
+	m_nextBlock = reverse ? (m_size - 1) / block_size() : 0;
+	compressor_thread_lock l(the_compressor_thread());
+	request_block(l, reverse ? m_dataSize : 0);
+}
+
+void serialization_reader_base::request_block(compressor_thread_lock & /*lock*/,
+											  stream_size_type readOffset) {
+	serialization_compressed_state & c = *m_compressedState;
+	c.nextBuffer->reset();
+	c.nextBuffer->transition_state(compressor_buffer_state::dirty,
+								   compressor_buffer_state::reading);
+	compressor_request r;
+	r.set_read_request(c.nextBuffer,
+					   &c.fileAccessor,
+					   readOffset,
+					   m_reverse ? read_direction::backward : read_direction::forward,
+					   1,
+					   &c.response);
+	the_compressor_thread().request(r);
+}
+
 void serialization_reader_base::read_block(const stream_size_type blk) {
 	stream_size_type from = blk * block_size();
 	stream_size_type to = std::min(from + block_size(), m_size);
 	if (to <= from) throw end_of_stream_exception();
 	m_index = 0;
 	m_blockSize = to-from;
+	if (m_compressed) {
+		read_compressed_block(blk);
+		return;
+	}
 	m_fileAccessor.seek_i(bits::serialization_header::header_size()
 						  + from);
 	m_fileAccessor.read_i(m_block.get(), m_blockSize);
 }
 
+void serialization_reader_base::read_compressed_block(const stream_size_type blk) {
+	if (blk != m_nextBlock)
+		throw stream_exception("Compressed serialization streams must be read in order");
+	serialization_compressed_state & c = *m_compressedState;
+	{
+		compressor_thread_lock l(the_compressor_thread());
+		while (c.nextBuffer->get_state() == compressor_buffer_state::reading)
+			c.response.wait(l);
+		c.buffer.swap(c.nextBuffer);
+		// Read ahead the block that is read next, if any, while this one is
+		// being consumed.
+		if (m_reverse ? blk > 0 : (blk + 1) * block_size() < m_size) {
+			m_nextBlock = m_reverse ? blk - 1 : blk + 1;
+			request_block(l, c.response.next_read_offset());
+		}
+	}
+	if (c.buffer->size() != m_blockSize)
+		throw stream_exception("Compressed block has the wrong size");
+	std::copy(c.buffer->get(), c.buffer->get() + m_blockSize, m_block.get());
+}
+
 void serialization_reader_base::close() {
 	if (!m_open) return;
-	m_fileAccessor.close_i();
+	if (m_compressed) {
+		serialization_compressed_state & c = *m_compressedState;
+		{
+			compressor_thread_lock l(the_compressor_thread());
+			while (!c.buffer.unique() || !c.nextBuffer.unique())
+				the_compressor_thread().wait_for_request_done(l);
+		}
+		c.fileAccessor.close();
+		m_compressedState.reset();
+	} else {
+		m_fileAccessor.close_i();
+	}
 	m_open = false;
 	m_block.resize(0);
 }
 
 stream_size_type serialization_reader_base::file_size() {
+	if (m_compressed)
+		return compressed_header_size() + m_dataSize;
 	return serialization_header::header_size() + m_size;
 }
 
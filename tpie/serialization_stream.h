@@ -30,12 +30,16 @@
 #include <tpie/access_type.h>
 #include <tpie/array.h>
 #include <tpie/tempname.h>
+#include <tpie/compressed/scheme.h>
+#include <tpie/compressed/predeclare.h>
 #include <algorithm>
 
 namespace tpie {
 
 namespace bits {
 
+struct serialization_compressed_state;
+
 class serialization_writer_base {
 public:
 	static memory_size_type block_size() {
@@ -45,19 +49,31 @@ public:
 private:
 	file_accessor::raw_file_accessor m_fileAccessor;
 	stream_size_type m_blocksWritten;
+	/** Number of bytes written, not counting the header. */
 	stream_size_type m_size;
+	/** Compressed streams: Number of bytes the blocks written by the
+	 * compressor thread take in the file, not counting the header. */
+	stream_size_type m_dataSize;
 	bool m_open;
 
+	compression_flags m_compressionFlags;
+	/** Compressed streams: The compressor thread compresses the blocks and
+	 * appends them to the file. */
+	std::shared_ptr<serialization_compressed_state> m_compressedState;
+
 	temp_file * m_tempFile;
 
 protected:
 	serialization_writer_base();
 
-	void open(std::string path, bool reverse);
-	void open(temp_file & tempFile, bool reverse);
+	void open(std::string path, bool reverse, compression_flags compressionFlags);
+	void open(temp_file & tempFile, bool reverse, compression_flags compressionFlags);
 
 private:
-	void open_inner(std::string path, bool reverse);
+	void open_inner(std::string path, bool reverse, compression_flags compressionFlags);
+
+	// Wait until the compressor thread is done with the last block.
+	void wait_for_block(compressor_thread_lock & lock);
 
 protected:
 	///////////////////////////////////////////////////////////////////////////
@@ -73,8 +89,19 @@ protected:
 	void close(bool reverse);
 
 public:
-	static memory_size_type memory_usage() { return block_size(); }
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Memory usage of a writer. A compressing writer also holds the
+	/// block handed to the compressor thread, and the thread needs about as
+	/// much again to compress it.
+	///////////////////////////////////////////////////////////////////////////
+	static memory_size_type memory_usage(bool compressed = false) {
+		return (compressed ? 3 : 1) * block_size();
+	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Size of file in bytes, including the header. While a
+	/// compressed stream is open, the block being compressed is not counted.
+	///////////////////////////////////////////////////////////////////////////
 	stream_size_type file_size();
 };
 
@@ -121,8 +148,14 @@ public:
 	serialization_writer();
 	~serialization_writer();
 
-	void open(std::string path);
-	void open(temp_file & tempFile);
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Open the stream for writing.
+	///
+	/// \param compressionFlags  Whether the compressor thread should compress
+	/// the blocks, as for compressed streams. Readers find out by themselves.
+	///////////////////////////////////////////////////////////////////////////
+	void open(std::string path, compression_flags compressionFlags = compression_none);
+	void open(temp_file & tempFile, compression_flags compressionFlags = compression_none);
 
 	void close();
 
@@ -215,8 +248,14 @@ public:
 	serialization_reverse_writer();
 	~serialization_reverse_writer();
 
-	void open(std::string path);
-	void open(temp_file & tempFile);
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Open the stream for writing.
+	///
+	/// \param compressionFlags  Whether the compressor thread should compress
+	/// the blocks, as for compressed streams. Readers find out by themselves.
+	///////////////////////////////////////////////////////////////////////////
+	void open(std::string path, compression_flags compressionFlags = compression_none);
+	void open(temp_file & tempFile, compression_flags compressionFlags = compression_none);
 
 	void close();
 
@@ -258,6 +297,23 @@ public:
 private:
 	file_accessor::raw_file_accessor m_fileAccessor;
 	bool m_open;
+	/** Whether the stream is compressed, in which case the compressor thread
+	 * reads the blocks. */
+	bool m_compressed;
+	bool m_reverse;
+	/** Compressed streams: Number of bytes the blocks take in the file. */
+	stream_size_type m_dataSize;
+	std::shared_ptr<serialization_compressed_state> m_compressedState;
+	/** Compressed streams: The number of the block read ahead, which must
+	 * be the next one read. */
+	stream_size_type m_nextBlock;
+
+	void open_compressed(std::string path, bool reverse);
+
+	// Request the block at the given read offset to be read ahead.
+	void request_block(compressor_thread_lock & lock, stream_size_type readOffset);
+
+	void read_compressed_block(const stream_size_type blk);
 
 protected:
 	tpie::array<char> m_block;
@@ -337,7 +393,14 @@ public:
 		unserialize(*this, a, b);
 	}
 
-	static memory_size_type memory_usage() { return block_size(); }
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief  Memory usage of a reader. A reader of a compressed stream
+	/// also holds the block the compressor thread has read and the block it
+	/// reads ahead.
+	///////////////////////////////////////////////////////////////////////////
+	static memory_size_type memory_usage(bool compressed = false) {
+		return (compressed ? 3 : 1) * block_size();
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Size of file in bytes, including the header.
@@ -85,6 +85,7 @@ void generic_sort(Stream & instream, Compare comp,
 	s.end();
 
 	instream.truncate(0);
+	instream.reserve(sz);
 	s.calc(merge);
 
 	output.init(sz);
@@ -124,6 +125,7 @@ void generic_sort(Stream & instream, Stream & outstream, Compare comp,
 	s.calc(merge);
 
 	outstream.truncate(0);
+	outstream.reserve(sz);
 	output.init(sz);
 	while (s.can_pull()) outstream.write(s.pull()), output.step();
 	output.done();
@@ -25,6 +25,7 @@
 
 namespace {
 	std::atomic<tpie::stream_size_type> temp_file_usage;
+	std::atomic<tpie::stream_size_type> temp_dir_usage[tpie::max_temp_dirs];
 	std::atomic<tpie::stream_size_type> bytes_read;
 	std::atomic<tpie::stream_size_type> bytes_written;
 	std::atomic<tpie::stream_size_type> user[20];
@@ -47,6 +48,24 @@ namespace tpie {
 		}
 	}
 
+	stream_size_type get_temp_dir_usage(size_t dir) {
+		return (dir < max_temp_dirs) ? temp_dir_usage[dir].load() : 0;
+	}
+
+	void increment_temp_dir_usage(size_t dir, stream_offset_type delta) {
+		if (dir >= max_temp_dirs) return;
+		stream_size_type x = temp_dir_usage[dir].fetch_add(delta);
+		if (static_cast<stream_offset_type>(x + delta) < 0) {
+			// As in increment_temp_file_usage, clamp a net negative usage.
+			temp_dir_usage[dir].fetch_sub(x + delta);
+		}
+	}
+
+	void reset_temp_dir_usage() {
+		for (size_t i = 0; i < max_temp_dirs; ++i)
+			temp_dir_usage[i] = 0;
+	}
+
 	stream_size_type get_bytes_read() {
 		return bytes_read.load();
 	}
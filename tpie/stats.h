@@ -39,6 +39,32 @@ namespace tpie {
 	///////////////////////////////////////////////////////////////////////////
 	void increment_temp_file_usage(stream_offset_type delta);
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Maximum number of temporary directories whose usage is counted
+	/// separately.
+	/// \sa tempname::set_default_paths
+	///////////////////////////////////////////////////////////////////////////
+	const size_t max_temp_dirs = 32;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Return the number of bytes currently being used by temporary
+	/// files in the given temporary directory.
+	/// \sa tempname::set_default_paths
+	///////////////////////////////////////////////////////////////////////////
+	stream_size_type get_temp_dir_usage(size_t dir);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Increment (possibly by a negative amount) the number of bytes
+	/// being used by temporary files in the given temporary directory.
+	///////////////////////////////////////////////////////////////////////////
+	void increment_temp_dir_usage(size_t dir, stream_offset_type delta);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Set the usage of every temporary directory to zero.
+	/// \sa tempname::set_default_paths
+	///////////////////////////////////////////////////////////////////////////
+	void reset_temp_dir_usage();
+
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Return the number of bytes read from disk since program start.
 	///////////////////////////////////////////////////////////////////////////
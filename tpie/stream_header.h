@@ -44,12 +44,17 @@ struct stream_header_t {
 
 	static const uint64_t cleanCloseMask = 0x1;
 	static const uint64_t compressedMask = 0x2;
+	/** A block index follows the last block of a compressed stream. */
+	static const uint64_t blockIndexMask = 0x4;
 
 	bool get_clean_close() const { return flags & cleanCloseMask; }
 	void set_clean_close(bool b) { if (b) flags |= cleanCloseMask; else flags &= ~cleanCloseMask; }
 
 	bool get_compressed() const { return flags & compressedMask; }
 	void set_compressed(bool b) { if (b) flags |= compressedMask; else flags &= ~compressedMask; }
+
+	bool get_block_index() const { return flags & blockIndexMask; }
+	void set_block_index(bool b) { if (b) flags |= blockIndexMask; else flags &= ~blockIndexMask; }
 };
 
 }
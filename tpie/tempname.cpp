@@ -35,6 +35,8 @@
 #include <tpie/err.h>
 #include <tpie/file_accessor/file_accessor.h>
 #include <stack>
+#include <mutex>
+#include <atomic>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -50,6 +52,25 @@ std::string default_base_name = "TPIE";
 std::string default_extension;
 std::stack<std::string> subdirs;
 
+///////////////////////////////////////////////////////////////////////////////
+/// A directory set using set_default_paths, and the subdirectory holding our
+/// temporary files in it, or the empty string if not created yet.
+///////////////////////////////////////////////////////////////////////////////
+struct temp_dir {
+	std::string path;
+	std::string subdir;
+};
+
+std::vector<temp_dir> temp_dirs;
+temp_dir_policy temp_dirs_policy = temp_dir_round_robin;
+size_t next_temp_dir = 0;
+/** Incremented whenever temp_dirs is replaced. */
+std::atomic<size_t> temp_dirs_generation(0);
+
+/** Protects default_path, subdirs and the temp_dirs state, since temporary
+ * names are generated from several threads. */
+std::mutex temp_dirs_mutex;
+
 }
 
 std::string tempname::get_system_path() {
@@ -90,24 +111,61 @@ std::string construct_name(std::string post_base, std::string timestamp, std::st
 #endif
 }
 
-void create_subdir() {
-	boost::filesystem::path base_dir = tempname::get_actual_path();
+std::string make_subdir(const boost::filesystem::path & base_dir) {
 	boost::filesystem::path p;
 	p = base_dir / construct_name("", get_timestamp(), "");
 	if ( !boost::filesystem::exists(p) && boost::filesystem::create_directory(p)) {
 #if BOOST_FILESYSTEM_VERSION == 3
-		std::string path = p.string();
+		return p.string();
 #else
-		std::string path = p.file_string();
+		return p.file_string();
 #endif
-		if (!subdirs.empty() && subdirs.top().empty())
-			subdirs.pop();
-		subdirs.push(path);
-		return;
 	}
 	throw tempfile_error("Unable to find free name for temporary folder");
 }
 
+void create_subdir() {
+	std::string path = make_subdir(tempname::get_actual_path());
+	if (!subdirs.empty() && subdirs.top().empty())
+		subdirs.pop();
+	subdirs.push(path);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Pick the directory for the next temporary file among temp_dirs.
+///////////////////////////////////////////////////////////////////////////////
+temp_dir & choose_temp_dir() {
+	const size_t n = temp_dirs.size();
+	size_t best = next_temp_dir % n;
+	if (temp_dirs_policy == temp_dir_least_used) {
+		// Ties go to the directory following the last one used
+		for (size_t i = 1; i < n; ++i) {
+			size_t j = (next_temp_dir + i) % n;
+			if (get_temp_dir_usage(j) < get_temp_dir_usage(best)) best = j;
+		}
+	}
+	next_temp_dir = best + 1;
+	temp_dir & d = temp_dirs[best];
+	if (d.subdir.empty()) d.subdir = make_subdir(d.path);
+	return d;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Stop using temp_dirs. Subdirectories already created are left to
+/// finish_tempfile. The usage counters start over, and temporary files
+/// placed in the retired directories no longer count towards them.
+///////////////////////////////////////////////////////////////////////////////
+void retire_temp_dirs() {
+	for (size_t i = 0; i < temp_dirs.size(); ++i) {
+		if (!temp_dirs[i].subdir.empty())
+			subdirs.push(temp_dirs[i].subdir);
+	}
+	temp_dirs.clear();
+	next_temp_dir = 0;
+	++temp_dirs_generation;
+	reset_temp_dir_usage();
+}
+
 std::string gen_temp(const std::string& post_base, const std::string& dir, const std::string& suffix) {
 	if (!dir.empty()) {
 		boost::filesystem::path p;
@@ -122,9 +180,14 @@ std::string gen_temp(const std::string& post_base, const std::string& dir, const
 		throw tempfile_error("Unable to find free name for temporary file");
 	}
 	else {
-		if (subdirs.empty() || subdirs.top().empty()) create_subdir();
-
-		boost::filesystem::path p = subdirs.top();
+		std::lock_guard<std::mutex> lock(temp_dirs_mutex);
+		boost::filesystem::path p;
+		if (!temp_dirs.empty()) {
+			p = choose_temp_dir().subdir;
+		} else {
+			if (subdirs.empty() || subdirs.top().empty()) create_subdir();
+			p = subdirs.top();
+		}
 		p /= construct_name(post_base, "", suffix);
 
 #if BOOST_FILESYSTEM_VERSION == 3
@@ -139,6 +202,14 @@ std::string gen_temp(const std::string& post_base, const std::string& dir, const
 
 namespace tpie {
 	void finish_tempfile() {
+		std::lock_guard<std::mutex> lock(temp_dirs_mutex);
+		for (size_t i = 0; i < temp_dirs.size(); ++i) {
+			if (!temp_dirs[i].subdir.empty()) {
+				boost::system::error_code c;
+				boost::filesystem::remove_all(temp_dirs[i].subdir, c);
+				temp_dirs[i].subdir.clear();
+			}
+		}
 		while (!subdirs.empty()) {
 			if (!subdirs.top().empty()) {
 				boost::system::error_code c;
@@ -188,7 +259,7 @@ bool tempname::try_directory(const std::string& path, const std::string& subdir)
 		try {
 			boost::filesystem::create_directory(p);
 		}
-		catch(boost::filesystem::filesystem_error) {
+		catch(const boost::filesystem::filesystem_error &) {
 			return false;
 		}
 	}
@@ -215,14 +286,16 @@ bool tempname::try_directory(const std::string& path, const std::string& subdir)
 			boost::filesystem::remove_all(p);
 		return true;
 	}
-	catch(tpie::exception) {}
-	catch (boost::filesystem::filesystem_error) {}
+	catch(const tpie::exception &) {}
+	catch (const boost::filesystem::filesystem_error &) {}
 
 	return false;
 	// remove file
 }
 
 void tempname::set_default_path(const std::string&  path, const std::string& subdir) {
+	std::lock_guard<std::mutex> lock(temp_dirs_mutex);
+	retire_temp_dirs();
 	if (subdir=="") {
 		default_path = path;
 		subdirs.push(""); // signals that the current global subdirectory has not been created yet
@@ -246,12 +319,73 @@ void tempname::set_default_path(const std::string&  path, const std::string& sub
 		default_path = p.directory_string();
 #endif
 		subdirs.push(""); // signals that the current global subdirectory has not been created yet
-	} catch (boost::filesystem::filesystem_error) { 
+	} catch (const boost::filesystem::filesystem_error &) { 
 		TP_LOG_WARNING_ID("Could not use " << p << " as directory for temporary files, trying " << path);
 		default_path = path; 
 	}	
 }
 
+void tempname::set_default_paths(const std::vector<std::string>& paths,
+								 temp_dir_policy policy,
+								 const std::string& subdir) {
+	if (paths.size() > max_temp_dirs)
+		throw tempfile_error("Too many temporary directories");
+	std::lock_guard<std::mutex> lock(temp_dirs_mutex);
+	retire_temp_dirs();
+	for (size_t i = 0; i < paths.size(); ++i) {
+		temp_dir d;
+		d.path = paths[i];
+		if (!subdir.empty()) {
+			boost::filesystem::path p = paths[i];
+			p = p / subdir;
+			try {
+				if (!boost::filesystem::exists(p))
+					boost::filesystem::create_directory(p);
+				if (boost::filesystem::is_directory(p)) {
+#if BOOST_FILESYSTEM_VERSION == 3
+					d.path = p.string();
+#else
+					d.path = p.directory_string();
+#endif
+				} else {
+					TP_LOG_WARNING_ID("Could not use " << p << " as directory for temporary files, trying " << paths[i]);
+				}
+			} catch (const boost::filesystem::filesystem_error &) {
+				TP_LOG_WARNING_ID("Could not use " << p << " as directory for temporary files, trying " << paths[i]);
+			}
+		}
+		temp_dirs.push_back(d);
+	}
+	temp_dirs_policy = policy;
+	default_path = temp_dirs.empty() ? std::string() : temp_dirs[0].path;
+	subdirs.push(""); // signals that the current global subdirectory has not been created yet
+}
+
+std::vector<std::string> tempname::get_default_paths() {
+	std::lock_guard<std::mutex> lock(temp_dirs_mutex);
+	std::vector<std::string> res;
+	for (size_t i = 0; i < temp_dirs.size(); ++i)
+		res.push_back(temp_dirs[i].path);
+	return res;
+}
+
+size_t tempname::get_temp_dir_index(const std::string& path) {
+	std::lock_guard<std::mutex> lock(temp_dirs_mutex);
+	for (size_t i = 0; i < temp_dirs.size(); ++i) {
+		if (temp_dirs[i].subdir.empty()) continue;
+		boost::filesystem::path dir = temp_dirs[i].subdir;
+		for (boost::filesystem::path p = boost::filesystem::path(path).parent_path();
+			 !p.empty(); p = p.parent_path()) {
+			if (p == dir) return i;
+		}
+	}
+	return max_temp_dirs;
+}
+
+size_t tempname::get_temp_dir_generation() {
+	return temp_dirs_generation;
+}
+
 void tempname::set_default_base_name(const std::string& name) {
 	default_base_name = name;
 }
@@ -284,18 +418,41 @@ temp_file_inner::~temp_file_inner() {
 	update_recorded_size(0);
 }
 
-temp_file_inner::temp_file_inner() : m_persist(false), m_recordedSize(0), m_count(0) {}
+temp_file_inner::temp_file_inner()
+	: m_persist(false)
+	, m_tempDir(max_temp_dirs)
+	, m_tempDirGeneration(0)
+	, m_recordedSize(0)
+	, m_count(0)
+{
+}
 
-temp_file_inner::temp_file_inner(const std::string & path, bool persist): m_path(path), m_persist(persist), m_recordedSize(0), m_count(0) {}
+temp_file_inner::temp_file_inner(const std::string & path, bool persist)
+	: m_path(path)
+	, m_persist(persist)
+	, m_tempDirGeneration(tempname::get_temp_dir_generation())
+	, m_recordedSize(0)
+	, m_count(0)
+{
+	m_tempDir = tempname::get_temp_dir_index(path);
+}
 
 const std::string & temp_file_inner::path() {
-	if(m_path.empty())
+	if(m_path.empty()) {
+		m_tempDirGeneration = tempname::get_temp_dir_generation();
 		m_path = tempname::tpie_name();
+		m_tempDir = tempname::get_temp_dir_index(m_path);
+	}
 	return m_path;
 }
 
 void temp_file_inner::update_recorded_size(stream_size_type size) {
-	increment_temp_file_usage(static_cast<stream_offset_type>(size) - static_cast<stream_offset_type>(m_recordedSize));
+	stream_offset_type delta = static_cast<stream_offset_type>(size) - static_cast<stream_offset_type>(m_recordedSize);
+	increment_temp_file_usage(delta);
+	// The directory was retired and its counter reset.
+	if (m_tempDirGeneration != tempname::get_temp_dir_generation())
+		m_tempDir = max_temp_dirs;
+	increment_temp_dir_usage(m_tempDir, delta);
 	m_recordedSize=size;
 }
 
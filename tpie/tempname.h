@@ -30,6 +30,7 @@
 #include <stdexcept>
 #include <boost/intrusive_ptr.hpp>
 #include <string>
+#include <vector>
  // The name of the environment variable pointing to a tmp directory.
 #define TMPDIR_ENV "TMPDIR"
 
@@ -43,6 +44,19 @@ namespace tpie {
 		explicit tempfile_error(const std::string & what): std::runtime_error(what) {}
 	};
 
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief How temporary files are placed when several temporary
+	/// directories are in use.
+	/// \sa tempname::set_default_paths
+	///////////////////////////////////////////////////////////////////////////
+	enum temp_dir_policy {
+		/** Use the directories in turn. */
+		temp_dir_round_robin,
+		/** Use the directory whose temporary files currently take up the
+		 * fewest bytes, as reported by get_temp_dir_usage. */
+		temp_dir_least_used
+	};
+
 	///////////////////////////////////////////////////////////////////////////
 	/// \brief Static methods for generating temporary file names and finding
 	/// temporary file directories.
@@ -100,6 +114,50 @@ namespace tpie {
 		///////////////////////////////////////////////////////////////////////
 		static void set_default_path(const std::string& path, const std::string& subdir="");
 
+		///////////////////////////////////////////////////////////////////////
+		/// \brief Spread temporary files over several directories, typically
+		/// on separate devices.
+		///
+		/// Each temporary file generated without an explicit directory,
+		/// such as merge sort runs and priority queue files, is placed in
+		/// one of the given directories according to the policy. The usage
+		/// of each directory is counted by temp_file and reported by
+		/// get_temp_dir_usage, indexed by the position in paths.
+		///
+		/// At most max_temp_dirs directories can be given. The first one
+		/// becomes the default path. Calling \ref set_default_path goes back
+		/// to using a single directory.
+		///
+		/// \param paths The directories to use; they must exist in the system.
+		/// \param policy How to choose a directory for a new temporary file.
+		/// \param subdir Subdirectory of each path, will be created if it does
+		/// not exist.
+		///////////////////////////////////////////////////////////////////////
+		static void set_default_paths(const std::vector<std::string>& paths,
+									  temp_dir_policy policy=temp_dir_round_robin,
+									  const std::string& subdir="");
+
+		///////////////////////////////////////////////////////////////////////
+		/// \brief Get the directories set using \ref set_default_paths, or an
+		/// empty vector if a single directory is used.
+		///////////////////////////////////////////////////////////////////////
+		static std::vector<std::string> get_default_paths();
+
+		///////////////////////////////////////////////////////////////////////
+		/// \brief Index in \ref get_default_paths of the directory containing
+		/// the given temporary file, or max_temp_dirs if it is in none of
+		/// them.
+		///////////////////////////////////////////////////////////////////////
+		static size_t get_temp_dir_index(const std::string& path);
+
+		///////////////////////////////////////////////////////////////////////
+		/// \brief Number of times the directories have been replaced by
+		/// \ref set_default_paths or \ref set_default_path, which also resets
+		/// the usage counters. An index returned by get_temp_dir_index is
+		/// only valid while this is unchanged.
+		///////////////////////////////////////////////////////////////////////
+		static size_t get_temp_dir_generation();
+
 		///////////////////////////////////////////////////////////////////////
 		/// \brief Set default base name for temporary files.
 		/// \sa tpie_name
@@ -185,6 +243,11 @@ namespace tpie {
 	private:
 		std::string m_path;
 		bool m_persist;
+		/** Index of the temporary directory holding the file, for
+		 * increment_temp_dir_usage. */
+		size_t m_tempDir;
+		/** tempname::get_temp_dir_generation when m_tempDir was found. */
+		size_t m_tempDirGeneration;
 		stream_size_type m_recordedSize;
 		memory_size_type m_count;			
 	};
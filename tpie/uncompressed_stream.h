@@ -151,16 +151,19 @@ public:
 	/// \param blockFactor The block factor you pass to open.
 	/// \param includeDefaultFileAccessor Unless you are supplying your own
 	/// file accessor to open, leave this to be true.
+	/// \param writeBehindBlocks The number passed to set_write_behind.
 	/// \returns The amount of memory maximally used by the count file_streams.
 	///////////////////////////////////////////////////////////////////////////
 	inline static memory_size_type memory_usage(
 		float blockFactor=1.0,
-		bool includeDefaultFileAccessor=true) throw() {
+		bool includeDefaultFileAccessor=true,
+		memory_size_type writeBehindBlocks=0) throw() {
 		// TODO
 		memory_size_type x = sizeof(uncompressed_stream);
 		x += block_memory_usage(blockFactor); // allocated in constructor
 		if (includeDefaultFileAccessor)
 			x += default_file_accessor::memory_usage();
+		x += write_behind_memory_usage(blockFactor, writeBehindBlocks);
 		return x;
 	}
 
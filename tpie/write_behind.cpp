@@ -0,0 +1,122 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2016, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+#include <tpie/write_behind.h>
+#include <tpie/tpie_assert.h>
+
+namespace tpie {
+
+namespace bits {
+
+write_behind_queue::write_behind_queue()
+	: m_written(0)
+	, m_started(0)
+	, m_stop(false)
+{
+}
+
+write_behind_queue::~write_behind_queue() {
+	finish();
+}
+
+void write_behind_queue::enqueue(file_accessor::file_accessor * accessor, const char * data,
+								 stream_size_type blockNumber, memory_size_type itemCount,
+								 void * tag) {
+	request r;
+	r.accessor = accessor;
+	r.data = data;
+	r.blockNumber = blockNumber;
+	r.itemCount = itemCount;
+	r.tag = tag;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_requests.push_back(r);
+	}
+	if (m_thread.get_id() == std::thread::id()) {
+		m_stop = false;
+		m_thread = std::thread(&write_behind_queue::run, this);
+	}
+	m_newRequest.notify_one();
+}
+
+void write_behind_queue::run() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		while (!m_stop && m_started == m_requests.size()) m_newRequest.wait(lock);
+		if (m_started == m_requests.size()) break;
+		request r = m_requests[m_started++];
+		lock.unlock();
+		std::exception_ptr error;
+		try {
+			r.accessor->write_block(r.data, r.blockNumber, r.itemCount);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		lock.lock();
+		if (error && !m_error) m_error = error;
+		++m_written;
+		m_requestDone.notify_all();
+	}
+}
+
+void * write_behind_queue::wait_one() {
+	tp_assert(!m_requests.empty(), "wait_one: No outstanding writes");
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_written == 0) m_requestDone.wait(lock);
+	void * tag = m_requests.front().tag;
+	m_requests.pop_front();
+	--m_written;
+	--m_started;
+	return tag;
+}
+
+const char * write_behind_queue::find(stream_size_type blockNumber, memory_size_type & itemCount) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::deque<request>::reverse_iterator i = m_requests.rbegin(); i != m_requests.rend(); ++i) {
+		if (i->blockNumber == blockNumber) {
+			itemCount = i->itemCount;
+			return i->data;
+		}
+	}
+	return 0;
+}
+
+void write_behind_queue::finish() {
+	if (m_thread.get_id() == std::thread::id()) return;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_newRequest.notify_one();
+	m_thread.join();
+	m_thread = std::thread();
+}
+
+void write_behind_queue::rethrow_error() {
+	std::exception_ptr error;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::swap(error, m_error);
+	}
+	if (error) std::rethrow_exception(error);
+}
+
+} // namespace bits
+
+} // namespace tpie
@@ -0,0 +1,128 @@
+// -*- mode: c++; tab-width: 4; indent-tabs-mode: t; c-file-style: "stroustrup"; -*-
+// vi:set ts=4 sts=4 sw=4 noet :
+// Copyright 2016, The TPIE development team
+//
+// This file is part of TPIE.
+//
+// TPIE is free software: you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by the
+// Free Software Foundation, either version 3 of the License, or (at your
+// option) any later version.
+//
+// TPIE is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+// License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with TPIE.  If not, see <http://www.gnu.org/licenses/>
+
+#ifndef TPIE_WRITE_BEHIND_H
+#define TPIE_WRITE_BEHIND_H
+
+///////////////////////////////////////////////////////////////////////////////
+/// \file write_behind.h  Background thread writing evicted stream blocks.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <tpie/types.h>
+#include <tpie/file_accessor/file_accessor.h>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <deque>
+#include <thread>
+
+namespace tpie {
+
+namespace bits {
+
+///////////////////////////////////////////////////////////////////////////////
+/// \brief FIFO of block writes carried out by a dedicated thread.
+///
+/// The owner hands over a block buffer with enqueue() and must leave it
+/// alone until the buffer's tag is returned by wait_one(). While writes are
+/// pending, the owner may query the size of the file accessor, access its
+/// user data and read blocks that are not pending; a pending block is read
+/// from its buffer, see find(). Truncating and closing must be preceded by
+/// collecting all buffers with wait_one().
+///
+/// The thread is started by the first enqueue() and runs until finish(),
+/// which is meant for closing the file.
+/// An exception thrown by a write is kept until rethrow_error() is called,
+/// so that the owner can collect its buffers first.
+///////////////////////////////////////////////////////////////////////////////
+class write_behind_queue {
+public:
+	write_behind_queue();
+	~write_behind_queue();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Queue a write of itemCount items from data to the given block.
+	/// \param tag Returned by wait_one() when the buffer may be reused.
+	///////////////////////////////////////////////////////////////////////////
+	void enqueue(file_accessor::file_accessor * accessor, const char * data,
+				 stream_size_type blockNumber, memory_size_type itemCount,
+				 void * tag);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Number of buffers enqueued and not yet returned by wait_one().
+	///////////////////////////////////////////////////////////////////////////
+	memory_size_type outstanding() const { return m_requests.size(); }
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Wait until a write has finished and return its tag.
+	/// Precondition: outstanding() > 0.
+	///////////////////////////////////////////////////////////////////////////
+	void * wait_one();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Find the buffer of the latest write to the given block that
+	/// has not been returned by wait_one().
+	/// \param itemCount Set to the number of items written from the buffer.
+	/// \returns The buffer, or 0 if no write to the block is pending.
+	///////////////////////////////////////////////////////////////////////////
+	const char * find(stream_size_type blockNumber, memory_size_type & itemCount);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Wait for all writes and stop the thread. Tags of buffers not
+	/// yet returned by wait_one() must be collected afterwards with
+	/// wait_one(), which then does not block.
+	///////////////////////////////////////////////////////////////////////////
+	void finish();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// \brief Throw the first exception raised by a write since the last
+	/// call, if any.
+	///////////////////////////////////////////////////////////////////////////
+	void rethrow_error();
+
+private:
+	struct request {
+		file_accessor::file_accessor * accessor;
+		const char * data;
+		stream_size_type blockNumber;
+		memory_size_type itemCount;
+		void * tag;
+	};
+
+	void run();
+
+	std::mutex m_mutex;
+	std::condition_variable m_newRequest;
+	std::condition_variable m_requestDone;
+	/** Requests not yet returned by wait_one(), oldest first. The first
+	 * m_written are written and the first m_started have been taken by the
+	 * thread. */
+	std::deque<request> m_requests;
+	memory_size_type m_written;
+	memory_size_type m_started;
+	std::exception_ptr m_error;
+	std::thread m_thread;
+	bool m_stop;
+};
+
+} // namespace bits
+
+} // namespace tpie
+
+#endif // TPIE_WRITE_BEHIND_H